@@ -1,15 +1,36 @@
+#define _GNU_SOURCE          // fallocate() and sync_file_range()
+#define _FILE_OFFSET_BITS 64  // 64-bit file sizes and offsets on 32-bit systems too
 #include <stdio.h>      // Standard input/output operations
 #include <stdlib.h>     // General purpose functions, including memory allocation
+#include <ctype.h>      // isdigit() when counting stat results
 #include <string.h>     // String handling functions
 #include <unistd.h>     // UNIX standard function definitions
 #include <arpa/inet.h>  // Definitions for internet operations
 #include <sys/types.h>  // Various data type definitions
 #include <sys/socket.h> // Socket definitions and functions
 #include <dirent.h>     // Directory entry operations
+#include <fnmatch.h>    // Globs in rmfile paths
 #include <sys/wait.h>   // Declarations for waiting
 #include <sys/stat.h>   // File status and information
 #include <fcntl.h>      // File control options
 #include <errno.h>      // System error numbers
+#include <stdint.h>     // Fixed width integer types for chunk headers
+#include <time.h>       // Clock used to measure chunk throughput
+#include <sys/mman.h>   // Slab mapping for the buffer pool
+#include <sys/uio.h>    // Vectored I/O for chunk headers and payloads
+#include <sys/file.h>   // flock() to serialise cache eviction between workers
+#include <sys/xattr.h>  // Checksums stored as extended attributes
+#include <poll.h>       // Connect timeout towards the backends
+#include <sys/un.h>     // Unix sockets towards co-located backends
+#include <stddef.h>     // offsetof() for abstract Unix socket addresses
+#include <pthread.h>    // Producer threads that build dtar archives, process-shared registry lock
+#include <sys/epoll.h>  // Event threads of threaded mode
+#include <sys/syscall.h> // Thread ids for temporary file names
+#include <sys/ioctl.h>  // FICLONE reflink copies for cpfile
+#include <linux/fs.h>   // ... and its request number
+#include <sys/sendfile.h> // In-kernel copies on kernels without copy_file_range()
+#include <signal.h>     // Ignoring SIGPIPE in threaded mode
+#include <regex.h>      // Extended and case-insensitive grep patterns
 
 #define PORT 6009
 #define SERVER_IP "127.0.1.4"
@@ -18,10 +39,100 @@
 #define STEXT_PORT 6012
 #define TEXT_ADDRESS "127.0.1.6"
 #define PDF_ADDRESS "127.0.1.7"
+#define MAX_BACKENDS 16                         // Registry slots for Spdf/Stext replicas
+#define REGISTRY_DEFAULT MAX_BACKENDS           // Slot number standing for the compiled-in backend address
+#define HEARTBEAT_TIMEOUT 6                     // A backend without a heartbeat for this many seconds is considered down
+#define BACKEND_RETRY_DELAY 5                   // Seconds a backend that refused a connection is skipped
+#define RESYNC_TIMEOUT 60                       // A replica resync that made no progress for this many seconds is started again
+#define BACKEND_CONNECT_TIMEOUT_MS 1000         // Longest wait for a backend to accept a connection
+#define BACKEND_MAX_LOAD 16                     // Requests per backend replica before new transfers for it are queued
+#define MAX_ACTIVE_TRANSFERS 32                 // Transfers Smain moves at the same time
+#define MAX_TRANSFERS_PER_CLIENT 8              // Transfers one client address may have running at the same time
+#define MAX_QUEUED_TRANSFERS 64                 // Transfers waiting for a slot before new ones are rejected at once
+#define ADMISSION_QUEUE_MS 2000                 // Longest a transfer waits in the queue before it is rejected
+#define MAX_CLIENT_SLOTS 256                    // Client addresses tracked for the per-client limit
+#define MAX_CONNECTIONS 256                     // Open connections before new ones are turned away
+#define LOCAL_TRANSPORT_ENABLED 1               // Reach co-located backends over their Unix socket instead of TCP loopback
+#define DIRECT_DATA_ENABLED 0                   // Hand the client connection to Spdf/Stext for file data, bypassing the download cache
+#define SMAIN_EVENT_THREADS 2                   // Threads watching idle client connections in threaded mode
+#define SMAIN_DEFAULT_WORKERS 16                // Worker threads running commands in threaded mode (Smain --threads [workers])
+#define CLIENT_DETACHED 1                       // process_client_command(): a thread of its own serves the connection now
+#define TASK_QUEUE_SIZE MAX_CONNECTIONS         // A connection has at most one task queued, so any queue can take a new one
+#define CACHE_ENABLED 1                         // Serve repeated .txt/.pdf downloads from a local copy kept by Smain
+#define CACHE_DIR ".smain_cache"                // Cache directory inside the HOME directory
+#define CACHE_MAX_BYTES (512LL * 1024 * 1024)   // Total cache size before least recently used files are evicted
+#define CACHE_MAX_ENTRY (64LL * 1024 * 1024)    // Bigger files are relayed without being cached
+#define RMFILE_MAX_REPORTED 8               // Failed paths listed in an rmfile reply, the rest are only counted
+#define RMFILE_REPORT_BYTES 640             // Room for the listed failures, so a reply fits one BUFFER_SIZE frame
+#define DELTA_MIN_BLOCK 1024                // Smallest block a delta upload matches, for files up to 1 MB
+#define DELTA_MAX_BLOCK (128 * 1024)        // Largest block, used from 16 GB up; in between the block is about sqrt(size)
+#define DELTA_SIGNATURE_BATCH 1024          // Block signatures sent per chunk
+#define STAT_MAX_PATHS 512                  // Paths one stat command can name, as many as fit one command frame
+#define STAT_LINE_MAX 64                    // Longest reply line for one path of a stat
+#define GREP_DEFAULT_LIMIT 1000             // Matching lines a grep returns unless -m asks for another number
+#define GREP_MAX_LIMIT 100000               // Largest -m a grep accepts
+#define GREP_MAX_THREADS 8                  // Threads one grep searches with, one per core up to this number
+#define GREP_MAX_FILES 65536                // Files one grep searches
+#define GREP_LINE_MAX 256                   // Longer matching lines are cut to this many bytes in the results
+#define GREP_BATCH 65536                    // Results of one file are sent in batches of about this size
+#define FEED_SLOTS 4096                     // Change events kept for subscribers, one that falls further behind is told so
+#define FEED_PATH_MAX 256                   // Longest path a change event carries, longer ones are cut
+#define FEED_WAIT_MS 250                    // A subscriber checks its connection for "unsubscribe" this often while idle
+#define FEED_BATCH 65536                    // Events sent to a subscriber in one chunk at most
+#define FEED_CREATED 0                      // Kinds of change events: a file was stored for the first time
+#define FEED_MODIFIED 1                     // A stored file was replaced
+#define FEED_DELETED 2                      // A file, or every file matching a glob, was deleted
+#define FEED_DELETED_TREE 3                 // A directory was deleted with everything below it
+#define PACK_ENABLED 0                      // Append small .c files to shared segment files, out of sight of the store directory
+#define PACK_DIR ".pack"                    // Segments and index of the pack, inside the store directory
+#define PACK_MAX_FILE (32 * 1024)           // Bigger files stay loose, below the size clients send as a delta upload
+#define PACK_SEGMENT_BYTES (64 * 1024 * 1024) // A segment takes appends until it holds this much
+#define PACK_MAX_SEGMENTS 1024              // Segment numbers in use at the same time
+#define PACK_INDEX_SLOTS 65536              // Hash slots of the index, a power of two; new files stay loose once 7/8 are used
+#define PACK_PATH_MAX 216                   // Longest packed path, files with longer paths stay loose
+#define PACK_COMPACT_RATIO 2                // A segment is compacted once less than half of it is live
+#define PACK_INDEX_MAGIC 0x6b636170u        // Marks an index written with this layout
+#define PACK_RECORD_MAGIC 0x64726370u       // Starts every record in a segment
+#define PACK_SLOT_EMPTY 0                   // States of an index slot: never used
+#define PACK_SLOT_USED 1                    // Holds a packed file
+#define PACK_SLOT_DELETED 2                 // The file was removed, probing continues past the slot
+#define PREALLOCATE_ENABLED 1               // Reserve the size a ufile announces with fallocate() before its data arrives
+#define UPLOAD_CHUNK_MIN (1024 * 1024)      // Smallest chunk of a parallel upload (1 MB)
+#define UPLOAD_CHUNK_MAX (256LL * 1024 * 1024) // Largest chunk of a parallel upload (256 MB)
+#define UPLOAD_MAX_CHUNKS 65536             // Most chunks one parallel upload is split into
+#define UPLOAD_TABLE_MAGIC 0x6b686375u      // Starts the chunk table of a parallel upload
+#define DISPLAY_CACHE_ENABLED 1             // Answer repeated displays of an unchanged directory from memory
+#define DISPLAY_CACHE_SLOTS 512             // Listings kept at most, about 1.3 KB each, so the cache stays under 1 MB
+#define DISPLAY_CACHE_WAYS 8                // Slots one directory's listing may take, the least recently used is replaced
+#define DISPLAY_PATH_MAX 256                // Longest directory path whose listing is kept
+#define DISPLAY_RACY_NS 1000000000LL        // A directory changed this recently is listed again, see display_cache_store()
+#define NEGATIVE_FILTER_ENABLED 1           // Answer dfile and rmfile of files no store holds without asking the store
+#define NEGATIVE_FILTER_COUNTERS (1 << 20)  // Counters per store, a power of two; about 1% false hits at 100000 files
+#define NEGATIVE_FILTER_HASHES 4            // Counters one path sets
+#define NEGATIVE_FILTER_PATHS (1 << 17)     // Fingerprints of counted paths kept per store, a power of two
+#define NEGATIVE_FILTER_PROBES 64           // Slots looked at for a fingerprint before a path is left unrecorded
+#define NEGATIVE_FILTER_LOAD_TIMEOUT 300    // Seconds before a load of a backend's paths that never ended is started again
+
+#include "crc32c.h"                 // CRC32C of file data, the same in every program
+#include "trace.h"                  // Request spans, the same in every program
+#include "chunks.h"                 // Buffer pool and chunked file transfers, the same in every program
+#include "command.h"                // Command frames and their words, the same in every server
 
 const char *valid_home_dir()
 {
-    return getenv("HOME"); //Function to define the HOME directory which other functions will use as Path variable
+    static const char *home_dir; // Looked up once, every path of every request starts with it
+
+    if (home_dir == NULL)
+    {
+        home_dir = getenv("HOME"); //Function to define the HOME directory which other functions will use as Path variable
+    }
+    return home_dir;
+}
+
+// Function to tell workers apart in temporary file names: the worker process id, or the thread id in threaded mode
+int worker_id()
+{
+    return (int)syscall(SYS_gettid);
 }
 
 int create_dir_if_new(const char *directory_path)
@@ -67,495 +178,7126 @@ int create_dir_if_new(const char *directory_path)
     return 0;
 }
 
-//Declaring functions beforehand and then working on them later in the code by defining them in required places
-void process_client_request(int client_socket);
-void process_uploaded_file(int client_socket, char *filename, char *destination, char *buffer);
-void manage_file_download(int client_socket, char *filename, char *command);
-void remove_file(int client_socket, char *filename, char *buffer);
-void handle_dtar(int client_sock, char *filetype);
-void handle_display(int client_sock, char *pathname);
-int establish_connection(const char *ip_address, int port_number, int *socket_fd);
+// Function to send a command frame to a backend, carrying the ID of the request the running thread works for
+ssize_t send_frame(int sock, char *frame)
+{
+    trace_stamp_frame(frame, trace_context.request);
+    return send(sock, frame, BUFFER_SIZE, 0);
+}
 
-int main()
+
+// Function to open the reply to a download with a status line: "data" when the file's chunk stream follows, "none"
+// when only the final message does. MSG_MORE holds the line back so it leaves in one segment with what follows
+int send_download_status(int sock, int found)
 {
-    int server_socket, client_socket; // declaring file descriptors for client and server
-    struct sockaddr_in server_address, client_address; // define structure for server address and client address
-    socklen_t client_address_len = sizeof(client_address); // setting  the length of the client address structure
+    const char *status = found ? "data\n" : "none\n";
 
-    // Creating a socket for the server
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) // check if the socket fails or not
+    return send(sock, status, strlen(status), MSG_MORE) == (ssize_t)strlen(status) ? 0 : -1;
+}
+
+// Function to read the file size a ufile frame announces after its destination, -1 when the client sent none
+long long announced_size(const char *frame)
+{
+    long long size;
+
+    return sscanf(frame, "%*s %*s %*s %lld", &size) == 1 && size >= 0 ? size : -1;
+}
+
+// Function to reserve the disk space of an upload before its data arrives, so a huge file gets few large extents and
+// a full disk is noticed before any data is sent. The file keeps its size while the data comes in
+// Returns -1 when the space is not there; filesystems without fallocate() allocate as the data is written instead
+int preallocate_file(FILE *file, long long size)
+{
+    if (!PREALLOCATE_ENABLED || size <= 0 ||
+        fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, size) == 0 || errno == EOPNOTSUPP || errno == ENOSYS)
     {
-        perror("Failed to create socket");
-        exit(EXIT_FAILURE);
+        return 0;
     }
+    return -1;
+}
 
-    // Defining the server address and port
-    server_address.sin_family = AF_INET; // setting the address family to AF_INET
-    server_address.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces (127.0.0.1)
-    server_address.sin_port = htons(PORT);        // Use the predefined port
+// Function to give back the space reserved past the end of an upload that came in shorter than announced
+void trim_preallocated(FILE *file, long long size)
+{
+    off_t end;
 
-    // Binding the server socket to the address and port
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    if (size > 0 && fflush(file) == 0 && (end = ftello(file)) < size && ftruncate(fileno(file), end) != 0)
     {
-        perror("Bind operation failed");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+        perror("Failed to release preallocated space");
     }
+}
 
-    // Setting the server socket to listen for incoming connections
-    if (listen(server_socket, 3) < 0)
+// Function to forward a chunked file stream from one socket to several others, including the CRC32C trailer
+// Used to write an upload to every replica of a backend; a target that fails is dropped and the others continue
+// When copy is not NULL every relayed byte is also written to it; *checksum (if not NULL) gets the trailer value
+// Returns the number of file bytes relayed, -1 when the source or every target failed, or TRANSFER_CORRUPT
+// when the data does not match its trailer
+long long relay_chunks_to(int from_sock, const int *to_socks, int to_count, FILE *copy, uint32_t *checksum)
+{
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    long long total = 0;
+    long length;
+    uint32_t computed = 0;
+    uint32_t trailer;
+    int target_failed[MAX_BACKENDS + 1] = {0};
+    int working = to_count;
+
+    if (buffer == NULL)
     {
-        perror("Failed to listen on socket");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    while ((length = recv_chunk(from_sock, &buffer, &capacity)) > 0)
+    {
+        for (int i = 0; i < to_count; i++)
+        {
+            if (!target_failed[i] && send_chunk(to_socks[i], buffer, length) != 0)
+            {
+                target_failed[i] = 1;
+                working--;
+            }
+        }
+        if (working == 0)
+        {
+            length = -1;
+            break;
+        }
+        computed = crc32c_update(computed, buffer, length);
+        if (copy != NULL && fwrite(buffer, 1, length, copy) != (size_t)length)
+        {
+            copy = NULL; // The copy is incomplete, the caller will notice the short file and drop it
+        }
+        total += length;
     }
+    pool_release(buffer, capacity);
 
-    printf("Smain server is listening on port %d...\n", PORT);
+    // Pass the sender's trailer on unchanged so the final receiver verifies end to end
+    int source_failed = length < 0 || recv_all(from_sock, &trailer, sizeof(trailer)) != 0;
+    for (int i = 0; i < to_count; i++)
+    {
+        // On failure terminate the stream with a checksum that cannot verify
+        if (!target_failed[i] && send_end_of_file(to_socks[i], source_failed ? ~computed : ntohl(trailer)) != 0)
+        {
+            target_failed[i] = 1;
+            working--;
+        }
+    }
+    if (source_failed || working == 0)
+    {
+        return -1;
+    }
+    if (checksum != NULL)
+    {
+        *checksum = ntohl(trailer);
+    }
+    if (ntohl(trailer) != computed)
+    {
+        fprintf(stderr, "Relayed data does not match its checksum (%08x expected, %08x seen)\n", ntohl(trailer), computed);
+        return TRANSFER_CORRUPT;
+    }
+    return total;
+}
 
-    // Main loop: accept incoming client connections
-    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len)) >= 0)
+// Function to forward a chunked file stream from one socket to another, see relay_chunks_to()
+long long relay_chunks(int from_sock, int to_sock, FILE *copy, uint32_t *checksum)
+{
+    return relay_chunks_to(from_sock, &to_sock, 1, copy, checksum);
+}
+
+// One cached display listing, valid while its directory keeps the identity and change times it had when it was listed
+struct display_entry
+{
+    int used;                           // Slot holds a listing
+    char path[DISPLAY_PATH_MAX];        // Directory as the clients name it, repeated and trailing slashes dropped
+    int present;                        // The directory existed when it was listed, packed files need none
+    dev_t device;                       // Identity and change times of the directory when it was listed
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long last_used;       // display_cache->ticks at the last use, the oldest listing of a set makes room
+    size_t length;                      // Bytes of the listing
+    char listing[BUFFER_SIZE];
+};
+
+// The display cache, one table every worker maps: sets of DISPLAY_CACHE_WAYS slots chosen by a hash of the path
+struct display_cache
+{
+    pthread_mutex_t lock;               // Process-shared lock guarding everything below
+    unsigned long long changes;         // Bumped by every invalidation, a listing made across one is not kept
+    unsigned long long ticks;           // Counts the uses of listings, for last_used
+    unsigned long hits;                 // Displays answered from the cache
+    unsigned long misses;               // Displays that listed the directory
+    unsigned long invalidations;        // Listings dropped because their directory changed
+    unsigned long evictions;            // Listings dropped to make room in a full set
+    struct display_entry entries[DISPLAY_CACHE_SLOTS];
+};
+
+// What display_cache_lookup() saw of a directory before it was listed, for display_cache_store()
+struct display_stamp
+{
+    int cacheable;                      // Caching is on and the path is short enough
+    char path[DISPLAY_PATH_MAX];
+    int present;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long changes;         // display_cache->changes at the lookup
+};
+
+struct display_cache *display_cache;    // Mapped by display_cache_init(), NULL while every display lists afresh
+
+// Function to map the display cache before the first worker starts, so all of them share it
+int display_cache_init()
+{
+    pthread_mutexattr_t attributes;
+
+    display_cache = mmap(NULL, sizeof(struct display_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (display_cache == MAP_FAILED)
     {
-        printf("A new client has connected to the Smain server\n");
+        perror("Failed to map the display cache");
+        display_cache = NULL;
+        return -1;
+    }
+    memset(display_cache, 0, sizeof(struct display_cache));
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&display_cache->lock, &attributes) != 0)
+    {
+        perror("Failed to create the display cache lock");
+        munmap(display_cache, sizeof(struct display_cache));
+        display_cache = NULL;
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attributes);
+    printf("Display cache keeps up to %d listings in %zu KB\n", DISPLAY_CACHE_SLOTS, sizeof(struct display_cache) / 1024);
+    return 0;
+}
 
-        // Creating a new process to handle the client connection
-        if (fork() == 0)
+// Function to turn a directory named by a client into its cache key, dropping repeated and trailing slashes
+// Returns -1 when it is too long to be cached
+int display_key(const char *path, char *key)
+{
+    size_t length = 0;
+
+    for (const char *p = path; *p != '\0'; p++)
+    {
+        if (*p == '/' && (length == 0 || key[length - 1] == '/'))
         {
-            // Child process: handle the client
-            close(server_socket);                   // Closing the listening socket in the child process
-            process_client_request(client_socket);  // Processing the client's requests
-            close(client_socket);                   // Closing the client socket after processing
-            exit(0);                                // Exiting the child process
+            continue;
+        }
+        if (length == DISPLAY_PATH_MAX - 1)
+        {
+            return -1;
+        }
+        key[length++] = *p;
+    }
+    while (length > 0 && key[length - 1] == '/')
+    {
+        length--;
+    }
+    key[length] = '\0';
+    return 0;
+}
+
+// Function to find the set of slots a key may use
+struct display_entry *display_set(const char *key)
+{
+    uint32_t hash = crc32c_update(0, key, strlen(key));
+
+    return &display_cache->entries[hash % (DISPLAY_CACHE_SLOTS / DISPLAY_CACHE_WAYS) * DISPLAY_CACHE_WAYS];
+}
+
+// Function to find the cached listing of a directory. directory is where the store keeps it; a listing is only used
+// while the directory has the identity and change times it had when it was listed, so changes made behind the
+// server's back are noticed too. *stamp records what was seen, for display_cache_store() after a miss
+// Returns the length of the listing copied to listing, -1 on a miss
+long display_cache_lookup(const char *path, const char *directory, char *listing, size_t size, struct display_stamp *stamp)
+{
+    struct display_entry *set;
+    struct stat info;
+    long length = -1;
+
+    stamp->cacheable = display_cache != NULL && display_key(path, stamp->path) == 0;
+    if (!stamp->cacheable)
+    {
+        return -1;
+    }
+    memset(&info, 0, sizeof(info));
+    stamp->present = stat(directory, &info) == 0 && S_ISDIR(info.st_mode);
+    stamp->device = stamp->present ? info.st_dev : 0;
+    stamp->inode = stamp->present ? info.st_ino : 0;
+    stamp->mtime = stamp->present ? info.st_mtim : (struct timespec){0, 0};
+    stamp->ctime = stamp->present ? info.st_ctim : (struct timespec){0, 0};
+    set = display_set(stamp->path);
+
+    pthread_mutex_lock(&display_cache->lock);
+    stamp->changes = display_cache->changes;
+    for (int i = 0; i < DISPLAY_CACHE_WAYS; i++)
+    {
+        struct display_entry *entry = &set[i];
+
+        if (!entry->used || strcmp(entry->path, stamp->path) != 0)
+        {
+            continue;
+        }
+        if (entry->present == stamp->present && entry->device == stamp->device && entry->inode == stamp->inode &&
+            entry->mtime.tv_sec == stamp->mtime.tv_sec && entry->mtime.tv_nsec == stamp->mtime.tv_nsec &&
+            entry->ctime.tv_sec == stamp->ctime.tv_sec && entry->ctime.tv_nsec == stamp->ctime.tv_nsec &&
+            entry->length < size)
+        {
+            memcpy(listing, entry->listing, entry->length);
+            listing[entry->length] = '\0';
+            length = (long)entry->length;
+            entry->last_used = ++display_cache->ticks;
         }
         else
         {
-            // Parent process: close the client socket and continue listening for new connections
-            close(client_socket);
+            entry->used = 0; // The directory changed since it was listed
+            display_cache->invalidations++;
+        }
+        break;
+    }
+    if (length >= 0)
+    {
+        display_cache->hits++;
+    }
+    else
+    {
+        display_cache->misses++;
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+    return length;
+}
+
+// Function to keep a listing made after display_cache_lookup() missed. It is not kept when an invalidation came in
+// meanwhile, nor when the directory changed in the last DISPLAY_RACY_NS: file times only move once per kernel clock
+// tick, so a second change in the tick of the first would leave them as they were
+void display_cache_store(const struct display_stamp *stamp, const char *listing, size_t length)
+{
+    struct display_entry *set, *slot = NULL;
+    struct timespec now;
+    long long changed_ns;
+
+    if (!stamp->cacheable || length >= BUFFER_SIZE)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    changed_ns = (long long)stamp->mtime.tv_sec * 1000000000LL + stamp->mtime.tv_nsec;
+    if ((long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec > changed_ns)
+    {
+        changed_ns = (long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec;
+    }
+    if (stamp->present && (long long)now.tv_sec * 1000000000LL + now.tv_nsec - changed_ns < DISPLAY_RACY_NS)
+    {
+        return;
+    }
+    set = display_set(stamp->path);
+
+    pthread_mutex_lock(&display_cache->lock);
+    if (display_cache->changes == stamp->changes)
+    {
+        // The directory's own slot when another worker listed it meanwhile, else a free one, else the least
+        // recently used of the set
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++)
+        {
+            if (set[i].used && strcmp(set[i].path, stamp->path) == 0)
+            {
+                slot = &set[i];
+            }
+        }
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++)
+        {
+            if (!set[i].used)
+            {
+                slot = &set[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            slot = &set[0];
+            for (int i = 1; i < DISPLAY_CACHE_WAYS; i++)
+            {
+                slot = set[i].last_used < slot->last_used ? &set[i] : slot;
+            }
+            display_cache->evictions++;
+        }
+        slot->used = 1;
+        snprintf(slot->path, sizeof(slot->path), "%s", stamp->path);
+        slot->present = stamp->present;
+        slot->device = stamp->device;
+        slot->inode = stamp->inode;
+        slot->mtime = stamp->mtime;
+        slot->ctime = stamp->ctime;
+        slot->last_used = ++display_cache->ticks;
+        slot->length = length;
+        memcpy(slot->listing, listing, length);
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+}
+
+// Function to drop the listings a change to a stored path makes stale: that of the directory holding it, and for
+// a directory or a glob its own and all below it. Called once the change is done, which also keeps a listing made
+// meanwhile from being stored
+void display_cache_invalidate(const char *path)
+{
+    char key[DISPLAY_PATH_MAX];
+    char *slash;
+    size_t length, parent_length;
+
+    if (display_cache == NULL)
+    {
+        return;
+    }
+    if (display_key(path, key) != 0)
+    {
+        key[0] = '\0'; // Too long to compare, every listing goes
+    }
+    if ((slash = strrchr(key, '/')) != NULL && strpbrk(slash + 1, "*?[") != NULL)
+    {
+        *slash = '\0'; // A glob may match directories, everything below its directory goes
+    }
+    length = strlen(key);
+    slash = strrchr(key, '/');
+    parent_length = slash != NULL ? (size_t)(slash - key) : 0;
+
+    pthread_mutex_lock(&display_cache->lock);
+    display_cache->changes++;
+    for (int i = 0; i < DISPLAY_CACHE_SLOTS; i++)
+    {
+        struct display_entry *entry = &display_cache->entries[i];
+
+        if (entry->used && (length == 0 ||
+            (strncmp(entry->path, key, length) == 0 && (entry->path[length] == '\0' || entry->path[length] == '/')) ||
+            (strlen(entry->path) == parent_length && strncmp(entry->path, key, parent_length) == 0)))
+        {
+            entry->used = 0;
+            display_cache->invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+}
+
+// Header in front of every file appended to a pack segment, followed by the path and then the file data
+struct pack_record
+{
+    uint32_t magic;                     // PACK_RECORD_MAGIC, marks the start of a record
+    uint32_t path_length;               // Bytes of the path, which is not terminated
+    uint32_t length;                    // Bytes of file data after the path
+    uint32_t checksum;                  // CRC32C of the file data
+    int64_t mtime_ns;                   // When the file was stored, in nanoseconds since the epoch
+};
+
+// One slot of the pack index: where the current version of a packed file is
+struct pack_entry
+{
+    uint32_t state;                     // PACK_SLOT_EMPTY, PACK_SLOT_USED or PACK_SLOT_DELETED
+    uint32_t segment;                   // Segment file holding the data
+    uint64_t offset;                    // Offset of the file data inside the segment
+    uint32_t length;
+    uint32_t checksum;
+    int64_t mtime_ns;
+    char path[PACK_PATH_MAX];           // Path relative to the store directory, "~smain/dir/file.c"
+};
+
+// The pack index, a file every worker maps: segment bookkeeping followed by an open addressing hash table
+struct pack_index
+{
+    uint32_t magic;                     // PACK_INDEX_MAGIC once the index is set up
+    uint32_t slot_count;                // PACK_INDEX_SLOTS of the build that created the index
+    pthread_rwlock_t lock;              // Process-shared; lookups share it, appends, removals and compaction take it alone
+    uint32_t active_segment;            // Segment new records are appended to
+    int compacting;                     // Set while a worker compacts, so only one does at a time
+    uint32_t entries;                   // Slots holding a file
+    uint32_t deleted;                   // Slots of removed files, reclaimed when the table is rebuilt
+    uint32_t generation[PACK_MAX_SEGMENTS];     // Bumped when a segment number is used again, so stale descriptors are noticed
+    uint64_t segment_bytes[PACK_MAX_SEGMENTS];  // Bytes appended to each segment, 0 for a number not in use
+    uint64_t live_bytes[PACK_MAX_SEGMENTS];     // Bytes of the records the index still points to
+    struct pack_entry slots[PACK_INDEX_SLOTS];
+};
+
+struct pack_index *pack_index;          // Mapped by pack_init(), NULL while every file is stored loose
+char pack_root[BUFFER_SIZE];            // Store directory the packed paths are relative to
+int pack_write_fd = -1;                 // This worker's descriptor of the active segment, used under the index lock
+uint32_t pack_write_segment;            // Segment and generation pack_write_fd was opened for
+uint32_t pack_write_generation;
+
+// Function to name the file of a segment
+void pack_segment_path(uint32_t segment, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s/segment-%04u", pack_root, PACK_DIR, segment);
+}
+
+// Function to map the pack index of a store, creating it on first use. An index written by a build with another
+// layout is started afresh. The lock and the compaction flag are reset here, before any worker runs, because a
+// worker killed while holding them would otherwise leave them taken for good
+int pack_init(const char *store_root)
+{
+    char path[BUFFER_SIZE * 2];
+    struct stat index_info;
+    uint32_t header[2];                 // Magic number and slot count of an existing index
+    pthread_rwlockattr_t attributes;
+    int index_fd;
+
+    snprintf(pack_root, sizeof(pack_root), "%s", store_root);
+    snprintf(path, sizeof(path), "%s/%s", store_root, PACK_DIR);
+    if (create_dir_if_new(path) != 0)
+    {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/index", store_root, PACK_DIR);
+    if ((index_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || fstat(index_fd, &index_info) != 0)
+    {
+        perror("Failed to open the pack index");
+        if (index_fd >= 0)
+        {
+            close(index_fd);
+        }
+        return -1;
+    }
+
+    // Truncating to zero first leaves a sparse, zeroed table without writing 16 MB
+    if (index_info.st_size != sizeof(struct pack_index) || pread(index_fd, header, sizeof(header), 0) != sizeof(header) ||
+        header[0] != PACK_INDEX_MAGIC || header[1] != PACK_INDEX_SLOTS)
+    {
+        if (ftruncate(index_fd, 0) != 0 || ftruncate(index_fd, sizeof(struct pack_index)) != 0)
+        {
+            perror("Failed to create the pack index");
+            close(index_fd);
+            return -1;
+        }
+    }
+    pack_index = mmap(NULL, sizeof(struct pack_index), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    close(index_fd);
+    if (pack_index == MAP_FAILED)
+    {
+        perror("Failed to map the pack index");
+        pack_index = NULL;
+        return -1;
+    }
+    pack_index->magic = PACK_INDEX_MAGIC;
+    pack_index->slot_count = PACK_INDEX_SLOTS;
+    pack_index->compacting = 0;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_rwlock_init(&pack_index->lock, &attributes) != 0)
+    {
+        perror("Failed to create the pack index lock");
+        munmap(pack_index, sizeof(struct pack_index));
+        pack_index = NULL;
+        return -1;
+    }
+    pthread_rwlockattr_destroy(&attributes);
+    printf("Pack storage in %s/%s holds %u files\n", store_root, PACK_DIR, pack_index->entries);
+    return 0;
+}
+
+// Function to turn a stored path into its index key: repeated slashes, "." components and a trailing slash are
+// dropped, so every spelling the file system accepts for a file finds the same entry. Returns -1 when it does not fit
+int pack_key(const char *path, char *key)
+{
+    size_t length = 0;
+
+    while (*path)
+    {
+        if (*path == '/' || (path[0] == '.' && (path[1] == '/' || path[1] == '\0')))
+        {
+            path++;
+            continue;
+        }
+        if (length > 0)
+        {
+            key[length++] = '/';
+        }
+        while (*path && *path != '/')
+        {
+            if (length >= PACK_PATH_MAX - 2)
+            {
+                return -1;
+            }
+            key[length++] = *path++;
+        }
+    }
+    key[length] = '\0';
+    return 0;
+}
+
+// Function to hash an index key, FNV-1a
+uint32_t pack_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (; *key; key++)
+    {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Function to find the slot of a key, caller holds the index lock
+// Returns the slot holding the key, or NULL with *free_slot set to where the key would go (NULL when the table is full)
+struct pack_entry *pack_find(const char *key, struct pack_entry **free_slot)
+{
+    uint32_t slot = pack_hash(key) & (PACK_INDEX_SLOTS - 1);
+    struct pack_entry *reusable = NULL;
+
+    for (uint32_t probes = 0; probes < PACK_INDEX_SLOTS; probes++, slot = (slot + 1) & (PACK_INDEX_SLOTS - 1))
+    {
+        struct pack_entry *entry = &pack_index->slots[slot];
+
+        if (entry->state == PACK_SLOT_EMPTY)
+        {
+            reusable = reusable != NULL ? reusable : entry;
+            break;
+        }
+        if (entry->state == PACK_SLOT_DELETED)
+        {
+            reusable = reusable != NULL ? reusable : entry;
+        }
+        else if (strcmp(entry->path, key) == 0)
+        {
+            return entry;
+        }
+    }
+    if (free_slot != NULL)
+    {
+        *free_slot = reusable;
+    }
+    return NULL;
+}
+
+// Function to give the bytes a file's record takes in its segment
+uint64_t pack_record_bytes(const struct pack_entry *entry)
+{
+    return sizeof(struct pack_record) + strlen(entry->path) + entry->length;
+}
+
+// Function to rebuild the hash table without the slots of removed files, caller holds the index lock alone
+void pack_rehash()
+{
+    struct pack_entry *live = malloc((pack_index->entries + 1) * sizeof(struct pack_entry));
+    struct pack_entry *slot;
+    uint32_t count = 0;
+
+    if (live == NULL)
+    {
+        return;
+    }
+    for (uint32_t i = 0; i < PACK_INDEX_SLOTS; i++)
+    {
+        if (pack_index->slots[i].state == PACK_SLOT_USED)
+        {
+            live[count++] = pack_index->slots[i];
+        }
+    }
+    memset(pack_index->slots, 0, sizeof(pack_index->slots));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pack_find(live[i].path, &slot);
+        *slot = live[i];
+    }
+    pack_index->entries = count;
+    pack_index->deleted = 0;
+    free(live);
+}
+
+// Function to append one record to the active segment, moving on to an unused segment number once it is full
+// Caller holds the index lock alone; *location gets where the data went. Returns -1 when nothing was appended
+int pack_append(const char *key, const char *data, uint32_t length, uint32_t checksum, int64_t mtime_ns, struct pack_entry *location)
+{
+    struct pack_record record = {PACK_RECORD_MAGIC, strlen(key), length, checksum, mtime_ns};
+    struct iovec parts[3] = {{&record, sizeof(record)}, {(void *)key, record.path_length}, {(void *)data, length}};
+    uint64_t record_bytes = sizeof(record) + record.path_length + length;
+    uint32_t segment = pack_index->active_segment;
+    char path[BUFFER_SIZE * 2];
+
+    if (pack_index->segment_bytes[segment] > 0 && pack_index->segment_bytes[segment] + record_bytes > PACK_SEGMENT_BYTES)
+    {
+        uint32_t next = segment;
+
+        for (uint32_t i = 1; i < PACK_MAX_SEGMENTS && next == segment; i++)
+        {
+            if (pack_index->segment_bytes[(segment + i) % PACK_MAX_SEGMENTS] == 0)
+            {
+                next = (segment + i) % PACK_MAX_SEGMENTS;
+            }
+        }
+        if (next == segment)
+        {
+            return -1; // Every segment number is in use, new files stay loose until compaction frees one
+        }
+        pack_index->active_segment = segment = next;
+        pack_index->generation[segment]++;
+    }
+    if (pack_write_fd < 0 || pack_write_segment != segment || pack_write_generation != pack_index->generation[segment])
+    {
+        if (pack_write_fd >= 0)
+        {
+            close(pack_write_fd);
+        }
+        // A number used for the first time may still have a file from before the index was started afresh
+        pack_segment_path(segment, path, sizeof(path));
+        pack_write_fd = open(path, O_WRONLY | O_CREAT | (pack_index->segment_bytes[segment] == 0 ? O_TRUNC : 0), 0600);
+        if (pack_write_fd < 0)
+        {
+            perror("Failed to open a pack segment");
+            return -1;
+        }
+        pack_write_segment = segment;
+        pack_write_generation = pack_index->generation[segment];
+    }
+    if (pwritev(pack_write_fd, parts, 3, pack_index->segment_bytes[segment]) != (ssize_t)record_bytes)
+    {
+        perror("Failed to append to a pack segment");
+        return -1;
+    }
+    location->state = PACK_SLOT_USED;
+    location->segment = segment;
+    location->offset = pack_index->segment_bytes[segment] + sizeof(record) + record.path_length;
+    location->length = length;
+    location->checksum = checksum;
+    location->mtime_ns = mtime_ns;
+    snprintf(location->path, sizeof(location->path), "%s", key);
+    pack_index->segment_bytes[segment] += record_bytes;
+    pack_index->live_bytes[segment] += record_bytes;
+    return 0;
+}
+
+// Function to store a small file in the pack: its record is appended to the active segment, the index entry is pointed
+// at it and a loose copy of the same path is deleted. Returns -1 when the file has to be stored as a loose file instead
+int pack_store(const char *path, const char *data, size_t length, uint32_t checksum)
+{
+    char key[PACK_PATH_MAX], loose_path[BUFFER_SIZE * 2];
+    struct pack_entry *entry, *free_slot, location;
+    struct timespec now;
+    int result = -1;
+
+    if (!PACK_ENABLED || pack_index == NULL || length > PACK_MAX_FILE || pack_key(path, key) != 0)
+    {
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_rwlock_wrlock(&pack_index->lock);
+    entry = pack_find(key, &free_slot);
+    if (entry == NULL && pack_index->entries + pack_index->deleted >= PACK_INDEX_SLOTS / 8 * 7)
+    {
+        // Probing gets slow in a table this full: reclaim the removed files' slots, or leave new files loose
+        if (pack_index->deleted > 0)
+        {
+            pack_rehash();
+            pack_find(key, &free_slot);
+        }
+        if (pack_index->entries + pack_index->deleted >= PACK_INDEX_SLOTS / 8 * 7)
+        {
+            free_slot = NULL;
+        }
+    }
+    if ((entry != NULL || free_slot != NULL) &&
+        pack_append(key, data, length, checksum, (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec, &location) == 0)
+    {
+        if (entry != NULL)
+        {
+            pack_index->live_bytes[entry->segment] -= pack_record_bytes(entry);
+        }
+        else
+        {
+            entry = free_slot;
+            pack_index->deleted -= entry->state == PACK_SLOT_DELETED;
+            pack_index->entries++;
+        }
+        *entry = location;
+        result = 0;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+
+    if (result == 0)
+    {
+        snprintf(loose_path, sizeof(loose_path), "%s/%s", pack_root, key);
+        unlink(loose_path);
+        display_cache_invalidate(key); // Packed files leave no trace in the directory's times
+    }
+    return result;
+}
+
+// Function to look a path up in the pack, returns 0 and copies its entry when the file is packed
+int pack_lookup(const char *path, struct pack_entry *found)
+{
+    char key[PACK_PATH_MAX];
+    struct pack_entry *entry;
+
+    if (pack_index == NULL || pack_key(path, key) != 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL && found != NULL)
+    {
+        *found = *entry;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return entry != NULL ? 0 : -1;
+}
+
+// Function to open the segment holding a packed file, the data is `found->length` bytes at `found->offset`
+// The segment is opened under the index lock, so compaction can neither delete it nor reuse its number in between
+// Returns the descriptor, -1 when the file is not packed
+int pack_open_file(const char *path, struct pack_entry *found)
+{
+    char key[PACK_PATH_MAX], segment_path[BUFFER_SIZE * 2];
+    struct pack_entry *entry;
+    int file_descriptor = -1;
+
+    if (pack_index == NULL || pack_key(path, key) != 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL)
+    {
+        *found = *entry;
+        pack_segment_path(entry->segment, segment_path, sizeof(segment_path));
+        file_descriptor = open(segment_path, O_RDONLY);
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return file_descriptor;
+}
+
+// Function to drop a file from the pack, its record becomes garbage for compaction. Returns 0 when it was packed
+int pack_remove(const char *path)
+{
+    char key[PACK_PATH_MAX];
+    struct pack_entry *entry;
+
+    if (pack_index == NULL || pack_key(path, key) != 0)
+    {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL)
+    {
+        pack_index->live_bytes[entry->segment] -= pack_record_bytes(entry);
+        entry->state = PACK_SLOT_DELETED;
+        pack_index->entries--;
+        pack_index->deleted++;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    if (entry != NULL)
+    {
+        display_cache_invalidate(key);
+    }
+    return entry != NULL ? 0 : -1;
+}
+
+// Function to copy the entries of every packed file below a directory, "" for the whole store
+// Returns the number of entries in *listing, which the caller frees; a path relative to the directory starts
+// *skip bytes into the entry's path
+int pack_list(const char *directory, struct pack_entry **listing, size_t *skip)
+{
+    char key[PACK_PATH_MAX];
+    size_t key_length;
+    int count = 0, capacity = 0;
+
+    *listing = NULL;
+    *skip = 0;
+    if (pack_index == NULL || pack_key(directory, key) != 0)
+    {
+        return 0;
+    }
+    key_length = strlen(key);
+    *skip = key_length > 0 ? key_length + 1 : 0;
+    pthread_rwlock_rdlock(&pack_index->lock);
+    for (uint32_t i = 0; i < PACK_INDEX_SLOTS; i++)
+    {
+        struct pack_entry *entry = &pack_index->slots[i];
+
+        if (entry->state != PACK_SLOT_USED ||
+            (key_length > 0 && (strncmp(entry->path, key, key_length) != 0 || entry->path[key_length] != '/')))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            struct pack_entry *bigger = realloc(*listing, (capacity > 0 ? capacity * 2 : 64) * sizeof(struct pack_entry));
+            if (bigger == NULL)
+            {
+                break;
+            }
+            *listing = bigger;
+            capacity = capacity > 0 ? capacity * 2 : 64;
+        }
+        (*listing)[count++] = *entry;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return count;
+}
+
+// Function to tell whether any segment but the active one is mostly garbage
+int pack_needs_compaction()
+{
+    int needed = 0;
+
+    if (pack_index == NULL)
+    {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&pack_index->lock);
+    for (uint32_t segment = 0; segment < PACK_MAX_SEGMENTS && !needed; segment++)
+    {
+        needed = segment != pack_index->active_segment && pack_index->segment_bytes[segment] > 0 &&
+                 pack_index->live_bytes[segment] * PACK_COMPACT_RATIO < pack_index->segment_bytes[segment];
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return needed;
+}
+
+// Function to move the records of one segment that the index still points to onto the active segment, then delete
+// the segment once nothing in it is live. The index lock is taken per record, so uploads and downloads carry on
+void pack_compact_segment(uint32_t segment, uint64_t size)
+{
+    char path[BUFFER_SIZE * 2], key[PACK_PATH_MAX];
+    char *buffer = malloc(PACK_PATH_MAX + PACK_MAX_FILE);
+    struct pack_record record;
+    struct pack_entry *entry, location;
+    uint64_t offset = 0;
+    long moved = 0;
+    int file_descriptor;
+
+    pack_segment_path(segment, path, sizeof(path));
+    if (buffer == NULL || (file_descriptor = open(path, O_RDONLY)) < 0)
+    {
+        free(buffer);
+        return;
+    }
+    while (offset < size && pread(file_descriptor, &record, sizeof(record), offset) == sizeof(record))
+    {
+        size_t record_bytes = sizeof(record) + record.path_length + record.length;
+
+        // Anything else is the tail of an append that never made it into the index
+        if (record.magic != PACK_RECORD_MAGIC || record.path_length >= PACK_PATH_MAX || record.length > PACK_MAX_FILE ||
+            pread(file_descriptor, buffer, record.path_length + record.length, offset + sizeof(record)) !=
+            (ssize_t)(record.path_length + record.length))
+        {
+            break;
+        }
+        memcpy(key, buffer, record.path_length);
+        key[record.path_length] = '\0';
+
+        pthread_rwlock_wrlock(&pack_index->lock);
+        entry = pack_find(key, NULL);
+        if (entry != NULL && entry->segment == segment && entry->offset == offset + sizeof(record) + record.path_length &&
+            pack_append(key, buffer + record.path_length, record.length, record.checksum, record.mtime_ns, &location) == 0)
+        {
+            pack_index->live_bytes[segment] -= record_bytes;
+            *entry = location;
+            moved++;
+        }
+        pthread_rwlock_unlock(&pack_index->lock);
+        offset += record_bytes;
+    }
+    close(file_descriptor);
+    free(buffer);
+
+    pthread_rwlock_wrlock(&pack_index->lock);
+    if (pack_index->live_bytes[segment] == 0)
+    {
+        unlink(path);
+        pack_index->segment_bytes[segment] = 0;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    printf("Compacted pack segment %u, %ld files moved\n", segment, moved);
+}
+
+// Function to compact every segment but the active one that is mostly garbage, in one worker at a time
+void pack_compact()
+{
+    if (pack_index == NULL || __atomic_exchange_n(&pack_index->compacting, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        return;
+    }
+    for (uint32_t segment = 0; segment < PACK_MAX_SEGMENTS; segment++)
+    {
+        uint64_t size;
+        int wanted;
+
+        pthread_rwlock_rdlock(&pack_index->lock);
+        size = pack_index->segment_bytes[segment];
+        wanted = segment != pack_index->active_segment && size > 0 &&
+                 pack_index->live_bytes[segment] * PACK_COMPACT_RATIO < size;
+        pthread_rwlock_unlock(&pack_index->lock);
+        if (wanted)
+        {
+            pack_compact_segment(segment, size);
+        }
+    }
+    __atomic_store_n(&pack_index->compacting, 0, __ATOMIC_RELEASE);
+}
+
+// A file received for the .c store: kept in memory while it is small enough for the pack, written to its loose
+// file once it grows past PACK_MAX_FILE
+struct pack_upload
+{
+    const char *loose_path;             // Where the file goes when it is too big for the pack
+    char *data;                         // The first PACK_MAX_FILE bytes
+    size_t used;
+    FILE *file;                         // Loose file, opened once the data no longer fits
+    long long size;                     // Size announced by the client, reserved for the loose file
+};
+
+// Function to receive a chunked file into a pack_upload, otherwise like recv_file_chunks()
+long long pack_receive(int sock, struct pack_upload *upload, uint32_t *checksum)
+{
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    long long total = 0;
+    long long released = 0;             // Loose file data handed to the disk so far
+    long length;
+    uint32_t computed = 0;
+    uint32_t trailer;
+
+    upload->used = 0;
+    upload->file = NULL;
+    if (buffer == NULL || (upload->data = malloc(PACK_MAX_FILE)) == NULL)
+    {
+        pool_release(buffer, capacity);
+        return -1;
+    }
+    // A file announced too big for the pack goes loose from the start, with its space reserved before any data comes
+    if (upload->size > PACK_MAX_FILE &&
+        ((upload->file = fopen(upload->loose_path, "wb")) == NULL || preallocate_file(upload->file, upload->size) != 0))
+    {
+        perror("Cannot store the announced file"); // Keep draining so the connection stays in sync
+        total = -1;
+    }
+    while ((length = recv_chunk(sock, &buffer, &capacity)) > 0)
+    {
+        computed = crc32c_update(computed, buffer, length);
+        if (total >= 0 && upload->file == NULL && upload->used + length <= PACK_MAX_FILE)
+        {
+            memcpy(upload->data + upload->used, buffer, length);
+            upload->used += length;
+        }
+        else if (total >= 0)
+        {
+            if (upload->file == NULL && ((upload->file = fopen(upload->loose_path, "wb")) == NULL ||
+                                         preallocate_file(upload->file, upload->size) != 0 ||
+                                         fwrite(upload->data, 1, upload->used, upload->file) != upload->used))
+            {
+                total = -1;
+            }
+            if (total >= 0 && fwrite(buffer, 1, length, upload->file) != (size_t)length)
+            {
+                total = -1;
+            }
+            if (total < 0)
+            {
+                perror("Failed to write received data"); // Keep draining so the connection stays in sync
+            }
+        }
+        if (total >= 0)
+        {
+            total += length;
+        }
+        if (upload->file != NULL && total >= 0)
+        {
+            release_written_pages(upload->file, total, &released);
+        }
+    }
+    pool_release(buffer, capacity);
+    if (length < 0 || recv_all(sock, &trailer, sizeof(trailer)) != 0)
+    {
+        return -1;
+    }
+    if (ntohl(trailer) != computed)
+    {
+        fprintf(stderr, "Checksum mismatch: expected %08x, received data has %08x\n", ntohl(trailer), computed);
+        return total < 0 ? -1 : TRANSFER_CORRUPT;
+    }
+    *checksum = computed;
+    return total;
+}
+
+// Function to store a received file: packed when it stayed small, otherwise its loose file is finished and an older
+// packed version dropped. A file that failed verification is never kept. Returns `received` or -1 when storing failed
+long long pack_finish_upload(struct pack_upload *upload, const char *path, long long received, uint32_t checksum)
+{
+    if (received >= 0 && upload->file == NULL && pack_store(path, upload->data, upload->used, checksum) != 0)
+    {
+        // The pack is full or unavailable, the file is stored loose after all
+        if ((upload->file = fopen(upload->loose_path, "wb")) == NULL ||
+            fwrite(upload->data, 1, upload->used, upload->file) != upload->used)
+        {
+            received = -1;
+        }
+    }
+    if (upload->file != NULL)
+    {
+        trim_preallocated(upload->file, upload->size);
+        if (received >= 0)
+        {
+            save_stored_checksum(fileno(upload->file), checksum); // Keep the verified checksum next to the file
+        }
+        if (fclose(upload->file) != 0 && received >= 0)
+        {
+            received = -1;
+        }
+        if (received < 0)
+        {
+            unlink(upload->loose_path);
+        }
+        else
+        {
+            pack_remove(path);
+        }
+    }
+    free(upload->data);
+    return received;
+}
+
+// State of one client connection that lives from one command to the next
+struct client_state
+{
+    int socket;                         // Client connection
+    uint32_t address;                   // Client IPv4 address, for the per-client transfer limit
+    int heartbeat_slot;                 // Registry slot of the backend when this connection carries its heartbeats
+    int event_loop;                     // Event thread watching the connection between commands, in threaded mode
+    char frame[BUFFER_SIZE];            // Command frame being received, it may arrive over several reads
+    size_t frame_used;                  // Bytes of the frame received so far
+    int64_t frame_started_ns;           // When the first bytes of the frame arrived
+    int64_t accepted_ns;                // When the connection was accepted, until its first command is traced
+    int64_t ready_ns;                   // When a worker had the connection set up
+};
+
+int64_t trace_accepted_ns;              // When the connection being set up was accepted, a fork mode worker inherits it
+
+//Declaring functions beforehand and then working on them later in the code by defining them in required places
+void process_client_request(int client_socket);
+void client_state_init(struct client_state *state, int client_socket);
+int process_client_command(struct client_state *state);
+void client_state_finish(struct client_state *state);
+int run_threaded_server(int server_socket, int workers);
+void process_uploaded_file(int client_socket, char *filename, char *destination, char *buffer);
+void process_chunked_upload(int client_socket, char *command, char *filename, char *destination, char *buffer);
+void forward_upload(int client_socket, char *filename, char *destination, char *buffer, const char *type);
+int forward_replica_replies(int client_socket, const int *sockets, const int *slots, int count, const char *filename, const char *type);
+void process_delta_upload(int client_socket, char *filename, char *destination, char *buffer);
+void manage_file_download(int client_socket, char *filename, char *command);
+void remove_file(int client_socket, char *buffer);
+void relocate_files(int client_socket, char *buffer, int move);
+void handle_file_stat(int client_socket, char *command);
+int stat_backend_file(const char *type, const char *path, long long *size, uint32_t *checksum);
+const char *route_by_type(const char *pattern);
+void handle_file_range(int client_socket, char *filename, char *command);
+void handle_dtar(int client_sock, char *filetype);
+void handle_grep(int client_sock, char *buffer);
+void handle_manifest(int client_socket, char *directory);
+int handle_subscribe(int client_socket, const char *path);
+int negative_filter_init();
+void negative_filter_load_later(const char *type);
+void negative_filter_note_upload(const char *filename, const char *destination);
+int negative_filter_missing(const char *type, const char *path);
+void handle_display(int client_sock, char *pathname);
+int establish_connection(const char *ip_address, int port_number, int *socket_fd);
+int establish_local_connection(const char *path, int socket_type, int *socket_fd);
+int registry_init();
+int admission_init();
+int feed_init();
+int registry_heartbeat(const char *command);
+void registry_disconnect(int slot);
+void release_backend(int slot);
+void resync_backend_later(int slot);
+
+// One Spdf or Stext replica known to Smain, kept up to date by its heartbeats
+struct backend_entry
+{
+    char type[8];                       // File type served: ".pdf" or ".txt"
+    char address[64];                   // Address and port the backend accepts requests on
+    int port;
+    int registered;                     // Slot holds a backend
+    time_t last_heartbeat;              // When the last heartbeat arrived, 0 once its heartbeat connection closed
+    time_t down_until;                  // Set when a connection failed, the backend is skipped until then
+    int active_transfers;               // Transfers in progress, from the last heartbeat
+    int queue_depth;                    // Connections waiting on the backend, from the last heartbeat
+    long long free_bytes;               // Free space in the backend's store, from the last heartbeat
+    int inflight;                       // Requests Smain workers currently have open with the backend
+    unsigned long requests;             // Requests routed to the backend
+    unsigned long failures;             // Connections to the backend that failed
+    char handoff_path[108];             // Unix socket accepting handed-off client connections, empty if the backend has none
+    char local_path[108];               // Unix stream socket taking the same requests as the TCP port, '@' for the abstract namespace
+    int lagging;                        // The replica may lack files the others hold, reads avoid it until it was resynced
+    time_t lagging_since;               // First write the replica missed, 0 when it only joined while others held files
+    unsigned long missed_writes;        // Writes the replica missed, a resync that saw one more does not count
+    time_t resync_active;               // Last progress of a resync of the replica, 0 while none runs
+};
+
+// Transfers running for one client address
+struct client_slot
+{
+    uint32_t address;                   // IPv4 address of the client
+    int active;                         // Admitted transfers still running, the slot is free at 0
+};
+
+// One change to the stored files, kept in the shared feed until FEED_SLOTS newer ones replace it
+struct change_event
+{
+    unsigned long long sequence;        // Position in the feed, counting every event since Smain started
+    int kind;                           // FEED_CREATED, FEED_MODIFIED, FEED_DELETED or FEED_DELETED_TREE
+    char path[FEED_PATH_MAX];           // "~smain/..." path, a glob or directory for deletions done by a backend
+    long long size;                     // Size after the change, -1 for deletions
+    uint32_t checksum;                  // CRC32C after the change
+};
+
+// State shared by every forked Smain worker, mapped once before the accept loop
+struct smain_shared
+{
+    unsigned long cache_hits;           // Downloads served from the local cache
+    unsigned long cache_misses;         // Downloads that had to be fetched from Spdf or Stext
+    unsigned long cache_fills;          // Files added to the cache after a miss
+    unsigned long cache_evictions;      // Files dropped to stay under CACHE_MAX_BYTES
+    unsigned long cache_invalidations;  // Files dropped because ufile or rmfile changed them
+    long long cache_bytes;              // Bytes currently held by the cache
+    pthread_mutex_t registry_lock;      // Process-shared lock guarding backends[]
+    struct backend_entry backends[MAX_BACKENDS]; // Spdf/Stext replicas that registered through heartbeats
+    pthread_mutex_t admission_lock;     // Process-shared lock guarding the admission counters below
+    pthread_cond_t admission_changed;   // Signalled when a transfer finishes or backend load changes
+    int active_transfers;               // Admitted transfers still running
+    int queued_transfers;               // Transfers waiting for a slot
+    int connections;                    // Open client connections, counted by the accept loop
+    unsigned long admitted;             // Transfers admitted, directly or after queueing
+    unsigned long rejected;             // Transfers answered with "busy"
+    long average_transfer_ms;           // Moving average of transfer durations, used for the retry hint
+    struct client_slot clients[MAX_CLIENT_SLOTS]; // Running transfers per client address
+    pthread_mutex_t feed_lock;          // Process-shared lock guarding the change feed
+    pthread_cond_t feed_changed;        // Broadcast when an event is added to the feed
+    unsigned long long feed_head;       // Sequence number of the next event
+    int feed_subscribers;               // Connections following the feed, no events are recorded while there are none
+    struct change_event feed[FEED_SLOTS]; // The last FEED_SLOTS events, the one with sequence s is at s % FEED_SLOTS
+};
+
+struct smain_shared *shared_state;      // Points into the shared mapping created by init_shared_state()
+
+// Function to map the shared state so that counters survive across the forked workers
+int init_shared_state()
+{
+    shared_state = mmap(NULL, sizeof(struct smain_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared_state == MAP_FAILED)
+    {
+        perror("Failed to map shared state");
+        return -1;
+    }
+    memset(shared_state, 0, sizeof(struct smain_shared));
+    return registry_init() == 0 && admission_init() == 0 && feed_init() == 0 ? 0 : -1;
+}
+
+// Function to set up the backend registry lock, which has to work across the forked workers
+int registry_init()
+{
+    pthread_mutexattr_t attributes;
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&shared_state->registry_lock, &attributes) != 0)
+    {
+        perror("Failed to create the backend registry lock");
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attributes);
+    return 0;
+}
+
+// Function to record a heartbeat "heartbeat <type> <address> <port> <active> <queue> <free bytes>"
+// The first heartbeat of a backend registers it; returns the registry slot or -1 for a malformed heartbeat
+int registry_heartbeat(const char *command)
+{
+    char type[8], address[64], handoff_path[108] = "-", local_path[108] = "-";
+    int port, active, queue, slot = -1, fields;
+    long long free_bytes;
+    time_t now = time(NULL);
+
+    // The Unix socket endpoints are optional, a backend leaves out what it does not offer or sends "-"
+    fields = sscanf(command, "%*s %7s %63s %d %d %d %lld %107s %107s", type, address, &port, &active, &queue, &free_bytes,
+                    handoff_path, local_path);
+    if (fields < 6 || (strcmp(type, ".pdf") != 0 && strcmp(type, ".txt") != 0))
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS && slot < 0; i++)
+    {
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (entry->registered && entry->port == port && strcmp(entry->address, address) == 0)
+        {
+            slot = i;
+        }
+    }
+    for (int i = 0; i < MAX_BACKENDS && slot < 0; i++)
+    {
+        // Reuse an empty slot, or one whose backend has been silent for ten heartbeat timeouts
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (!entry->registered || now - entry->last_heartbeat > 10 * HEARTBEAT_TIMEOUT)
+        {
+            slot = i;
+            memset(entry, 0, sizeof(*entry));
+            snprintf(entry->type, sizeof(entry->type), "%s", type);
+            snprintf(entry->address, sizeof(entry->address), "%s", address);
+            entry->port = port;
+            entry->registered = 1;
+            printf("Registered %s backend %s:%d\n", type, address, port);
+
+            // Whatever the other replicas of the type already hold has to reach this one before it serves reads
+            for (int j = 0; j < MAX_BACKENDS; j++)
+            {
+                if (j != i && shared_state->backends[j].registered && strcmp(shared_state->backends[j].type, type) == 0)
+                {
+                    entry->lagging = 1;
+                }
+            }
+        }
+    }
+    if (slot >= 0)
+    {
+        struct backend_entry *entry = &shared_state->backends[slot];
+        entry->last_heartbeat = now;
+        entry->down_until = 0; // A heartbeat shows the backend is alive again
+        entry->active_transfers = active;
+        entry->queue_depth = queue;
+        entry->free_bytes = free_bytes;
+        snprintf(entry->handoff_path, sizeof(entry->handoff_path), "%s", strcmp(handoff_path, "-") == 0 ? "" : handoff_path);
+        snprintf(entry->local_path, sizeof(entry->local_path), "%s", strcmp(local_path, "-") == 0 ? "" : local_path);
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    pthread_cond_broadcast(&shared_state->admission_changed); // Backend load changed, queued transfers re-check
+    return slot;
+}
+
+// Function to mark a backend down at once when its heartbeat connection closes, instead of waiting for the timeout
+void registry_disconnect(int slot)
+{
+    pthread_mutex_lock(&shared_state->registry_lock);
+    shared_state->backends[slot].last_heartbeat = 0;
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    printf("%s backend %s:%d went away\n", shared_state->backends[slot].type,
+           shared_state->backends[slot].address, shared_state->backends[slot].port);
+}
+
+// Function to tell whether a registered backend may receive requests, caller holds the registry lock
+int backend_healthy(const struct backend_entry *entry, time_t now)
+{
+    return entry->registered && now - entry->last_heartbeat <= HEARTBEAT_TIMEOUT && entry->down_until <= now;
+}
+
+// Function to record that a write did not reach a replica, caller holds the registry lock
+void registry_missed_write(struct backend_entry *entry, time_t now)
+{
+    if (!entry->lagging || entry->lagging_since == 0)
+    {
+        entry->lagging_since = now;
+    }
+    entry->lagging = 1;
+    entry->missed_writes++;
+}
+
+// Function to flag every registered replica of a type that is down, for a write that only reaches the healthy ones
+void registry_note_write(const char *type)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS; i++)
+    {
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (entry->registered && strcmp(entry->type, type) == 0 && !backend_healthy(entry, now))
+        {
+            registry_missed_write(entry, now);
+        }
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+}
+
+// Function to flag one replica that took part in a write but did not confirm it
+void registry_write_failed(int slot)
+{
+    if (slot >= 0 && slot != REGISTRY_DEFAULT)
+    {
+        pthread_mutex_lock(&shared_state->registry_lock);
+        registry_missed_write(&shared_state->backends[slot], time(NULL));
+        pthread_mutex_unlock(&shared_state->registry_lock);
+    }
+}
+
+// Function to open a connection to a backend slot, or to the compiled-in server when slot is REGISTRY_DEFAULT
+// A backend advertising a Unix socket is reached through it when it runs on this host; connecting to a Unix socket
+// of a backend elsewhere fails at once, and TCP is used instead.
+// A failed connection marks the backend down for BACKEND_RETRY_DELAY seconds, so other workers skip it right away
+int connect_registered(int slot, const char *type, int *socket_fd)
+{
+    const char *address = strcmp(type, ".pdf") == 0 ? PDF_ADDRESS : TEXT_ADDRESS;
+    int port = strcmp(type, ".pdf") == 0 ? SPDF_PORT : STEXT_PORT;
+    int64_t started = trace_now();
+
+    if (slot != REGISTRY_DEFAULT)
+    {
+        address = shared_state->backends[slot].address;
+        port = shared_state->backends[slot].port;
+        if (LOCAL_TRANSPORT_ENABLED && shared_state->backends[slot].local_path[0] != '\0' &&
+            establish_local_connection(shared_state->backends[slot].local_path, SOCK_STREAM, socket_fd) == 0)
+        {
+            trace_span(TRACE_CONNECT, trace_context.request, started, trace_now(), 0, type);
+            return 0;
+        }
+    }
+    if (establish_connection(address, port, socket_fd) == 0)
+    {
+        trace_span(TRACE_CONNECT, trace_context.request, started, trace_now(), 0, type);
+        return 0;
+    }
+    trace_span(TRACE_CONNECT, trace_context.request, started, trace_now(), -1, type);
+    if (slot != REGISTRY_DEFAULT)
+    {
+        pthread_mutex_lock(&shared_state->registry_lock);
+        shared_state->backends[slot].down_until = time(NULL) + BACKEND_RETRY_DELAY;
+        shared_state->backends[slot].failures++;
+        pthread_mutex_unlock(&shared_state->registry_lock);
+        fprintf(stderr, "Marked %s backend %s:%d down\n", type, address, port);
+    }
+    return -1;
+}
+
+// Function to choose the least-loaded healthy backend serving a file type (".pdf" or ".txt") that was not tried yet
+// Load is the backend's own figure from its last heartbeat plus the requests Smain workers have open with it right now;
+// ties go to the backend with more free disk. A lagging replica is only chosen while no replica in sync is left, as it
+// may answer "not found" or send an old version. With need_handoff only backends advertising a handoff socket qualify.
+// The chosen backend is counted in flight until release_backend(). Returns its slot or -1.
+int pick_backend(const char *type, const int *tried, int need_handoff, int *any_registered)
+{
+    int best = -1;
+    long best_load = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS; i++)
+    {
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (!entry->registered || strcmp(entry->type, type) != 0)
+        {
+            continue;
+        }
+        *any_registered = 1;
+        if (tried[i] || !backend_healthy(entry, now) || (need_handoff && entry->handoff_path[0] == '\0'))
+        {
+            continue;
+        }
+        long load = entry->active_transfers + entry->queue_depth + entry->inflight;
+        if (best < 0 || entry->lagging < shared_state->backends[best].lagging ||
+            (entry->lagging == shared_state->backends[best].lagging &&
+             (load < best_load || (load == best_load && entry->free_bytes > shared_state->backends[best].free_bytes))))
+        {
+            best = i;
+            best_load = load;
+        }
+    }
+    if (best >= 0)
+    {
+        shared_state->backends[best].inflight++;
+        shared_state->backends[best].requests++;
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    return best;
+}
+
+// Function to connect to the least-loaded healthy backend serving a file type, see pick_backend()
+// Backends that refuse the connection are skipped and the next one is tried.
+// With no registered backend the compiled-in address is used. Returns the slot to pass to release_backend() or -1.
+int connect_backend(const char *type, int *socket_fd)
+{
+    int tried[MAX_BACKENDS] = {0};
+    int any_registered = 0;
+
+    while (1)
+    {
+        int best = pick_backend(type, tried, 0, &any_registered);
+
+        if (best < 0)
+        {
+            // Fall back to the compiled-in server only while nothing of this type has registered
+            if (!any_registered && connect_registered(REGISTRY_DEFAULT, type, socket_fd) == 0)
+            {
+                return REGISTRY_DEFAULT;
+            }
+            return -1;
+        }
+        if (connect_registered(best, type, socket_fd) == 0)
+        {
+            return best;
+        }
+        release_backend(best);
+        tried[best] = 1;
+    }
+}
+
+// Function to connect to every healthy backend serving a file type, so a write reaches all replicas
+// Replicas that are down or refuse the connection miss the write and are flagged as lagging until a resync
+// Returns the number of connections made; sockets[] and slots[] receive up to MAX_BACKENDS entries
+int connect_all_backends(const char *type, int *sockets, int *slots)
+{
+    int candidates[MAX_BACKENDS];
+    int candidate_count = 0, connected = 0, any_registered = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS; i++)
+    {
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (entry->registered && strcmp(entry->type, type) == 0)
+        {
+            any_registered = 1;
+            if (backend_healthy(entry, now))
+            {
+                entry->inflight++;
+                entry->requests++;
+                candidates[candidate_count++] = i;
+            }
+            else
+            {
+                registry_missed_write(entry, now); // Every caller writes, a replica that is down misses it
+            }
+        }
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+
+    for (int i = 0; i < candidate_count; i++)
+    {
+        if (connect_registered(candidates[i], type, &sockets[connected]) == 0)
+        {
+            slots[connected++] = candidates[i];
+        }
+        else
+        {
+            registry_write_failed(candidates[i]);
+            release_backend(candidates[i]);
+        }
+    }
+    if (!any_registered && connect_registered(REGISTRY_DEFAULT, type, &sockets[0]) == 0)
+    {
+        slots[connected++] = REGISTRY_DEFAULT;
+    }
+    return connected;
+}
+
+// Function to end a request on a backend obtained from connect_backend() or connect_all_backends()
+void release_backend(int slot)
+{
+    if (slot >= 0 && slot != REGISTRY_DEFAULT)
+    {
+        pthread_mutex_lock(&shared_state->registry_lock);
+        shared_state->backends[slot].inflight--;
+        pthread_mutex_unlock(&shared_state->registry_lock);
+        pthread_cond_broadcast(&shared_state->admission_changed);
+    }
+}
+
+// Function to tell the client that no backend of a type could be reached
+void send_backend_unavailable(int client_socket, const char *type)
+{
+    char response[BUFFER_SIZE];
+
+    snprintf(response, sizeof(response), "No %s server is available, try again later\n", strcmp(type, ".pdf") == 0 ? "Spdf" : "Stext");
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to count the healthy replicas serving a file type
+int healthy_backends(const char *type)
+{
+    int count = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS; i++)
+    {
+        if (strcmp(shared_state->backends[i].type, type) == 0 && backend_healthy(&shared_state->backends[i], now))
+        {
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    return count;
+}
+
+// Function to hand a client request to a backend so the file data moves between the backend and the client directly
+// The command frame travels over the backend's Unix socket together with a copy of the client socket (SCM_RIGHTS);
+// the backend answers the client itself and sends back one status byte once it is done with the connection,
+// after which Smain reads the next command. Returns 0 when the backend served the request, -1 when the request
+// never reached a backend and the caller has to relay it as usual.
+int handoff_to_backend(int client_socket, const char *frame, const char *type)
+{
+    int tried[MAX_BACKENDS] = {0};
+    int any_registered = 0;
+
+    if (!DIRECT_DATA_ENABLED)
+    {
+        return -1;
+    }
+    while (1)
+    {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {(void *)frame, BUFFER_SIZE};
+        struct msghdr message;
+        struct cmsghdr *header;
+        char status = 1;
+        int unix_socket;
+        int slot = pick_backend(type, tried, 1, &any_registered);
+
+        if (slot < 0)
+        {
+            return -1;
+        }
+        tried[slot] = 1;
+
+        if (establish_local_connection(shared_state->backends[slot].handoff_path, SOCK_SEQPACKET, &unix_socket) != 0)
+        {
+            // The backend runs on another host or without a handoff listener, try the next one
+            release_backend(slot);
+            continue;
+        }
+
+        memset(&message, 0, sizeof(message));
+        memset(control, 0, sizeof(control));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &client_socket, sizeof(int));
+        if (sendmsg(unix_socket, &message, MSG_NOSIGNAL) != BUFFER_SIZE)
+        {
+            close(unix_socket);
+            release_backend(slot);
+            continue;
+        }
+
+        // From here on the backend owns the client connection until it reports back
+        if (recv(unix_socket, &status, 1, 0) != 1)
+        {
+            fprintf(stderr, "Backend %s:%d went away during a handed-off transfer\n",
+                    shared_state->backends[slot].address, shared_state->backends[slot].port);
+            status = 0; // The request was already taken, relaying it again would garble the stream
+        }
+        close(unix_socket);
+        release_backend(slot);
+        return status == 0 ? 0 : -1;
+    }
+}
+
+// Function to set up the admission lock and condition, which have to work across the forked workers
+int admission_init()
+{
+    pthread_mutexattr_t mutex_attributes;
+    pthread_condattr_t cond_attributes;
+
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&cond_attributes);
+    pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attributes, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&shared_state->admission_lock, &mutex_attributes) != 0 ||
+        pthread_cond_init(&shared_state->admission_changed, &cond_attributes) != 0)
+    {
+        perror("Failed to create the admission lock");
+        return -1;
+    }
+    pthread_mutexattr_destroy(&mutex_attributes);
+    pthread_condattr_destroy(&cond_attributes);
+    shared_state->average_transfer_ms = 100;
+    return 0;
+}
+
+// Function to set up the change feed lock and condition, which have to work across the forked workers
+int feed_init()
+{
+    pthread_mutexattr_t mutex_attributes;
+    pthread_condattr_t cond_attributes;
+
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_setpshared(&mutex_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_init(&cond_attributes);
+    pthread_condattr_setpshared(&cond_attributes, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attributes, CLOCK_MONOTONIC);
+    if (pthread_mutex_init(&shared_state->feed_lock, &mutex_attributes) != 0 ||
+        pthread_cond_init(&shared_state->feed_changed, &cond_attributes) != 0)
+    {
+        perror("Failed to create the change feed lock");
+        return -1;
+    }
+    pthread_mutexattr_destroy(&mutex_attributes);
+    pthread_condattr_destroy(&cond_attributes);
+    return 0;
+}
+
+// Function to tell whether anyone follows the change feed, so a change is only looked up and recorded when it matters
+int feed_subscribed()
+{
+    return __atomic_load_n(&shared_state->feed_subscribers, __ATOMIC_RELAXED) > 0;
+}
+
+// Function to add a change to the feed and wake the subscribers; repeated slashes in the path are dropped
+void feed_publish(int kind, const char *path, long long size, uint32_t checksum)
+{
+    struct change_event *event;
+    size_t length = 0;
+
+    if (!feed_subscribed())
+    {
+        return;
+    }
+    pthread_mutex_lock(&shared_state->feed_lock);
+    event = &shared_state->feed[shared_state->feed_head % FEED_SLOTS];
+    event->sequence = shared_state->feed_head++;
+    event->kind = kind;
+    event->size = size;
+    event->checksum = checksum;
+    for (const char *p = path; *p && length < FEED_PATH_MAX - 1; p++)
+    {
+        if (*p != '/' || length == 0 || event->path[length - 1] != '/')
+        {
+            event->path[length++] = *p;
+        }
+    }
+    event->path[length] = '\0';
+    pthread_mutex_unlock(&shared_state->feed_lock);
+    pthread_cond_broadcast(&shared_state->feed_changed);
+}
+
+// Function to find the per-client counter of an address, claiming a free one when needed, caller holds the admission lock
+struct client_slot *admission_client(uint32_t client_address)
+{
+    struct client_slot *free_slot = NULL;
+
+    for (int i = 0; i < MAX_CLIENT_SLOTS; i++)
+    {
+        struct client_slot *slot = &shared_state->clients[(client_address + i) % MAX_CLIENT_SLOTS];
+        if (slot->active > 0 && slot->address == client_address)
+        {
+            return slot;
+        }
+        if (slot->active == 0 && free_slot == NULL)
+        {
+            free_slot = slot;
+        }
+    }
+    if (free_slot != NULL)
+    {
+        free_slot->address = client_address;
+    }
+    return free_slot;
+}
+
+// Function to tell whether every healthy replica of a backend type already carries BACKEND_MAX_LOAD requests
+// Transfers for a saturated backend wait in Smain's queue instead of piling more work onto it
+int backend_saturated(const char *type)
+{
+    int saturated = 1, any = 0;
+    time_t now = time(NULL);
+
+    if (type == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&shared_state->registry_lock);
+    for (int i = 0; i < MAX_BACKENDS; i++)
+    {
+        struct backend_entry *entry = &shared_state->backends[i];
+        if (strcmp(entry->type, type) == 0 && backend_healthy(entry, now))
+        {
+            any = 1;
+            if (entry->active_transfers + entry->inflight < BACKEND_MAX_LOAD)
+            {
+                saturated = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    return any && saturated;
+}
+
+// Function to check whether one more transfer may start, caller holds the admission lock
+int admission_open(struct client_slot *client, const char *type)
+{
+    return shared_state->active_transfers < MAX_ACTIVE_TRANSFERS &&
+           (client == NULL || client->active < MAX_TRANSFERS_PER_CLIENT) && !backend_saturated(type);
+}
+
+// Function to estimate how long a rejected client should wait: the queue ahead of it drained at the observed transfer rate
+long admission_retry_ms()
+{
+    long retry = shared_state->average_transfer_ms * (shared_state->queued_transfers + 1) / MAX_ACTIVE_TRANSFERS;
+
+    return retry < 100 ? 100 : retry > 10000 ? 10000 : retry;
+}
+
+// Function to admit a transfer from client_address going to backend type (NULL for Smain's own files)
+// A transfer over the server-wide, per-client or backend limit waits in the queue for up to ADMISSION_QUEUE_MS;
+// when the queue is full or the deadline passes it is rejected right away. Returns 0 when admitted,
+// or -1 with *retry_ms set to the suggested wait before retrying
+int admit_transfer(uint32_t client_address, const char *type, long *retry_ms)
+{
+    struct timespec deadline;
+    struct client_slot *client;
+    int admitted = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ADMISSION_QUEUE_MS / 1000;
+    deadline.tv_nsec += (ADMISSION_QUEUE_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&shared_state->admission_lock);
+    client = admission_client(client_address);
+    if (admission_open(client, type))
+    {
+        admitted = 1;
+    }
+    else if (shared_state->queued_transfers < MAX_QUEUED_TRANSFERS)
+    {
+        // Wait for a finishing transfer or a backend heartbeat to open a slot; re-check the backends now and then
+        shared_state->queued_transfers++;
+        while (!admitted)
+        {
+            struct timespec now, wake;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            wake = now;
+            wake.tv_nsec += 100000000L;
+            if (wake.tv_nsec >= 1000000000L)
+            {
+                wake.tv_sec++;
+                wake.tv_nsec -= 1000000000L;
+            }
+            if (wake.tv_sec > deadline.tv_sec || (wake.tv_sec == deadline.tv_sec && wake.tv_nsec > deadline.tv_nsec))
+            {
+                wake = deadline;
+            }
+            pthread_cond_timedwait(&shared_state->admission_changed, &shared_state->admission_lock, &wake);
+            client = client != NULL ? client : admission_client(client_address);
+            admitted = admission_open(client, type);
+            if (wake.tv_sec == deadline.tv_sec && wake.tv_nsec == deadline.tv_nsec)
+            {
+                break;
+            }
+        }
+        shared_state->queued_transfers--;
+    }
+
+    if (admitted)
+    {
+        shared_state->active_transfers++;
+        shared_state->admitted++;
+        if (client != NULL)
+        {
+            client->active++;
+        }
+    }
+    else
+    {
+        shared_state->rejected++;
+        *retry_ms = admission_retry_ms();
+    }
+    pthread_mutex_unlock(&shared_state->admission_lock);
+    return admitted ? 0 : -1;
+}
+
+// Function to give back the slot of an admitted transfer and fold its duration into the retry estimate
+void finish_transfer(uint32_t client_address, const struct timespec *started)
+{
+    struct timespec now;
+    long elapsed_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ms = (now.tv_sec - started->tv_sec) * 1000 + (now.tv_nsec - started->tv_nsec) / 1000000;
+
+    pthread_mutex_lock(&shared_state->admission_lock);
+    struct client_slot *client = admission_client(client_address);
+    if (client != NULL && client->active > 0)
+    {
+        client->active--;
+    }
+    shared_state->active_transfers--;
+    shared_state->average_transfer_ms = (shared_state->average_transfer_ms * 7 + elapsed_ms) / 8;
+    pthread_cond_broadcast(&shared_state->admission_changed);
+    pthread_mutex_unlock(&shared_state->admission_lock);
+}
+
+// Function to name the backend type a transfer will load, or NULL when Smain serves it from its own files
+const char *transfer_backend(const char *command, const char *argument)
+{
+    if (strcmp(command, "dtar") == 0)
+    {
+        return strcmp(argument, ".pdf") == 0 || strcmp(argument, ".txt") == 0 ? argument : NULL;
+    }
+    if (strstr(argument, ".c") != NULL)
+    {
+        return NULL;
+    }
+    return strstr(argument, ".txt") != NULL ? ".txt" : strstr(argument, ".pdf") != NULL ? ".pdf" : NULL;
+}
+
+// Function to answer a transfer that was not admitted, keeping the connection in step with the client
+// Uploads and upload chunks are drained, downloads and delta uploads get an empty stream that cannot verify; all are followed by the busy message
+void reject_transfer(int client_socket, const char *command, long retry_ms)
+{
+    char response[BUFFER_SIZE];
+
+    if (strcmp(command, "ufile") == 0 || strcmp(command, "uchunk") == 0)
+    {
+        recv_file_chunks(client_socket, NULL, NULL);
+    }
+    else if (strcmp(command, "dfile") == 0)
+    {
+        send_download_status(client_socket, 0);
+    }
+    else
+    {
+        send_end_of_file(client_socket, 1);
+    }
+    if (strcmp(command, "drange") != 0) // A stripe connection reads nothing after its stream
+    {
+        snprintf(response, sizeof(response), "Server busy, retry after %ld ms\n", retry_ms);
+        send(client_socket, response, strlen(response), 0);
+    }
+}
+
+// Function to build the cache file paths for a stored .txt/.pdf file
+// The file name is hashed (64-bit FNV-1a) after dropping leading and repeated slashes, so "d1//a.txt" and "/d1/a.txt" share an entry
+void cache_entry_paths(const char *filename, char *key, char *data_path, char *meta_path)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    size_t key_length = 0;
+
+    // Normalise the name into key
+    for (const char *p = filename; *p && key_length < BUFFER_SIZE - 1; p++)
+    {
+        if (*p == '/' && (key_length == 0 || key[key_length - 1] == '/'))
+        {
+            continue;
+        }
+        key[key_length++] = *p;
+    }
+    key[key_length] = '\0';
+
+    for (size_t i = 0; i < key_length; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    snprintf(data_path, BUFFER_SIZE, "%s/%s/%016llx", valid_home_dir(), CACHE_DIR, hash);
+    snprintf(meta_path, BUFFER_SIZE, "%s/%s/%016llx.meta", valid_home_dir(), CACHE_DIR, hash);
+}
+
+// Function to create the cache directory and count what an earlier run left in it
+void cache_init()
+{
+    char cache_path[BUFFER_SIZE];
+    char entry_path[BUFFER_SIZE * 2];
+    struct dirent *entry;
+    struct stat entry_info;
+    DIR *cache_dir;
+
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", valid_home_dir(), CACHE_DIR);
+    if (create_dir_if_new(cache_path) != 0 || (cache_dir = opendir(cache_path)) == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(cache_dir)) != NULL)
+    {
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, entry->d_name);
+        if (strstr(entry->d_name, ".tmp") != NULL)
+        {
+            unlink(entry_path); // Half-written fill from a worker that died
+        }
+        else if (strstr(entry->d_name, ".meta") == NULL && stat(entry_path, &entry_info) == 0 && S_ISREG(entry_info.st_mode))
+        {
+            shared_state->cache_bytes += entry_info.st_size;
+        }
+    }
+    closedir(cache_dir);
+    printf("Download cache in %s holds %lld bytes\n", cache_path, shared_state->cache_bytes);
+}
+
+// Function to drop the cached copy of a file, used when ufile or rmfile changes it
+void cache_invalidate(const char *filename)
+{
+    char key[BUFFER_SIZE], data_path[BUFFER_SIZE], meta_path[BUFFER_SIZE];
+    struct stat entry_info;
+
+    if (!CACHE_ENABLED)
+    {
+        return;
+    }
+    cache_entry_paths(filename, key, data_path, meta_path);
+    unlink(meta_path);
+    if (stat(data_path, &entry_info) == 0 && unlink(data_path) == 0)
+    {
+        __atomic_sub_fetch(&shared_state->cache_bytes, (long long)entry_info.st_size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&shared_state->cache_invalidations, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Entry looked at while evicting
+struct cache_victim
+{
+    char name[64];
+    time_t last_used;
+    off_t size;
+};
+
+// Function to order eviction candidates from least to most recently used
+int compare_cache_victims(const void *left, const void *right)
+{
+    const struct cache_victim *a = left, *b = right;
+    return (a->last_used > b->last_used) - (a->last_used < b->last_used);
+}
+
+// Function to evict least recently used entries until the cache is back under 90% of CACHE_MAX_BYTES
+// Every hit bumps the entry's modification time, so the oldest modification time is the least recently used entry
+void cache_evict()
+{
+    char cache_path[BUFFER_SIZE];
+    char entry_path[BUFFER_SIZE * 2];
+    struct cache_victim *victims = NULL, *grown;
+    size_t count = 0, allocated = 0;
+    struct dirent *entry;
+    struct stat entry_info;
+    DIR *cache_dir;
+
+    snprintf(cache_path, sizeof(cache_path), "%s/%s", valid_home_dir(), CACHE_DIR);
+    if ((cache_dir = opendir(cache_path)) == NULL)
+    {
+        return;
+    }
+
+    // Only one worker evicts at a time, the others simply skip it
+    if (flock(dirfd(cache_dir), LOCK_EX | LOCK_NB) != 0)
+    {
+        closedir(cache_dir);
+        return;
+    }
+    while ((entry = readdir(cache_dir)) != NULL)
+    {
+        char name[sizeof(victims->name)];
+
+        if (entry->d_name[0] == '.' || strchr(entry->d_name, '.') != NULL ||
+            snprintf(name, sizeof(name), "%s", entry->d_name) >= (int)sizeof(name))
+        {
+            continue; // Skip ".", "..", metadata and temporary files, and names no cache entry has
+        }
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, name);
+        if (stat(entry_path, &entry_info) != 0)
+        {
+            continue;
+        }
+        if (count == allocated)
+        {
+            // Without the whole list the oldest entries are not known, so nothing is evicted this time
+            if ((grown = realloc(victims, (allocated ? allocated * 2 : 64) * sizeof(*victims))) == NULL)
+            {
+                free(victims);
+                closedir(cache_dir);
+                return;
+            }
+            victims = grown;
+            allocated = allocated ? allocated * 2 : 64;
+        }
+        memcpy(victims[count].name, name, sizeof(name));
+        victims[count].last_used = entry_info.st_mtime;
+        victims[count].size = entry_info.st_size;
+        count++;
+    }
+    qsort(victims, count, sizeof(*victims), compare_cache_victims);
+
+    for (size_t i = 0; i < count && shared_state->cache_bytes > CACHE_MAX_BYTES / 10 * 9; i++)
+    {
+        snprintf(entry_path, sizeof(entry_path), "%s/%s.meta", cache_path, victims[i].name);
+        unlink(entry_path);
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, victims[i].name);
+        if (unlink(entry_path) == 0)
+        {
+            __atomic_sub_fetch(&shared_state->cache_bytes, (long long)victims[i].size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&shared_state->cache_evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(victims);
+    closedir(cache_dir); // Closing the directory also releases the lock
+}
+
+// Function to open the cached copy of a file if it still matches the backend's size and modification time
+// Returns an open file descriptor on a hit or -1 on a miss
+int cache_lookup(const char *filename, long long size, long long mtime_sec, long mtime_nsec)
+{
+    char key[BUFFER_SIZE], data_path[BUFFER_SIZE], meta_path[BUFFER_SIZE];
+    char cached_key[BUFFER_SIZE];
+    long long cached_size, cached_sec;
+    long cached_nsec;
+    FILE *meta_file;
+    int matches = 0;
+    int file_descriptor;
+
+    cache_entry_paths(filename, key, data_path, meta_path);
+    if ((meta_file = fopen(meta_path, "r")) == NULL)
+    {
+        return -1;
+    }
+    if (fgets(cached_key, sizeof(cached_key), meta_file) != NULL &&
+        fscanf(meta_file, "%lld %lld %ld", &cached_size, &cached_sec, &cached_nsec) == 3)
+    {
+        cached_key[strcspn(cached_key, "\n")] = '\0';
+        matches = strcmp(cached_key, key) == 0 && cached_size == size && cached_sec == mtime_sec && cached_nsec == mtime_nsec;
+    }
+    fclose(meta_file);
+    if (!matches || (file_descriptor = open(data_path, O_RDONLY)) < 0)
+    {
+        return -1;
+    }
+    utimensat(AT_FDCWD, data_path, NULL, 0); // Mark the entry as most recently used
+    return file_descriptor;
+}
+
+// Function to publish a completely received temporary file as the cache entry for filename
+void cache_store(const char *temp_path, const char *filename, long long size, long long mtime_sec, long mtime_nsec)
+{
+    char key[BUFFER_SIZE], data_path[BUFFER_SIZE], meta_path[BUFFER_SIZE];
+    char meta_temp[BUFFER_SIZE + 32];
+    struct stat old_info;
+    FILE *meta_file;
+
+    cache_entry_paths(filename, key, data_path, meta_path);
+    if (stat(data_path, &old_info) != 0)
+    {
+        old_info.st_size = 0;
+    }
+
+    // Data first, then the metadata that makes it visible; a reader never sees metadata for data that is not complete
+    unlink(meta_path);
+    if (rename(temp_path, data_path) != 0)
+    {
+        unlink(temp_path);
+        return;
+    }
+    snprintf(meta_temp, sizeof(meta_temp), "%s.%d.tmp", meta_path, worker_id());
+    if ((meta_file = fopen(meta_temp, "w")) == NULL)
+    {
+        return;
+    }
+    fprintf(meta_file, "%s\n%lld %lld %ld\n", key, size, mtime_sec, mtime_nsec);
+    fclose(meta_file);
+    rename(meta_temp, meta_path);
+
+    __atomic_add_fetch(&shared_state->cache_bytes, size - (long long)old_info.st_size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shared_state->cache_fills, 1, __ATOMIC_RELAXED);
+    if (shared_state->cache_bytes > CACHE_MAX_BYTES)
+    {
+        cache_evict();
+    }
+}
+
+// Function to read a single reply line up to and including the newline, so no later data is consumed
+// Returns 0 on success and -1 on error
+int recv_line(int sock, char *line, size_t size)
+{
+    size_t length = 0;
+
+    while (length < size - 1)
+    {
+        if (recv(sock, line + length, 1, 0) != 1)
+        {
+            return -1;
+        }
+        if (line[length++] == '\n')
+        {
+            break;
+        }
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+// Function to read the status line that opens the reply to a download, see send_download_status()
+// Returns 1 when the file's chunk stream follows, 0 when only the final message does, -1 when the peer went away
+int recv_download_status(int sock)
+{
+    char status[16];
+
+    if (recv_line(sock, status, sizeof(status)) != 0)
+    {
+        return -1;
+    }
+    return strcmp(status, "data\n") == 0;
+}
+
+// Function to receive a reply of `count` lines that the sender writes in one go, returns its length or -1
+long recv_lines(int sock, char *buffer, size_t size, int count)
+{
+    size_t length = 0;
+
+    while (count > 0 && length < size - 1)
+    {
+        ssize_t received = recv(sock, buffer + length, size - 1 - length, 0);
+        if (received <= 0)
+        {
+            return -1;
+        }
+        for (ssize_t i = 0; i < received; i++)
+        {
+            count -= buffer[length + i] == '\n';
+        }
+        length += received;
+    }
+    buffer[length] = '\0';
+    return count <= 0 ? (long)length : -1;
+}
+
+// Function to ask a backend for the size and modification time of a file over an open connection
+// Returns 0 when the file exists, 1 when the backend reports it missing and -1 on error
+int backend_stat(int backend_socket, const char *filename, long long *size, long long *mtime_sec, long *mtime_nsec)
+{
+    char frame[BUFFER_SIZE];
+    char reply[128];
+
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "stat %s", filename);
+    if (send_frame(backend_socket, frame) != BUFFER_SIZE || recv_line(backend_socket, reply, sizeof(reply)) != 0)
+    {
+        return -1;
+    }
+    if (strncmp(reply, "missing", 7) == 0)
+    {
+        return 1;
+    }
+    return sscanf(reply, "%lld %lld %ld", size, mtime_sec, mtime_nsec) == 3 ? 0 : -1;
+}
+
+// Function to serve a .txt/.pdf download from the backend, going through the local cache when it is enabled
+void serve_backend_download(int client_socket, char *filename, char *command, const char *type)
+{
+    char response[BUFFER_SIZE];         // Final status message
+    char temp_path[BUFFER_SIZE + 32];   // Cache fill in progress
+    char key[BUFFER_SIZE], data_path[BUFFER_SIZE], meta_path[BUFFER_SIZE];
+    long long size = 0, mtime_sec = 0;
+    long mtime_nsec = 0;
+    uint32_t checksum = 0;
+    FILE *cache_file = NULL;
+    long long relayed;
+    int backend_socket;
+    int file_descriptor;
+    int status = -1;
+    int found;
+    int slot;
+
+    // In direct data mode the backend sends the file to the client itself, so these downloads bypass the cache
+    if (handoff_to_backend(client_socket, command, type) == 0)
+    {
+        return;
+    }
+
+    // establish connection to the least-loaded replica of the backend server that owns this file type
+    if ((slot = connect_backend(type, &backend_socket)) < 0)
+    {
+        send_download_status(client_socket, 0);
+        send_backend_unavailable(client_socket, type);
+        return;
+    }
+
+    if (CACHE_ENABLED)
+    {
+        // Validate any cached copy against the backend's size and modification time
+        status = backend_stat(backend_socket, filename, &size, &mtime_sec, &mtime_nsec);
+        if (status == 0 && (file_descriptor = cache_lookup(filename, size, mtime_sec, mtime_nsec)) >= 0)
+        {
+            close(backend_socket);
+            release_backend(slot);
+            __atomic_add_fetch(&shared_state->cache_hits, 1, __ATOMIC_RELAXED);
+            printf("Cache hit for %s (%lu hits, %lu misses)\n", filename, shared_state->cache_hits, shared_state->cache_misses);
+
+            send_download_status(client_socket, 1);
+            send_file_chunks(client_socket, file_descriptor);
+            close(file_descriptor);
+            snprintf(response, sizeof(response), "File %s downloaded successfully\n", filename);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+        __atomic_add_fetch(&shared_state->cache_misses, 1, __ATOMIC_RELAXED);
+        printf("Cache miss for %s (%lu hits, %lu misses)\n", filename, shared_state->cache_hits, shared_state->cache_misses);
+
+        // Copy the file into the cache while relaying it, unless it is too big to be worth keeping
+        if (status == 0 && size <= CACHE_MAX_ENTRY)
+        {
+            cache_entry_paths(filename, key, data_path, meta_path);
+            snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", data_path, worker_id());
+            cache_file = fopen(temp_path, "wb");
+        }
+    }
+
+    send_frame(backend_socket, command); // Sending the command frame to the backend server to request the file
+
+    // Pass the backend's status on; only a file it has is relayed, up to the end-of-file chunk
+    found = recv_download_status(backend_socket);
+    send_download_status(client_socket, found == 1);
+    relayed = found == 1 ? relay_chunks(backend_socket, client_socket, cache_file, &checksum) : -1;
+
+    if (cache_file != NULL)
+    {
+        // Only a complete, verified copy of the version that was validated becomes a cache entry
+        if (relayed == size)
+        {
+            save_stored_checksum(fileno(cache_file), checksum);
+        }
+        if (fclose(cache_file) == 0 && relayed == size)
+        {
+            cache_store(temp_path, filename, size, mtime_sec, mtime_nsec);
+        }
+        else
+        {
+            unlink(temp_path);
+        }
+    }
+
+    int length = found < 0 ? 0 : recv(backend_socket, response, sizeof(response), 0); // receive the final responce from the backend server
+    if (length > 0)
+    {
+        send(client_socket, response, length, 0); // send the final responce to the client
+    }
+    else if (found < 0)
+    {
+        send_backend_unavailable(client_socket, type); // The backend went away before it answered
+    }
+    close(backend_socket); // closing the connection with the backend server
+    release_backend(slot);
+}
+
+// Function to turn a new connection away at once when too many are open already, returns 1 if it was closed
+int connection_limit_reached(int client_socket)
+{
+    char busy[BUFFER_SIZE];
+
+    if (__atomic_load_n(&shared_state->connections, __ATOMIC_RELAXED) < MAX_CONNECTIONS)
+    {
+        return 0;
+    }
+    snprintf(busy, sizeof(busy), "Server busy, retry after %ld ms\n", admission_retry_ms());
+    send(client_socket, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_socket);
+    return 1;
+}
+
+// A unit of blocking work for the worker threads of threaded mode
+struct task
+{
+    void (*run)(void *argument);
+    void *argument;
+};
+
+// One worker's task queue: the owner takes the newest task, idle workers steal the oldest one
+// Every queue has its own lock, so workers only contend when one of them steals from another
+struct task_queue
+{
+    pthread_mutex_t lock;
+    struct task tasks[TASK_QUEUE_SIZE];
+    unsigned long head;                 // Oldest task, taken by thieves
+    unsigned long tail;                 // One past the newest task, taken by the owner
+};
+
+// Work-stealing pool running the commands of threaded mode
+struct task_pool
+{
+    int workers;
+    struct task_queue *queues;          // One queue per worker
+    unsigned long next_queue;           // Round-robin position for new tasks
+    int pending;                        // Tasks submitted and not taken yet, idle workers sleep while it is 0
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_available;
+};
+
+struct task_pool task_pool;
+int event_loops[SMAIN_EVENT_THREADS];   // epoll instances of the event threads
+
+// Function to queue a task for the worker threads
+void task_submit(void (*run)(void *), void *argument)
+{
+    struct task_queue *queue = &task_pool.queues[__atomic_fetch_add(&task_pool.next_queue, 1, __ATOMIC_RELAXED) % task_pool.workers];
+
+    // Counted before it is queued, so a worker woken for it keeps looking until it shows up
+    __atomic_add_fetch(&task_pool.pending, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&queue->lock);
+    queue->tasks[queue->tail % TASK_QUEUE_SIZE].run = run;
+    queue->tasks[queue->tail % TASK_QUEUE_SIZE].argument = argument;
+    queue->tail++;
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_mutex_lock(&task_pool.idle_lock);
+    pthread_cond_signal(&task_pool.work_available);
+    pthread_mutex_unlock(&task_pool.idle_lock);
+}
+
+// Function to take a task from a queue, the newest one for its owner or the oldest one when stealing
+int task_take(struct task_queue *queue, struct task *task, int steal)
+{
+    int taken = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head != queue->tail)
+    {
+        if (steal)
+        {
+            *task = queue->tasks[queue->head % TASK_QUEUE_SIZE];
+            queue->head++;
+        }
+        else
+        {
+            queue->tail--;
+            *task = queue->tasks[queue->tail % TASK_QUEUE_SIZE];
+        }
+        taken = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return taken;
+}
+
+// Function run by every worker thread: its own queue first, then the other workers' queues, then sleep
+// A worker keeps its buffer pool between tasks, so its slabs are reused by every command it runs
+void *task_worker(void *argument)
+{
+    int self = (int)(long)argument;
+    struct task task;
+
+    while (1)
+    {
+        pthread_mutex_lock(&task_pool.idle_lock);
+        while (__atomic_load_n(&task_pool.pending, __ATOMIC_ACQUIRE) == 0)
+        {
+            pthread_cond_wait(&task_pool.work_available, &task_pool.idle_lock);
+        }
+        pthread_mutex_unlock(&task_pool.idle_lock);
+
+        int taken = task_take(&task_pool.queues[self], &task, 0);
+        for (int i = 1; i < task_pool.workers && !taken; i++)
+        {
+            taken = task_take(&task_pool.queues[(self + i) % task_pool.workers], &task, 1);
+        }
+        if (taken)
+        {
+            __atomic_sub_fetch(&task_pool.pending, 1, __ATOMIC_RELAXED);
+            task.run(task.argument);
+        }
+    }
+    return NULL;
+}
+
+// Function to give a connection back to its event thread once a command is done, or to close it if the client has gone
+void client_command_done(struct client_state *state, int result)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = state;
+    if (result == 0 && epoll_ctl(event_loops[state->event_loop], EPOLL_CTL_MOD, state->socket, &event) == 0)
+    {
+        return;
+    }
+    client_state_finish(state);
+    close(state->socket);
+    __atomic_sub_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+    free(state);
+}
+
+// Task running one command of a client; the connection goes back to its event thread for the next one
+void serve_client_command(void *argument)
+{
+    struct client_state *state = argument;
+    int result = process_client_command(state);
+
+    if (result != CLIENT_DETACHED)
+    {
+        client_command_done(state, result);
+    }
+    pool_trim(); // The worker goes on to other clients, their commands must find the memory cap free
+}
+
+// A subscribed connection of threaded mode, served by a thread of its own
+struct subscription
+{
+    struct client_state *state;
+    char path[BUFFER_SIZE];
+};
+
+// Function run by the thread of a subscribed connection until the client unsubscribes or goes away
+void *subscription_thread(void *argument)
+{
+    struct subscription *subscription = argument;
+
+    client_command_done(subscription->state, handle_subscribe(subscription->state->socket, subscription->path));
+    free(subscription);
+    return NULL;
+}
+
+// Function to start following the change feed on a connection
+// A subscription lasts as long as the client wants, so in threaded mode it gets its own thread instead of holding one
+// of the pool's workers; returns CLIENT_DETACHED then, otherwise what handle_subscribe() returns
+int start_subscription(struct client_state *state, const char *path)
+{
+    struct subscription *subscription;
+    pthread_t thread;
+
+    if (task_pool.workers > 0 && (subscription = malloc(sizeof(*subscription))) != NULL)
+    {
+        subscription->state = state;
+        snprintf(subscription->path, sizeof(subscription->path), "%s", path);
+        if (pthread_create(&thread, NULL, subscription_thread, subscription) == 0)
+        {
+            pthread_detach(thread);
+            return CLIENT_DETACHED;
+        }
+        free(subscription);
+    }
+    return handle_subscribe(state->socket, path);
+}
+
+// Function run by the event threads: waits until an idle connection has a command and queues it for a worker
+// Connections are watched one-shot, so a connection whose command is running is not reported again until it is done
+void *event_loop_thread(void *argument)
+{
+    int epoll_fd = event_loops[(long)argument];
+    struct epoll_event events[64];
+
+    while (1)
+    {
+        // While tracing, the thread wakes up now and then to write out spans a quiet server would hold on to
+        int ready = epoll_wait(epoll_fd, events, 64, trace_ring.file >= 0 ? TRACE_FLUSH_MS : -1);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("Event thread failed");
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            task_submit(serve_client_command, events[i].data.ptr);
+        }
+        trace_flush(0);
+    }
+    return NULL;
+}
+
+// Function to serve every client from this process: the accepting thread hands new connections to the event threads,
+// which pass each command to the work-stealing pool. The registry, admission counters and cache are the same shared
+// state the worker processes of fork mode use; buffer pools stay per thread.
+int run_threaded_server(int server_socket, int workers)
+{
+    int client_socket;
+    unsigned long next_loop = 0;
+    pthread_t thread;
+
+    signal(SIGPIPE, SIG_IGN); // A client that goes away mid-transfer must not take the whole server down
+
+    task_pool.workers = workers;
+    if ((task_pool.queues = calloc(workers, sizeof(struct task_queue))) == NULL)
+    {
+        perror("Failed to allocate the task queues");
+        return -1;
+    }
+    pthread_mutex_init(&task_pool.idle_lock, NULL);
+    pthread_cond_init(&task_pool.work_available, NULL);
+    for (long i = 0; i < workers; i++)
+    {
+        pthread_mutex_init(&task_pool.queues[i].lock, NULL);
+        if (pthread_create(&thread, NULL, task_worker, (void *)i) != 0)
+        {
+            perror("Failed to start a worker thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    for (long i = 0; i < SMAIN_EVENT_THREADS; i++)
+    {
+        if ((event_loops[i] = epoll_create1(0)) < 0 || pthread_create(&thread, NULL, event_loop_thread, (void *)i) != 0)
+        {
+            perror("Failed to start an event thread");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    printf("Smain runs %d event threads and %d worker threads\n", SMAIN_EVENT_THREADS, workers);
+
+    while ((client_socket = accept(server_socket, NULL, NULL)) >= 0)
+    {
+        struct client_state *state;
+        struct epoll_event event;
+
+        trace_accepted_ns = trace_now();
+        printf("A new client has connected to the Smain server\n");
+        if (connection_limit_reached(client_socket))
+        {
+            continue;
+        }
+        if ((state = malloc(sizeof(*state))) == NULL)
+        {
+            close(client_socket);
+            continue;
+        }
+        __atomic_add_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+        client_state_init(state, client_socket);
+        state->event_loop = next_loop++ % SMAIN_EVENT_THREADS;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = state;
+        if (epoll_ctl(event_loops[state->event_loop], EPOLL_CTL_ADD, client_socket, &event) != 0)
+        {
+            perror("Failed to watch the client connection");
+            close(client_socket);
+            __atomic_sub_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+            free(state);
+        }
+    }
+    perror("Failed to accept connection");
+    return -1;
+}
+
+// Usage: Smain [--threads [workers]]
+// By default every client gets its own worker process; --threads serves all clients from one process instead
+int main(int argc, char *argv[])
+{
+    int server_socket, client_socket; // declaring file descriptors for client and server
+    struct sockaddr_in server_address, client_address; // define structure for server address and client address
+    socklen_t client_address_len = sizeof(client_address); // setting  the length of the client address structure
+
+    int workers = 0; // Worker threads in threaded mode, 0 for one process per client
+
+    crc32c_init(); // Preparing the checksum tables before any transfer
+
+    if (argc > 1 && strcmp(argv[1], "--threads") == 0)
+    {
+        workers = argc > 2 ? atoi(argv[2]) : SMAIN_DEFAULT_WORKERS;
+        workers = workers > 0 ? workers : SMAIN_DEFAULT_WORKERS;
+    }
+
+    // Creating a socket for the server
+    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == 0) // check if the socket fails or not
+    {
+        perror("Failed to create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Defining the server address and port
+    server_address.sin_family = AF_INET; // setting the address family to AF_INET
+    server_address.sin_addr.s_addr = INADDR_ANY;  // Listen on all available interfaces (127.0.0.1)
+    server_address.sin_port = htons(PORT);        // Use the predefined port
+
+    // Binding the server socket to the address and port
+    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    {
+        perror("Bind operation failed");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Setting the server socket to listen for incoming connections
+    // The backlog holds a burst of connections until the workers pick them up, admission control does the limiting
+    if (listen(server_socket, SOMAXCONN) < 0)
+    {
+        perror("Failed to listen on socket");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Mapping the state shared by all workers and preparing the download cache
+    if (init_shared_state() != 0)
+    {
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+    if (CACHE_ENABLED)
+    {
+        cache_init();
+    }
+    {
+        char store_root[BUFFER_SIZE], index_path[BUFFER_SIZE * 2];
+
+        // Without its index the pack is left out and every .c file is stored loose. With packing off, the index of an
+        // earlier run is still mapped so the files packed then stay readable and removable; new files are stored loose
+        snprintf(store_root, sizeof(store_root), "%s/smain", valid_home_dir());
+        snprintf(index_path, sizeof(index_path), "%s/%s/index", store_root, PACK_DIR);
+        if (PACK_ENABLED || access(index_path, F_OK) == 0)
+        {
+            pack_init(store_root);
+        }
+    }
+    if (DISPLAY_CACHE_ENABLED)
+    {
+        display_cache_init(); // Without it every display lists its directory afresh
+    }
+    if (NEGATIVE_FILTER_ENABLED)
+    {
+        negative_filter_init(); // Without it every dfile and rmfile asks the store
+    }
+    trace_init(TRACE_HOP_SMAIN);
+
+    printf("Smain server is listening on port %d...\n", PORT);
+
+    if (workers > 0)
+    {
+        run_threaded_server(server_socket, workers);
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Main loop: accept incoming client connections
+    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len)) >= 0)
+    {
+        trace_accepted_ns = trace_now();
+        printf("A new client has connected to the Smain server\n");
+
+        // Reap finished workers, then turn the connection away at once if too many are open already
+        // The count drops when a worker is reaped, so a worker that was killed never holds on to its slot
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+        {
+            __atomic_sub_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+        }
+        if (connection_limit_reached(client_socket))
+        {
+            continue;
+        }
+        __atomic_add_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+
+        // Creating a new process to handle the client connection
+        pid_t worker = fork();
+        if (worker == 0)
+        {
+            // Child process: handle the client
+            close(server_socket);                   // Closing the listening socket in the child process
+            process_client_request(client_socket);  // Processing the client's requests
+            close(client_socket);                   // Closing the client socket after processing
+            trace_flush(1);                         // Writing out the spans of this worker's requests
+            pool_report("Smain");                   // Printing the buffer pool counters of this worker
+            pool_destroy();
+            exit(0);                                // Exiting the child process
+        }
+        else
+        {
+            // Parent process: close the client socket and continue listening for new connections
+            if (worker < 0)
+            {
+                __atomic_sub_fetch(&shared_state->connections, 1, __ATOMIC_RELAXED);
+            }
+            close(client_socket);
+        }
+    }
+
+    // Handle the case where accepting a connection fails
+    if (client_socket < 0)
+    {
+        perror("Failed to accept connection");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Close the server socket before exiting the program
+    close(server_socket);
+    return 0;
+}
+
+
+void process_client_request(int client_socket)
+{
+    struct client_state state;
+
+    client_state_init(&state, client_socket);
+
+    // infinite loop to continuoulsy handle the input and processing
+    while (process_client_command(&state) == 0)
+    {
+    }
+    client_state_finish(&state);
+}
+
+// Function to set up the state of a newly accepted client connection
+void client_state_init(struct client_state *state, int client_socket)
+{
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+
+    memset(state, 0, sizeof(*state));
+    state->socket = client_socket;
+    state->heartbeat_slot = -1;
+    state->accepted_ns = trace_accepted_ns;
+    state->ready_ns = trace_now();
+    if (getpeername(client_socket, (struct sockaddr *)&peer, &peer_length) == 0 && peer.sin_family == AF_INET)
+    {
+        state->address = ntohl(peer.sin_addr.s_addr);
+    }
+}
+
+// Function to end a client connection's state, the caller closes the socket
+void client_state_finish(struct client_state *state)
+{
+    if (state->heartbeat_slot >= 0)
+    {
+        registry_disconnect(state->heartbeat_slot); // The backend closed its heartbeat connection
+    }
+}
+
+// Function to receive and carry out one command of a client
+// Returns 0 when the connection stays open for the next command, -1 once the client has gone, or CLIENT_DETACHED
+int process_client_command(struct client_state *state)
+{
+    struct command_words words;
+    char *buffer = state->frame;        // The whole command frame, for handlers that read past the first words
+    char *command, *argument1, *argument2;
+    int client_socket = state->socket;
+    // Commands arrive as fixed BUFFER_SIZE frames; threaded mode takes only what has arrived and resumes on the next
+    // wakeup, a fork mode worker waits for the whole frame
+    int received = recv_command_frame(client_socket, state->frame, &state->frame_used, &state->frame_started_ns,
+                                      task_pool.workers == 0);
+
+    if (received < 0 && errno == 0)
+    {
+        printf("Client has disconnected\n");
+        printf("Waiting for new connection request \n");
+    }
+    else if (received < 0)
+    {
+        perror("Failed to receive data");
+    }
+    if (received != 0)
+    {
+        return received == COMMAND_PARTIAL ? 0 : -1;
+    }
+    if (parse_command(buffer, &words) != 0)
+    {
+        // What follows an unreadable command cannot be told apart from the next one, so the connection ends here
+        char *error_message = "Command argument too long\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+        return -1;
+    }
+    command = words.command;
+    argument1 = words.argument1;
+    argument2 = words.argument2;
+
+    // The client put a request ID into the frame; the spans of this command and the frames sent on to backends carry it
+    trace_begin(trace_frame_request(buffer));
+    if (state->accepted_ns != 0)
+    {
+        trace_span(TRACE_ACCEPT, trace_context.request, state->accepted_ns, state->ready_ns, 0, command);
+        state->accepted_ns = 0;
+    }
+    trace_span(TRACE_PARSE, trace_context.request, state->frame_started_ns, trace_now(), 0, command);
+
+    // Backends keep a connection open and send a heartbeat frame on it every few seconds, no reply is sent
+    if (strcmp(command, "heartbeat") == 0)
+    {
+        int slot = registry_heartbeat(buffer);
+        state->heartbeat_slot = slot >= 0 ? slot : state->heartbeat_slot;
+        if (slot >= 0)
+        {
+            negative_filter_load_later(shared_state->backends[slot].type); // Until the store's paths were learned
+            resync_backend_later(slot);
+        }
+        return 0;
+    }
+
+    printf("Command received: %s\n", command);
+
+    // Transfers go through admission control, short commands are answered straight away
+    int transfer = strcmp(command, "ufile") == 0 || strcmp(command, "dufile") == 0 || strcmp(command, "dfile") == 0 ||
+                   strcmp(command, "drange") == 0 || strcmp(command, "dtar") == 0 || strcmp(command, "uchunk") == 0;
+    struct timespec transfer_started;
+    long retry_ms;
+    if (transfer)
+    {
+        if (admit_transfer(state->address, transfer_backend(command, argument1), &retry_ms) != 0)
+        {
+            printf("Busy, %s rejected (%d running, %d queued)\n", command, shared_state->active_transfers, shared_state->queued_transfers);
+            reject_transfer(client_socket, command, retry_ms);
+            trace_end(command, -1);
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &transfer_started);
+    }
+
+    // An upload's path is known before its file is, so a download never fails fast while the file is there
+    if (strcmp(command, "ufile") == 0 || strcmp(command, "dufile") == 0 || strcmp(command, "ubegin") == 0)
+    {
+        negative_filter_note_upload(argument1, argument2);
+    }
+
+    // Handle the command based on the parsed input
+    if (strcmp(command, "ufile") == 0)
+    {
+        process_uploaded_file(client_socket, argument1, argument2, buffer);         // to handle the ufile command
+    }
+    else if (strcmp(command, "dufile") == 0)
+    {
+        process_delta_upload(client_socket, argument1, argument2, buffer);         // to handle a delta ufile
+    }
+    else if (strcmp(command, "ubegin") == 0 || strcmp(command, "uchunk") == 0 || strcmp(command, "ucommit") == 0)
+    {
+        process_chunked_upload(client_socket, command, argument1, argument2, buffer); // to handle a parallel ufile
+    }
+    else if (strcmp(command, "dfile") == 0)
+    {
+        manage_file_download(client_socket, argument1, buffer);                     // to handle the dfile command
+    }
+    else if (strcmp(command, "rmfile") == 0)
+    {
+        remove_file(client_socket, buffer);                                         // to handle the rmfile command
+    }
+    else if (strcmp(command, "mvfile") == 0 || strcmp(command, "cpfile") == 0)
+    {
+        relocate_files(client_socket, buffer, strcmp(command, "mvfile") == 0);     // to move or copy inside the stores
+    }
+
+    else if (strcmp(command, "stat") == 0)
+    {
+        handle_file_stat(client_socket, buffer);                                    // to describe one or more stored files
+    }
+    else if (strcmp(command, "drange") == 0)
+    {
+        handle_file_range(client_socket, argument1, buffer);                        // to send one stripe of a striped download
+    }
+    else if (strcmp(command, "dtar") == 0)
+    {
+        handle_dtar(client_socket, argument1);                                      // to handle the dtar command
+    }
+    else if (strcmp(command, "grep") == 0)
+    {
+        handle_grep(client_socket, buffer);                                         // to search the stored .c and .txt files
+    }
+    else if (strcmp(command, "manifest") == 0)
+    {
+        handle_manifest(client_socket, argument1);                                  // to list a whole tree for usync
+    }
+    else if (strcmp(command, "subscribe") == 0)
+    {
+        trace_end(command, 0);                                                      // A subscription lasts as long as the client wants
+        return start_subscription(state, argument1);                                // to stream changes until unsubscribe
+    }
+
+    else if (strcmp(command, "display") == 0)
+    {
+        handle_display(client_socket, argument1);                                   // to handle the display command
+    }
+
+    else
+    {
+        // Sending an error message for unrecognized commands
+        char *error_message = "Invalid command\n";
+        send(client_socket, error_message, strlen(error_message), 0);
+    }
+
+    if (transfer)
+    {
+        finish_transfer(state->address, &transfer_started);
+    }
+
+    // The rest of a file whose chunk stream broke off must not be taken for the next commands
+    if (chunk_stream_broken(client_socket))
+    {
+        printf("Closing the connection, the data of its %s broke off part way\n", command);
+        trace_end(command, -1);
+        return -1;
+    }
+    trace_end(command, 0);
+    return 0;
+}
+
+
+// Function to publish a .txt/.pdf upload to the change feed with the size and checksum the backend now has for it
+void announce_backend_upload(const char *type, const char *path, int existed)
+{
+    long long size;
+    uint32_t checksum;
+
+    if (stat_backend_file(type, path, &size, &checksum) == 0)
+    {
+        feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, path, size, checksum);
+    }
+}
+
+// Function to forward a .txt/.pdf upload to every healthy replica of its backend
+// The first replica's reply goes back to the client; a replica that did not get the whole file is reported
+void forward_upload(int client_socket, char *filename, char *destination, char *buffer, const char *type)
+{
+    char cached_name[BUFFER_SIZE];
+    int sockets[MAX_BACKENDS + 1], slots[MAX_BACKENDS + 1];
+    int count, announce = feed_subscribed(), existed;
+
+    // Any cached copy of the file is about to become stale
+    snprintf(cached_name, sizeof(cached_name), "%s/%s", destination, filename);
+    cache_invalidate(cached_name);
+    existed = announce && stat_backend_file(type, cached_name, NULL, NULL) == 0;
+
+    // A single replica can receive the data straight from the client; several replicas need Smain to fan it out.
+    // While the change feed has subscribers the data goes through Smain, which has to see the upload succeed.
+    if (!announce && healthy_backends(type) == 1 && handoff_to_backend(client_socket, buffer, type) == 0)
+    {
+        registry_note_write(type);
+        return;
+    }
+
+    count = connect_all_backends(type, sockets, slots);
+    if (count == 0)
+    {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the file data the client already sent
+        send_backend_unavailable(client_socket, type);
+        return;
+    }
+
+    // Sending the command frame to every replica, then forwarding the chunked file data to all of them
+    for (int i = 0; i < count; i++)
+    {
+        send_frame(sockets[i], buffer);
+    }
+    relay_chunks_to(client_socket, sockets, count, NULL, NULL);
+    if (forward_replica_replies(client_socket, sockets, slots, count, filename, type) == 0 && announce)
+    {
+        announce_backend_upload(type, cached_name, existed);
+    }
+}
+
+// Function to pass the first replica's reply to an upload on to the client, the other replies are only checked
+// Closes the replica connections and ends their requests; returns 0 when the first replica stored the file
+int forward_replica_replies(int client_socket, const int *sockets, const int *slots, int count, const char *filename, const char *type)
+{
+    char server_response[BUFFER_SIZE];  // Reply forwarded to the client
+    char replica_response[BUFFER_SIZE]; // Replies of the other replicas, only checked
+    int length = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int received = recv(sockets[i], i == 0 ? server_response : replica_response, sizeof(server_response) - 1, 0);
+        if (i == 0)
+        {
+            length = received;
+        }
+        else if (received <= 0)
+        {
+            fprintf(stderr, "Replica %d did not confirm the upload of %s\n", slots[i], filename);
+            registry_write_failed(slots[i]);
+        }
+        close(sockets[i]);
+        release_backend(slots[i]);
+    }
+    if (length > 0)
+    {
+        send(client_socket, server_response, length, 0);
+        server_response[length] = '\0';
+        return strstr(server_response, "uploaded") != NULL ? 0 : -1;
+    }
+    send_backend_unavailable(client_socket, type);
+    return -1;
+}
+
+
+void process_uploaded_file(int client_socket, char *filename, char *destination, char *buffer)
+{
+    char path[BUFFER_SIZE];             // Path to store the full file path
+    char relative[BUFFER_SIZE];         // Path inside the store, the key of a packed file
+    char dest_path[BUFFER_SIZE];        // Path to store the destination directory path
+    FILE *file_ptr;                     // File pointer for handling the file
+    char server_response[BUFFER_SIZE];  // Buffer for sending responses to the client
+    long long received_bytes;           // Number of file bytes received
+    uint32_t checksum;                  // Verified CRC32C of the received file
+    int existed;                        // The upload replaces a stored file, for the change feed
+    long long size = announced_size(buffer); // File size the client announced, -1 from older clients
+
+    if (strstr(filename, ".c") != NULL)
+    {
+        // Construct the destination path
+        snprintf(dest_path, sizeof(dest_path), "%s/smain/%s", valid_home_dir(), destination);
+        // Ensure the destination directory exists
+        if (create_dir_if_new(dest_path) != 0)
+        {
+            recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+            snprintf(server_response, sizeof(server_response), "Could not create directory %s\n", destination);
+            send(client_socket, server_response, strlen(server_response), 0);
+            return;
+        }
+
+        // Construct the full file path for the uploaded file
+        snprintf(path, sizeof(path), "%s/smain/%s/%s", valid_home_dir(), destination, filename);
+        snprintf(relative, sizeof(relative), "%s/%s", destination, filename);
+        existed = access(path, F_OK) == 0 || pack_lookup(relative, NULL) == 0;
+
+        // With the pack, the file is held in memory while it is small and packed once it verifies
+        if (pack_index != NULL)
+        {
+            struct pack_upload upload = {path, NULL, 0, NULL, size};
+
+            printf("Receiving file: %s\n", path);
+            received_bytes = pack_receive(client_socket, &upload, &checksum);
+            received_bytes = pack_finish_upload(&upload, relative, received_bytes, checksum);
+            file_ptr = NULL;
+        }
+        // Open the file for writing
+        else if ((file_ptr = fopen(path, "wb")) == NULL)
+        {
+            recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+            snprintf(server_response, sizeof(server_response), "Could not open file %s for writing\n", path);
+            send(client_socket, server_response, strlen(server_response), 0);
+            return;
+        }
+        else if (preallocate_file(file_ptr, size) != 0)
+        {
+            fclose(file_ptr);
+            unlink(path);
+            recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+            snprintf(server_response, sizeof(server_response), "Cannot reserve %lld bytes for %s\n", size, filename);
+            send(client_socket, server_response, strlen(server_response), 0);
+            return;
+        }
+        else
+        {
+            // Receive the chunked file data from the client and write it to the file
+            printf("Receiving file: %s\n", path);
+            received_bytes = recv_file_chunks(client_socket, file_ptr, &checksum);
+            trim_preallocated(file_ptr, size);
+            if (received_bytes >= 0)
+            {
+                save_stored_checksum(fileno(file_ptr), checksum); // Keep the verified checksum next to the file
+            }
+            fclose(file_ptr);
+        }
+        if (received_bytes == TRANSFER_CORRUPT)
+        {
+            if (file_ptr != NULL)
+            {
+                unlink(path); // Never keep data that failed verification
+            }
+            snprintf(server_response, sizeof(server_response), "Checksum mismatch, upload of %s rejected\n", filename);
+            send(client_socket, server_response, strlen(server_response), 0);
+            return;
+        }
+        if (received_bytes < 0)
+        {
+            snprintf(server_response, sizeof(server_response), "Failed to receive file %s\n", filename);
+            send(client_socket, server_response, strlen(server_response), 0);
+            return;
+        }
+        printf("File scanned completely, copied %lld bytes to the Main server directory from the Client server\n", received_bytes);
+        display_cache_invalidate(relative);
+        feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, relative, received_bytes, checksum);
+
+        // Notifying the client that the file was uploaded successfully
+        snprintf(server_response, sizeof(server_response), "File %s uploaded successfully\n", filename);
+        send(client_socket, server_response, strlen(server_response), 0);
+    }
+
+    // Text and PDF files are written to every Stext or Spdf replica
+    else if (strstr(filename, ".txt") != NULL)
+    {
+        forward_upload(client_socket, filename, destination, buffer, ".txt");
+    }
+    else if (strstr(filename, ".pdf") != NULL)
+    {
+        forward_upload(client_socket, filename, destination, buffer, ".pdf");
+    }
+    else
+    {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the file data the client already sent
+        snprintf(server_response, sizeof(server_response), "File type %s is not supported.\n", filename);
+        send(client_socket, server_response, strlen(server_response), 0);
+    }
+}
+
+
+// Chunk table of a parallel upload, kept next to the file being assembled so that every worker receiving one of its
+// chunks can record it there: this header, then one upload_chunk per chunk
+struct upload_table
+{
+    uint32_t magic;                     // UPLOAD_TABLE_MAGIC
+    uint32_t chunks;                    // Number of chunks the file is split into
+    long long size;                     // File size announced by ubegin
+    long long chunk_size;               // Bytes in every chunk but the last
+};
+
+// One chunk's entry in the table, written once the chunk arrived with a matching CRC32C
+struct upload_chunk
+{
+    uint32_t stored;                    // 1 once the chunk is in place
+    uint32_t checksum;                  // CRC32C of the chunk, combined into the whole-file checksum by ucommit
+};
+
+// Function to name the file a parallel upload is assembled in and its chunk table
+// The suffixes keep both out of display, dtar and manifest listings until ucommit renames the file into place
+void upload_paths(const char *destination, const char *file_name, const char *upload_id, char *part_path, char *table_path)
+{
+    snprintf(part_path, BUFFER_SIZE * 2, "%s/smain/%s/.%s.%s.upload", valid_home_dir(), destination, file_name, upload_id);
+    snprintf(table_path, BUFFER_SIZE * 2, "%s/smain/%s/.%s.%s.chunks", valid_home_dir(), destination, file_name, upload_id);
+}
+
+// Function to open the chunk table of a parallel upload and read its header, returns the descriptor or -1
+int open_upload_table(const char *table_path, struct upload_table *table)
+{
+    int table_fd = open(table_path, O_RDWR);
+
+    if (table_fd >= 0 && (pread(table_fd, table, sizeof(*table), 0) != sizeof(*table) || table->magic != UPLOAD_TABLE_MAGIC))
+    {
+        close(table_fd);
+        return -1;
+    }
+    return table_fd;
+}
+
+// Function to handle "ubegin <file> <destination> <size> <chunk size> <upload ID>", the start of a parallel upload:
+// the file is created at its full size with its space reserved, and an empty chunk table is written next to it.
+// A ubegin repeated with the same upload ID and layout keeps the chunks already stored, so an upload can be resumed
+void handle_upload_begin(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17], directory[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table, existing;
+    long long size, chunk_size;
+    int part_fd, table_fd;
+
+    if (sscanf(command, "%*s %512s %512s %lld %lld %16[0-9a-f]", file_name, destination, &size, &chunk_size, upload_id) != 5 ||
+        size < 0 || chunk_size < UPLOAD_CHUNK_MIN || chunk_size > UPLOAD_CHUNK_MAX || (size + chunk_size - 1) / chunk_size > UPLOAD_MAX_CHUNKS)
+    {
+        snprintf(response, sizeof(response), "Invalid parallel upload request\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    table = (struct upload_table){UPLOAD_TABLE_MAGIC, (size + chunk_size - 1) / chunk_size, size, chunk_size};
+    snprintf(directory, sizeof(directory), "%s/smain/%s", valid_home_dir(), destination);
+    upload_paths(destination, file_name, upload_id, part_path, table_path);
+    if (create_dir_if_new(directory) != 0 || (part_fd = open(part_path, O_WRONLY | O_CREAT, 0644)) < 0)
+    {
+        snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // Size the file up front so every chunk can be written into place, and reserve its space like a ufile does
+    if (ftruncate(part_fd, size) != 0 || (PREALLOCATE_ENABLED && size > 0 && fallocate(part_fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 &&
+                                          errno != EOPNOTSUPP && errno != ENOSYS))
+    {
+        close(part_fd);
+        unlink(part_path);
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Cannot reserve %lld bytes for %s\n", size, file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    close(part_fd);
+
+    // Keep the table of an earlier ubegin of the same layout, start any other one with no chunk stored
+    table_fd = open_upload_table(table_path, &existing);
+    if (table_fd < 0 || existing.size != size || existing.chunk_size != chunk_size)
+    {
+        if (table_fd >= 0)
+        {
+            close(table_fd);
+        }
+        table_fd = open(table_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (table_fd < 0 || pwrite(table_fd, &table, sizeof(table), 0) != sizeof(table) ||
+            ftruncate(table_fd, sizeof(table) + (off_t)table.chunks * sizeof(struct upload_chunk)) != 0)
+        {
+            if (table_fd >= 0)
+            {
+                close(table_fd);
+            }
+            unlink(part_path);
+            unlink(table_path);
+            snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+    }
+    close(table_fd);
+    printf("Parallel upload of %s/%s started: %lld bytes in %u chunks\n", destination, file_name, size, table.chunks);
+    snprintf(response, sizeof(response), "Ready for %u chunks\n", table.chunks);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "uchunk <file> <destination> <upload ID> <index>" and the chunk stream after it: the data is
+// written into place with pwrite() and, when its CRC32C trailer matches, the chunk is marked stored in the table.
+// The chunks of one upload arrive on any number of connections at once, each only touches its own byte range
+void handle_upload_chunk(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table;
+    struct upload_chunk chunk = {1, 0};
+    size_t capacity = POOL_MAX_CHUNK;
+    char *buffer = NULL;
+    long long offset, expected, received = 0;
+    long length;
+    unsigned int index = 0;
+    uint32_t trailer;
+    int part_fd = -1, table_fd = -1, failed = 0;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %u", file_name, destination, upload_id, &index) == 4)
+    {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0 || index >= table.chunks || (part_fd = open(part_path, O_WRONLY)) < 0 ||
+        (buffer = pool_acquire(&capacity)) == NULL)
+    {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the chunk so the connection stays in sync
+        snprintf(response, sizeof(response), "Chunk %u failed, no parallel upload of it was started\n", index);
+        send(client_socket, response, strlen(response), 0);
+        if (part_fd >= 0)
+        {
+            close(part_fd);
+        }
+        if (table_fd >= 0)
+        {
+            close(table_fd);
+        }
+        return;
+    }
+    offset = (long long)index * table.chunk_size;
+    expected = table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size;
+
+    // A chunk that runs past its range or cannot be written is still received to the end, the stream stays in step
+    while ((length = recv_chunk(client_socket, &buffer, &capacity)) > 0)
+    {
+        if (failed || received + length > expected)
+        {
+            failed = 1;
+            continue;
+        }
+        chunk.checksum = crc32c_update(chunk.checksum, buffer, length);
+        for (long written = 0; written < length; )
+        {
+            ssize_t result = pwrite(part_fd, buffer + written, length - written, offset + received + written);
+            if (result <= 0)
+            {
+                perror("Failed to write received chunk");
+                failed = 1;
+                break;
+            }
+            written += result;
+        }
+        received += length;
+    }
+    pool_release(buffer, capacity);
+    close(part_fd);
+    if (length < 0 || recv_all(client_socket, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != chunk.checksum ||
+        received != expected || failed ||
+        pwrite(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)index * sizeof(chunk)) != sizeof(chunk))
+    {
+        snprintf(response, sizeof(response), "Chunk %u failed\n", index);
+    }
+    else
+    {
+        snprintf(response, sizeof(response), "Chunk %u stored\n", index);
+    }
+    close(table_fd);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "ucommit <file> <destination> <upload ID> <CRC32C>", the end of a parallel upload: once every
+// chunk is stored, the chunk checksums are combined into the whole-file CRC32C and compared with the client's, and
+// the assembled file is renamed over the destination in one step, so no reader ever sees a partial file.
+// Missing chunks are listed in the reply and the upload stays open for them
+void handle_upload_commit(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1] = "", destination[COMMAND_WORD_MAX + 1], upload_id[17], final_path[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    char relative[BUFFER_SIZE * 2];         // Path inside the store, the key of a packed file
+    struct upload_table table;
+    struct upload_chunk chunk;
+    unsigned int missing = 0;
+    size_t listed;
+    uint32_t expected, checksum = 0;
+    int part_fd, table_fd = -1, existed;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %x", file_name, destination, upload_id, &expected) == 4)
+    {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0)
+    {
+        snprintf(response, sizeof(response), "No parallel upload of %s was started\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // List as many missing chunks as fit the reply, the client sends them and commits again
+    listed = snprintf(response, sizeof(response), "Missing chunks:");
+    for (unsigned int i = 0; i < table.chunks; i++)
+    {
+        long long offset = (long long)i * table.chunk_size;
+
+        if (pread(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)i * sizeof(chunk)) != sizeof(chunk) || !chunk.stored)
+        {
+            if (listed + 12 < sizeof(response))
+            {
+                listed += snprintf(response + listed, sizeof(response) - listed, " %u", i);
+            }
+            missing++;
+            continue;
+        }
+        checksum = crc32c_combine(checksum, chunk.checksum, table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size);
+    }
+    close(table_fd);
+    if (missing > 0)
+    {
+        strcpy(response + listed, "\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (checksum != expected)
+    {
+        unlink(part_path); // Never keep data that failed verification
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Checksum mismatch, upload of %s rejected\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    snprintf(final_path, sizeof(final_path), "%s/smain/%s/%s", valid_home_dir(), destination, file_name);
+    snprintf(relative, sizeof(relative), "%s/%s", destination, file_name);
+    existed = access(final_path, F_OK) == 0 || pack_lookup(relative, NULL) == 0;
+    if ((part_fd = open(part_path, O_RDONLY)) >= 0)
+    {
+        save_stored_checksum(part_fd, checksum); // Keep the verified checksum next to the file
+        close(part_fd);
+    }
+    if (part_fd < 0 || rename(part_path, final_path) != 0)
+    {
+        snprintf(response, sizeof(response), "Unable to store %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    unlink(table_path);
+    pack_remove(relative); // The loose file replaces any packed copy
+    display_cache_invalidate(relative);
+    feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, relative, table.size, checksum);
+    printf("Parallel upload of %s assembled from %u chunks, %lld bytes\n", final_path, table.chunks, table.size);
+    snprintf(response, sizeof(response), "File %s uploaded successfully in %u chunks\n", file_name, table.chunks);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to route the commands of a parallel upload: .c files are assembled in smain's own store, .txt and .pdf
+// commands go to every healthy replica of their backend like a ufile, uchunk with the chunk data after its frame.
+// A chunk is handed straight to a lone replica; a commit invalidates the cached copy and announces the new file
+void process_chunked_upload(int client_socket, char *command, char *filename, char *destination, char *buffer)
+{
+    char cached_name[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    int sockets[MAX_BACKENDS + 1], slots[MAX_BACKENDS + 1];
+    int count, announce = 0, existed = 0;
+    int with_data = strcmp(command, "uchunk") == 0;
+    const char *type = strstr(filename, ".txt") != NULL ? ".txt" : strstr(filename, ".pdf") != NULL ? ".pdf" : NULL;
+
+    if (strstr(filename, ".c") != NULL)
+    {
+        if (strcmp(command, "ubegin") == 0)
+        {
+            handle_upload_begin(client_socket, buffer);
+        }
+        else if (with_data)
+        {
+            handle_upload_chunk(client_socket, buffer);
+        }
+        else
+        {
+            handle_upload_commit(client_socket, buffer);
+        }
+        return;
+    }
+    if (type == NULL)
+    {
+        if (with_data)
+        {
+            recv_file_chunks(client_socket, NULL, NULL); // Drain the chunk the client already sent
+        }
+        snprintf(response, sizeof(response), "File type %s is not supported.\n", filename);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (strcmp(command, "ucommit") == 0)
+    {
+        // Any cached copy of the file is about to become stale
+        snprintf(cached_name, sizeof(cached_name), "%s/%s", destination, filename);
+        cache_invalidate(cached_name);
+        announce = feed_subscribed();
+        existed = announce && stat_backend_file(type, cached_name, NULL, NULL) == 0;
+    }
+    if (with_data && healthy_backends(type) == 1 && handoff_to_backend(client_socket, buffer, type) == 0)
+    {
+        registry_note_write(type);
+        return;
+    }
+
+    count = connect_all_backends(type, sockets, slots);
+    if (count == 0)
+    {
+        if (with_data)
+        {
+            recv_file_chunks(client_socket, NULL, NULL); // Drain the chunk the client already sent
+        }
+        send_backend_unavailable(client_socket, type);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        send_frame(sockets[i], buffer);
+    }
+    if (with_data)
+    {
+        relay_chunks_to(client_socket, sockets, count, NULL, NULL);
+    }
+    if (forward_replica_replies(client_socket, sockets, slots, count, filename, type) == 0 && announce)
+    {
+        announce_backend_upload(type, cached_name, existed);
+    }
+}
+
+
+// Function to pick the block size of a delta upload's signatures, about the square root of the stored file as rsync does
+int delta_block_size(long long size)
+{
+    int block = DELTA_MIN_BLOCK;
+
+    while ((long long)block * block < size && block < DELTA_MAX_BLOCK)
+    {
+        block *= 2;
+    }
+    return block;
+}
+
+// Function to compute the weak checksum of a block: the sum of its bytes and the sum of those sums, 16 bits each
+// The client can roll it along its file one byte at a time to find blocks at any offset
+uint32_t delta_weak_checksum(const unsigned char *data, size_t length)
+{
+    uint32_t sum = 0, sum_of_sums = 0;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        sum += data[i];
+        sum_of_sums += sum;
+    }
+    return (sum & 0xffff) | (sum_of_sums << 16);
+}
+
+// Function to send the signatures of the stored copy a delta upload is built against, file_descriptor is -1 without one
+// The stream holds the block size and file size, then the weak checksum and CRC32C of every whole block
+// Returns 0 when the signatures were sent; *block_size and *size describe the copy for apply_delta()
+int send_delta_signatures(int sock, int file_descriptor, int *block_size, long long *size)
+{
+    uint32_t entries[2 * DELTA_SIGNATURE_BATCH + 3];
+    const unsigned char *data = NULL;
+    struct stat file_info;
+    uint32_t checksum = 0;
+    long long blocks;
+    int used = 3, status = 0;
+
+    *size = file_descriptor >= 0 && fstat(file_descriptor, &file_info) == 0 ? file_info.st_size : 0;
+    *block_size = delta_block_size(*size);
+    if (*size > 0 && (data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, file_descriptor, 0)) == MAP_FAILED)
+    {
+        data = NULL;
+        *size = 0; // Without a readable copy every byte is sent as literal data
+    }
+    if (data != NULL)
+    {
+        madvise((void *)data, *size, MADV_SEQUENTIAL);
+    }
+    blocks = *size / *block_size;
+
+    // The header goes in front of the first batch: block size and the file size as two 32-bit halves
+    entries[0] = htonl(*block_size);
+    entries[1] = htonl((uint32_t)(*size >> 32));
+    entries[2] = htonl((uint32_t)*size);
+    for (long long i = 0; i < blocks && status == 0; i++)
+    {
+        const unsigned char *block = data + i * *block_size;
+        entries[used++] = htonl(delta_weak_checksum(block, *block_size));
+        entries[used++] = htonl(crc32c_update(0, block, *block_size));
+        if (used >= 2 * DELTA_SIGNATURE_BATCH)
+        {
+            checksum = crc32c_update(checksum, entries, used * sizeof(uint32_t));
+            status = send_chunk(sock, (const char *)entries, used * sizeof(uint32_t));
+            used = 0;
+        }
+    }
+    if (status == 0 && used > 0)
+    {
+        checksum = crc32c_update(checksum, entries, used * sizeof(uint32_t));
+        status = send_chunk(sock, (const char *)entries, used * sizeof(uint32_t));
+    }
+    if (data != NULL)
+    {
+        munmap((void *)data, *size);
+    }
+    return status == 0 ? send_end_of_file(sock, checksum) : -1;
+}
+
+// Chunk stream of delta instructions read as a byte stream, an instruction may span chunks
+struct delta_reader
+{
+    int sock;
+    char *buffer;                       // Pool buffer holding the current chunk
+    size_t capacity;
+    long length;                        // Bytes in the current chunk
+    long offset;                        // Bytes of the current chunk already read
+    uint32_t checksum;                  // CRC32C of every chunk received so far
+    int ended;                          // The end-of-file chunk arrived
+    int broken;                         // The connection failed, nothing more can be read
+};
+
+// Function to read exactly `length` bytes of the instruction stream, returns 0 or -1 when the stream ended or broke
+int delta_read(struct delta_reader *reader, void *data, size_t length)
+{
+    while (length > 0)
+    {
+        size_t available;
+
+        if (reader->offset == reader->length)
+        {
+            if (reader->ended || reader->broken || (reader->length = recv_chunk(reader->sock, &reader->buffer, &reader->capacity)) <= 0)
+            {
+                reader->ended |= reader->length == 0;
+                reader->broken |= reader->length < 0;
+                reader->length = reader->offset = 0;
+                return -1;
+            }
+            reader->checksum = crc32c_update(reader->checksum, reader->buffer, reader->length);
+            reader->offset = 0;
+        }
+        available = reader->length - reader->offset;
+        available = available < length ? available : length;
+        memcpy(data, reader->buffer + reader->offset, available);
+        reader->offset += available;
+        data = (char *)data + available;
+        length -= available;
+    }
+    return 0;
+}
+
+// Function to rebuild a file from a delta upload into output_descriptor: 'C' copies a run of blocks of the stored copy,
+// 'L' carries literal bytes and 'E' ends with the size and CRC32C of the whole new file
+// Returns the size of the rebuilt file, -1 for a broken stream or TRANSFER_CORRUPT when the result does not verify;
+// *checksum gets the new file's CRC32C and *literal the bytes that came over the wire
+long long apply_delta(int sock, int old_descriptor, int block_size, long long old_size, int output_descriptor,
+                      uint32_t *checksum, long long *literal)
+{
+    struct delta_reader reader = {sock, NULL, POOL_MIN_CHUNK, 0, 0, 0, 0, 0};
+    size_t capacity = DELTA_MAX_BLOCK;
+    char *staging = pool_acquire(&capacity);
+    long long written = 0, expected_size = -1;
+    uint32_t computed = 0, expected_checksum = 0, fields[3], trailer;
+    unsigned char operation;
+    int failed = 0;
+
+    reader.buffer = pool_acquire(&reader.capacity);
+    *literal = 0;
+    while (!failed && staging != NULL && reader.buffer != NULL && delta_read(&reader, &operation, 1) == 0)
+    {
+        if (operation == 'E')
+        {
+            failed = delta_read(&reader, fields, 3 * sizeof(uint32_t)) != 0;
+            expected_size = ((long long)ntohl(fields[0]) << 32) | ntohl(fields[1]);
+            expected_checksum = ntohl(fields[2]);
+            break;
+        }
+        if ((operation != 'C' && operation != 'L') || delta_read(&reader, fields, (operation == 'C' ? 2 : 1) * sizeof(uint32_t)) != 0)
+        {
+            failed = 1;
+            break;
+        }
+
+        // 'C' <first block> <block count> copies from the stored copy, 'L' <length> is followed by the literal bytes
+        long long offset = operation == 'C' ? (long long)ntohl(fields[0]) * block_size : 0;
+        long long remaining = operation == 'C' ? (long long)ntohl(fields[1]) * block_size : ntohl(fields[0]);
+        if (operation == 'C' && (old_descriptor < 0 || offset + remaining > old_size))
+        {
+            failed = 1;
+        }
+        *literal += operation == 'L' ? remaining : 0;
+        while (!failed && remaining > 0)
+        {
+            size_t piece = remaining < (long long)capacity ? (size_t)remaining : capacity;
+            if (operation == 'C' ? pread(old_descriptor, staging, piece, offset) != (ssize_t)piece : delta_read(&reader, staging, piece) != 0)
+            {
+                failed = 1;
+                break;
+            }
+            if (write(output_descriptor, staging, piece) != (ssize_t)piece)
+            {
+                perror("Failed to write the rebuilt file");
+                failed = 1;
+                break;
+            }
+            computed = crc32c_update(computed, staging, piece);
+            written += piece;
+            offset += piece;
+            remaining -= piece;
+        }
+    }
+    pool_release(staging, capacity);
+
+    // 'E' has to be the last instruction; the rest of the stream is read in any case so the connection stays in step
+    failed |= expected_size < 0 || reader.offset != reader.length;
+    while (!reader.ended && !reader.broken && reader.buffer != NULL)
+    {
+        long length = recv_chunk(sock, &reader.buffer, &reader.capacity);
+        reader.ended = length == 0;
+        reader.broken = length < 0;
+        failed |= length > 0;
+        reader.checksum = crc32c_update(reader.checksum, reader.buffer, length > 0 ? length : 0);
+    }
+    failed |= reader.broken || reader.buffer == NULL || recv_all(sock, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != reader.checksum;
+    pool_release(reader.buffer, reader.capacity);
+    if (failed)
+    {
+        return -1;
+    }
+    if (written != expected_size || computed != expected_checksum)
+    {
+        fprintf(stderr, "Rebuilt file does not match: %lld bytes with %08x, expected %lld bytes with %08x\n",
+                written, computed, expected_size, expected_checksum);
+        return TRANSFER_CORRUPT;
+    }
+    *checksum = computed;
+    return written;
+}
+
+// Function to forward a .txt delta upload: the signatures come from the first replica, the instructions go to all of them
+// Replicas hold the same copy, so the instructions built against one rebuild the file on every replica; a replica whose
+// copy differs rejects the result when it does not verify
+void forward_delta_upload(int client_socket, char *filename, char *destination, char *buffer, const char *type)
+{
+    char cached_name[BUFFER_SIZE];
+    int sockets[MAX_BACKENDS + 1], slots[MAX_BACKENDS + 1];
+    int count, announce = feed_subscribed(), existed;
+
+    snprintf(cached_name, sizeof(cached_name), "%s/%s", destination, filename);
+    cache_invalidate(cached_name);
+    existed = announce && stat_backend_file(type, cached_name, NULL, NULL) == 0;
+
+    if (!announce && healthy_backends(type) == 1 && handoff_to_backend(client_socket, buffer, type) == 0)
+    {
+        registry_note_write(type);
+        return;
+    }
+    count = connect_all_backends(type, sockets, slots);
+    if (count == 0)
+    {
+        send_end_of_file(client_socket, 1); // Signatures that cannot verify make the client send nothing
+        send_backend_unavailable(client_socket, type);
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        send_frame(sockets[i], buffer);
+    }
+    relay_chunks_to(sockets[0], &client_socket, 1, NULL, NULL);
+    for (int i = 1; i < count; i++)
+    {
+        recv_file_chunks(sockets[i], NULL, NULL);
+    }
+    relay_chunks_to(client_socket, sockets, count, NULL, NULL);
+    if (forward_replica_replies(client_socket, sockets, slots, count, filename, type) == 0 && announce)
+    {
+        announce_backend_upload(type, cached_name, existed);
+    }
+}
+
+// Function to handle "dufile <file> <destination>", an upload that only moves what changed since the stored copy
+// Smain sends the block signatures of its copy, the client answers with block references and literal data, and the
+// new version is rebuilt into a temporary file that replaces the stored one once its CRC32C verifies
+void process_delta_upload(int client_socket, char *filename, char *destination, char *buffer)
+{
+    char dest_path[BUFFER_SIZE], path[BUFFER_SIZE], relative[BUFFER_SIZE], temporary_path[BUFFER_SIZE + 32], server_response[BUFFER_SIZE];
+    int old_descriptor, output_descriptor, block_size, existed;
+    long long old_size, rebuilt, literal;
+    uint32_t checksum;
+
+    if (strstr(filename, ".c") == NULL && strstr(filename, ".txt") != NULL)
+    {
+        forward_delta_upload(client_socket, filename, destination, buffer, ".txt");
+        return;
+    }
+    if (strstr(filename, ".c") == NULL)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(server_response, sizeof(server_response), "File type %s is not supported.\n", filename);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+
+    snprintf(dest_path, sizeof(dest_path), "%s/smain/%s", valid_home_dir(), destination);
+    if (create_dir_if_new(dest_path) != 0)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(server_response, sizeof(server_response), "Could not create directory %s\n", destination);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/smain/%s/%s", valid_home_dir(), destination, filename);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", path, worker_id());
+    output_descriptor = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (output_descriptor < 0)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(server_response, sizeof(server_response), "Could not open file %s for writing\n", filename);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+
+    printf("Receiving delta of file: %s\n", path);
+    old_descriptor = open(path, O_RDONLY);
+    snprintf(relative, sizeof(relative), "%s/%s", destination, filename);
+
+    // A packed copy is smaller than any file sent as a delta, so it is not worth matching against
+    existed = old_descriptor >= 0 || pack_lookup(relative, NULL) == 0;
+    if (send_delta_signatures(client_socket, old_descriptor, &block_size, &old_size) != 0)
+    {
+        rebuilt = -1;
+    }
+    else
+    {
+        rebuilt = apply_delta(client_socket, old_descriptor, block_size, old_size, output_descriptor, &checksum, &literal);
+    }
+    if (rebuilt >= 0)
+    {
+        save_stored_checksum(output_descriptor, checksum); // Keep the verified checksum next to the file
+    }
+    if (old_descriptor >= 0)
+    {
+        close(old_descriptor);
+    }
+    close(output_descriptor);
+
+    // Only a verified file replaces the stored copy, which stays untouched otherwise
+    if (rebuilt >= 0 && rename(temporary_path, path) == 0)
+    {
+        printf("Rebuilt %lld bytes, %lld of them sent by the client\n", rebuilt, literal);
+        pack_remove(relative); // The loose file replaces a packed version
+        display_cache_invalidate(relative);
+        feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, relative, rebuilt, checksum);
+        snprintf(server_response, sizeof(server_response), "File %s uploaded successfully (delta: %lld of %lld bytes sent)\n",
+                 filename, literal, rebuilt);
+    }
+    else if (rebuilt == TRANSFER_CORRUPT)
+    {
+        unlink(temporary_path); // Never keep data that failed verification
+        snprintf(server_response, sizeof(server_response), "Checksum mismatch, upload of %s rejected\n", filename);
+    }
+    else
+    {
+        unlink(temporary_path);
+        snprintf(server_response, sizeof(server_response), "Failed to receive file %s\n", filename);
+    }
+    send(client_socket, server_response, strlen(server_response), 0);
+}
+
+// The negative lookup filter: for every store a counting Bloom filter of the paths it holds, in a mapping every worker
+// shares. A path with one of its counters at zero was never stored, so a dfile or rmfile of it is answered without
+// asking the store; any other path goes on to the store as before. Counters only drop once a single named file is
+// gone, a path moved or removed by a glob or a tree stays set, which costs no more than the round trip it used to.
+// Paths are learned from Smain's own store at startup and from a backend's manifest once it registers; uploads, mvfile
+// and cpfile note their paths before the file appears. Files put into a store behind Smain's back are only seen
+// after a restart, and were never counted in: the fingerprints of the paths that were tell them apart, so deleting
+// one leaves the counters alone instead of clearing one that a stored path shares
+struct negative_filter_path
+{
+    uint64_t fingerprint;               // Both hashes of the normalised path, 0 for a slot never used
+    uint32_t count;                     // Times the path was counted in and not yet out
+    uint32_t unused;
+};
+
+struct negative_filter
+{
+    int ready[3];                       // The paths of the .c, .txt and .pdf store were learned, misses can be trusted
+    int learning[3];                    // Relocations whose targets are being learned, misses are not trusted meanwhile
+    time_t loading_since[3];            // When the load of a backend's paths started, 0 while none runs
+    unsigned long fast_failures;        // Requests answered without asking a store
+    unsigned long passed;               // Requests the filter sent on to a store
+    uint8_t counters[3][NEGATIVE_FILTER_COUNTERS];
+    struct negative_filter_path paths[3][NEGATIVE_FILTER_PATHS];
+};
+
+struct negative_filter *negative_filter; // Mapped by negative_filter_init(), NULL while every request asks the store
+static const char *negative_filter_types[] = {".c", ".txt", ".pdf"};
+
+// Function to find the filter of the store holding a file type, -1 for a type no store holds
+int negative_filter_store(const char *type)
+{
+    for (int i = 0; type != NULL && i < 3; i++)
+    {
+        if (strcmp(type, negative_filter_types[i]) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function to find the counters of a path: double hashing of its CRC32C and FNV-1a over the normalised path
+// Both hashes together are left in fingerprint when it is given, never 0
+// Returns -1 for a path too long to be normalised, such a path is never taken to be missing
+int negative_filter_positions(const char *path, uint32_t *positions, uint64_t *fingerprint)
+{
+    char key[PACK_PATH_MAX];
+    uint32_t first, second;
+
+    if (pack_key(path, key) != 0)
+    {
+        return -1;
+    }
+    first = crc32c_update(0, key, strlen(key));
+    second = pack_hash(key) | 1;
+    for (int i = 0; i < NEGATIVE_FILTER_HASHES; i++)
+    {
+        positions[i] = (first + i * second) & (NEGATIVE_FILTER_COUNTERS - 1);
+    }
+    if (fingerprint != NULL)
+    {
+        *fingerprint = (uint64_t)first << 32 | second;
+    }
+    return 0;
+}
+
+// Function to count a path's fingerprint in or out of its store's table, by linear probing from the fingerprint
+// Returns 0 when done; -1 when counting in found no free slot nearby, or counting out found a path never counted in
+int negative_filter_count_path(int store, uint64_t fingerprint, int delta)
+{
+    for (uint32_t i = 0; i < NEGATIVE_FILTER_PROBES; i++)
+    {
+        struct negative_filter_path *slot =
+            &negative_filter->paths[store][((fingerprint >> 32) + i) & (NEGATIVE_FILTER_PATHS - 1)];
+        uint64_t found = __atomic_load_n(&slot->fingerprint, __ATOMIC_ACQUIRE);
+
+        if (found == 0)
+        {
+            // Slots are taken in probe order, so a path counted in would have been met before a free one
+            if (delta < 0)
+            {
+                return -1;
+            }
+            // On failure another worker took the slot meanwhile, and found holds its fingerprint
+            if (__atomic_compare_exchange_n(&slot->fingerprint, &found, fingerprint, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+            {
+                found = fingerprint;
+            }
+        }
+        if (found != fingerprint)
+        {
+            continue;
+        }
+        if (delta > 0)
+        {
+            __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        uint32_t count = __atomic_load_n(&slot->count, __ATOMIC_RELAXED);
+        while (count > 0 &&
+               !__atomic_compare_exchange_n(&slot->count, &count, count - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+        return count > 0 ? 0 : -1;
+    }
+    return -1;
+}
+
+// Function to count a path in or out of a store's filter. Counters stop at 255 and one that got there is never
+// lowered again, since it no longer tells how many paths share it. A path is only counted out when its fingerprint
+// shows it was counted in; one that could not be recorded keeps its counters set, which costs a round trip at most
+void negative_filter_update(int store, const char *path, int delta)
+{
+    uint32_t positions[NEGATIVE_FILTER_HASHES];
+    uint64_t fingerprint;
+
+    if (negative_filter == NULL || store < 0 || negative_filter_positions(path, positions, &fingerprint) != 0 ||
+        (negative_filter_count_path(store, fingerprint, delta) != 0 && delta < 0))
+    {
+        return;
+    }
+    for (int i = 0; i < NEGATIVE_FILTER_HASHES; i++)
+    {
+        uint8_t *counter = &negative_filter->counters[store][positions[i]];
+        uint8_t value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+        while (value != UINT8_MAX && (delta > 0 || value != 0) &&
+               !__atomic_compare_exchange_n(counter, &value, value + delta, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+}
+
+// Function to note a path about to be stored, before it can be downloaded
+void negative_filter_note(const char *type, const char *path)
+{
+    negative_filter_update(negative_filter_store(type), path, 1);
+}
+
+// Function to note an upload "<file name> <destination>" in the store the upload goes to
+void negative_filter_note_upload(const char *filename, const char *destination)
+{
+    char path[BUFFER_SIZE * 2];
+
+    snprintf(path, sizeof(path), "%s/%s", destination, filename);
+    negative_filter_note(strstr(filename, ".c") != NULL ? ".c" : strstr(filename, ".txt") != NULL ? ".txt" :
+                         strstr(filename, ".pdf") != NULL ? ".pdf" : NULL, path);
+}
+
+// Function to count out a single file the store confirmed it deleted. Before the store's paths were learned the file
+// may not have been counted in yet, and the learning would count it in after it is gone
+void negative_filter_forget(const char *type, const char *path)
+{
+    int store = negative_filter_store(type);
+
+    if (negative_filter != NULL && store >= 0 && __atomic_load_n(&negative_filter->ready[store], __ATOMIC_ACQUIRE))
+    {
+        negative_filter_update(store, path, -1);
+    }
+}
+
+// Function to tell whether a path is certainly not in the store of a type. Only paths ending in the type and below
+// ~smain are judged, as only those are in the manifests the filter was learned from
+int negative_filter_missing(const char *type, const char *path)
+{
+    uint32_t positions[NEGATIVE_FILTER_HASHES];
+    int store = negative_filter_store(type), missing = 0;
+    const char *route = route_by_type(path);
+
+    if (negative_filter == NULL || store < 0 || route == NULL || strcmp(route, type) != 0 ||
+        strncmp(path, "~smain/", strlen("~smain/")) != 0 || !__atomic_load_n(&negative_filter->ready[store], __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&negative_filter->learning[store], __ATOMIC_ACQUIRE) > 0 || negative_filter_positions(path, positions, NULL) != 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < NEGATIVE_FILTER_HASHES && !missing; i++)
+    {
+        missing = __atomic_load_n(&negative_filter->counters[store][positions[i]], __ATOMIC_RELAXED) == 0;
+    }
+    __atomic_add_fetch(missing ? &negative_filter->fast_failures : &negative_filter->passed, 1, __ATOMIC_RELAXED);
+    return missing;
+}
+
+// Function to count in every file below an open directory of Smain's own store, the descriptor is consumed
+long negative_filter_walk(int directory_fd, const char *relative)
+{
+    DIR *directory = fdopendir(directory_fd);
+    struct dirent *entry;
+    long count = 0;
+
+    if (directory == NULL)
+    {
+        close(directory_fd);
+        return 0;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char path[BUFFER_SIZE * 2];
+        int child_fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", relative, entry->d_name);
+        if (entry->d_type == DT_DIR)
+        {
+            if ((child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0)
+            {
+                count += negative_filter_walk(child_fd, path);
+            }
+            continue;
+        }
+        negative_filter_update(0, path, 1);
+        count++;
+    }
+    closedir(directory);
+    return count;
+}
+
+// Function to count in one "<path> <size> <mtime> <crc32c>" line of a manifest asked for below a directory
+void negative_filter_add_listed(int store, const char *directory, char *line)
+{
+    char path[BUFFER_SIZE * 3];
+
+    for (int i = 0; i < 3; i++)
+    {
+        char *space = strrchr(line, ' ');
+
+        if (space == NULL)
+        {
+            return;
+        }
+        *space = '\0';
+    }
+    snprintf(path, sizeof(path), "%s/%s", directory, line);
+    negative_filter_update(store, path, 1);
+}
+
+// Function to count in every file a store holds below a directory: Smain walks its own store and pack, a backend
+// is asked for its manifest. Returns the number of files, or -1 when the backend could not give a complete manifest
+long negative_filter_learn(int store, const char *directory)
+{
+    char frame[BUFFER_SIZE], path[BUFFER_SIZE * 2], line[BUFFER_SIZE * 2], status[BUFFER_SIZE];
+    size_t capacity = POOL_MIN_CHUNK, used = 0, skip;
+    uint32_t checksum = 0, trailer;
+    long length = -1, entries = -1;
+    struct pack_entry *listing;
+    int backend_socket, slot, directory_fd;
+    char *buffer;
+
+    if (store == 0)
+    {
+        int count = pack_list(directory, &listing, &skip);
+
+        for (int i = 0; i < count; i++)
+        {
+            negative_filter_update(0, listing[i].path, 1);
+        }
+        free(listing);
+        snprintf(path, sizeof(path), "%s/smain/%s", valid_home_dir(), directory);
+        directory_fd = open(path, O_RDONLY | O_DIRECTORY);
+        return count + (directory_fd >= 0 ? negative_filter_walk(directory_fd, directory) : 0);
+    }
+
+    if ((slot = connect_backend(negative_filter_types[store], &backend_socket)) < 0)
+    {
+        return -1;
+    }
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "manifest %s", directory);
+    buffer = pool_acquire(&capacity);
+    if (buffer != NULL && send_frame(backend_socket, frame) == BUFFER_SIZE)
+    {
+        // Lines may be split across chunks; one too long for line[] is dropped, its path could not be judged anyway
+        while ((length = recv_chunk(backend_socket, &buffer, &capacity)) > 0)
+        {
+            checksum = crc32c_update(checksum, buffer, length);
+            for (long i = 0; i < length; i++)
+            {
+                if (buffer[i] != '\n')
+                {
+                    line[used] = buffer[i];
+                    used += used < sizeof(line) - 1;
+                    continue;
+                }
+                line[used] = '\0';
+                if (used < sizeof(line) - 1)
+                {
+                    negative_filter_add_listed(store, directory, line);
+                }
+                used = 0;
+            }
+        }
+        if (length != 0 || recv_all(backend_socket, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != checksum ||
+            recv_line(backend_socket, status, sizeof(status)) != 0 || sscanf(status, "manifest %ld files", &entries) != 1)
+        {
+            entries = -1;
+        }
+    }
+    pool_release(buffer, capacity);
+    close(backend_socket);
+    release_backend(slot);
+    return entries;
+}
+
+// Function to map the filter before the first worker starts and learn Smain's own store
+int negative_filter_init()
+{
+    long count;
+
+    negative_filter = mmap(NULL, sizeof(struct negative_filter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (negative_filter == MAP_FAILED)
+    {
+        perror("Failed to map the negative lookup filter");
+        negative_filter = NULL;
+        return -1;
+    }
+    memset(negative_filter, 0, sizeof(struct negative_filter));
+    count = negative_filter_learn(0, "~smain");
+    negative_filter->ready[0] = 1;
+    printf("Negative lookup filter knows %ld .c files, %d counters per store in %zu KB\n", count,
+           NEGATIVE_FILTER_COUNTERS, sizeof(struct negative_filter) / 1024);
+    return 0;
+}
+
+// Function run by the thread that learns a backend store's paths
+void *negative_filter_load_thread(void *argument)
+{
+    int store = (int)(intptr_t)argument;
+    long count = negative_filter_learn(store, "~smain");
+
+    if (count >= 0)
+    {
+        __atomic_store_n(&negative_filter->ready[store], 1, __ATOMIC_RELEASE);
+        printf("Negative lookup filter knows %ld %s files\n", count, negative_filter_types[store]);
+    }
+    __atomic_store_n(&negative_filter->loading_since[store], 0, __ATOMIC_RELEASE);
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to learn the paths of a backend's store on a thread of its own once a backend of the type sends heartbeats,
+// until a load succeeded. One worker loads at a time; a load whose worker went away is started again after a while
+void negative_filter_load_later(const char *type)
+{
+    int store = negative_filter_store(type);
+    time_t now = time(NULL), since;
+    pthread_t thread;
+
+    if (negative_filter == NULL || store <= 0 || __atomic_load_n(&negative_filter->ready[store], __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    since = __atomic_load_n(&negative_filter->loading_since[store], __ATOMIC_ACQUIRE);
+    if ((since != 0 && now - since < NEGATIVE_FILTER_LOAD_TIMEOUT) ||
+        !__atomic_compare_exchange_n(&negative_filter->loading_since[store], &since, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    if (pthread_create(&thread, NULL, negative_filter_load_thread, (void *)(intptr_t)store) != 0)
+    {
+        __atomic_store_n(&negative_filter->loading_since[store], 0, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// One stored file in a replica's manifest, for resync_backend_thread()
+struct resync_file
+{
+    char *path;                         // Path below ~smain, points into the manifest text
+    long long size;
+    long long mtime;
+    char *checksum;                     // CRC32C in hex, "-" when the replica has none recorded
+};
+
+// Function to order manifest entries by path for qsort()
+int resync_file_compare(const void *first, const void *second)
+{
+    return strcmp(((const struct resync_file *)first)->path, ((const struct resync_file *)second)->path);
+}
+
+// Function to fetch the manifest of a replica's whole store and split it into entries sorted by path
+// Returns the manifest text the entries point into, for the caller to free, or NULL when it could not be had whole
+char *resync_manifest(int slot, const char *type, struct resync_file **files, long *count)
+{
+    char frame[BUFFER_SIZE], status[BUFFER_SIZE];
+    char *text = NULL, *line, *save, *fields[3];
+    size_t length = 0;
+    long entries = -1, used = 0;
+    FILE *stream;
+    int backend_socket;
+
+    *files = NULL;
+    *count = 0;
+    if (connect_registered(slot, type, &backend_socket) != 0)
+    {
+        return NULL;
+    }
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "manifest ~smain");
+    stream = open_memstream(&text, &length);
+    if (stream == NULL || send_frame(backend_socket, frame) != BUFFER_SIZE || recv_file_chunks(backend_socket, stream, NULL) < 0 ||
+        recv_line(backend_socket, status, sizeof(status)) != 0 || sscanf(status, "manifest %ld files", &entries) != 1)
+    {
+        entries = -1;
+    }
+    if (stream != NULL)
+    {
+        fclose(stream);
+    }
+    close(backend_socket);
+    if (entries < 0 || text == NULL || (*files = calloc(entries + 1, sizeof(**files))) == NULL)
+    {
+        free(text);
+        return NULL;
+    }
+
+    // "<path> <size> <mtime> <crc32c or ->", the fields are taken from the end of the line
+    for (line = strtok_r(text, "\n", &save); line != NULL && used < entries; line = strtok_r(NULL, "\n", &save))
+    {
+        int found = 0;
+
+        while (found < 3 && (fields[found] = strrchr(line, ' ')) != NULL)
+        {
+            *fields[found]++ = '\0';
+            found++;
+        }
+        if (found == 3)
+        {
+            (*files)[used].path = line;
+            (*files)[used].size = atoll(fields[2]);
+            (*files)[used].mtime = atoll(fields[1]);
+            (*files)[used].checksum = fields[0];
+            used++;
+        }
+    }
+    qsort(*files, used, sizeof(**files), resync_file_compare);
+    *count = used;
+    return text;
+}
+
+// Function to copy one file from a replica in sync to a lagging one, returns 0 once the lagging one stored it
+int resync_copy(int from, int to, const char *type, const struct resync_file *file)
+{
+    char frame[BUFFER_SIZE], reply[BUFFER_SIZE];
+    const char *name = strrchr(file->path, '/');
+    int from_socket, to_socket, length, stored = 0;
+
+    if (connect_registered(from, type, &from_socket) != 0)
+    {
+        return -1;
+    }
+    if (connect_registered(to, type, &to_socket) != 0)
+    {
+        close(from_socket);
+        return -1;
+    }
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "dfile ~smain/%s", file->path);
+    send_frame(from_socket, frame);
+    if ((length = recv_download_status(from_socket)) != 1)
+    {
+        // A file deleted on the way needs no copy, the deletion reached the lagging replica as well
+        close(from_socket);
+        close(to_socket);
+        return length == 0 ? 0 : -1;
+    }
+
+    // The frame a client upload passes on: "ufile <name> <directory> <size>"
+    memset(frame, 0, sizeof(frame));
+    if (name == NULL)
+    {
+        snprintf(frame, sizeof(frame), "ufile %s ~smain %lld", file->path, file->size);
+    }
+    else
+    {
+        snprintf(frame, sizeof(frame), "ufile %s ~smain/%.*s %lld", name + 1, (int)(name - file->path), file->path, file->size);
+    }
+    send_frame(to_socket, frame);
+
+    relay_chunks(from_socket, to_socket, NULL, NULL);
+    if ((length = recv(to_socket, reply, sizeof(reply) - 1, 0)) > 0)
+    {
+        reply[length] = '\0';
+        stored = strstr(reply, "uploaded") != NULL;
+    }
+    close(from_socket);
+    close(to_socket);
+    return stored ? 0 : -1;
+}
+
+// Function to delete one file from a lagging replica, returns 0 once it is gone
+int resync_remove(int slot, const char *type, const struct resync_file *file)
+{
+    char frame[BUFFER_SIZE], reply[BUFFER_SIZE];
+    int backend_socket, removed = 0, failed = 1;
+
+    if (connect_registered(slot, type, &backend_socket) != 0)
+    {
+        return -1;
+    }
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "rmfile ~smain/%s", file->path);
+    if (send_frame(backend_socket, frame) == BUFFER_SIZE && recv_all(backend_socket, reply, BUFFER_SIZE) == 0)
+    {
+        reply[BUFFER_SIZE - 1] = '\0';
+        sscanf(reply, "removed %d failed %d", &removed, &failed);
+    }
+    close(backend_socket);
+    return failed == 0 ? 0 : -1;
+}
+
+// Function run by the thread that brings a lagging replica up to date from one in sync: files it lacks or holds in
+// another version are copied over, files it still holds that were deleted while it missed writes are removed.
+// A replica that only joined keeps what it holds newer than the copy in sync and what the other lacks, as there
+// is no telling which side is behind. It serves reads again once a whole pass went through without it missing a write
+void *resync_backend_thread(void *argument)
+{
+    int slot = (int)(intptr_t)argument, source = -1, copied = 0, removed = 0, failed = 0;
+    struct backend_entry *target = &shared_state->backends[slot];
+    struct resync_file *want = NULL, *have = NULL;
+    long want_count = 0, have_count = 0, i = 0, j = 0;
+    char type[8], *want_text = NULL, *have_text = NULL;
+    time_t now = time(NULL), since;
+    unsigned long missed;
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    snprintf(type, sizeof(type), "%s", target->type);
+    missed = target->missed_writes;
+    since = target->lagging_since;
+    for (int k = 0; k < MAX_BACKENDS && source < 0; k++)
+    {
+        struct backend_entry *entry = &shared_state->backends[k];
+        if (k != slot && !entry->lagging && strcmp(entry->type, type) == 0 && backend_healthy(entry, now))
+        {
+            source = k;
+        }
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    if (source < 0)
+    {
+        // Nothing to copy from yet, the next heartbeat tries again
+        __atomic_store_n(&target->resync_active, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    printf("Resyncing %s backend %s:%d from %s:%d\n", type, target->address, target->port,
+           shared_state->backends[source].address, shared_state->backends[source].port);
+    if ((want_text = resync_manifest(source, type, &want, &want_count)) == NULL ||
+        (have_text = resync_manifest(slot, type, &have, &have_count)) == NULL)
+    {
+        failed = 1;
+    }
+    while (!failed && (i < want_count || j < have_count))
+    {
+        int order = i == want_count ? 1 : j == have_count ? -1 : strcmp(want[i].path, have[j].path);
+
+        if (order < 0)
+        {
+            failed |= resync_copy(source, slot, type, &want[i]) != 0;
+            copied++;
+            i++;
+        }
+        else if (order > 0)
+        {
+            if (since != 0 && have[j].mtime < since)
+            {
+                failed |= resync_remove(slot, type, &have[j]) != 0;
+                removed++;
+            }
+            j++;
+        }
+        else
+        {
+            int differs = want[i].size != have[j].size ||
+                          (strcmp(want[i].checksum, "-") != 0 && strcmp(have[j].checksum, "-") != 0 &&
+                           strcmp(want[i].checksum, have[j].checksum) != 0);
+
+            if (differs && (since != 0 || want[i].mtime >= have[j].mtime))
+            {
+                failed |= resync_copy(source, slot, type, &want[i]) != 0;
+                copied++;
+            }
+            i++;
+            j++;
+        }
+        __atomic_store_n(&target->resync_active, time(NULL), __ATOMIC_RELEASE);
+    }
+    free(want);
+    free(have);
+    free(want_text);
+    free(have_text);
+
+    // A pass that failed waits RESYNC_TIMEOUT for the next one instead of starting over with every heartbeat
+    pthread_mutex_lock(&shared_state->registry_lock);
+    if (!failed && target->missed_writes == missed)
+    {
+        target->lagging = 0;
+        target->lagging_since = 0;
+    }
+    target->resync_active = failed ? time(NULL) : 0;
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    printf("Resync of %s backend %s:%d %s, %d files copied, %d removed\n", type, target->address, target->port,
+           failed ? "failed" : target->lagging ? "missed a write meanwhile" : "done", copied, removed);
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to resync a lagging replica on a thread of its own when its heartbeat arrives, one pass at a time.
+// A pass whose worker went away is started again once it made no progress for RESYNC_TIMEOUT
+void resync_backend_later(int slot)
+{
+    struct backend_entry *entry = &shared_state->backends[slot];
+    time_t now = time(NULL);
+    pthread_t thread;
+    int start;
+
+    pthread_mutex_lock(&shared_state->registry_lock);
+    start = entry->lagging && (entry->resync_active == 0 || now - entry->resync_active >= RESYNC_TIMEOUT);
+    if (start)
+    {
+        entry->resync_active = now;
+    }
+    pthread_mutex_unlock(&shared_state->registry_lock);
+    if (!start)
+    {
+        return;
+    }
+    if (pthread_create(&thread, NULL, resync_backend_thread, (void *)(intptr_t)slot) != 0)
+    {
+        __atomic_store_n(&entry->resync_active, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Function to stop trusting misses of a store while a glob or directory is moved or copied into it, as the files
+// that arrive are only known once negative_filter_resume() learned the target
+void negative_filter_pause(const char *type)
+{
+    int store = negative_filter_store(type);
+
+    if (negative_filter != NULL && store >= 0)
+    {
+        __atomic_add_fetch(&negative_filter->learning[store], 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+// Function to learn what a relocation put below its target, then trust misses again. When the target cannot be
+// learned the store's paths are loaded afresh, misses are not trusted until then
+void negative_filter_resume(const char *type, const char *target)
+{
+    int store = negative_filter_store(type);
+
+    if (negative_filter == NULL || store < 0)
+    {
+        return;
+    }
+    if (negative_filter_learn(store, target) < 0)
+    {
+        __atomic_store_n(&negative_filter->ready[store], 0, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&negative_filter->learning[store], 1, __ATOMIC_ACQ_REL);
+}
+
+void manage_file_download(int client_socket, char *filename, char *command)
+{
+    char file_path[BUFFER_SIZE];        // Path to store the full file path
+    int file_descriptor;                // File descriptor for the file to be read
+    char response[BUFFER_SIZE];         // Buffer for sending responses to the client
+    struct pack_entry packed;           // Where the file is when it is packed
+    const char *type = strstr(filename, ".c") != NULL ? ".c" : strstr(filename, ".txt") != NULL ? ".txt" :
+                       strstr(filename, ".pdf") != NULL ? ".pdf" : NULL;
+
+    // A file the store never received gets the store's own reply without the store being asked
+    if (type != NULL && negative_filter_missing(type, filename))
+    {
+        printf("File %s is not stored (%lu answered by the negative lookup filter)\n", filename, negative_filter->fast_failures);
+        send_download_status(client_socket, 0);
+        snprintf(response, sizeof(response), "File %s not found\n", filename);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // check if the file contains a .c extension
+    if (strstr(filename, ".c") != NULL)
+    {
+        // Construct the full file path for the requested file
+        // Construct the full file path by appending the "smain" directory and the filename
+        // valid_home_dir() is assumed to return the home directory path
+        snprintf(file_path, sizeof(file_path), "%s/smain/%s", valid_home_dir(), filename);
+        printf("File: %s\n", file_path);
+
+        // A packed file is a range of its segment, anything else a loose file
+        if ((file_descriptor = pack_open_file(filename, &packed)) >= 0)
+        {
+            send_download_status(client_socket, 1);
+            send_range_chunks(client_socket, file_descriptor, packed.offset, packed.length, &packed.checksum, NULL);
+            close(file_descriptor);
+            snprintf(response, sizeof(response), "File %s downloaded successfully\n", filename);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+        file_descriptor = open(file_path, O_RDONLY); // attempts to open the file in realy only mode
+
+        // Check if the file was successfully opened, a missing file gets no data at all
+        if (file_descriptor < 0)
+        {
+            perror("Error opening file");
+            send_download_status(client_socket, 0);
+            snprintf(response, sizeof(response), "File %s not found\n", filename);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+
+        // Read the file data and send it to the client as adaptive chunks ending with the end-of-file chunk
+        // The end-of-file chunk tells the client where the data stops, so no delay is needed before the status message
+        send_download_status(client_socket, 1);
+        send_file_chunks(client_socket, file_descriptor);
+        close(file_descriptor);
+
+        // Notify the client that the file was downloaded successfully
+        snprintf(response, sizeof(response), "File %s downloaded successfully\n", filename);
+        send(client_socket, response, strlen(response), 0);
+    }
+
+    // Handling .txt and .pdf files by fetching from Spdf or Stext server
+    else if (strstr(filename, ".txt") != NULL)
+    {
+        serve_backend_download(client_socket, filename, command, ".txt");
+    }
+    // checking for the filename containing .pdf extension
+    else if (strstr(filename, ".pdf") != NULL)
+    {
+        serve_backend_download(client_socket, filename, command, ".pdf");
+    }
+    else
+    {
+        send_download_status(client_socket, 0);
+        snprintf(response, sizeof(response), "File type %s is not supported.\n", filename);
+        send(client_socket, response, strlen(response), 0);
+    }
+}
+
+
+// Function to describe one stored file as "<size> <mtime seconds> <mtime nanoseconds> <crc32c or ->" or "missing"
+void stat_stored_file(const char *file_path, char *line, size_t size)
+{
+    char checksum_text[16] = "-";           // Stored CRC32C, "-" when the file has none
+    struct stat file_info;
+    uint32_t checksum;
+    int file_descriptor = open(file_path, O_RDONLY);
+
+    if (file_descriptor >= 0 && fstat(file_descriptor, &file_info) == 0 && S_ISREG(file_info.st_mode))
+    {
+        if (load_stored_checksum(file_descriptor, &checksum) == 0)
+        {
+            snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+        }
+        snprintf(line, size, "%lld %lld %ld %s\n", (long long)file_info.st_size,
+                 (long long)file_info.st_mtim.tv_sec, file_info.st_mtim.tv_nsec, checksum_text);
+    }
+    else
+    {
+        snprintf(line, size, "missing\n");
+    }
+    if (file_descriptor >= 0)
+    {
+        close(file_descriptor);
+    }
+}
+
+// Function to describe a packed file like stat_stored_file(), returns -1 when the file is not packed
+int pack_stat_file(const char *path, char *line, size_t size)
+{
+    struct pack_entry packed;
+
+    if (pack_lookup(path, &packed) != 0)
+    {
+        return -1;
+    }
+    snprintf(line, size, "%u %lld %lld %08x\n", packed.length, (long long)(packed.mtime_ns / 1000000000LL),
+             (long long)(packed.mtime_ns % 1000000000LL), packed.checksum);
+    return 0;
+}
+
+// Manifest lines collected into chunks before they are sent
+struct manifest_stream
+{
+    int sock;
+    char *buffer;                       // Pool buffer the lines are collected in
+    size_t capacity;
+    size_t used;
+    uint32_t checksum;                  // CRC32C of every byte sent, for the stream's trailer
+    long entries;                       // Files listed
+    int failed;                         // Sending failed, the rest of the walk is skipped
+};
+
+// Function to send the lines collected so far as one chunk
+void manifest_flush(struct manifest_stream *stream)
+{
+    if (stream->used > 0 && !stream->failed)
+    {
+        stream->checksum = crc32c_update(stream->checksum, stream->buffer, stream->used);
+        stream->failed = send_chunk(stream->sock, stream->buffer, stream->used) != 0;
+    }
+    stream->used = 0;
+}
+
+// Function to add whole lines to the manifest, sending a chunk first when they do not fit
+void manifest_add(struct manifest_stream *stream, const char *lines, size_t length)
+{
+    if (stream->used + length > stream->capacity)
+    {
+        manifest_flush(stream);
+    }
+    if (length > stream->capacity)
+    {
+        stream->checksum = crc32c_update(stream->checksum, lines, length);
+        stream->failed |= send_chunk(stream->sock, lines, length) != 0;
+        return;
+    }
+    memcpy(stream->buffer + stream->used, lines, length);
+    stream->used += length;
+}
+
+// Function to list every stored file of one type below an open directory as "<path> <size> <mtime> <crc32c or ->"
+// Paths are relative to the directory the manifest was asked for; the directory descriptor is consumed
+void manifest_walk(struct manifest_stream *stream, int directory_fd, const char *relative, const char *extension)
+{
+    DIR *directory = fdopendir(directory_fd);
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+
+    if (directory == NULL)
+    {
+        close(directory_fd);
+        return;
+    }
+    while (!stream->failed && (entry = readdir(directory)) != NULL)
+    {
+        char path[BUFFER_SIZE], line[BUFFER_SIZE + 64], checksum_text[16] = "-";
+        size_t name_length = strlen(entry->d_name);
+        struct stat file_info;
+        uint32_t checksum;
+        int child_fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+        if (entry->d_type == DT_DIR)
+        {
+            if ((child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0)
+            {
+                manifest_walk(stream, child_fd, path, extension);
+            }
+            continue;
+        }
+        if (name_length <= extension_length || strcmp(entry->d_name + name_length - extension_length, extension) != 0 ||
+            (child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW)) < 0)
+        {
+            continue;
+        }
+        if (fstat(child_fd, &file_info) == 0 && S_ISREG(file_info.st_mode))
+        {
+            if (load_stored_checksum(child_fd, &checksum) == 0)
+            {
+                snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+            }
+            manifest_add(stream, line, snprintf(line, sizeof(line), "%s %lld %lld %s\n", path, (long long)file_info.st_size,
+                                                (long long)file_info.st_mtim.tv_sec, checksum_text));
+            stream->entries++;
+        }
+        close(child_fd);
+    }
+    closedir(directory);
+}
+
+// Function to list the packed files of one type below a directory like manifest_walk() does for loose files
+void manifest_add_packed(struct manifest_stream *stream, const char *directory, const char *extension)
+{
+    char line[PACK_PATH_MAX + 64];
+    size_t extension_length = strlen(extension), skip;
+    struct pack_entry *listing;
+    int count = pack_list(directory, &listing, &skip);
+
+    for (int i = 0; i < count && !stream->failed; i++)
+    {
+        size_t path_length = strlen(listing[i].path);
+
+        if (path_length > extension_length && strcmp(listing[i].path + path_length - extension_length, extension) == 0)
+        {
+            manifest_add(stream, line, snprintf(line, sizeof(line), "%s %u %lld %08x\n", listing[i].path + skip, listing[i].length,
+                                                (long long)(listing[i].mtime_ns / 1000000000LL), listing[i].checksum));
+            stream->entries++;
+        }
+    }
+    free(listing);
+}
+
+// Function to describe every path of a stat that belongs to one backend store with a single request
+// The backend answers one line per path in the order asked; paths stay "unavailable" if it cannot be reached
+void stat_on_backend(const char *type, char **paths, int count, char results[][STAT_LINE_MAX])
+{
+    char frame[BUFFER_SIZE], reply[STAT_MAX_PATHS * STAT_LINE_MAX];
+    char *save, *line;
+    int batch[STAT_MAX_PATHS], batch_count = 0, backend_socket, slot;
+    size_t used;
+
+    memset(frame, 0, sizeof(frame));
+    used = snprintf(frame, sizeof(frame), "stat");
+    for (int i = 0; i < count; i++)
+    {
+        if (route_by_type(paths[i]) != NULL && strcmp(route_by_type(paths[i]), type) == 0)
+        {
+            used += snprintf(frame + used, sizeof(frame) - used, " %s", paths[i]);
+            batch[batch_count++] = i;
+        }
+    }
+    if (batch_count == 0 || (slot = connect_backend(type, &backend_socket)) < 0)
+    {
+        return;
+    }
+    if (send_frame(backend_socket, frame) == BUFFER_SIZE && recv_lines(backend_socket, reply, sizeof(reply), batch_count) >= 0)
+    {
+        line = strtok_r(reply, "\n", &save);
+        for (int i = 0; i < batch_count && line != NULL; i++, line = strtok_r(NULL, "\n", &save))
+        {
+            snprintf(results[batch[i]], STAT_LINE_MAX, "%s\n", line);
+        }
+    }
+    close(backend_socket);
+    release_backend(slot);
+}
+
+// Function to look up one stored .txt/.pdf file on its backend, returns 0 with its size and checksum when it exists
+int stat_backend_file(const char *type, const char *path, long long *size, uint32_t *checksum)
+{
+    char results[1][STAT_LINE_MAX] = {"unavailable\n"};
+    char *paths[1] = {(char *)path};
+    long long found_size;
+    unsigned int found_checksum = 0;
+
+    stat_on_backend(type, paths, 1, results);
+    if (sscanf(results[0], "%lld %*d %*d %x", &found_size, &found_checksum) < 1)
+    {
+        return -1;
+    }
+    if (size != NULL)
+    {
+        *size = found_size;
+        *checksum = found_checksum;
+    }
+    return 0;
+}
+
+// Function to answer "stat <file>..." with the size, modification time and stored checksum of every file, no data is moved
+// One file gets the single line "<size> <mtime seconds> <mtime nanoseconds> <crc32c or ->" or "missing", which clients
+// use to size a striped download and to verify it afterwards. Several files get a chunk stream of "<file> <line>" lines
+// in the order asked, then a status message; .c files are looked up here and Spdf/Stext get one request each
+void handle_file_stat(int client_socket, char *command)
+{
+    char arguments[BUFFER_SIZE], file_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    char results[STAT_MAX_PATHS][STAT_LINE_MAX];
+    char *paths[STAT_MAX_PATHS], *save, *token, *listing;
+    int count = 0, found = 0, missing = 0;
+    size_t used = 0;
+
+    snprintf(arguments, sizeof(arguments), "%s", command + strlen("stat"));
+    for (token = strtok_r(arguments, " ", &save); token != NULL && count < STAT_MAX_PATHS; token = strtok_r(NULL, " ", &save))
+    {
+        const char *type = route_by_type(token);
+
+        snprintf(results[count], STAT_LINE_MAX, "%s", type == NULL ? "missing\n" : "unavailable\n");
+        if (type != NULL && strcmp(type, ".c") == 0)
+        {
+            snprintf(file_path, sizeof(file_path), "%s/smain/%s", valid_home_dir(), token);
+            if (pack_stat_file(token, results[count], STAT_LINE_MAX) != 0)
+            {
+                stat_stored_file(file_path, results[count], STAT_LINE_MAX);
+            }
+        }
+        paths[count++] = token;
+    }
+    stat_on_backend(".txt", paths, count, results);
+    stat_on_backend(".pdf", paths, count, results);
+
+    if (count <= 1)
+    {
+        snprintf(response, sizeof(response), "%s", count == 1 ? results[0] : "missing\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    listing = malloc(sizeof(arguments) + sizeof(results));
+    for (int i = 0; listing != NULL && i < count; i++)
+    {
+        used += snprintf(listing + used, sizeof(arguments) + sizeof(results) - used, "%s %s", paths[i], results[i]);
+        found += isdigit((unsigned char)results[i][0]) != 0;
+        missing += strcmp(results[i], "missing\n") == 0;
+    }
+    if (listing == NULL || send_chunk(client_socket, listing, used) != 0)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(response, sizeof(response), "stat failed\n");
+    }
+    else
+    {
+        send_end_of_file(client_socket, crc32c_update(0, listing, used));
+        snprintf(response, sizeof(response), "stat of %d files: %d found, %d missing, %d unavailable\n", count, found, missing, count - found - missing);
+    }
+    send(client_socket, response, strlen(response), 0);
+    free(listing);
+}
+
+// Function to pass one backend's manifest on inside the client's stream, returns 0 once its trailer verified
+int manifest_merge(struct manifest_stream *stream, int backend_socket)
+{
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    char status[BUFFER_SIZE];
+    uint32_t checksum = 0, trailer;
+    long length = -1, entries = 0;
+
+    manifest_flush(stream);
+    while (buffer != NULL && (length = recv_chunk(backend_socket, &buffer, &capacity)) > 0)
+    {
+        checksum = crc32c_update(checksum, buffer, length);
+        stream->checksum = crc32c_update(stream->checksum, buffer, length);
+        stream->failed |= send_chunk(stream->sock, buffer, length) != 0;
+    }
+    pool_release(buffer, capacity);
+    if (length != 0 || recv_all(backend_socket, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != checksum ||
+        recv_line(backend_socket, status, sizeof(status)) != 0 || sscanf(status, "manifest %ld files", &entries) != 1)
+    {
+        return -1;
+    }
+    stream->entries += entries;
+    return 0;
+}
+
+// Function to handle "manifest <directory>": every stored .c, .txt and .pdf file below the directory as one chunk
+// stream of "<path> <size> <mtime> <crc32c or ->" lines, paths relative to the directory, then a status message
+// Spdf and Stext get the request first and walk their stores while Smain walks its own, so usync compares a whole
+// tree against its local copy with one round trip instead of one stat per file
+void handle_manifest(int client_socket, char *directory)
+{
+    static const char *backend_types[] = {".pdf", ".txt"};
+    struct manifest_stream stream = {client_socket, NULL, POOL_MAX_CHUNK / 4, 0, 0, 0, 0};
+    int backend_sockets[2], slots[2];
+    char frame[BUFFER_SIZE], path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    const char *missing = NULL;
+    int directory_fd;
+
+    if (strstr(directory, "..") != NULL || strncmp(directory, "~smain", strlen("~smain")) != 0)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(response, sizeof(response), "Invalid directory %s\n", directory);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "manifest %s", directory);
+    for (int i = 0; i < 2; i++)
+    {
+        if ((slots[i] = connect_backend(backend_types[i], &backend_sockets[i])) >= 0 &&
+            send_frame(backend_sockets[i], frame) != BUFFER_SIZE)
+        {
+            close(backend_sockets[i]);
+            release_backend(slots[i]);
+            slots[i] = -1;
+        }
+    }
+
+    stream.buffer = pool_acquire(&stream.capacity);
+    snprintf(path, sizeof(path), "%s/smain/%s", valid_home_dir(), directory);
+    if (stream.buffer != NULL && (directory_fd = open(path, O_RDONLY | O_DIRECTORY)) >= 0)
+    {
+        manifest_walk(&stream, directory_fd, "", ".c");
+    }
+    if (stream.buffer != NULL)
+    {
+        manifest_add_packed(&stream, directory, ".c");
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (slots[i] < 0 || stream.buffer == NULL || manifest_merge(&stream, backend_sockets[i]) != 0)
+        {
+            missing = backend_types[i];
+        }
+        if (slots[i] >= 0)
+        {
+            close(backend_sockets[i]);
+            release_backend(slots[i]);
+        }
+    }
+    manifest_flush(&stream);
+    if (stream.buffer == NULL)
+    {
+        stream.failed = 1;
+    }
+    pool_release(stream.buffer, stream.capacity);
+
+    // A client must not delete extras from a partial manifest, so an incomplete one never verifies
+    send_end_of_file(client_socket, stream.failed || missing != NULL ? ~stream.checksum : stream.checksum);
+    if (missing != NULL)
+    {
+        snprintf(response, sizeof(response), "manifest incomplete, no %s server is available\n", missing);
+    }
+    else
+    {
+        snprintf(response, sizeof(response), "manifest %ld files\n", stream.entries);
+    }
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "subscribe <path>": keep the connection open and stream every change below the path as it happens
+// Events are lines "<sequence> <created|modified|deleted|deleted-tree> <path> <size> <crc32c>" (size and checksum "-"
+// for deletions) sent as chunks. Every subscriber reads the shared feed from its own position, so its backlog is at
+// most FEED_SLOTS events; one that falls further behind gets "<sequence> overflow <lost events>" and should resync,
+// for example with usync. The client ends the stream with an "unsubscribe" frame and the connection carries on;
+// any other frame on a subscribed connection drops it.
+// Returns 0 when the connection stays open for the next command, -1 once the client has gone
+int handle_subscribe(int client_socket, const char *path)
+{
+    static const char *kinds[] = {"created", "modified", "deleted", "deleted-tree"};
+    char *batch = malloc(FEED_BATCH), frame[BUFFER_SIZE], response[BUFFER_SIZE];
+    unsigned long long cursor;
+    size_t path_length = strlen(path), used = 0;
+    uint32_t checksum = 0;
+    long events = 0;
+    int state = 1;                      // 1 while subscribed, 0 after "unsubscribe", -1 once the client is gone
+
+    if (batch == NULL || strstr(path, "..") != NULL || strncmp(path, "~smain", strlen("~smain")) != 0)
+    {
+        send_end_of_file(client_socket, 1);
+        snprintf(response, sizeof(response), "Invalid path %s\n", path);
+        send(client_socket, response, strlen(response), 0);
+        free(batch);
+        return 0;
+    }
+    while (path_length > strlen("~smain") && path[path_length - 1] == '/')
+    {
+        path_length--;
+    }
+
+    pthread_mutex_lock(&shared_state->feed_lock);
+    cursor = shared_state->feed_head;
+    shared_state->feed_subscribers++;
+    pthread_mutex_unlock(&shared_state->feed_lock);
+    printf("Client subscribed to changes below %.*s\n", (int)path_length, path);
+
+    while (state == 1)
+    {
+        struct pollfd client = {client_socket, POLLIN, 0};
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += FEED_WAIT_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_lock(&shared_state->feed_lock);
+        while (cursor == shared_state->feed_head &&
+               pthread_cond_timedwait(&shared_state->feed_changed, &shared_state->feed_lock, &deadline) == 0)
+        {
+        }
+        if (shared_state->feed_head - cursor > FEED_SLOTS)
+        {
+            used += snprintf(batch + used, FEED_BATCH - used, "%llu overflow %llu\n", cursor,
+                             shared_state->feed_head - FEED_SLOTS - cursor);
+            cursor = shared_state->feed_head - FEED_SLOTS;
+        }
+        for (; cursor < shared_state->feed_head && used + FEED_PATH_MAX + 96 < FEED_BATCH; cursor++)
+        {
+            const struct change_event *event = &shared_state->feed[cursor % FEED_SLOTS];
+
+            if (strncmp(event->path, path, path_length) != 0 || (event->path[path_length] != '/' && event->path[path_length] != '\0'))
+            {
+                continue;
+            }
+            events++;
+            if (event->size < 0)
+            {
+                used += snprintf(batch + used, FEED_BATCH - used, "%llu %s %s - -\n", event->sequence, kinds[event->kind], event->path);
+            }
+            else
+            {
+                used += snprintf(batch + used, FEED_BATCH - used, "%llu %s %s %lld %08x\n", event->sequence, kinds[event->kind],
+                                 event->path, event->size, event->checksum);
+            }
+        }
+        pthread_mutex_unlock(&shared_state->feed_lock);
+
+        if (used > 0)
+        {
+            checksum = crc32c_update(checksum, batch, used);
+            state = send_chunk(client_socket, batch, used) == 0 ? 1 : -1;
+            used = 0;
+        }
+        if (state == 1 && poll(&client, 1, 0) > 0)
+        {
+            state = recv(client_socket, frame, BUFFER_SIZE, MSG_WAITALL) == BUFFER_SIZE && strncmp(frame, "unsubscribe", 11) == 0 ? 0 : -1;
+        }
+    }
+
+    pthread_mutex_lock(&shared_state->feed_lock);
+    shared_state->feed_subscribers--;
+    pthread_mutex_unlock(&shared_state->feed_lock);
+    free(batch);
+    if (state < 0)
+    {
+        return -1;
+    }
+    send_end_of_file(client_socket, checksum);
+    snprintf(response, sizeof(response), "Subscription to %.*s ended after %ld changes\n", (int)path_length, path, events);
+    send(client_socket, response, strlen(response), 0);
+    return 0;
+}
+
+// Function to answer "drange <file> <offset> <length>" with one stripe of a file as a chunk stream
+// Each stripe of a striped download arrives on its own client connection, so every stripe gets its own Smain
+// worker and, for .txt/.pdf files, its own backend process reading the range with pread()
+void handle_file_range(int client_socket, char *filename, char *command)
+{
+    long long offset = 0, length = 0;
+    const char *type = NULL;
+
+    if (sscanf(command, "%*s %*s %lld %lld", &offset, &length) != 2 || offset < 0 || length < 0)
+    {
+        send_end_of_file(client_socket, 1); // An empty stream with a wrong checksum makes the stripe fail
+        return;
+    }
+    if (strstr(filename, ".c") != NULL)
+    {
+        char file_path[BUFFER_SIZE];
+        struct pack_entry packed;
+        int file_descriptor;
+
+        snprintf(file_path, sizeof(file_path), "%s/smain/%s", valid_home_dir(), filename);
+        if ((file_descriptor = pack_open_file(filename, &packed)) >= 0)
+        {
+            // The range is clipped to the packed file, reading on would return the next record of the segment
+            offset = offset < packed.length ? offset : packed.length;
+            length = length < packed.length - offset ? length : packed.length - offset;
+            offset += packed.offset;
+        }
+        else if ((file_descriptor = open(file_path, O_RDONLY)) < 0)
+        {
+            send_end_of_file(client_socket, 1);
+            return;
+        }
+        send_range_chunks(client_socket, file_descriptor, offset, length, NULL, NULL);
+        close(file_descriptor);
+        return;
+    }
+
+    if (strstr(filename, ".txt") != NULL)
+    {
+        type = ".txt";
+    }
+    else if (strstr(filename, ".pdf") != NULL)
+    {
+        type = ".pdf";
+    }
+
+    // Every stripe picks its replica on its own, so the stripes of one download spread over all replicas
+    int backend_socket;
+    int slot;
+
+    if (type != NULL && handoff_to_backend(client_socket, command, type) == 0)
+    {
+        return;
+    }
+    if (type == NULL || (slot = connect_backend(type, &backend_socket)) < 0)
+    {
+        send_end_of_file(client_socket, 1);
+        return;
+    }
+    if (send_frame(backend_socket, command) != BUFFER_SIZE ||
+        relay_chunks(backend_socket, client_socket, NULL, NULL) < 0)
+    {
+        fprintf(stderr, "Relaying range of %s failed\n", filename);
+    }
+    close(backend_socket);
+    release_backend(slot);
+}
+
+
+// Outcome of a batched rmfile in one store, sent back to Smain and merged into the reply for the client
+struct remove_summary
+{
+    int removed;                            // Files deleted
+    int failed;                             // Paths that could not be deleted
+    int listed;                             // Failures spelled out in failures[], at most RMFILE_MAX_REPORTED
+    char failures[RMFILE_REPORT_BYTES];     // One "path: reason" line per listed failure
+};
+
+// Function to count a path that could not be deleted, the first few are listed with their reason
+void remove_failure(struct remove_summary *summary, const char *path, const char *reason)
+{
+    size_t used = strlen(summary->failures);
+
+    summary->failed++;
+    if (summary->listed < RMFILE_MAX_REPORTED)
+    {
+        snprintf(summary->failures + used, sizeof(summary->failures) - used, "%s: %s\n", path, reason);
+        summary->listed++;
+    }
+}
+
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary);
+
+// Function to delete one directory entry relative to an open directory
+// unlinkat() is tried first, so a plain file costs one system call; directories are only removed with -r.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void remove_entry(int dir_fd, const char *name, const char *path, int recursive, int matched, struct remove_summary *summary)
+{
+    if (unlinkat(dir_fd, name, 0) == 0)
+    {
+        summary->removed++;
+        display_cache_invalidate(path);
+        feed_publish(FEED_DELETED, path, -1, 0);
+    }
+    else if (errno == EISDIR)
+    {
+        if (recursive)
+        {
+            remove_tree_at(dir_fd, name, path, summary);
+        }
+        else if (!matched)
+        {
+            remove_failure(summary, path, "Is a directory, use rmfile -r");
+        }
+    }
+    else if (errno != ENOENT || (!matched && !recursive))
+    {
+        remove_failure(summary, path, strerror(errno));
+    }
+}
+
+// Function to delete a directory with everything below it, working on directory file descriptors throughout
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary)
+{
+    char child_path[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory;
+    int dir_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+    if (dir_fd < 0 || (directory = fdopendir(dir_fd)) == NULL)
+    {
+        remove_failure(summary, path, strerror(errno));
+        if (dir_fd >= 0)
+        {
+            close(dir_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        remove_entry(dirfd(directory), entry->d_name, child_path, 1, 1, summary);
+    }
+    closedir(directory);
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    {
+        remove_failure(summary, path, strerror(errno));
+    }
+    display_cache_invalidate(path);
+}
+
+// Function to delete the packed files an rmfile path names: the file itself, the files matching a glob in the last
+// path component and, with -r, everything below a matching directory. Returns the number of files removed
+int pack_remove_pattern(const char *pattern, int recursive, struct remove_summary *summary)
+{
+    char directory[BUFFER_SIZE], component[PACK_PATH_MAX];
+    const char *name = strrchr(pattern, '/');
+    struct pack_entry *listing;
+    size_t skip;
+    int count, removed = 0;
+
+    // A plain file name is one hash lookup, only globs and trees need a pass over the index
+    if (pack_remove(pattern) == 0)
+    {
+        summary->removed++;
+        feed_publish(FEED_DELETED, pattern, -1, 0);
+        return 1;
+    }
+    if (strpbrk(pattern, "*?[") == NULL && !recursive)
+    {
+        return 0;
+    }
+    snprintf(directory, sizeof(directory), "%.*s", name != NULL ? (int)(name - pattern) : 0, pattern);
+    name = name != NULL ? name + 1 : pattern;
+    count = pack_list(directory, &listing, &skip);
+    for (int i = 0; i < count; i++)
+    {
+        const char *rest = listing[i].path + skip;
+        const char *slash = strchr(rest, '/');
+
+        snprintf(component, sizeof(component), "%.*s", slash != NULL ? (int)(slash - rest) : (int)strlen(rest), rest);
+        if ((slash == NULL || recursive) && fnmatch(name, component, FNM_PERIOD) == 0 && pack_remove(listing[i].path) == 0)
+        {
+            summary->removed++;
+            feed_publish(FEED_DELETED, listing[i].path, -1, 0);
+            removed++;
+        }
+    }
+    free(listing);
+    return removed;
+}
+
+// Function to tell whether a path climbs out of the store with a ".." component
+int path_leaves_store(const char *path)
+{
+    size_t length = strlen(path);
+
+    return strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 || strstr(path, "/../") != NULL ||
+           (length >= 3 && strcmp(path + length - 3, "/..") == 0);
+}
+
+// Function to delete what one rmfile path names inside a store: a file, a glob in the last path component,
+// or with -r a directory tree. Paths that climb out of the store are refused
+void remove_pattern(const char *store_root, const char *pattern, int recursive, struct remove_summary *summary)
+{
+    char directory[BUFFER_SIZE], child_path[BUFFER_SIZE];
+    const char *name = strrchr(pattern, '/');
+    struct dirent *entry;
+    DIR *listing;
+    int dir_fd, packed;
+
+    if (path_leaves_store(pattern))
+    {
+        remove_failure(summary, pattern, "Path leaves the store");
+        return;
+    }
+    packed = pack_remove_pattern(pattern, recursive, summary);
+    snprintf(directory, sizeof(directory), "%s/%.*s", store_root, name != NULL ? (int)(name - pattern) : 0, pattern);
+    name = name != NULL ? name + 1 : pattern;
+    if ((dir_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        // A glob or tree that has nothing in this store is not an error, the other stores may hold its files
+        if (errno != ENOENT || (strpbrk(name, "*?[") == NULL && !recursive && packed == 0))
+        {
+            remove_failure(summary, pattern, strerror(errno));
+        }
+        return;
+    }
+    if (strpbrk(name, "*?[") == NULL)
+    {
+        // Once the pack held the file, a loose file of that name is not expected any more
+        remove_entry(dir_fd, name, pattern, recursive, packed > 0, summary);
+        close(dir_fd);
+        return;
+    }
+    if ((listing = fdopendir(dir_fd)) == NULL)
+    {
+        remove_failure(summary, pattern, strerror(errno));
+        close(dir_fd);
+        return;
+    }
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fnmatch(name, entry->d_name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%.*s%s", (int)(name - pattern), pattern, entry->d_name);
+        remove_entry(dirfd(listing), entry->d_name, child_path, recursive, 1, summary);
+    }
+    closedir(listing);
+}
+
+// Function to carry out the arguments of a batched rmfile in one store: "-r" and any number of paths or globs
+// Returns the number of paths handled
+int remove_batch(const char *store_dir, const char *arguments, struct remove_summary *summary)
+{
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *patterns[BUFFER_SIZE / 2], *save, *token;
+    int count = 0, recursive = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-r") == 0)
+        {
+            recursive = 1;
+        }
+        else
+        {
+            while (strlen(token) > 1 && token[strlen(token) - 1] == '/')
+            {
+                token[strlen(token) - 1] = '\0'; // "dir/" names the same directory as "dir"
+            }
+            patterns[count++] = token;
+        }
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    for (int i = 0; i < count; i++)
+    {
+        remove_pattern(store_root, patterns[i], recursive, summary);
+    }
+    return count;
+}
+
+// Function to tell which store a path belongs to from its file type, NULL for directories and
+// rmfile globs without a type, which concern every store
+const char *route_by_type(const char *pattern)
+{
+    static const char *types[] = {".c", ".txt", ".pdf"};
+    size_t length = strlen(pattern);
+
+    for (int i = 0; i < 3; i++)
+    {
+        size_t type_length = strlen(types[i]);
+        if (length > type_length && strcmp(pattern + length - type_length, types[i]) == 0)
+        {
+            return types[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to merge a backend's rmfile, mvfile or cpfile reply frame into the summary for the client
+void remove_merge(struct remove_summary *summary, const char *reply)
+{
+    const char *line = strchr(reply, '\n');
+    int removed = 0, failed = 0;
+
+    if (sscanf(reply, "%*s %d failed %d", &removed, &failed) != 2)
+    {
+        remove_failure(summary, "rmfile", "Unexpected reply from a backend");
+        return;
+    }
+    summary->removed += removed;
+    summary->failed += failed;
+    while (line != NULL && line[1] != '\0' && summary->listed < RMFILE_MAX_REPORTED)
+    {
+        const char *end = strchr(line + 1, '\n');
+        size_t used = strlen(summary->failures);
+
+        if (end == NULL)
+        {
+            break;
+        }
+        snprintf(summary->failures + used, sizeof(summary->failures) - used, "%.*s", (int)(end - line), line + 1);
+        summary->listed++;
+        line = end;
+    }
+}
+
+// Function to send one batched rmfile, mvfile or cpfile to every replica of a backend type and merge the first
+// replica's reply
+void batch_on_backends(const char *type, const char *command, const char *arguments, struct remove_summary *summary)
+{
+    char frame[BUFFER_SIZE], reply[BUFFER_SIZE], replica_reply[BUFFER_SIZE];
+    int sockets[MAX_BACKENDS + 1], slots[MAX_BACKENDS + 1];
+    int count, replied = 0;
+
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "%s%s", command, arguments);
+    count = connect_all_backends(type, sockets, slots);
+    for (int i = 0; i < count; i++)
+    {
+        send_frame(sockets[i], frame);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (recv_all(sockets[i], i == 0 ? reply : replica_reply, BUFFER_SIZE) == 0)
+        {
+            replied |= i == 0;
+        }
+        else if (i > 0)
+        {
+            fprintf(stderr, "Replica %d did not confirm %s\n", slots[i], command);
+            registry_write_failed(slots[i]);
+        }
+        close(sockets[i]);
+        release_backend(slots[i]);
+    }
+    if (replied)
+    {
+        reply[BUFFER_SIZE - 1] = '\0';
+        remove_merge(summary, reply);
+    }
+    else
+    {
+        remove_failure(summary, type, strcmp(type, ".pdf") == 0 ? "No Spdf server is available" : "No Stext server is available");
+    }
+}
+
+// Function to publish what an rmfile deleted on Spdf/Stext to the change feed; a backend only reports counts, so the
+// events carry the paths as given: a file, a glob, or with -r a directory that went with everything below it.
+// removed_by[] tells which stores (.c, .txt, .pdf) deleted anything, .c deletions were published file by file
+void announce_backend_removals(const char *arguments, const int *removed_by)
+{
+    char copy[BUFFER_SIZE], *save, *token;
+
+    if (!feed_subscribed())
+    {
+        return;
+    }
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        const char *route = route_by_type(token);
+
+        if (strcmp(token, "-r") == 0 || (route != NULL && (strcmp(route, ".c") == 0 ||
+                                                           !removed_by[strcmp(route, ".txt") == 0 ? 1 : 2])))
+        {
+            continue;
+        }
+        feed_publish(route == NULL && strpbrk(token, "*?[") == NULL ? FEED_DELETED_TREE : FEED_DELETED, token, -1, 0);
+    }
+}
+
+// Function run by the thread that compacts the pack in threaded mode
+void *pack_compact_thread(void *argument)
+{
+    (void)argument;
+    pack_compact();
+    return NULL;
+}
+
+// Function to compact the pack after files were removed: on a thread of its own in threaded mode, and in fork mode
+// in the worker itself once the reply is out, since a worker process may end before a thread of it could finish
+void pack_compact_later()
+{
+    pthread_t thread;
+
+    if (!pack_needs_compaction())
+    {
+        return;
+    }
+    if (task_pool.workers > 0 && pthread_create(&thread, NULL, pack_compact_thread, NULL) == 0)
+    {
+        pthread_detach(thread);
+        return;
+    }
+    pack_compact();
+}
+
+// Function to handle "rmfile [-r] path...": every path may be a file, a glob in its last component, or with -r a directory
+// The paths are split by store and every store gets a single batch: Smain deletes the .c files itself and sends one
+// request to each Spdf/Stext replica. The client gets one reply with the totals and the first failures.
+void remove_file(int client_socket, char *buffer)
+{
+    static const char *types[] = {".c", ".txt", ".pdf"};
+    char arguments[BUFFER_SIZE], batches[3][BUFFER_SIZE], response[BUFFER_SIZE];
+    char *save, *token, *single = NULL;
+    struct remove_summary summary;
+    int recursive = 0, patterns = 0, removed_by[3] = {0};
+
+    // "-r" applies to every path, wherever it stands
+    snprintf(arguments, sizeof(arguments), "%s", buffer + strlen("rmfile"));
+    for (token = strtok_r(arguments, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        recursive |= strcmp(token, "-r") == 0;
+    }
+
+    memset(&summary, 0, sizeof(summary));
+    memset(batches, 0, sizeof(batches));
+    for (int i = 0; i < 3 && recursive; i++)
+    {
+        snprintf(batches[i], sizeof(batches[i]), " -r");
+    }
+
+    snprintf(arguments, sizeof(arguments), "%s", buffer + strlen("rmfile"));
+    for (token = strtok_r(arguments, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        const char *route = route_by_type(token);
+        int glob = strpbrk(token, "*?[") != NULL;
+
+        if (strcmp(token, "-r") == 0)
+        {
+            continue;
+        }
+        patterns++;
+        single = patterns == 1 && route != NULL && !glob ? token : NULL;
+        if (route == NULL && !glob && !recursive)
+        {
+            remove_failure(&summary, token, "Is a directory, use rmfile -r");
+            continue;
+        }
+        if (route != NULL && !glob && negative_filter_missing(route, token))
+        {
+            remove_failure(&summary, token, strerror(ENOENT)); // Never stored, the store is not asked
+            continue;
+        }
+        if (route != NULL && !glob && strcmp(route, ".c") != 0)
+        {
+            cache_invalidate(token); // Drop the cached copy before the file goes away
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            size_t used = strlen(batches[i]);
+            if (route == NULL || strcmp(route, types[i]) == 0)
+            {
+                snprintf(batches[i] + used, sizeof(batches[i]) - used, " %s", token);
+            }
+        }
+    }
+
+    if (patterns == 0)
+    {
+        snprintf(response, sizeof(response), "Usage: rmfile [-r] filepath_in_smain...\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (strlen(batches[i]) <= (recursive ? 3 : 0))
+        {
+            continue; // No path for this store
+        }
+        if (i == 0)
+        {
+            remove_batch("smain", batches[i], &summary);
+        }
+        else
+        {
+            int removed_before = summary.removed;
+
+            batch_on_backends(types[i], "rmfile", batches[i], &summary);
+            removed_by[i] = summary.removed > removed_before;
+        }
+    }
+    if (removed_by[1] || removed_by[2])
+    {
+        announce_backend_removals(buffer + strlen("rmfile"), removed_by);
+    }
+
+    // A single named file keeps the short reply rmfile always had
+    if (single != NULL && summary.removed == 1 && summary.failed == 0)
+    {
+        negative_filter_forget(route_by_type(single), single);
+        snprintf(response, sizeof(response), "File %s deleted successfully.\n", single);
+    }
+    else
+    {
+        snprintf(response, sizeof(response), "Removed %d files, %d failed\n%s%s", summary.removed, summary.failed,
+                 summary.failures, summary.failed > summary.listed ? "...\n" : "");
+    }
+    send(client_socket, response, strlen(response), 0);
+    pack_compact_later();
+}
+
+
+// One mvfile or cpfile carried out inside a store, summed up like an rmfile: summary->removed counts the entries
+// moved or copied, a directory moved in one rename counting once
+struct relocation
+{
+    const char *store_root;             // Store directory the paths are relative to
+    const char *extension;              // Type of file the store holds, ".c", ".txt" or ".pdf"
+    int move;                           // mvfile when set, cpfile otherwise
+    int recursive;                      // cpfile -r: directories are copied with everything below them
+    struct remove_summary *summary;
+};
+
+// Function to copy one file inside a store without its data passing through this process: FICLONE shares the data
+// blocks on filesystems with reflinks (Btrfs, XFS), copy_file_range() copies in the kernel everywhere else.
+// The copy is built next to the target and renamed over it, and it keeps the source's stored checksum
+// Returns 0, or -1 with errno set
+int copy_file_at(int from_dir, const char *from_name, int to_dir, const char *to_name)
+{
+    char temp_name[BUFFER_SIZE];
+    struct stat info;
+    uint32_t checksum;
+    int in, out = -1, result = -1, saved_errno;
+
+    snprintf(temp_name, sizeof(temp_name), ".%.200s.copy", to_name);
+    if ((in = openat(from_dir, from_name, O_RDONLY | O_NOFOLLOW)) >= 0 && fstat(in, &info) == 0 &&
+        (out = openat(to_dir, temp_name, O_WRONLY | O_CREAT | O_TRUNC, info.st_mode & 0777)) >= 0)
+    {
+        result = 0;
+        if (ioctl(out, FICLONE, in) != 0)
+        {
+            for (off_t left = info.st_size; left > 0; left -= result)
+            {
+                ssize_t copied = copy_file_range(in, NULL, out, NULL, left, 0);
+
+                if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    copied = sendfile(out, in, NULL, left); // Kernels without copy_file_range() still copy in the kernel
+                }
+                if (copied <= 0)
+                {
+                    result = copied < 0 ? -1 : 0; // A source that got shorter while it was copied ends the copy
+                    break;
+                }
+                result = copied;
+            }
+            result = result < 0 ? -1 : 0;
+        }
+        if (result == 0 && load_stored_checksum(in, &checksum) == 0)
+        {
+            save_stored_checksum(out, checksum);
+        }
+    }
+    saved_errno = errno;
+    if (in >= 0)
+    {
+        close(in);
+    }
+    if (out >= 0 && close(out) != 0 && result == 0)
+    {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result == 0 && renameat(to_dir, temp_name, to_dir, to_name) != 0)
+    {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result != 0)
+    {
+        unlinkat(to_dir, temp_name, 0);
+    }
+    errno = saved_errno;
+    return result;
+}
+
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation);
+
+// Function to copy a directory with everything below it, working on directory file descriptors throughout
+void copy_tree_at(int from_parent, const char *from_name, const char *from_path, int to_parent, const char *to_name,
+                  const char *to_path, struct relocation *relocation)
+{
+    char from_child[BUFFER_SIZE], to_child[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory = NULL;
+    int from_fd = openat(from_parent, from_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW), to_fd = -1;
+
+    if (from_fd >= 0 && (mkdirat(to_parent, to_name, 0755) == 0 || errno == EEXIST))
+    {
+        to_fd = openat(to_parent, to_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (from_fd < 0 || to_fd < 0 || (directory = fdopendir(from_fd)) == NULL)
+    {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        if (from_fd >= 0)
+        {
+            close(from_fd);
+        }
+        if (to_fd >= 0)
+        {
+            close(to_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(from_child, sizeof(from_child), "%s/%s", from_path, entry->d_name);
+        snprintf(to_child, sizeof(to_child), "%s/%s", to_path, entry->d_name);
+        relocate_entry(dirfd(directory), entry->d_name, from_child, to_fd, entry->d_name, to_child, 1, relocation);
+    }
+    closedir(directory);
+    close(to_fd);
+}
+
+// Function to publish a moved or copied .c file to the change feed, with the size and checksum it has now, packed or loose
+void announce_relocation(const char *from_path, const char *to_path, int existed, int move)
+{
+    char full_path[BUFFER_SIZE * 2];
+    struct pack_entry found;
+    struct stat info;
+    uint32_t checksum = 0;
+    int file_descriptor;
+
+    if (!feed_subscribed())
+    {
+        return;
+    }
+    if (move)
+    {
+        feed_publish(FEED_DELETED, from_path, -1, 0);
+    }
+    snprintf(full_path, sizeof(full_path), "%s/smain/%s", valid_home_dir(), to_path);
+    if (pack_lookup(to_path, &found) == 0)
+    {
+        feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, to_path, found.length, found.checksum);
+    }
+    else if ((file_descriptor = open(full_path, O_RDONLY | O_NOFOLLOW)) >= 0)
+    {
+        if (fstat(file_descriptor, &info) == 0)
+        {
+            load_stored_checksum(file_descriptor, &checksum);
+            feed_publish(existed ? FEED_MODIFIED : FEED_CREATED, to_path, info.st_size, checksum);
+        }
+        close(file_descriptor);
+    }
+}
+
+// Function to move or copy one directory entry between two open directories of a store. A move is one
+// renameat2(): a file replaces its target like an upload would, a directory never replaces an existing one.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation)
+{
+    struct stat info;
+    int existed;
+
+    if (fstatat(from_dir, from_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        if (errno != ENOENT || !matched)
+        {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+        }
+        return;
+    }
+    if (S_ISDIR(info.st_mode) && !relocation->move)
+    {
+        if (relocation->recursive)
+        {
+            copy_tree_at(from_dir, from_name, from_path, to_dir, to_name, to_path, relocation);
+        }
+        else if (!matched)
+        {
+            remove_failure(relocation->summary, from_path, "Is a directory, use cpfile -r");
+        }
+        return;
+    }
+    existed = feed_subscribed() && faccessat(to_dir, to_name, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+    if (relocation->move)
+    {
+        if (renameat2(from_dir, from_name, to_dir, to_name, S_ISDIR(info.st_mode) ? RENAME_NOREPLACE : 0) != 0)
+        {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+            return;
+        }
+    }
+    else if (copy_file_at(from_dir, from_name, to_dir, to_name) != 0)
+    {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        return;
+    }
+    relocation->summary->removed++;
+    display_cache_invalidate(from_path);
+    display_cache_invalidate(to_path);
+    if (S_ISDIR(info.st_mode))
+    {
+        feed_publish(FEED_DELETED_TREE, from_path, -1, 0);
+        return;
+    }
+    pack_remove(to_path); // The loose file replaces any packed copy
+    announce_relocation(from_path, to_path, existed, relocation->move);
+}
+
+// Function to store a copy of a packed file under another path: in the pack, or as a loose file when the pack
+// cannot take the new path. Returns 0 once the copy is stored
+int pack_copy(const char *store_root, const char *from, const char *to)
+{
+    char loose_path[BUFFER_SIZE * 2];
+    struct pack_entry found;
+    char *data;
+    int segment_fd = pack_open_file(from, &found), result = -1;
+    FILE *file;
+
+    if (segment_fd < 0)
+    {
+        return -1;
+    }
+    if ((data = malloc(found.length + 1)) != NULL && pread(segment_fd, data, found.length, found.offset) == (ssize_t)found.length)
+    {
+        result = pack_store(to, data, found.length, found.checksum);
+        snprintf(loose_path, sizeof(loose_path), "%s/%s", store_root, to);
+        if (result != 0 && (file = fopen(loose_path, "wb")) != NULL)
+        {
+            result = fwrite(data, 1, found.length, file) == found.length ? 0 : -1;
+            save_stored_checksum(fileno(file), found.checksum);
+            if (fclose(file) != 0)
+            {
+                result = -1;
+            }
+        }
+    }
+    free(data);
+    close(segment_fd);
+    return result;
+}
+
+// Function to move or copy the packed files a source names: the file itself, the files matching a glob in its last
+// component, or every file below a directory. They are stored again under the target's path, small as they are,
+// and a move drops the old entries. base is where a path relative to source_dir lands; returns the files handled
+int pack_relocate_pattern(const char *source_dir, const char *name, const char *base, const char *target,
+                          struct relocation *relocation)
+{
+    char from_path[BUFFER_SIZE], to_path[BUFFER_SIZE * 2], component[PACK_PATH_MAX];
+    int glob = strpbrk(name, "*?[") != NULL, count, handled = 0;
+    struct pack_entry *listing;
+    size_t skip;
+
+    // A single file is one hash lookup, only globs and directories need a pass over the index
+    snprintf(from_path, sizeof(from_path), "%s%s%s", source_dir, *source_dir ? "/" : "", name);
+    if (!glob && pack_copy(relocation->store_root, from_path, target) == 0)
+    {
+        if (relocation->move)
+        {
+            pack_remove(from_path);
+        }
+        relocation->summary->removed++;
+        announce_relocation(from_path, target, 0, relocation->move);
+        return 1;
+    }
+    if (pack_index == NULL || (!glob && !relocation->move && !relocation->recursive))
+    {
+        return 0;
+    }
+    count = pack_list(glob ? source_dir : from_path, &listing, &skip);
+    for (int i = 0; i < count; i++)
+    {
+        const char *rest = listing[i].path + skip;
+        const char *slash = strchr(rest, '/');
+
+        snprintf(component, sizeof(component), "%.*s", slash != NULL ? (int)(slash - rest) : (int)strlen(rest), rest);
+        if (glob && (fnmatch(name, component, FNM_PERIOD) != 0 || (slash != NULL && !relocation->move && !relocation->recursive)))
+        {
+            continue;
+        }
+        snprintf(to_path, sizeof(to_path), "%s/%s", base, rest);
+        if (pack_copy(relocation->store_root, listing[i].path, to_path) != 0)
+        {
+            remove_failure(relocation->summary, listing[i].path, "Cannot store the packed file's copy");
+            continue;
+        }
+        if (relocation->move)
+        {
+            pack_remove(listing[i].path);
+        }
+        relocation->summary->removed++;
+        announce_relocation(listing[i].path, to_path, 0, relocation->move);
+        handled++;
+    }
+    free(listing);
+    return handled;
+}
+
+// Function to carry out one mvfile or cpfile inside a store. The source is a file, a glob in its last component or a
+// directory. A target ending in '/' is the directory everything goes into, and so is a target without the file
+// type of a single source file; otherwise the target is the source's new name. Target directories are created
+// when they are new
+void relocate_pattern(struct relocation *relocation, const char *source, const char *target)
+{
+    char source_dir[BUFFER_SIZE], target_dir[BUFFER_SIZE], target_name[BUFFER_SIZE], directory[BUFFER_SIZE * 2];
+    char from_path[BUFFER_SIZE * 2], to_path[BUFFER_SIZE * 2], base[BUFFER_SIZE * 2];
+    const char *name = strrchr(source, '/'), *slash;
+    size_t name_length, source_length = strlen(source), extension_length = strlen(relocation->extension);
+    struct dirent *entry;
+    DIR *listing;
+    int glob, typed, packed, named, from_fd, to_fd;
+
+    if (path_leaves_store(source) || path_leaves_store(target))
+    {
+        remove_failure(relocation->summary, source, "Path leaves the store");
+        return;
+    }
+    snprintf(source_dir, sizeof(source_dir), "%.*s", name != NULL ? (int)(name - source) : 0, source);
+    name = name != NULL ? name + 1 : source;
+    name_length = strlen(name);
+    glob = strpbrk(name, "*?[") != NULL;
+    typed = name_length > extension_length && strcmp(name + name_length - extension_length, relocation->extension) == 0;
+    if (!glob && strncmp(target, source, source_length) == 0 && target[source_length] == '/')
+    {
+        remove_failure(relocation->summary, source, "Target is inside the source");
+        return;
+    }
+    if (glob || target[strlen(target) - 1] == '/' ||
+        (typed && (strlen(target) <= extension_length || strcmp(target + strlen(target) - extension_length, relocation->extension) != 0)))
+    {
+        snprintf(target_dir, sizeof(target_dir), "%s", target);
+        for (size_t length = strlen(target_dir); length > 1 && target_dir[length - 1] == '/'; length--)
+        {
+            target_dir[length - 1] = '\0';
+        }
+        snprintf(target_name, sizeof(target_name), "%s", name);
+    }
+    else
+    {
+        slash = strrchr(target, '/');
+        snprintf(target_dir, sizeof(target_dir), "%.*s", slash != NULL ? (int)(slash - target) : 0, target);
+        snprintf(target_name, sizeof(target_name), "%s", slash != NULL ? slash + 1 : target);
+    }
+    snprintf(to_path, sizeof(to_path), "%s%s%s", target_dir, *target_dir ? "/" : "", target_name);
+    snprintf(base, sizeof(base), "%s", glob ? target_dir : to_path);
+
+    // A file of this store's type that is neither packed nor loose is an error; a glob or directory that has
+    // nothing in this store is not, the other stores may hold its files
+    packed = pack_relocate_pattern(source_dir, name, base, to_path, relocation);
+    named = !glob && packed == 0 && typed;
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, source_dir);
+    if ((from_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        if (errno != ENOENT || named)
+        {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        return;
+    }
+    if (!glob && faccessat(from_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        if (named)
+        {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        close(from_fd);
+        return;
+    }
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, target_dir);
+    if (create_dir_if_new(directory) != 0 || (to_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        remove_failure(relocation->summary, target, strerror(errno));
+        close(from_fd);
+        return;
+    }
+    if (!glob)
+    {
+        relocate_entry(from_fd, name, source, to_fd, target_name, to_path, !named, relocation);
+        close(from_fd);
+    }
+    else if ((listing = fdopendir(from_fd)) == NULL)
+    {
+        remove_failure(relocation->summary, source, strerror(errno));
+        close(from_fd);
+    }
+    else
+    {
+        while ((entry = readdir(listing)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                fnmatch(name, entry->d_name, FNM_PERIOD) != 0)
+            {
+                continue;
+            }
+            snprintf(from_path, sizeof(from_path), "%s%s%s", source_dir, *source_dir ? "/" : "", entry->d_name);
+            snprintf(to_path, sizeof(to_path), "%s/%s", target_dir, entry->d_name);
+            relocate_entry(dirfd(listing), entry->d_name, from_path, to_fd, entry->d_name, to_path, 1, relocation);
+        }
+        closedir(listing);
+    }
+    close(to_fd);
+}
+
+// Function to carry out the arguments of an mvfile or cpfile in one store: "[-r] <source> <target>"
+// Returns -1 when they are not two paths
+int relocate_batch(const char *store_dir, const char *extension, const char *arguments, int move, struct remove_summary *summary)
+{
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *paths[2], *save, *token;
+    struct relocation relocation = {store_root, extension, move, 0, summary};
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-r") == 0)
+        {
+            relocation.recursive = 1;
+        }
+        else if (count < 2)
+        {
+            paths[count++] = token;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    if (count != 2)
+    {
+        return -1;
+    }
+    while (strlen(paths[0]) > 1 && paths[0][strlen(paths[0]) - 1] == '/')
+    {
+        paths[0][strlen(paths[0]) - 1] = '\0'; // "dir/" names the same directory as "dir"
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    relocate_pattern(&relocation, paths[0], paths[1]);
+    return 0;
+}
+
+// Function to publish an mvfile or cpfile done by Spdf/Stext to the change feed: a single file with the size and
+// checksum the backend now has for it, a moved glob or directory as the deletion of the source
+void announce_backend_relocation(const char *type, const char *source, const char *to_path, int existed, int move)
+{
+    if (strpbrk(source, "*?[") == NULL && route_by_type(source) != NULL)
+    {
+        if (move)
+        {
+            feed_publish(FEED_DELETED, source, -1, 0);
+        }
+        announce_backend_upload(type, to_path, existed);
+    }
+    else if (move)
+    {
+        feed_publish(strpbrk(source, "*?[") != NULL ? FEED_DELETED : FEED_DELETED_TREE, source, -1, 0);
+    }
+}
+
+// Function to handle "mvfile <source> <target>" and "cpfile [-r] <source> <target>" inside the stores, so no file data
+// crosses the network: a file goes to the store of its type, a glob or directory to every store it may have files in.
+// Smain moves or copies .c files itself and sends the command to every replica of Spdf and Stext; the client gets one
+// reply with the totals and the first failures
+void relocate_files(int client_socket, char *buffer, int move)
+{
+    static const char *types[] = {".c", ".txt", ".pdf"};
+    const char *command = move ? "mvfile" : "cpfile", *route, *target_route, *name;
+    char arguments[BUFFER_SIZE], response[BUFFER_SIZE], to_path[BUFFER_SIZE * 2] = "", local_path[BUFFER_SIZE * 2];
+    char *paths[3], *save, *token;
+    struct remove_summary summary;
+    struct stat info;
+    int count = 0, recursive = 0, single, existed = 0, handled_by[3] = {0};
+    size_t source_length;
+
+    snprintf(arguments, sizeof(arguments), "%s", buffer + strlen(command));
+    for (token = strtok_r(arguments, " ", &save); token != NULL && count < 3; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-r") != 0 || move)
+        {
+            paths[count++] = token;
+        }
+        else
+        {
+            recursive = 1;
+        }
+    }
+    if (count != 2)
+    {
+        snprintf(response, sizeof(response), "Usage: %s\n", move ? "mvfile source_in_smain target_in_smain" :
+                                                                   "cpfile [-r] source_in_smain target_in_smain");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    while (strlen(paths[0]) > 1 && paths[0][strlen(paths[0]) - 1] == '/')
+    {
+        paths[0][strlen(paths[0]) - 1] = '\0'; // "dir/" names the same directory as "dir"
+    }
+    route = route_by_type(paths[0]);
+    target_route = route_by_type(paths[1]);
+    name = strrchr(paths[0], '/') != NULL ? strrchr(paths[0], '/') + 1 : paths[0];
+    single = route != NULL && strpbrk(name, "*?[") == NULL;
+    if (strncmp(paths[0], "~smain", strlen("~smain")) != 0 || strncmp(paths[1], "~smain", strlen("~smain")) != 0 ||
+        strstr(paths[0], "..") != NULL || strstr(paths[1], "..") != NULL)
+    {
+        snprintf(response, sizeof(response), "Both paths of %s must be below ~smain\n", command);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (strcmp(paths[0], paths[1]) == 0 || (single && target_route != NULL && strcmp(route, target_route) != 0))
+    {
+        snprintf(response, sizeof(response), strcmp(paths[0], paths[1]) == 0 ? "%s is its own target\n" :
+                 "%s cannot change the file type\n", paths[0]);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // Mistakes every store would report alike are answered once here. A directory holds files of any type, so
+    // Smain's own store, where every upload creates its directory, tells whether the source is one
+    source_length = strlen(paths[0]);
+    snprintf(local_path, sizeof(local_path), "%s/smain/%s", valid_home_dir(), paths[0]);
+    if (strpbrk(name, "*?[") == NULL && strncmp(paths[1], paths[0], source_length) == 0 && paths[1][source_length] == '/')
+    {
+        snprintf(response, sizeof(response), "%s cannot go inside itself\n", paths[0]);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (!move && !recursive && route == NULL && stat(local_path, &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        snprintf(response, sizeof(response), "%s is a directory, use cpfile -r\n", paths[0]);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // A single file lands at the target, or in it when the target is a directory; its cached copies go stale
+    if (single)
+    {
+        size_t target_length = strlen(paths[1]);
+
+        while (target_length > 1 && paths[1][target_length - 1] == '/')
+        {
+            target_length--;
+        }
+        snprintf(to_path, sizeof(to_path), target_route != NULL ? "%.*s" : "%.*s/%s", (int)target_length, paths[1], name);
+        if (strcmp(route, ".c") != 0)
+        {
+            if (move)
+            {
+                cache_invalidate(paths[0]);
+            }
+            cache_invalidate(to_path);
+            existed = feed_subscribed() && stat_backend_file(route, to_path, NULL, NULL) == 0;
+        }
+        negative_filter_note(route, to_path);
+    }
+
+    memset(&summary, 0, sizeof(summary));
+    for (int i = 0; i < 3; i++)
+    {
+        if (route != NULL && strcmp(route, types[i]) != 0)
+        {
+            continue; // The source has no files in this store
+        }
+        if (!single)
+        {
+            negative_filter_pause(types[i]); // Which files arrive below the target is only known afterwards
+        }
+        if (i == 0)
+        {
+            relocate_batch("smain", ".c", buffer + strlen(command), move, &summary);
+        }
+        else
+        {
+            int handled_before = summary.removed;
+
+            batch_on_backends(types[i], command, buffer + strlen(command), &summary);
+            handled_by[i] = summary.removed > handled_before;
+        }
+        if (!single)
+        {
+            negative_filter_resume(types[i], paths[1]);
+        }
+    }
+    for (int i = 1; i < 3; i++)
+    {
+        if (handled_by[i] && feed_subscribed())
+        {
+            announce_backend_relocation(types[i], paths[0], to_path, existed, move);
+        }
+    }
+
+    // A single named file gets a short reply like rmfile's
+    if (single && summary.removed == 1 && summary.failed == 0)
+    {
+        if (move)
+        {
+            negative_filter_forget(route, paths[0]);
+        }
+        // Each path gets half of the one frame reply, so neither can crowd out the other
+        snprintf(response, sizeof(response), "File %.*s %s to %.*s\n", BUFFER_SIZE / 2 - 16, paths[0],
+                 move ? "moved" : "copied", BUFFER_SIZE / 2 - 16, to_path);
+    }
+    else if (summary.removed == 0 && summary.failed == 0)
+    {
+        snprintf(response, sizeof(response), "Nothing in the stores matches %s\n", paths[0]);
+    }
+    else
+    {
+        snprintf(response, sizeof(response), "%s %d entries, %d failed\n%s%s", move ? "Moved" : "Copied", summary.removed,
+                 summary.failed, summary.failures, summary.failed > summary.listed ? "...\n" : "");
+    }
+    send(client_socket, response, strlen(response), 0);
+    if (move)
+    {
+        pack_compact_later(); // Moved packed files leave their old records behind
+    }
+}
+
+
+// One tar archive streamed to the client as chunks; producers append whole entries while holding the lock
+struct tar_stream
+{
+    int client_sock;            // Client receiving the archive
+    pthread_mutex_t lock;       // Held while one entry is written, so entries from different stores never mix
+    uint32_t checksum;          // CRC32C of every archive byte sent so far
+    unsigned long entries;      // Number of files added to the archive
+    int failed;                 // Set once sending to the client failed
+};
+
+// One store feeding the archive: the local .c scan or a backend listing
+struct tar_source
+{
+    struct tar_stream *stream;
+    const char *store;          // Store directory name, also used as the top directory inside the archive
+    const char *extension;      // File type collected from this store, also the backend type to ask
+    int local;                  // Set for the local scan of Smain's own store
+};
+
+static const char tar_zero_block[512]; // Padding and end-of-archive blocks
+
+// Function to append archive bytes to the client stream, caller holds the stream lock
+int tar_send(struct tar_stream *stream, const char *data, size_t length)
+{
+    if (stream->failed || length == 0)
+    {
+        return stream->failed ? -1 : 0;
+    }
+    stream->checksum = crc32c_update(stream->checksum, data, length);
+    if (send_chunk(stream->client_sock, data, length) != 0)
+    {
+        stream->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to write the 512-byte ustar header of a regular file, returns -1 when the name does not fit
+int tar_begin_entry(struct tar_stream *stream, const char *name, long long size, long long mtime, unsigned int mode)
+{
+    char header[512];
+    const char *split = NULL;
+    size_t name_length = strlen(name);
+    unsigned int sum = 0;
+
+    memset(header, 0, sizeof(header));
+
+    // Names over 100 bytes go into the 155-byte prefix field, split at a slash
+    if (name_length > 100)
+    {
+        for (const char *p = name; *p; p++)
+        {
+            if (*p == '/' && p - name <= 155 && name_length - (p - name) - 1 <= 100)
+            {
+                split = p;
+                break;
+            }
+        }
+        if (split == NULL)
+        {
+            fprintf(stderr, "Skipping %s, the name is too long for a tar header\n", name);
+            return -1;
+        }
+        memcpy(header + 345, name, split - name);
+        memcpy(header, split + 1, name_length - (split - name) - 1);
+    }
+    else
+    {
+        memcpy(header, name, name_length);
+    }
+
+    snprintf(header + 100, 8, "%07o", mode & 07777);
+    snprintf(header + 108, 8, "%07o", 0);
+    snprintf(header + 116, 8, "%07o", 0);
+    if (size < 077777777777LL)
+    {
+        snprintf(header + 124, 12, "%011llo", size);
+    }
+    else
+    {
+        // Files of 8 GB and more use the base-256 size encoding understood by GNU and BSD tar
+        header[124] = (char)0x80;
+        for (int i = 11; i > 3; i--, size >>= 8)
+        {
+            header[124 + i] = (char)(size & 0xff);
+        }
+    }
+    snprintf(header + 136, 12, "%011llo", mtime);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    // The header checksum is computed with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    for (int i = 0; i < 512; i++)
+    {
+        sum += (unsigned char)header[i];
+    }
+    snprintf(header + 148, 8, "%06o", sum);
+
+    return tar_send(stream, header, sizeof(header));
+}
+
+// Function to finish an entry: fill up to the size announced in the header and pad to a 512-byte boundary
+int tar_end_entry(struct tar_stream *stream, long long size, long long written)
+{
+    while (written < size)
+    {
+        long long gap = size - written < (long long)sizeof(tar_zero_block) ? size - written : (long long)sizeof(tar_zero_block);
+        if (tar_send(stream, tar_zero_block, gap) != 0)
+        {
+            return -1;
+        }
+        written += gap;
+    }
+    stream->entries++;
+    return tar_send(stream, tar_zero_block, (512 - size % 512) % 512);
+}
+
+// Function to add every local file with the source's extension below one directory of the .c store
+void tar_scan_local(struct tar_source *source, const char *root, const char *relative)
+{
+    char dir_path[BUFFER_SIZE];             // Directory being scanned
+    char entry_relative[BUFFER_SIZE];       // Entry path relative to the store root
+    char entry_path[BUFFER_SIZE * 2];       // Full path of the entry
+    char archive_name[BUFFER_SIZE * 2];     // Name of the entry inside the archive
+    size_t extension_length = strlen(source->extension);
+    struct tar_stream *stream = source->stream;
+    struct dirent *entry;
+    struct stat entry_info;
+    DIR *directory;
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+    if ((directory = opendir(dir_path)) == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL && !stream->failed)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(entry_relative, sizeof(entry_relative), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name);
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", root, entry_relative);
+        if (lstat(entry_path, &entry_info) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(entry_info.st_mode))
+        {
+            tar_scan_local(source, root, entry_relative);
+            continue;
+        }
+        size_t name_length = strlen(entry->d_name);
+        if (!S_ISREG(entry_info.st_mode) || name_length < extension_length ||
+            strcmp(entry->d_name + name_length - extension_length, source->extension) != 0)
+        {
+            continue;
+        }
+
+        int file_descriptor = open(entry_path, O_RDONLY);
+        if (file_descriptor < 0)
+        {
+            continue;
+        }
+        fstat(file_descriptor, &entry_info);
+        snprintf(archive_name, sizeof(archive_name), "%s/%s", source->store, entry_relative);
+
+        // Read the file before taking the lock only as far as the first chunk, then stream the rest under it
+        struct chunk_sizer sizer;
+        if (chunk_sizer_init(&sizer) != 0)
+        {
+            close(file_descriptor);
+            continue;
+        }
+        ssize_t bytes_read = read(file_descriptor, sizer.buffer, sizer.size);
+        long long written = 0;
+
+        pthread_mutex_lock(&stream->lock);
+        if (tar_begin_entry(stream, archive_name, entry_info.st_size, entry_info.st_mtime, entry_info.st_mode) == 0)
+        {
+            while (bytes_read > 0)
+            {
+                // Never write more than the header announced, even if the file grew meanwhile
+                long long remaining = entry_info.st_size > written ? (long long)entry_info.st_size - written : 0;
+                size_t usable = bytes_read > remaining ? (size_t)remaining : (size_t)bytes_read;
+                if (usable == 0 || tar_send(stream, sizer.buffer, usable) != 0)
+                {
+                    break;
+                }
+                written += usable;
+                chunk_sizer_update(&sizer, bytes_read);
+                bytes_read = read(file_descriptor, sizer.buffer, sizer.size);
+            }
+            tar_end_entry(stream, entry_info.st_size, written);
+        }
+        pthread_mutex_unlock(&stream->lock);
+
+        chunk_sizer_done(&sizer);
+        close(file_descriptor);
+    }
+    closedir(directory);
+}
+
+// Function to add every packed file with the source's extension to the archive, read from its segment
+void tar_add_packed(struct tar_source *source)
+{
+    char archive_name[BUFFER_SIZE];
+    char *buffer = malloc(PACK_MAX_FILE);
+    size_t extension_length = strlen(source->extension), skip;
+    struct tar_stream *stream = source->stream;
+    struct pack_entry *listing, packed;
+    int count = pack_list("", &listing, &skip);
+
+    for (int i = 0; i < count && buffer != NULL && !stream->failed; i++)
+    {
+        size_t path_length = strlen(listing[i].path);
+        ssize_t bytes_read;
+        int file_descriptor;
+
+        // The file is looked up again, it may have been replaced or removed since the listing
+        if (path_length <= extension_length || strcmp(listing[i].path + path_length - extension_length, source->extension) != 0 ||
+            (file_descriptor = pack_open_file(listing[i].path, &packed)) < 0)
+        {
+            continue;
+        }
+        bytes_read = pread(file_descriptor, buffer, packed.length, packed.offset);
+        close(file_descriptor);
+        if (bytes_read != (ssize_t)packed.length)
+        {
+            continue;
+        }
+        snprintf(archive_name, sizeof(archive_name), "%s/%s", source->store, packed.path);
+
+        pthread_mutex_lock(&stream->lock);
+        if (tar_begin_entry(stream, archive_name, packed.length, packed.mtime_ns / 1000000000LL, 0644) == 0)
+        {
+            tar_send(stream, buffer, packed.length);
+            tar_end_entry(stream, packed.length, packed.length);
+        }
+        pthread_mutex_unlock(&stream->lock);
+    }
+    free(buffer);
+    free(listing);
+}
+
+// Function to copy one file announced by a backend listing into the archive
+// The backend sent the header chunk; its file chunks and CRC32C trailer follow on the socket
+void tar_add_remote_entry(struct tar_source *source, int backend_socket, char *header)
+{
+    struct tar_stream *stream = source->stream;
+    char archive_name[BUFFER_SIZE * 2];
+    long long size, mtime, written = 0;
+    unsigned int mode;
+    int path_offset = 0;
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer;
+    long length;
+    uint32_t computed = 0, trailer;
+
+    if (sscanf(header, "%lld %lld %o %n", &size, &mtime, &mode, &path_offset) != 3 || path_offset == 0)
+    {
+        recv_file_chunks(backend_socket, NULL, NULL); // Malformed header, skip the file that follows it
+        return;
+    }
+    snprintf(archive_name, sizeof(archive_name), "%s/%s", source->store, header + path_offset);
+    if ((buffer = pool_acquire(&capacity)) == NULL)
+    {
+        stream->failed = 1;
+        return;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    int skip = tar_begin_entry(stream, archive_name, size, mtime, mode) != 0;
+    while ((length = recv_chunk(backend_socket, &buffer, &capacity)) > 0)
+    {
+        computed = crc32c_update(computed, buffer, length);
+        long long usable = written + length > size ? size - written : length;
+        if (!skip && usable > 0 && tar_send(stream, buffer, usable) == 0)
+        {
+            written += usable;
+        }
+    }
+    if (length == 0 && recv_all(backend_socket, &trailer, sizeof(trailer)) == 0 && ntohl(trailer) != computed)
+    {
+        fprintf(stderr, "Checksum mismatch for %s while archiving\n", archive_name);
+    }
+    if (!skip)
+    {
+        tar_end_entry(stream, size, written);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    pool_release(buffer, capacity);
+    if (length < 0)
+    {
+        stream->failed = 1;
+    }
+}
+
+// Function run by one producer thread: scans the local store or pulls a backend's listing into the archive
+void *tar_producer(void *argument)
+{
+    struct tar_source *source = argument;
+    char path[BUFFER_SIZE];
+
+    if (source->local)
+    {
+        snprintf(path, sizeof(path), "%s/%s", valid_home_dir(), source->store);
+        tar_scan_local(source, path, "");
+        tar_add_packed(source);
+    }
+    else
+    {
+        int backend_socket;
+        size_t capacity = BUFFER_SIZE * 2;
+        char *header = pool_acquire(&capacity);
+        long length;
+
+        int slot = connect_backend(source->extension, &backend_socket);
+
+        if (slot < 0)
+        {
+            fprintf(stderr, "Archive is missing the %s files, no server is available\n", source->extension);
+            source->stream->failed = 1;
+            pool_release(header, capacity);
+            pool_destroy();
+            return NULL;
+        }
+        memset(path, 0, sizeof(path));
+        snprintf(path, sizeof(path), "dtar %s", source->extension);
+        send_frame(backend_socket, path);
+
+        // Each header chunk announces one file; an empty header chunk ends the listing
+        while (header != NULL && (length = recv_chunk(backend_socket, &header, &capacity)) > 0)
+        {
+            header[length < (long)capacity ? length : (long)capacity - 1] = '\0';
+            tar_add_remote_entry(source, backend_socket, header);
+        }
+        pool_release(header, capacity);
+        close(backend_socket);
+        release_backend(slot);
+    }
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to stream one tar archive of .c, .pdf, .txt or all stored files to the client
+// Every store is read by its own thread, so the archive takes about as long as the slowest store
+// The reply is always a chunked file stream (empty for an unsupported type) followed by a status message
+void handle_dtar(int client_sock, char *filetype)
+{
+    struct tar_stream stream;           // Archive shared by the producer threads
+    struct tar_source sources[3];       // Stores that contribute to the archive
+    pthread_t threads[3];
+    int started[3] = {0, 0, 0};
+    int source_count = 0;
+    int all = strcmp(filetype, "all") == 0;
+    char response[BUFFER_SIZE];
+
+    memset(&stream, 0, sizeof(stream));
+    stream.client_sock = client_sock;
+    pthread_mutex_init(&stream.lock, NULL);
+
+    // .c files are archived from Smain's own directory, .pdf and .txt files are pulled from Spdf and Stext
+    if (all || strcmp(filetype, ".c") == 0)
+    {
+        sources[source_count++] = (struct tar_source){&stream, "smain", ".c", 1};
+    }
+    if (all || strcmp(filetype, ".pdf") == 0)
+    {
+        sources[source_count++] = (struct tar_source){&stream, "spdf", ".pdf", 0};
+    }
+    if (all || strcmp(filetype, ".txt") == 0)
+    {
+        sources[source_count++] = (struct tar_source){&stream, "stext", ".txt", 0};
+    }
+    if (source_count == 0)        // If the file type is not supported
+    {
+        send_end_of_file(client_sock, 0);
+        snprintf(response, sizeof(response), "Unsupported file type %s\n", filetype);
+        send(client_sock, response, strlen(response), 0);
+        return;
+    }
+
+    // Start one producer per store, falling back to running it inline if no thread can be created
+    for (int i = 0; i < source_count; i++)
+    {
+        started[i] = pthread_create(&threads[i], NULL, tar_producer, &sources[i]) == 0;
+        if (!started[i])
+        {
+            tar_producer(&sources[i]);
+        }
+    }
+    for (int i = 0; i < source_count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
         }
     }
+    pthread_mutex_destroy(&stream.lock);
 
-    // Handle the case where accepting a connection fails
-    if (client_socket < 0)
+    // Two zero blocks end a tar archive, then the chunk stream ends with the archive's checksum
+    tar_send(&stream, tar_zero_block, sizeof(tar_zero_block));
+    tar_send(&stream, tar_zero_block, sizeof(tar_zero_block));
+    send_end_of_file(client_sock, stream.checksum);
+
+    if (stream.failed)
     {
-        perror("Failed to accept connection");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+        snprintf(response, sizeof(response), "Archive of %s files is incomplete\n", filetype);
     }
-
-    // Close the server socket before exiting the program
-    close(server_socket);
-    return 0;
+    else
+    {
+        snprintf(response, sizeof(response), "Archive of %s files sent with %lu entries\n", filetype, stream.entries);
+    }
+    send(client_sock, response, strlen(response), 0);
 }
 
+// One grep request: what to look for, the files to search and the result stream shared by the search threads
+struct grep_search
+{
+    char pattern[BUFFER_SIZE];          // Substring or, with -E/-i, POSIX extended regular expression
+    size_t length;
+    int use_regex;
+    regex_t regex;
+    size_t rare_offset;                 // Position of the pattern's least common byte, which memchr() looks for first
+    const char *store_root;             // Store directory the relative paths below start from
+    char **files;                       // Files to search, relative to the store
+    int file_count;
+    int file_capacity;
+    int next_file;                      // Next file to search, taken with an atomic increment
+    int sock;                           // Stream the matching lines go to
+    pthread_mutex_t lock;               // Held while a batch is sent, so lines of different files never mix
+    uint32_t checksum;                  // CRC32C of every result byte sent so far
+    long limit;                         // Matching lines to send before the search stops
+    long matches;                       // Matching lines sent
+    long matched_files;                 // Files that contributed at least one line
+    int stopped;                        // Limit reached or sending failed, the search threads finish early
+    int failed;                         // Sending to the client failed
+};
+
+// Function to rank how common a byte is in source code and text, 0 for bytes outside the list
+int grep_byte_rank(unsigned char byte)
+{
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqzETAOINSRHLDCUMFPGWYBVKXJQZ_;,.()0123456789\n\t=*{}\"'";
+    const char *found = byte != 0 ? strchr(common, byte) : NULL;
 
-void process_client_request(int client_socket)
+    return found != NULL ? (int)(sizeof(common) - (found - common)) : 0;
+}
+
+// Function to read "[-i] [-E] [-m limit] pattern [path]" into a search, returns the path to search or NULL
+// -i searches without regard to case, -E takes the pattern as an extended regular expression
+const char *grep_parse(struct grep_search *search, char *arguments, const char *default_path)
 {
-    char buffer[BUFFER_SIZE]; // buffer to store the data recieved
-    char command[BUFFER_SIZE]; // buffer to store the command entered by the user
-    char argument1[BUFFER_SIZE], argument2[BUFFER_SIZE]; // buffer to store the command arguments
+    char *save, *token, *path = NULL;
+    int ignore_case = 0, have_pattern = 0;
 
-    // infinite loop to continuoulsy handle the input and processing
-    while (1)
+    search->limit = GREP_DEFAULT_LIMIT;
+    for (token = strtok_r(arguments, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
     {
-        // clear the contents of the buffer by setting the elements to 0
-        for (int i = 0; i < BUFFER_SIZE; i++)
+        if (!have_pattern && strcmp(token, "-i") == 0)
         {
-            buffer[i] = 0;
-            command[i] = 0;
-            argument1[i] = 0;
-            argument2[i] = 0;
+            ignore_case = 1;
         }
-
-        // Receiving a command from the client
-        // Receive data from the client and store it in buffer
-        // recv() reads up to BUFFER_SIZE - 1 bytes from the client_socket
-        // and returns the number of bytes received or -1 if an error occurs
-        int received_length = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (received_length <= 0)
+        else if (!have_pattern && strcmp(token, "-E") == 0)
         {
-            if (received_length == 0)
-            {
-                printf("Client has disconnected\n");
-                printf("Waiting for new connection request \n");
-            }
-            else
-            {
-                perror("Failed to receive data");
-            }
-            break;
+            search->use_regex = 1;
         }
-
-        // Null-terminate the buffer to safely handle it as a string
-        buffer[received_length] = '\0';
-
-        // Parse the received command and its arguments
-        sscanf(buffer, "%s %s %s", command, argument1, argument2);
-
-        printf("Command received: %s\n", command);
-
-        // Handle the command based on the parsed input
-        if (strcmp(command, "ufile") == 0)
+        else if (!have_pattern && strcmp(token, "-m") == 0 && (token = strtok_r(NULL, " ", &save)) != NULL)
         {
-            process_uploaded_file(client_socket, argument1, argument2, buffer);         // to handle the ufile command
+            search->limit = atol(token);
         }
-        else if (strcmp(command, "dfile") == 0)
+        else if (!have_pattern)
         {
-            manage_file_download(client_socket, argument1, buffer);                     // to handle the dfile command
+            snprintf(search->pattern, sizeof(search->pattern), "%s", token);
+            have_pattern = 1;
         }
-        else if (strcmp(command, "rmfile") == 0)
+        else if (path == NULL)
         {
-            remove_file(client_socket, argument1, buffer);                              // to handle the rmfile command
+            path = token;
         }
+    }
+    if (!have_pattern || search->limit <= 0 || (path != NULL && strstr(path, "..") != NULL))
+    {
+        return NULL;
+    }
+    search->limit = search->limit > GREP_MAX_LIMIT ? GREP_MAX_LIMIT : search->limit;
+    search->length = strlen(search->pattern);
 
-        else if (strcmp(command, "dtar") == 0)
+    if (ignore_case && !search->use_regex)
+    {
+        // A case-insensitive substring is searched as a regular expression with its special characters escaped
+        char escaped[BUFFER_SIZE];
+        size_t used = 0;
+        for (size_t i = 0; i < search->length && used + 2 < sizeof(escaped); i++)
         {
-            handle_dtar(client_socket, argument1);                                      // to handle the dtar command
+            if (strchr("\\.[]()*+?{}|^$", search->pattern[i]) != NULL)
+            {
+                escaped[used++] = '\\';
+            }
+            escaped[used++] = search->pattern[i];
         }
-
-        else if (strcmp(command, "display") == 0)
+        escaped[used] = '\0';
+        snprintf(search->pattern, sizeof(search->pattern), "%s", escaped);
+        search->use_regex = 1;
+    }
+    if (search->use_regex)
+    {
+        if (regcomp(&search->regex, search->pattern, REG_EXTENDED | REG_NEWLINE | (ignore_case ? REG_ICASE : 0)) != 0)
         {
-            handle_display(client_socket, argument1);                                   // to handle the display command
+            search->use_regex = 0;
+            return NULL;
         }
-
-        else
+    }
+    else
+    {
+        for (size_t i = 1; i < search->length; i++)
         {
-            // Sending an error message for unrecognized commands
-            char *error_message = "Invalid command\n";
-            send(client_socket, error_message, strlen(error_message), 0);
+            if (grep_byte_rank(search->pattern[i]) < grep_byte_rank(search->pattern[search->rare_offset]))
+            {
+                search->rare_offset = i;
+            }
         }
     }
+    return path != NULL ? path : default_path;
 }
 
+// Function to add one file to the search, returns -1 when the list cannot grow
+int grep_add_file(struct grep_search *search, const char *relative)
+{
+    if (search->file_count == search->file_capacity)
+    {
+        int capacity = search->file_capacity > 0 ? search->file_capacity * 2 : 64;
+        char **files = realloc(search->files, capacity * sizeof(char *));
+        if (files == NULL)
+        {
+            return -1;
+        }
+        search->files = files;
+        search->file_capacity = capacity;
+    }
+    if ((search->files[search->file_count] = strdup(relative)) != NULL)
+    {
+        search->file_count++;
+    }
+    return 0;
+}
 
-void process_uploaded_file(int client_socket, char *filename, char *destination, char *buffer)
+// Function to add the files of one type below a directory of the store to the search, depth first
+void grep_collect(struct grep_search *search, const char *relative, const char *extension)
 {
-    char path[BUFFER_SIZE];             // Path to store the full file path
-    char dest_path[BUFFER_SIZE];        // Path to store the destination directory path
-    FILE *file_ptr;                     // File pointer for handling the file
-    char server_response[BUFFER_SIZE];  // Buffer for sending responses to the client
-    char file_data[BUFFER_SIZE];        // Buffer for storing the received file data
-    int received_bytes;                 // Variable to store the number of bytes received
+    char path[BUFFER_SIZE], child[BUFFER_SIZE];
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+    DIR *directory;
 
-    if (strstr(filename, ".c") != NULL)
+    snprintf(path, sizeof(path), "%s/%s", search->store_root, relative);
+    if ((directory = opendir(path)) == NULL)
     {
-        // Construct the destination path
-        snprintf(dest_path, sizeof(dest_path), "%s/smain/%s", valid_home_dir(), destination);
-        // Ensure the destination directory exists
-        if (create_dir_if_new(dest_path) != 0)
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL && search->file_count < GREP_MAX_FILES)
+    {
+        size_t name_length = strlen(entry->d_name);
+
+        if (entry->d_name[0] == '.')
         {
-            return;
+            continue;
         }
-
-        // Construct the full file path for the uploaded file
-        snprintf(path, sizeof(path), "%s/smain/%s/%s", valid_home_dir(), destination, filename);
-        // Open the file for writing
-        file_ptr = fopen(path, "wb");
-        if (file_ptr == NULL)
+        snprintf(child, sizeof(child), "%s/%s", relative, entry->d_name);
+        if (entry->d_type == DT_DIR)
         {
-            snprintf(server_response, sizeof(server_response), "Could not open file %s for writing\n", path);
-            send(client_socket, server_response, strlen(server_response), 0);
-            return;
+            grep_collect(search, child, extension);
         }
-
-        // Receive data from the client
-        printf("Receiving file: %s\n", path);
-        while ((received_bytes = recv(client_socket, file_data, sizeof(file_data), 0)) > 0)
+        else if (name_length > extension_length && strcmp(entry->d_name + name_length - extension_length, extension) == 0 &&
+                 grep_add_file(search, child) != 0)
         {
-            // Write the received data to the file
-            fwrite(file_data, 1, received_bytes, file_ptr);
-
-            if (received_bytes < sizeof(file_data))
-            {
-                printf("File scanned completely, copying to the Main server directory from the Client server\n");
-                break;
-            }
+            break;
         }
-
-        // Notifying the client that the file was uploaded successfully
-        snprintf(server_response, sizeof(server_response), "File %s uploaded successfully\n", filename);
-        send(client_socket, server_response, strlen(server_response), 0);
     }
+    closedir(directory);
+}
 
-    // Checking if the file is a text file
-    else if (strstr(filename, ".txt") != NULL)
+// Function to add the packed files of one type below a directory to the search
+void grep_collect_packed(struct grep_search *search, const char *relative, const char *extension)
+{
+    size_t extension_length = strlen(extension), skip;
+    struct pack_entry *listing;
+    int count = pack_list(relative, &listing, &skip);
+
+    for (int i = 0; i < count && search->file_count < GREP_MAX_FILES; i++)
     {
-        int stext_socket;
+        size_t path_length = strlen(listing[i].path);
 
-        // Establishing a connection to the Stext server
-        establish_connection(TEXT_ADDRESS, STEXT_PORT, &stext_socket);
-        // Sending the initial buffer to the Stext server
-        if (send(stext_socket, buffer, BUFFER_SIZE, 0) == -1)
+        if (path_length > extension_length && strcmp(listing[i].path + path_length - extension_length, extension) == 0 &&
+            grep_add_file(search, listing[i].path) != 0)
         {
-            snprintf(server_response, sizeof(server_response), "Failed to establish socket connection for text files", filename);
-            send(client_socket, server_response, strlen(server_response), 0);
+            break;
         }
+    }
+    free(listing);
+}
 
-        // Forwarding the file data to the Stext server
-        while ((received_bytes = recv(client_socket, file_data, sizeof(file_data), 0)) > 0)
-        {
-            send(stext_socket, file_data, received_bytes, 0);
-            if (received_bytes < sizeof(file_data))
-            {
-                break;
-            }
-        }
-        // Receive the response from the Stext server
-        int length = recv(stext_socket, server_response, sizeof(server_response) - 1, 0);
+// Function to send a batch of whole matching lines, cut at the limit; returns the bytes sent, less than length once cut
+long grep_emit(struct grep_search *search, const char *data, size_t length, int new_file)
+{
+    const char *end = data, *newline;
+    long lines = 0;
 
-        // Forward the response to the client
-        send(client_socket, server_response, length, 0);
-        close(stext_socket);
+    pthread_mutex_lock(&search->lock);
+    while (lines < search->limit - search->matches && (newline = memchr(end, '\n', data + length - end)) != NULL)
+    {
+        end = newline + 1;
+        lines++;
     }
-    // Checking if the file is a PDF file
-    else if (strstr(filename, ".pdf") != NULL)
+    if (search->stopped || lines == 0)
     {
-        int spdf_socket;
-
-        // Establish a connection to the Spdf server
-        establish_connection(PDF_ADDRESS, SPDF_PORT, &spdf_socket);
-        if (send(spdf_socket, buffer, BUFFER_SIZE, 0) == -1)
-        {
-            snprintf(server_response, sizeof(server_response), "Failed to establish socket connection for PDF files", filename);
-            send(client_socket, server_response, strlen(server_response), 0);
-        }
-
-        while ((received_bytes = recv(client_socket, file_data, sizeof(file_data), 0)) > 0)
+        end = data;
+    }
+    else
+    {
+        search->checksum = crc32c_update(search->checksum, data, end - data);
+        if (send_chunk(search->sock, data, end - data) != 0)
         {
-            send(spdf_socket, file_data, received_bytes, 0);
-            if (received_bytes < sizeof(file_data))
-            {
-                break;
-            }
+            search->failed = 1;
         }
-
-        // Receive the response from the Spdf server
-        int length = recv(spdf_socket, server_response, sizeof(server_response) - 1, 0);
-        // Forward the response to the client
-        send(client_socket, server_response, length, 0);
-        close(spdf_socket);
+        search->matches += lines;
+        search->matched_files += new_file;
     }
-    else
+    if (search->failed || search->matches >= search->limit)
     {
-        snprintf(server_response, sizeof(server_response), "File type %s is not supported.\n", filename);
-        send(client_socket, server_response, strlen(server_response), 0);
+        __atomic_store_n(&search->stopped, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&search->lock);
+    return end - data;
 }
 
-
-void manage_file_download(int client_socket, char *filename, char *command)
+// Function to find the next occurrence of the substring between data and end
+// memchr(), vectorised by the C library, skips to the next place the pattern's rarest byte occurs and memcmp() confirms
+const char *grep_find(const struct grep_search *search, const char *data, const char *end)
 {
-    char buffer[BUFFER_SIZE];           // Buffer for storing data to send or receive
-    char file_path[BUFFER_SIZE];        // Path to store the full file path
-    int file_descriptor;                // File descriptor for the file to be read
-    int bytes_read;                     // Variable to store the number of bytes read
-    char response[BUFFER_SIZE];         // Buffer for sending responses to the client
+    const char *candidate = data + search->rare_offset;
 
-    // check if the file contains a .c extension
-    if (strstr(filename, ".c") != NULL)
+    while (candidate < end && (candidate = memchr(candidate, search->pattern[search->rare_offset], end - candidate)) != NULL)
     {
-        // Construct the full file path for the requested file
-        // Construct the full file path by appending the "smain" directory and the filename
-        // valid_home_dir() is assumed to return the home directory path
-        snprintf(file_path, sizeof(file_path), "%s/smain/%s", valid_home_dir(), filename);
-        printf("File: %s\n", file_path);
-
-        file_descriptor = open(file_path, O_RDONLY); // attempts to open the file in realy only mode
-
-        // Check if the file was successfully opened
-        if (file_descriptor < 0)
+        const char *start = candidate - search->rare_offset;
+        if (start + search->length <= end && memcmp(start, search->pattern, search->length) == 0)
         {
-            perror("Error opening file");
-            return;
+            return start;
         }
+        candidate++;
+    }
+    return NULL;
+}
 
-        // Read the file data and send it to the client
-        // Continuously read data from the file descriptor into the buffer
-        // Read up to sizeof(buffer) bytes from the file_descriptor
-        while ((bytes_read = read(file_descriptor, buffer, sizeof(buffer))) >= 0)
-        {
-            // If no more data is read (bytes_read == 0), it indicates the end of the file
-            if (bytes_read == 0)
-            {
-                send(client_socket, buffer, 1, 0);      // Sending empty buffer to indicate end of file
-            }
-            else
-            {
-                send(client_socket, buffer, bytes_read, 0); // send the raed data to the client
-            }
-            // If the number of bytes read is less than the buffer size, it means end of file is reached
-            if (bytes_read < sizeof(buffer))
-            {
-                break; // End of file reached
-            }
-        }
+// Function to search one mapped file and send its matching lines as "path:line:text"
+void grep_file(struct grep_search *search, const char *relative)
+{
+    char batch[GREP_BATCH + BUFFER_SIZE + GREP_LINE_MAX + 64];
+    char path[BUFFER_SIZE];
+    size_t used = 0;
+    struct stat status;
+    struct pack_entry packed;
+    const char *mapping, *data, *end, *position, *counted;
+    size_t size = 0, lead = 0;          // File size, and bytes of the segment mapped in front of a packed file
+    off_t start = 0;                    // Where the mapping starts, page aligned
+    long line_number = 1;
+    int new_file = 1;
+    int file_descriptor;
 
+    // A packed file is mapped from its segment, starting at the page that holds its first byte
+    snprintf(path, sizeof(path), "%s/%s", search->store_root, relative);
+    if ((file_descriptor = pack_open_file(relative, &packed)) >= 0)
+    {
+        lead = packed.offset % sysconf(_SC_PAGESIZE);
+        start = packed.offset - lead;
+        size = packed.length;
+    }
+    else if ((file_descriptor = open(path, O_RDONLY)) < 0)
+    {
+        return;
+    }
+    else if (fstat(file_descriptor, &status) == 0)
+    {
+        size = status.st_size;
+    }
+    if (size == 0 || (mapping = mmap(NULL, lead + size, PROT_READ, MAP_PRIVATE, file_descriptor, start)) == MAP_FAILED)
+    {
         close(file_descriptor);
-        // Delay to ensure that all data is sent
-        sleep(2);
-
-        // Notify the client that the file was downloaded successfully
-        snprintf(response, sizeof(response), "File %s downloaded successfully\n", filename);
-        send(client_socket, response, strlen(response), 0);
+        return;
     }
+    close(file_descriptor);
+    madvise((void *)mapping, lead + size, MADV_SEQUENTIAL);
+    data = mapping + lead;
+    end = data + size;
+    position = counted = data;
 
-    // Handling .txt and .pdf files by fetching from Spdf or Stext server
-    else if (strstr(filename, ".txt") != NULL)
+    while (position < end && !__atomic_load_n(&search->stopped, __ATOMIC_RELAXED))
     {
-        int text_socket;
+        const char *line_start, *line_end;
 
-        // establish connection to a text server at TEXT_ADD and STEXT_PORT
-        // Pass the file descriptor for the text server socket to text_socket
-        establish_connection(TEXT_ADDRESS, STEXT_PORT, &text_socket);
-        send(text_socket, command, strlen(command), 0); // Sending the command to the text server to request the file or perform an operation
-        
-        // continuously send the data from the text server to the client
-        while ((bytes_read = recv(text_socket, buffer, BUFFER_SIZE, 0)) >= 0)
+        if (search->use_regex)
         {
-            send(client_socket, buffer, bytes_read, 0); // sending the received data to the client
-            // if there are fewer bytes which indicates the end of the file or data transfer
-            if (bytes_read < sizeof(buffer))
+            // Line by line, REG_STARTEND lets regexec() work on the mapping without copying lines out
+            regmatch_t match;
+            line_start = position;
+            line_end = memchr(position, '\n', end - position);
+            line_end = line_end != NULL ? line_end : end;
+            match.rm_so = 0;
+            match.rm_eo = line_end - line_start;
+            position = line_end + 1;
+            if (regexec(&search->regex, line_start, 1, &match, REG_STARTEND) != 0)
             {
-                break; // End of file
+                line_number++;
+                counted = position;
+                continue;
             }
         }
-        int length = recv(text_socket, response, sizeof(response), 0); // receive the final responce from the text server
-        send(client_socket, response, strlen(response), 0); // send the final responce to the client
-        close(text_socket); // closing the connection with the text server
-    }
-    // checking for the filename containing .pdf extension
-    else if (strstr(filename, ".pdf") != NULL)
-    {
-        int pdf_socket;
-        // Establish a connection to the PDF server at PDF_ADDRESS and SPDF_PORT
-        // Pass the file descriptor for the PDF server socket to pdf_socket
-
-        establish_connection(PDF_ADDRESS, SPDF_PORT, &pdf_socket); // Send the command to the PDF server to request the file or perform an operation
-        send(pdf_socket, command, strlen(command), 0); // Send the command to the PDF server to request the file or perform an operation
-        
-        // continuously receive data from the PDF server and send it to the client
-        while ((bytes_read = recv(pdf_socket, buffer, BUFFER_SIZE, 0)) >= 0)
+        else
         {
-            send(client_socket, buffer, bytes_read, 0); // send the received data to the client
-            // If fewer bytes than the buffer size are read, it indicates end of file or data transfer
-            if (bytes_read < sizeof(buffer))
+            const char *found = grep_find(search, position, end);
+            if (found == NULL)
+            {
+                break;
+            }
+            line_start = found;
+            while (line_start > data && line_start[-1] != '\n')
             {
-                break; // End of file
+                line_start--;
             }
+            line_end = memchr(found, '\n', end - found);
+            line_end = line_end != NULL ? line_end : end;
+            position = line_end + 1;
         }
 
-        int length = recv(pdf_socket, response, sizeof(response), 0);  // Receive the final response or status from the PDF server
-        // Send the final response to the client
-        // Send the entire response buffer, even if it's not null-terminated
-        send(client_socket, response, sizeof(response), 0);
-        close(pdf_socket); // close the connection for the PDF server
+        // Count the lines skipped since the last match
+        while (counted < line_start && (counted = memchr(counted, '\n', line_start - counted)) != NULL)
+        {
+            counted++;
+            line_number++;
+        }
+        counted = position;
+
+        used += snprintf(batch + used, sizeof(batch) - used, "%s:%ld:%.*s\n", relative, line_number, (int)(line_end - line_start > GREP_LINE_MAX ? GREP_LINE_MAX : line_end - line_start), line_start);
+        line_number++;
+        if (used >= GREP_BATCH)
+        {
+            grep_emit(search, batch, used, new_file);
+            used = 0;
+            new_file = 0;
+        }
     }
-    else
+    if (used > 0)
     {
-        snprintf(response, sizeof(response), "File type %s is not supported.\n", filename);
-        send(client_socket, response, strlen(response), 0);
+        grep_emit(search, batch, used, new_file);
     }
+    munmap((void *)mapping, lead + size);
 }
 
-
-void remove_file(int client_socket, char *filename, char *buffer)
+// Function run by every search thread: takes the next unsearched file until none is left or the search stopped
+void *grep_worker(void *argument)
 {
-    char response[BUFFER_SIZE];                 // Response buffer to store and send messages back to the client
-        // Checking if the file to be removed is a C source file (".c")
-        if (strstr(filename, ".c") != NULL)
-    {
-        char path[BUFFER_SIZE];
+    struct grep_search *search = argument;
+    int index;
 
-        // Constructing the full path to the file in the 'smain' directory
-        snprintf(path, sizeof(path), "%s/smain/%s", valid_home_dir(), filename);
-        remove(path);           // Remove the file from the server's filesystem
-        snprintf(response, sizeof(response), "File %s deleted successfully.\n", filename);
-        send(client_socket, response, strlen(response), 0);     // Send the success message back to the client
+    while (!__atomic_load_n(&search->stopped, __ATOMIC_RELAXED) && (index = __atomic_fetch_add(&search->next_file, 1, __ATOMIC_RELAXED)) < search->file_count)
+    {
+        grep_file(search, search->files[index]);
     }
+    return NULL;
+}
 
-    // Request removal from Spdf or Stext if the file is .pdf or .txt
-    if (strstr(filename, ".txt") != NULL)
-    {
-        int text_socket;
+// Function to search all collected files with up to GREP_MAX_THREADS threads, one per core
+void grep_run(struct grep_search *search)
+{
+    pthread_t threads[GREP_MAX_THREADS];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = 0;
 
-        // Establish a connection to the Stext server using predefined address and port
-        establish_connection(TEXT_ADDRESS, STEXT_PORT, &text_socket);
-        // Send the request to remove the .txt file to the Stext server
-        send(text_socket, buffer, strlen(buffer), 0);
-        int length = recv(text_socket, response, BUFFER_SIZE, 0);
-        // Forward the response from the Stext server to the client
-        send(client_socket, response, strlen(response), 0);
-        close(text_socket);
+    cores = cores < 1 ? 1 : cores > GREP_MAX_THREADS ? GREP_MAX_THREADS : cores;
+    while (thread_count < cores - 1 && thread_count < search->file_count - 1 &&
+           pthread_create(&threads[thread_count], NULL, grep_worker, search) == 0)
+    {
+        thread_count++;
     }
-
-    // Handling the removal of .pdf files from the Spdf server
-    else if (strstr(filename, ".pdf") != NULL)
+    grep_worker(search); // The calling thread searches too
+    for (int i = 0; i < thread_count; i++)
     {
-        int pdf_socket;
+        pthread_join(threads[i], NULL);
+    }
+}
 
-        // Establishing a connection to the Spdf server using predefined address and port
-        establish_connection(PDF_ADDRESS, SPDF_PORT, &pdf_socket);
-        send(pdf_socket, buffer, strlen(buffer), 0);
-        // Receiving the response from the Spdf server after processing the request
-        int length = recv(pdf_socket, response, BUFFER_SIZE, 0);
-        send(client_socket, response, strlen(response), 0);
-        close(pdf_socket);
+// Function to release what a search allocated
+void grep_free(struct grep_search *search)
+{
+    for (int i = 0; i < search->file_count; i++)
+    {
+        free(search->files[i]);
     }
+    free(search->files);
+    if (search->use_regex)
+    {
+        regfree(&search->regex);
+    }
+    pthread_mutex_destroy(&search->lock);
 }
 
+// One Stext search whose results are merged into the client's stream
+struct grep_relay
+{
+    struct grep_search *search;
+    int backend_socket;
+    long matched_files;                 // Files the forwarded lines came from
+    int complete;                       // Stext's stream ended with a good checksum
+    int threaded;                       // Running in its own thread, which owns its buffer pool
+};
 
-void handle_dtar(int client_sock, char *filetype)
+// Function to pass Stext's matching lines on to the client while Smain searches its own files
+// The stream is read to its end even after the limit is reached, so the connection stays in step
+void *grep_relay_thread(void *argument)
 {
-    char buffer[BUFFER_SIZE];   // Buffer for storing data to send or receive
-    FILE *tar_file;             // File pointer to handle tar files locally
-    size_t file_size;           // Variable to hold the size of the file
+    struct grep_relay *relay = argument;
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    char status[BUFFER_SIZE], previous[BUFFER_SIZE] = "";
+    uint32_t checksum = 0, trailer;
+    long length, reported, sent;
+    int all_sent = 1;
 
-    if (strcmp(filetype, ".c") == 0)
+    while (buffer != NULL && (length = recv_chunk(relay->backend_socket, &buffer, &capacity)) > 0)
     {
-        // Handling .c files locally on Smain server
+        // Every chunk holds lines of one file, a chunk naming another file than the last one starts a new file
+        const char *colon = memchr(buffer, ':', length);
+        size_t name_length = colon != NULL ? (size_t)(colon - buffer) : (size_t)length;
+        int new_file = name_length >= sizeof(previous) || strncmp(buffer, previous, name_length) != 0 || previous[name_length] != '\0';
 
-        // Create a tar archive of all .c files in the ~/smain directory
-        // The system function executes the shell command to find all .c files and archive them into a tar file
-        system("find ~/smain -name '*.c' | tar -cvf c_list.tar -T -");
-        tar_file = fopen("c_list.tar", "rb");
+        checksum = crc32c_update(checksum, buffer, length);
+        sent = grep_emit(relay->search, buffer, length, 0);
+        all_sent &= sent == length;
+        if (sent > 0 && new_file)
+        {
+            relay->matched_files++;
+            snprintf(previous, sizeof(previous), "%.*s", (int)name_length, buffer);
+        }
     }
-    // Checking if the file type is ".pdf"
-    else if (strcmp(filetype, ".pdf") == 0)
+    if (buffer != NULL && length == 0 && recv_all(relay->backend_socket, &trailer, sizeof(trailer)) == 0 &&
+        ntohl(trailer) == checksum && recv_line(relay->backend_socket, status, sizeof(status)) == 0)
     {
-        // Handle .pdf files on Spdf server
-        int spdf_sock;
-        establish_connection(PDF_ADDRESS, SPDF_PORT, &spdf_sock);
-        // Send command to Spdf server to create the tar file
-        send(spdf_sock, "dtar .pdf", strlen("dtar .pdf"), 0);
-
-        close(spdf_sock);
+        relay->complete = 1;
+        // Lines of a big file may come in several chunks between other files' chunks, Stext's own count is exact
+        if (all_sent && sscanf(status, "grep found %*d matching lines in %ld", &reported) == 1)
+        {
+            relay->matched_files = reported;
+        }
     }
-    // Checking if the file type is ".txt"
-    else if (strcmp(filetype, ".txt") == 0)
+    pool_release(buffer, capacity);
+    if (relay->threaded)
     {
-        // Handle .txt files on Stext server
-        int stext_sock;
+        pool_destroy(); // The thread's buffers go away with it
+    }
+    return NULL;
+}
 
-        // Establish a connection to the Stext server using its address and port number
-        establish_connection(TEXT_ADDRESS, STEXT_PORT, &stext_sock);
+// Function to handle "grep [-i] [-E] [-m limit] pattern [path]" over the stored .c and .txt files
+// Smain searches its .c files with one thread per core while Stext does the same for the .txt files, and both
+// result sets go to the client as one chunked stream of "path:line:text" lines followed by a status message
+void handle_grep(int client_sock, char *buffer)
+{
+    struct grep_search search;
+    struct grep_relay relay;
+    pthread_t relay_thread;
+    char arguments[BUFFER_SIZE], frame[BUFFER_SIZE], store_root[BUFFER_SIZE], response[BUFFER_SIZE];
+    const char *path;
+    int slot = -1;
 
-        // Send command to Stext server to create the tar file
-        send(stext_sock, "dtar .txt", strlen("dtar .txt"), 0);
+    memset(&search, 0, sizeof(search));
+    memset(&relay, 0, sizeof(relay));
+    pthread_mutex_init(&search.lock, NULL);
+    snprintf(arguments, sizeof(arguments), "%s", buffer + strlen("grep"));
+    snprintf(store_root, sizeof(store_root), "%s/smain", valid_home_dir());
+    search.store_root = store_root;
+    search.sock = client_sock;
 
-        close(stext_sock);
-    }
-    else        // If the file type is not supported
+    if ((path = grep_parse(&search, arguments, "~smain")) == NULL)
     {
-        char *msg = "Unsupported file type\n";
-
-        // Send the error message to the client
-        send(client_sock, msg, strlen(msg), 0);
+        send_end_of_file(client_sock, 1);
+        snprintf(response, sizeof(response), "Usage: grep [-i] [-E] [-m limit] pattern [path]\n");
+        send(client_sock, response, strlen(response), 0);
+        grep_free(&search);
         return;
     }
 
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "File uploaded successfully\n");
+    // Stext gets the same request and searches while Smain collects and searches the .c files
+    memset(frame, 0, sizeof(frame));
+    snprintf(frame, sizeof(frame), "%s", buffer);
+    if ((slot = connect_backend(".txt", &relay.backend_socket)) >= 0)
+    {
+        relay.search = &search;
+        send_frame(relay.backend_socket, frame);
+        relay.threaded = pthread_create(&relay_thread, NULL, grep_relay_thread, &relay) == 0;
+    }
+    grep_collect(&search, path, ".c");
+    grep_collect_packed(&search, path, ".c");
+    grep_run(&search);
+    if (slot >= 0)
+    {
+        if (relay.threaded)
+        {
+            pthread_join(relay_thread, NULL);
+        }
+        else
+        {
+            grep_relay_thread(&relay);
+        }
+        close(relay.backend_socket);
+        release_backend(slot);
+    }
+    send_end_of_file(client_sock, search.checksum);
 
-    // Send the success message to the client
+    snprintf(response, sizeof(response), "grep found %ld matching lines in %ld files%s%s\n", search.matches,
+             search.matched_files + relay.matched_files, search.matches >= search.limit ? " (limit reached)" : "",
+             slot < 0 ? ", .txt files not searched, no Stext server is available" :
+             !relay.complete ? ", .txt results incomplete" : "");
     send(client_sock, response, strlen(response), 0);
+    grep_free(&search);
 }
 
 void handle_display(int client_sock, char *pathname) {
@@ -565,43 +7307,75 @@ void handle_display(int client_sock, char *pathname) {
     char txt_files_list[BUFFER_SIZE] = "";
     char final_list[3 * BUFFER_SIZE] = ""; // Buffer to store the final combined list of all file types
     char command[BUFFER_SIZE];  // Buffer to hold commands or file paths
+    char directory[BUFFER_SIZE * 2]; // Where the store keeps the directory
+    struct display_stamp stamp; // What the display cache saw of it
+
+    // A directory unchanged since it was last listed is answered from the display cache
+    snprintf(directory, sizeof(directory), "%s/smain/%s", valid_home_dir(), pathname);
+    if (display_cache_lookup(pathname, directory, c_files_list, sizeof(c_files_list), &stamp) >= 0) {
+        printf("Display of %s served from memory (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
+    } else {
+        // Retrieving the list of .c files in the specified local directory (within smain) -maxdepth 1 ensures we only search the specified directory and not subdirectories
+        // -exec basename {} \; strips the directory path, leaving just the filenames
+        snprintf(command, sizeof(command), "find %s/smain/%s -maxdepth 1 -name '*.c' -exec basename {} \\;", valid_home_dir(), pathname);
+        FILE *fp = popen(command, "r"); // Execute the command using popen and open a pipe to read its output
+        if (fp != NULL) {
+            // Reading the output of the find command line by line and append it to the c_files_list buffer
+            while (fgets(command, sizeof(command), fp) != NULL) {
+                size_t used = strlen(c_files_list);
+                snprintf(c_files_list + used, sizeof(c_files_list) - used, "%s", command);
+            }
+            pclose(fp);
+        }
 
-    // Retrieving the list of .c files in the specified local directory (within smain) -maxdepth 1 ensures we only search the specified directory and not subdirectories
-    // -exec basename {} \; strips the directory path, leaving just the filenames
-    snprintf(command, sizeof(command), "find %s/smain/%s -maxdepth 1 -name '*.c' -exec basename {} \\;", valid_home_dir(), pathname);
-    FILE *fp = popen(command, "r"); // Execute the command using popen and open a pipe to read its output
-    if (fp != NULL) {
-        // Reading the output of the find command line by line and append it to the c_files_list buffer
-        while (fgets(command, sizeof(command), fp) != NULL) {
-            strcat(c_files_list, command);
+        // Packed .c files are not in the directory, the pack index lists the ones directly inside it
+        struct pack_entry *packed;
+        size_t skip;
+        int packed_count = pack_list(pathname, &packed, &skip);
+        for (int i = 0; i < packed_count; i++) {
+            const char *name = packed[i].path + skip;
+            size_t used = strlen(c_files_list), length = strlen(name);
+            if (strchr(name, '/') == NULL && length > 2 && strcmp(name + length - 2, ".c") == 0) {
+                snprintf(c_files_list + used, sizeof(c_files_list) - used, "%s\n", name);
+            }
+        }
+        free(packed);
+        display_cache_store(&stamp, c_files_list, strlen(c_files_list));
+        if (display_cache != NULL) {
+            printf("Display of %s listed from the store (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
         }
-        pclose(fp);
     }
 
     // Request the list of .pdf files from Spdf
     int spdf_socket;
-    if (establish_connection(PDF_ADDRESS, SPDF_PORT, &spdf_socket) == 0)
+    int spdf_slot = connect_backend(".pdf", &spdf_socket);
+    if (spdf_slot >= 0)
         {
         // Constructing the display command for the server to list .pdf files
+        memset(command, 0, sizeof(command));
         snprintf(command, sizeof(command), "display %s", pathname);
-        if (send(spdf_socket, command, strlen(command), 0) >= 0) {
+        if (send_frame(spdf_socket, command) >= 0) {
         // Receiving the list of .pdf files from the Spdf server
         recv(spdf_socket, pdf_files_list, sizeof(pdf_files_list) - 1, 0);
         }
         close(spdf_socket);
+        release_backend(spdf_slot);
     }
 
     // Request the list of .txt files from Stext
     int stext_socket;
-    if (establish_connection(TEXT_ADDRESS, STEXT_PORT, &stext_socket) == 0)
+    int stext_slot = connect_backend(".txt", &stext_socket);
+    if (stext_slot >= 0)
         {
                 // Constructing the display command for the server to list .txt files
+                memset(command, 0, sizeof(command));
                 snprintf(command, sizeof(command), "display %s", pathname);
-        if (send(stext_socket, command, strlen(command), 0) >= 0) {
+        if (send_frame(stext_socket, command) >= 0) {
         // Receiving the list of .txt files from the Stext server
             recv(stext_socket, txt_files_list, sizeof(txt_files_list) - 1, 0);
         }
         close(stext_socket);
+        release_backend(stext_slot);
     }
 
     // Combining the lists of .c, .pdf, and .txt files into a single list
@@ -634,7 +7408,6 @@ int establish_connection(const char *ip_address, int port_number, int *socket_fd
     if (*socket_fd < 0)
     {
         perror("Error creating socket");
-        exit(EXIT_FAILURE);
         return -1;
     }
 
@@ -646,16 +7419,62 @@ int establish_connection(const char *ip_address, int port_number, int *socket_fd
     if (inet_pton(AF_INET, ip_address, &server_address.sin_addr) <= 0)
     {
         perror("Address conversion failed");
-        exit(EXIT_FAILURE);
+        close(*socket_fd);
         return -1;
     }
 
     // Attempting to connect to the server using the socket and the server address structure
-    // The connect() function establishes a connection to the server
-    if (connect(*socket_fd, (struct sockaddr *)&server_address, sizeof(server_address)) < 0)
+    // The connect runs non-blocking with a BACKEND_CONNECT_TIMEOUT_MS limit, so an unreachable backend
+    // costs the client a short delay instead of the kernel's full connect timeout
+    int flags = fcntl(*socket_fd, F_GETFL, 0);
+    fcntl(*socket_fd, F_SETFL, flags | O_NONBLOCK);
+    int result = connect(*socket_fd, (struct sockaddr *)&server_address, sizeof(server_address));
+    if (result < 0 && errno == EINPROGRESS)
     {
-        perror("Failed to connect to server");
-        exit(EXIT_FAILURE);
+        struct pollfd waiting = {*socket_fd, POLLOUT, 0};
+        int error = ETIMEDOUT;
+        socklen_t error_length = sizeof(error);
+
+        if (poll(&waiting, 1, BACKEND_CONNECT_TIMEOUT_MS) == 1)
+        {
+            getsockopt(*socket_fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        }
+        errno = error;
+        result = error == 0 ? 0 : -1;
+    }
+    if (result < 0)
+    {
+        fprintf(stderr, "Failed to connect to server %s:%d: %s\n", ip_address, port_number, strerror(errno));
+        close(*socket_fd);
+        return -1;
+    }
+    fcntl(*socket_fd, F_SETFL, flags);
+    return 0;
+}
+
+// Function to connect to a Unix socket of a co-located backend, a path starting with '@' is in the abstract namespace
+// Fails quietly, the caller falls back to another way of reaching the backend
+int establish_local_connection(const char *path, int socket_type, int *socket_fd)
+{
+    struct sockaddr_un address;
+    socklen_t length = sizeof(address);
+
+    if ((*socket_fd = socket(AF_UNIX, socket_type, 0)) < 0)
+    {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    if (path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+        length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    }
+    if (connect(*socket_fd, (struct sockaddr *)&address, length) != 0)
+    {
+        close(*socket_fd);
+        return -1;
     }
     return 0;
 }
\ No newline at end of file
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE          // fallocate() and sync_file_range()
+#define _FILE_OFFSET_BITS 64  // 64-bit file sizes and offsets on 32-bit systems too
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +11,51 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>  // FICLONE reflink copies for cpfile
+#include <linux/fs.h>   // ... and its request number
+#include <sys/sendfile.h> // In-kernel copies on kernels without copy_file_range()
+#include <pthread.h>    // Process-shared lock of the display cache
 
 #define PORT 6011
 #define BUFFER_SIZE 1024
 #define ADDRESS "127.0.1.7"
+#define SMAIN_ADDRESS "127.0.0.4"           // Smain, which this server registers with through heartbeats
+#define SMAIN_PORT 6009
+#define HEARTBEAT_INTERVAL 2                // Seconds between two heartbeats
+#define LOCAL_TRANSPORT_ENABLED 1           // Also take Smain's requests over a Unix socket when both run on one host
+#define RMFILE_MAX_REPORTED 8               // Failed paths listed in an rmfile reply, the rest are only counted
+#define RMFILE_REPORT_BYTES 640             // Room for the listed failures, so a reply fits one BUFFER_SIZE frame
+#define STAT_MAX_PATHS 512                  // Paths one stat command can name, as many as fit one command frame
+#define STAT_LINE_MAX 64                    // Longest reply line for one path of a stat
+#define PREALLOCATE_ENABLED 1               // Reserve the size a ufile announces with fallocate() before its data arrives
+#define UPLOAD_CHUNK_MIN (1024 * 1024)      // Smallest chunk of a parallel upload (1 MB)
+#define UPLOAD_CHUNK_MAX (256LL * 1024 * 1024) // Largest chunk of a parallel upload (256 MB)
+#define UPLOAD_MAX_CHUNKS 65536             // Most chunks one parallel upload is split into
+#define UPLOAD_TABLE_MAGIC 0x6b686375u      // Starts the chunk table of a parallel upload
+#define DISPLAY_CACHE_ENABLED 1             // Answer repeated displays of an unchanged directory from memory
+#define DISPLAY_CACHE_SLOTS 512             // Listings kept at most, about 1.3 KB each, so the cache stays under 1 MB
+#define DISPLAY_CACHE_WAYS 8                // Slots one directory's listing may take, the least recently used is replaced
+#define DISPLAY_PATH_MAX 256                // Longest directory path whose listing is kept
+#define DISPLAY_RACY_NS 1000000000LL        // A directory changed this recently is listed again, see display_cache_store()
+
+#include "crc32c.h"                 // CRC32C of file data, the same in every program
+#include "trace.h"                  // Request spans, the same in every program
+#include "chunks.h"                 // Buffer pool and chunked file transfers, the same in every program
+#include "command.h"                // Command frames and their words, the same in every server
 
 const char *valid_home_dir()
 {
@@ -55,19 +98,604 @@ int create_dir_if_new(const char *directory_path) {
     return 0; // Return 0 to indicate success
 }
 
+
+// Function to open the reply to a download with a status line: "data" when the file's chunk stream follows, "none"
+// when only the final message does. MSG_MORE holds the line back so it leaves in one segment with what follows
+int send_download_status(int sock, int found)
+{
+    const char *status = found ? "data\n" : "none\n";
+
+    return send(sock, status, strlen(status), MSG_MORE) == (ssize_t)strlen(status) ? 0 : -1;
+}
+
+// Function to read the file size a ufile frame announces after its destination, -1 when the client sent none
+long long announced_size(const char *frame)
+{
+    long long size;
+
+    return sscanf(frame, "%*s %*s %*s %lld", &size) == 1 && size >= 0 ? size : -1;
+}
+
+// Function to reserve the disk space of an upload before its data arrives, so a huge file gets few large extents and
+// a full disk is noticed before any data is sent. The file keeps its size while the data comes in
+// Returns -1 when the space is not there; filesystems without fallocate() allocate as the data is written instead
+int preallocate_file(FILE *file, long long size)
+{
+    if (!PREALLOCATE_ENABLED || size <= 0 ||
+        fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, size) == 0 || errno == EOPNOTSUPP || errno == ENOSYS)
+    {
+        return 0;
+    }
+    return -1;
+}
+
+// Function to give back the space reserved past the end of an upload that came in shorter than announced
+void trim_preallocated(FILE *file, long long size)
+{
+    off_t end;
+
+    if (size > 0 && fflush(file) == 0 && (end = ftello(file)) < size && ftruncate(fileno(file), end) != 0)
+    {
+        perror("Failed to release preallocated space");
+    }
+}
+
 void process_client(int sock_client);
 void process_upload(int sock_client, char *file_name, char *path_dest, char *recv_buffer);
 void process_download(int sock_client, char *file_name);
-void handle_remove_file(int client_socket, char *file_name);
+void handle_remove_file(int client_socket, char *command);
+void handle_relocate(int client_socket, char *command, int move);
 void handle_create_tar(int client_socket, char *file_extension);
 void handle_display(int client_socket, char *pathname);
+void handle_stat(int client_socket, char *command);
+void handle_manifest(int client_socket, char *directory);
+void handle_range(int client_socket, char *file_name, char *command);
+void handle_upload_begin(int client_socket, char *command);
+void handle_upload_chunk(int client_socket, char *command);
+void handle_upload_commit(int client_socket, char *command);
+
+// One cached display listing, valid while its directory keeps the identity and change times it had when it was listed
+struct display_entry
+{
+    int used;                           // Slot holds a listing
+    char path[DISPLAY_PATH_MAX];        // Directory as the clients name it, repeated and trailing slashes dropped
+    int present;                        // The directory existed when it was listed, packed files need none
+    dev_t device;                       // Identity and change times of the directory when it was listed
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long last_used;       // display_cache->ticks at the last use, the oldest listing of a set makes room
+    size_t length;                      // Bytes of the listing
+    char listing[BUFFER_SIZE];
+};
+
+// The display cache, one table every worker maps: sets of DISPLAY_CACHE_WAYS slots chosen by a hash of the path
+struct display_cache
+{
+    pthread_mutex_t lock;               // Process-shared lock guarding everything below
+    unsigned long long changes;         // Bumped by every invalidation, a listing made across one is not kept
+    unsigned long long ticks;           // Counts the uses of listings, for last_used
+    unsigned long hits;                 // Displays answered from the cache
+    unsigned long misses;               // Displays that listed the directory
+    unsigned long invalidations;        // Listings dropped because their directory changed
+    unsigned long evictions;            // Listings dropped to make room in a full set
+    struct display_entry entries[DISPLAY_CACHE_SLOTS];
+};
+
+// What display_cache_lookup() saw of a directory before it was listed, for display_cache_store()
+struct display_stamp
+{
+    int cacheable;                      // Caching is on and the path is short enough
+    char path[DISPLAY_PATH_MAX];
+    int present;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long changes;         // display_cache->changes at the lookup
+};
+
+struct display_cache *display_cache;    // Mapped by display_cache_init(), NULL while every display lists afresh
+
+// Function to map the display cache before the first worker starts, so all of them share it
+int display_cache_init()
+{
+    pthread_mutexattr_t attributes;
+
+    display_cache = mmap(NULL, sizeof(struct display_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (display_cache == MAP_FAILED)
+    {
+        perror("Failed to map the display cache");
+        display_cache = NULL;
+        return -1;
+    }
+    memset(display_cache, 0, sizeof(struct display_cache));
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&display_cache->lock, &attributes) != 0)
+    {
+        perror("Failed to create the display cache lock");
+        munmap(display_cache, sizeof(struct display_cache));
+        display_cache = NULL;
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attributes);
+    printf("Display cache keeps up to %d listings in %zu KB\n", DISPLAY_CACHE_SLOTS, sizeof(struct display_cache) / 1024);
+    return 0;
+}
+
+// Function to turn a directory named by a client into its cache key, dropping repeated and trailing slashes
+// Returns -1 when it is too long to be cached
+int display_key(const char *path, char *key)
+{
+    size_t length = 0;
+
+    for (const char *p = path; *p != '\0'; p++)
+    {
+        if (*p == '/' && (length == 0 || key[length - 1] == '/'))
+        {
+            continue;
+        }
+        if (length == DISPLAY_PATH_MAX - 1)
+        {
+            return -1;
+        }
+        key[length++] = *p;
+    }
+    while (length > 0 && key[length - 1] == '/')
+    {
+        length--;
+    }
+    key[length] = '\0';
+    return 0;
+}
+
+// Function to find the set of slots a key may use
+struct display_entry *display_set(const char *key)
+{
+    uint32_t hash = crc32c_update(0, key, strlen(key));
+
+    return &display_cache->entries[hash % (DISPLAY_CACHE_SLOTS / DISPLAY_CACHE_WAYS) * DISPLAY_CACHE_WAYS];
+}
+
+// Function to find the cached listing of a directory. directory is where the store keeps it; a listing is only used
+// while the directory has the identity and change times it had when it was listed, so changes made behind the
+// server's back are noticed too. *stamp records what was seen, for display_cache_store() after a miss
+// Returns the length of the listing copied to listing, -1 on a miss
+long display_cache_lookup(const char *path, const char *directory, char *listing, size_t size, struct display_stamp *stamp)
+{
+    struct display_entry *set;
+    struct stat info;
+    long length = -1;
+
+    stamp->cacheable = display_cache != NULL && display_key(path, stamp->path) == 0;
+    if (!stamp->cacheable)
+    {
+        return -1;
+    }
+    memset(&info, 0, sizeof(info));
+    stamp->present = stat(directory, &info) == 0 && S_ISDIR(info.st_mode);
+    stamp->device = stamp->present ? info.st_dev : 0;
+    stamp->inode = stamp->present ? info.st_ino : 0;
+    stamp->mtime = stamp->present ? info.st_mtim : (struct timespec){0, 0};
+    stamp->ctime = stamp->present ? info.st_ctim : (struct timespec){0, 0};
+    set = display_set(stamp->path);
+
+    pthread_mutex_lock(&display_cache->lock);
+    stamp->changes = display_cache->changes;
+    for (int i = 0; i < DISPLAY_CACHE_WAYS; i++)
+    {
+        struct display_entry *entry = &set[i];
+
+        if (!entry->used || strcmp(entry->path, stamp->path) != 0)
+        {
+            continue;
+        }
+        if (entry->present == stamp->present && entry->device == stamp->device && entry->inode == stamp->inode &&
+            entry->mtime.tv_sec == stamp->mtime.tv_sec && entry->mtime.tv_nsec == stamp->mtime.tv_nsec &&
+            entry->ctime.tv_sec == stamp->ctime.tv_sec && entry->ctime.tv_nsec == stamp->ctime.tv_nsec &&
+            entry->length < size)
+        {
+            memcpy(listing, entry->listing, entry->length);
+            listing[entry->length] = '\0';
+            length = (long)entry->length;
+            entry->last_used = ++display_cache->ticks;
+        }
+        else
+        {
+            entry->used = 0; // The directory changed since it was listed
+            display_cache->invalidations++;
+        }
+        break;
+    }
+    if (length >= 0)
+    {
+        display_cache->hits++;
+    }
+    else
+    {
+        display_cache->misses++;
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+    return length;
+}
+
+// Function to keep a listing made after display_cache_lookup() missed. It is not kept when an invalidation came in
+// meanwhile, nor when the directory changed in the last DISPLAY_RACY_NS: file times only move once per kernel clock
+// tick, so a second change in the tick of the first would leave them as they were
+void display_cache_store(const struct display_stamp *stamp, const char *listing, size_t length)
+{
+    struct display_entry *set, *slot = NULL;
+    struct timespec now;
+    long long changed_ns;
+
+    if (!stamp->cacheable || length >= BUFFER_SIZE)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    changed_ns = (long long)stamp->mtime.tv_sec * 1000000000LL + stamp->mtime.tv_nsec;
+    if ((long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec > changed_ns)
+    {
+        changed_ns = (long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec;
+    }
+    if (stamp->present && (long long)now.tv_sec * 1000000000LL + now.tv_nsec - changed_ns < DISPLAY_RACY_NS)
+    {
+        return;
+    }
+    set = display_set(stamp->path);
+
+    pthread_mutex_lock(&display_cache->lock);
+    if (display_cache->changes == stamp->changes)
+    {
+        // The directory's own slot when another worker listed it meanwhile, else a free one, else the least
+        // recently used of the set
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++)
+        {
+            if (set[i].used && strcmp(set[i].path, stamp->path) == 0)
+            {
+                slot = &set[i];
+            }
+        }
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++)
+        {
+            if (!set[i].used)
+            {
+                slot = &set[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            slot = &set[0];
+            for (int i = 1; i < DISPLAY_CACHE_WAYS; i++)
+            {
+                slot = set[i].last_used < slot->last_used ? &set[i] : slot;
+            }
+            display_cache->evictions++;
+        }
+        slot->used = 1;
+        snprintf(slot->path, sizeof(slot->path), "%s", stamp->path);
+        slot->present = stamp->present;
+        slot->device = stamp->device;
+        slot->inode = stamp->inode;
+        slot->mtime = stamp->mtime;
+        slot->ctime = stamp->ctime;
+        slot->last_used = ++display_cache->ticks;
+        slot->length = length;
+        memcpy(slot->listing, listing, length);
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+}
+
+// Function to drop the listings a change to a stored path makes stale: that of the directory holding it, and for
+// a directory or a glob its own and all below it. Called once the change is done, which also keeps a listing made
+// meanwhile from being stored
+void display_cache_invalidate(const char *path)
+{
+    char key[DISPLAY_PATH_MAX];
+    char *slash;
+    size_t length, parent_length;
+
+    if (display_cache == NULL)
+    {
+        return;
+    }
+    if (display_key(path, key) != 0)
+    {
+        key[0] = '\0'; // Too long to compare, every listing goes
+    }
+    if ((slash = strrchr(key, '/')) != NULL && strpbrk(slash + 1, "*?[") != NULL)
+    {
+        *slash = '\0'; // A glob may match directories, everything below its directory goes
+    }
+    length = strlen(key);
+    slash = strrchr(key, '/');
+    parent_length = slash != NULL ? (size_t)(slash - key) : 0;
+
+    pthread_mutex_lock(&display_cache->lock);
+    display_cache->changes++;
+    for (int i = 0; i < DISPLAY_CACHE_SLOTS; i++)
+    {
+        struct display_entry *entry = &display_cache->entries[i];
+
+        if (entry->used && (length == 0 ||
+            (strncmp(entry->path, key, length) == 0 && (entry->path[length] == '\0' || entry->path[length] == '/')) ||
+            (strlen(entry->path) == parent_length && strncmp(entry->path, key, parent_length) == 0)))
+        {
+            entry->used = 0;
+            display_cache->invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&display_cache->lock);
+}
+
+// Load figures reported to Smain in every heartbeat, shared by all workers of this server
+struct server_load
+{
+    int active_transfers;       // Workers moving file data right now
+    int connections;            // Connections being served, including idle ones waiting for a command
+};
+
+struct server_load *load;                   // Shared mapping created in main()
+const char *listen_address = ADDRESS;       // Address and port this server accepts on, from argv or the defaults
+int listen_port = PORT;
+const char *smain_address = SMAIN_ADDRESS;  // Where heartbeats are sent
+char handoff_path[108];                     // Unix socket receiving handed-off client connections, empty when disabled
+int64_t trace_accepted_ns;                  // When the connection a new worker serves was accepted
+char local_path[108];                       // Abstract Unix socket for requests from a co-located Smain, empty when disabled
+
+// Function to connect to Smain for heartbeats, returns the socket or -1
+int connect_smain()
+{
+    struct sockaddr_in address;
+    int smain_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SMAIN_PORT);
+    if (smain_socket < 0 || inet_pton(AF_INET, smain_address, &address.sin_addr) <= 0 ||
+        connect(smain_socket, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        if (smain_socket >= 0)
+        {
+            close(smain_socket);
+        }
+        return -1;
+    }
+    return smain_socket;
+}
+
+// Function run by the heartbeat process: reports this server and its load to Smain every HEARTBEAT_INTERVAL seconds
+// The first heartbeat registers the server; the connection is reopened whenever Smain goes away,
+// and the process ends once the server it reports for has exited
+void run_heartbeats(pid_t server_pid)
+{
+    char frame[BUFFER_SIZE];
+    char store[BUFFER_SIZE];
+    struct statvfs disk;
+    int smain_socket = -1;
+
+    snprintf(store, sizeof(store), "%s/spdf", valid_home_dir());
+    while (getppid() == server_pid)
+    {
+        if (smain_socket < 0)
+        {
+            smain_socket = connect_smain();
+        }
+        if (smain_socket >= 0)
+        {
+            long long free_bytes = 0;
+            int active = __atomic_load_n(&load->active_transfers, __ATOMIC_RELAXED);
+            int connections = __atomic_load_n(&load->connections, __ATOMIC_RELAXED);
+
+            if (statvfs(store, &disk) == 0 || statvfs(valid_home_dir(), &disk) == 0)
+            {
+                free_bytes = (long long)disk.f_bavail * disk.f_frsize;
+            }
+            memset(frame, 0, sizeof(frame));
+            snprintf(frame, sizeof(frame), "heartbeat .pdf %s %d %d %d %lld %s %s", listen_address, listen_port,
+                     active, connections > active ? connections - active : 0, free_bytes,
+                     handoff_path[0] ? handoff_path : "-", local_path[0] ? local_path : "-");
+            if (send(smain_socket, frame, BUFFER_SIZE, MSG_NOSIGNAL) != BUFFER_SIZE)
+            {
+                close(smain_socket);
+                smain_socket = -1;
+            }
+        }
+        sleep(HEARTBEAT_INTERVAL);
+    }
+    exit(0);
+}
+
+// Function to receive one handed-off request from Smain: the command frame with the client's socket attached
+// Returns the client socket, or -1 once Smain closed the handoff connection
+int recv_handoff(int unix_socket, char *frame)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {frame, BUFFER_SIZE};
+    struct msghdr message;
+    struct cmsghdr *header;
+    int client_socket = -1;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(unix_socket, &message, 0) != BUFFER_SIZE)
+    {
+        return -1;
+    }
+    for (header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        {
+            memcpy(&client_socket, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    frame[BUFFER_SIZE - 1] = '\0';
+    return client_socket;
+}
+
+// Function to serve the requests Smain hands off on one Unix socket connection
+// The data moves straight between this worker and the client; the one-byte reply tells Smain the client
+// connection is back in its hands and the next command may be read from it
+void serve_handoffs(int unix_socket)
+{
+    char frame[BUFFER_SIZE];
+    struct command_words words;
+    int client_socket;
+    int64_t accepted_ns = trace_accepted_ns, ready_ns = trace_now();
+
+    while ((client_socket = recv_handoff(unix_socket, frame)) >= 0)
+    {
+        char status = 0;
+        int64_t received_ns = trace_now();
+        int parsed = parse_command(frame, &words) == 0;
+
+        __atomic_add_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        if (parsed)
+        {
+            trace_command(frame, words.command, &accepted_ns, ready_ns, received_ns);
+        }
+        if (!parsed)
+        {
+            status = 1; // Smain answers the client itself
+        }
+        else if (strcmp(words.command, "ufile") == 0)
+        {
+            process_upload(client_socket, words.argument1, words.argument2, frame);
+        }
+        else if (strcmp(words.command, "dfile") == 0)
+        {
+            process_download(client_socket, words.argument1);
+        }
+        else if (strcmp(words.command, "drange") == 0)
+        {
+            handle_range(client_socket, words.argument1, frame);
+        }
+        else if (strcmp(words.command, "uchunk") == 0)
+        {
+            handle_upload_chunk(client_socket, frame);
+        }
+        else
+        {
+            status = 1; // Not a command that can be handed off, Smain answers the client itself
+        }
+        __atomic_sub_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        if (parsed)
+        {
+            trace_end(words.command, status == 0 ? 0 : -1);
+        }
+
+        // Smain shares the client connection, so a stream that broke off part way has to end it for Smain too
+        if (chunk_stream_broken(client_socket))
+        {
+            shutdown(client_socket, SHUT_RDWR);
+        }
+        close(client_socket);
+        if (send(unix_socket, &status, 1, MSG_NOSIGNAL) != 1)
+        {
+            break;
+        }
+    }
+}
+
+// Function run by a Unix socket listener process: accepts the co-located Smain's connections and forks a worker
+// running serve() for each. The listener ends together with the server it belongs to
+void run_unix_listener(int unix_server, void (*serve)(int))
+{
+    int unix_socket;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while ((unix_socket = accept(unix_server, NULL, NULL)) >= 0)
+    {
+        trace_accepted_ns = trace_now();
+        if (fork() == 0)
+        {
+            close(unix_server);
+            __atomic_add_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            serve(unix_socket);
+            __atomic_sub_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            close(unix_socket);
+            trace_flush(1);
+            pool_destroy();
+            exit(0);
+        }
+        close(unix_socket);
+        while (waitpid(-1, NULL, WNOHANG) > 0)
+        {
+        }
+    }
+    exit(0);
+}
+
+// Function to open a listening Unix socket of the given type, returns the socket or -1 after clearing path
+// A path starting with '@' names a socket in the abstract namespace, which needs no file and vanishes with the server
+int open_unix_listener(int socket_type, char *path)
+{
+    struct sockaddr_un address;
+    socklen_t length = sizeof(address);
+    int unix_server = socket(AF_UNIX, socket_type, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    if (path[0] == '@')
+    {
+        address.sun_path[0] = '\0';
+        length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    }
+    else
+    {
+        unlink(path); // Left over from an earlier run
+    }
+    if (unix_server < 0 || bind(unix_server, (struct sockaddr *)&address, length) != 0 ||
+        listen(unix_server, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "Cannot listen on Unix socket %s: %s\n", path, strerror(errno));
+        if (unix_server >= 0)
+        {
+            close(unix_server);
+        }
+        path[0] = '\0';
+        return -1;
+    }
+    return unix_server;
+}
 
-int main()
+// Usage: Spdf [address port [smain_address]]
+// Further replicas are started with their own address or port and their own HOME, and register with Smain by themselves
+int main(int argc, char *argv[])
 {
     int sock_server, sock_client; // Declare a socket descriptor for the server socket, client socket
     struct sockaddr_in addr_server, addr_client; // Define the server address structure to hold server address information
     socklen_t len_addr = sizeof(addr_client); // Define the client address structure to hold client address information
 
+    crc32c_init(); // Prepare the checksum tables before any transfer
+    trace_init(TRACE_HOP_SPDF); // Workers inherit the trace file, their spans are appended to it
+
+    if (argc > 2)
+    {
+        listen_address = argv[1];
+        listen_port = atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        smain_address = argv[3];
+    }
+    load = mmap(NULL, sizeof(struct server_load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (load == MAP_FAILED)
+    {
+        perror("Failed to map the load counters");
+        exit(EXIT_FAILURE);
+    }
+    memset(load, 0, sizeof(struct server_load));
+    if (DISPLAY_CACHE_ENABLED)
+    {
+        display_cache_init(); // Without it every display lists its directory afresh
+    }
+
     // Create a socket for the server
     if ((sock_server = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -78,10 +706,10 @@ int main()
     addr_server.sin_family = AF_INET; // Set the address family to AF_INET for IPv4 addresses
     // Set the port number for the server address, converting from host byte order to network byte order
     // htons() ensures the port number is in the correct byte order for network communication
-    addr_server.sin_port = htons(PORT);
+    addr_server.sin_port = htons(listen_port);
 
     // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, ADDRESS, &addr_server.sin_addr) <= 0)
+    if (inet_pton(AF_INET, listen_address, &addr_server.sin_addr) <= 0)
     {
         perror("Invalid IP address");
         exit(EXIT_FAILURE);
@@ -96,18 +724,53 @@ int main()
     }
 
     // Listen for incoming connections
-    if (listen(sock_server, 3) < 0)
+    if (listen(sock_server, SOMAXCONN) < 0)
     {
         perror("Failed to listen");
         close(sock_server);
         exit(EXIT_FAILURE);
     }
 
-    printf("PDF server running and listening on port %d\n", PORT);
+    printf("PDF server running and listening on %s:%d\n", listen_address, listen_port);
+
+    // Start the Unix socket listeners used by a co-located Smain, then the heartbeat process that registers this server
+    // Requests arrive over the local stream socket instead of TCP, handed-off client connections over the handoff socket
+    pid_t server_pid = getpid();
+    int unix_server;
+    snprintf(handoff_path, sizeof(handoff_path), "%s/.spdf-%d.sock", valid_home_dir(), listen_port);
+    if ((unix_server = open_unix_listener(SOCK_SEQPACKET, handoff_path)) >= 0)
+    {
+        if (fork() == 0)
+        {
+            close(sock_server);
+            run_unix_listener(unix_server, serve_handoffs);
+        }
+        close(unix_server);
+    }
+    snprintf(local_path, sizeof(local_path), "@datasync-spdf-%s-%d", listen_address, listen_port);
+    if (LOCAL_TRANSPORT_ENABLED && (unix_server = open_unix_listener(SOCK_STREAM, local_path)) >= 0)
+    {
+        if (fork() == 0)
+        {
+            close(sock_server);
+            run_unix_listener(unix_server, process_client);
+        }
+        close(unix_server);
+    }
+    else
+    {
+        local_path[0] = '\0';
+    }
+    if (fork() == 0)
+    {
+        close(sock_server);
+        run_heartbeats(server_pid);
+    }
 
     // Accept and handle incoming client connections
     while ((sock_client = accept(sock_server, (struct sockaddr *)&addr_client, &len_addr)) >= 0)
     {
+        trace_accepted_ns = trace_now();
         printf("Incoming client connection...\n");
         printf("Establishing connection...\n");
 
@@ -115,14 +778,22 @@ int main()
         if (fork() == 0) // child process
         {
             close(sock_server); // Close the server socket in the child process as it is not needed
+            __atomic_add_fetch(&load->connections, 1, __ATOMIC_RELAXED);
             process_client(sock_client); // to handle the client requests
+            __atomic_sub_fetch(&load->connections, 1, __ATOMIC_RELAXED);
             close(sock_client);
+            trace_flush(1);      // Write out the spans of this worker's requests
+            pool_report("Spdf"); // Print the buffer pool counters of this worker
+            pool_destroy();
             exit(0);
         }
         else
         {
             close(sock_client);
-            wait(NULL); // Wait for the child process to terminate
+            // Reap finished workers without blocking, so the stripes of a striped download are served side by side
+            while (waitpid(-1, NULL, WNOHANG) > 0)
+            {
+            }
         }
     }
 
@@ -140,29 +811,39 @@ int main()
 void process_client(int sock_client)
 {
     char recv_buffer[BUFFER_SIZE]; // Buffer to store the data received from the client
-    char cmd[BUFFER_SIZE]; // Buffer to store the command received from the client
-    char param1[BUFFER_SIZE], param2[BUFFER_SIZE]; // Buffer to store the first and second parameter for the command received from the client
+    struct command_words words;    // The command and its parameters, split out of the frame
+    int64_t accepted_ns = trace_accepted_ns, ready_ns = trace_now(); // For the span of the wait for this worker
 
     // Infinite loop to continuously handle client requests
     while (1)
     {
-        // Clear buffers before processing a new client request
-        for (int i = 0; i < BUFFER_SIZE; i++)
-        {
-            recv_buffer[i] = 0;
-            cmd[i] = 0;
-            param1[i] = 0;
-            param2[i] = 0;
-        }
-        // Receive the command from the client
-        if (recv(sock_client, recv_buffer, BUFFER_SIZE, 0) <= 0)
+        // Receive the command frame from the client, Smain always sends a full BUFFER_SIZE frame
+        // Nothing past the frame is read, the chunks of an upload that follow it stay in the socket for the handler
+        size_t frame_used = 0;
+        int64_t received_ns;
+        if (recv_command_frame(sock_client, recv_buffer, &frame_used, &received_ns, 1) != 0)
         {
-        //    perror("Error in receiving data");
             break;  // Exit loop on receiving failure
         }
 
         // Parse the received command and arguments
-        sscanf(recv_buffer, "%s %s %s", cmd, param1, param2);
+        if (parse_command(recv_buffer, &words) != 0)
+        {
+            // What follows an unreadable command cannot be told apart from the next one, so the connection ends here
+            char *error_message = "Command argument too long\n";
+            send(sock_client, error_message, strlen(error_message), 0);
+            break;
+        }
+        char *cmd = words.command, *param1 = words.argument1, *param2 = words.argument2;
+        trace_command(recv_buffer, cmd, &accepted_ns, ready_ns, received_ns); // Smain passed on the client's request ID
+
+        // Commands that move file data count as active transfers in the heartbeats
+        int transfer = strcmp(cmd, "ufile") == 0 || strcmp(cmd, "dfile") == 0 || strcmp(cmd, "drange") == 0 || strcmp(cmd, "dtar") == 0 ||
+                       strcmp(cmd, "uchunk") == 0;
+        if (transfer)
+        {
+            __atomic_add_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        }
 
         // Handle the command based on its type
         if (strcmp(cmd, "ufile") == 0)
@@ -175,7 +856,11 @@ void process_client(int sock_client)
         }
         else if (strcmp(cmd, "rmfile") == 0)
         {
-            handle_remove_file(sock_client, param1); // to handle the rmfile command
+            handle_remove_file(sock_client, recv_buffer); // to handle the rmfile command
+        }
+        else if (strcmp(cmd, "mvfile") == 0 || strcmp(cmd, "cpfile") == 0)
+        {
+            handle_relocate(sock_client, recv_buffer, strcmp(cmd, "mvfile") == 0); // to move or copy inside the store
         }
         else if (strcmp(cmd, "dtar") == 0)
         {
@@ -185,13 +870,49 @@ void process_client(int sock_client)
         {
            handle_display(sock_client, param1);  // to handle the display command
         }
+        else if (strcmp(cmd, "stat") == 0)
+        {
+            handle_stat(sock_client, recv_buffer);  // to answer Smain's size/mtime query
+        }
+        else if (strcmp(cmd, "drange") == 0)
+        {
+            handle_range(sock_client, param1, recv_buffer); // to send one stripe of a file
+        }
+        else if (strcmp(cmd, "manifest") == 0)
+        {
+            handle_manifest(sock_client, param1); // to list a tree for Smain's manifest
+        }
+        else if (strcmp(cmd, "ubegin") == 0)
+        {
+            handle_upload_begin(sock_client, recv_buffer); // to start a parallel upload
+        }
+        else if (strcmp(cmd, "uchunk") == 0)
+        {
+            handle_upload_chunk(sock_client, recv_buffer); // to store one chunk of a parallel upload
+        }
+        else if (strcmp(cmd, "ucommit") == 0)
+        {
+            handle_upload_commit(sock_client, recv_buffer); // to assemble a parallel upload
+        }
         else
         {
             // Send an error message if the command is invalid
             const char *err_msg = "Command not recognized\n";
             send(sock_client, err_msg, strlen(err_msg), 0);
         }
-    }
+        if (transfer)
+        {
+            __atomic_sub_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        }
+
+        // The rest of a file whose chunk stream broke off must not be taken for the next commands
+        if (chunk_stream_broken(sock_client))
+        {
+            trace_end(cmd, -1);
+            break;
+        }
+        trace_end(cmd, 0);
+    }
 }
 
 void process_upload(int sock_client, char *file_name, char *path_dest, char *recv_buffer)
@@ -200,8 +921,10 @@ void process_upload(int sock_client, char *file_name, char *path_dest, char *rec
     FILE *file_pointer;                         // File pointer to manage file operations
     char response_buffer[BUFFER_SIZE];          // Buffer to hold responses sent back to the client
     char dest_dir_path[BUFFER_SIZE];            // Buffer to hold the path of the destination directory
-    char recv_file_buffer[BUFFER_SIZE];         // Buffer to hold chunks of the file data received from the client
-    int recv_bytes;                                                     // Variable to store the number of bytes received
+    char relative_path[BUFFER_SIZE * 2];        // The file's path inside the store, for the display cache
+    long long recv_bytes;                       // Number of file bytes received
+    uint32_t checksum;                          // Verified CRC32C of the received file
+    long long size = announced_size(recv_buffer); // File size the client announced, -1 from older clients
 
     // Construct the full path for the destination directory where the file will be uploaded
     snprintf(dest_dir_path, sizeof(dest_dir_path), "%s/spdf/%s", valid_home_dir(), path_dest);
@@ -209,6 +932,9 @@ void process_upload(int sock_client, char *file_name, char *path_dest, char *rec
     // Create the directory structure if it doesn't exist
     if (create_dir_if_new(dest_dir_path) != 0)
     {
+        recv_file_chunks(sock_client, NULL, NULL);    // Drain the file data so the connection stays in sync
+        snprintf(response_buffer, sizeof(response_buffer), "Unable to create directory %s\n", path_dest);
+        send(sock_client, response_buffer, strlen(response_buffer), 0);
         return;                                 // Exit if the directory cannot be created
     }
 
@@ -220,41 +946,326 @@ void process_upload(int sock_client, char *file_name, char *path_dest, char *rec
     if (file_pointer == NULL)
     {
         // Send an error message to the client if the file cannot be opened
+        recv_file_chunks(sock_client, NULL, NULL);    // Drain the file data so the connection stays in sync
         snprintf(response_buffer, sizeof(response_buffer), "Unable to open file %s for writing\n", full_file_path);
         send(sock_client, response_buffer, strlen(response_buffer), 0);
         return;
     }
+    if (preallocate_file(file_pointer, size) != 0)
+    {
+        fclose(file_pointer);
+        unlink(full_file_path);
+        recv_file_chunks(sock_client, NULL, NULL);    // Drain the file data so the connection stays in sync
+        snprintf(response_buffer, sizeof(response_buffer), "Cannot reserve %lld bytes for %s\n", size, file_name);
+        send(sock_client, response_buffer, strlen(response_buffer), 0);
+        return;
+    }
 
     printf("Starting to receive file: %s\n", full_file_path);   // Informing the server that the file reception is starting
 
 
-    // Loop to receive file data from the client and write it to the file
-    while ((recv_bytes = recv(sock_client, recv_file_buffer, sizeof(recv_file_buffer), 0)) > 0)
+    // Receive the chunked file data from the client and write it to the file
+    recv_bytes = recv_file_chunks(sock_client, file_pointer, &checksum);
+    trim_preallocated(file_pointer, size);
+    if (recv_bytes >= 0)
     {
-        printf("The file has %d bytes\n", recv_bytes);          // Displaying the number of bytes received
-
-        // Write the received data to the file
-        fwrite(recv_file_buffer, 1, recv_bytes, file_pointer);
-        if (recv_bytes < sizeof(recv_file_buffer))
-        {
-            printf("File transfer in progress from the Client to the Main server Directory..\n");
-            break; // End of file
-        }
+        save_stored_checksum(fileno(file_pointer), checksum); // Keep the verified checksum next to the file
     }
+    fclose(file_pointer); // Close the file after the upload is complete
+    snprintf(relative_path, sizeof(relative_path), "%s/%s", path_dest, file_name);
+    display_cache_invalidate(relative_path); // Listings of its directory are stale now, whatever the outcome
+    if (recv_bytes == TRANSFER_CORRUPT)
+    {
+        unlink(full_file_path); // Never keep data that failed verification
+        snprintf(response_buffer, sizeof(response_buffer), "Checksum mismatch, upload of %s rejected\n", file_name);
+        send(sock_client, response_buffer, strlen(response_buffer), 0);
+        return;
+    }
+    if (recv_bytes < 0)
+    {
+        snprintf(response_buffer, sizeof(response_buffer), "Failed to receive file %s\n", file_name);
+        send(sock_client, response_buffer, strlen(response_buffer), 0);
+        return;
+    }
+    printf("The file has %lld bytes\n", recv_bytes);             // Displaying the number of bytes received
 
     // Send a success message to the client indicating that the file has been successfully uploaded
     snprintf(response_buffer, sizeof(response_buffer), "File %s successfully uploaded\n", file_name);
     send(sock_client, response_buffer, strlen(response_buffer), 0);
-    fclose(file_pointer); // Close the file after the upload is complete
+}
+
+// Chunk table of a parallel upload, kept next to the file being assembled so that every worker receiving one of its
+// chunks can record it there: this header, then one upload_chunk per chunk
+struct upload_table
+{
+    uint32_t magic;                     // UPLOAD_TABLE_MAGIC
+    uint32_t chunks;                    // Number of chunks the file is split into
+    long long size;                     // File size announced by ubegin
+    long long chunk_size;               // Bytes in every chunk but the last
+};
+
+// One chunk's entry in the table, written once the chunk arrived with a matching CRC32C
+struct upload_chunk
+{
+    uint32_t stored;                    // 1 once the chunk is in place
+    uint32_t checksum;                  // CRC32C of the chunk, combined into the whole-file checksum by ucommit
+};
+
+// Function to name the file a parallel upload is assembled in and its chunk table
+// The suffixes keep both out of display, dtar and manifest listings until ucommit renames the file into place
+void upload_paths(const char *destination, const char *file_name, const char *upload_id, char *part_path, char *table_path)
+{
+    snprintf(part_path, BUFFER_SIZE * 2, "%s/spdf/%s/.%s.%s.upload", valid_home_dir(), destination, file_name, upload_id);
+    snprintf(table_path, BUFFER_SIZE * 2, "%s/spdf/%s/.%s.%s.chunks", valid_home_dir(), destination, file_name, upload_id);
+}
+
+// Function to open the chunk table of a parallel upload and read its header, returns the descriptor or -1
+int open_upload_table(const char *table_path, struct upload_table *table)
+{
+    int table_fd = open(table_path, O_RDWR);
+
+    if (table_fd >= 0 && (pread(table_fd, table, sizeof(*table), 0) != sizeof(*table) || table->magic != UPLOAD_TABLE_MAGIC))
+    {
+        close(table_fd);
+        return -1;
+    }
+    return table_fd;
+}
+
+// Function to handle "ubegin <file> <destination> <size> <chunk size> <upload ID>", the start of a parallel upload:
+// the file is created at its full size with its space reserved, and an empty chunk table is written next to it.
+// A ubegin repeated with the same upload ID and layout keeps the chunks already stored, so an upload can be resumed
+void handle_upload_begin(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17], directory[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table, existing;
+    long long size, chunk_size;
+    int part_fd, table_fd;
+
+    if (sscanf(command, "%*s %512s %512s %lld %lld %16[0-9a-f]", file_name, destination, &size, &chunk_size, upload_id) != 5 ||
+        size < 0 || chunk_size < UPLOAD_CHUNK_MIN || chunk_size > UPLOAD_CHUNK_MAX || (size + chunk_size - 1) / chunk_size > UPLOAD_MAX_CHUNKS)
+    {
+        snprintf(response, sizeof(response), "Invalid parallel upload request\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    table = (struct upload_table){UPLOAD_TABLE_MAGIC, (size + chunk_size - 1) / chunk_size, size, chunk_size};
+    snprintf(directory, sizeof(directory), "%s/spdf/%s", valid_home_dir(), destination);
+    upload_paths(destination, file_name, upload_id, part_path, table_path);
+    if (create_dir_if_new(directory) != 0 || (part_fd = open(part_path, O_WRONLY | O_CREAT, 0644)) < 0)
+    {
+        snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // Size the file up front so every chunk can be written into place, and reserve its space like a ufile does
+    if (ftruncate(part_fd, size) != 0 || (PREALLOCATE_ENABLED && size > 0 && fallocate(part_fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 &&
+                                          errno != EOPNOTSUPP && errno != ENOSYS))
+    {
+        close(part_fd);
+        unlink(part_path);
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Cannot reserve %lld bytes for %s\n", size, file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    close(part_fd);
+
+    // Keep the table of an earlier ubegin of the same layout, start any other one with no chunk stored
+    table_fd = open_upload_table(table_path, &existing);
+    if (table_fd < 0 || existing.size != size || existing.chunk_size != chunk_size)
+    {
+        if (table_fd >= 0)
+        {
+            close(table_fd);
+        }
+        table_fd = open(table_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (table_fd < 0 || pwrite(table_fd, &table, sizeof(table), 0) != sizeof(table) ||
+            ftruncate(table_fd, sizeof(table) + (off_t)table.chunks * sizeof(struct upload_chunk)) != 0)
+        {
+            if (table_fd >= 0)
+            {
+                close(table_fd);
+            }
+            unlink(part_path);
+            unlink(table_path);
+            snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+    }
+    close(table_fd);
+    printf("Parallel upload of %s/%s started: %lld bytes in %u chunks\n", destination, file_name, size, table.chunks);
+    snprintf(response, sizeof(response), "Ready for %u chunks\n", table.chunks);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "uchunk <file> <destination> <upload ID> <index>" and the chunk stream after it: the data is
+// written into place with pwrite() and, when its CRC32C trailer matches, the chunk is marked stored in the table.
+// The chunks of one upload arrive on any number of connections at once, each only touches its own byte range
+void handle_upload_chunk(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table;
+    struct upload_chunk chunk = {1, 0};
+    size_t capacity = POOL_MAX_CHUNK;
+    char *buffer = NULL;
+    long long offset, expected, received = 0;
+    long length;
+    unsigned int index = 0;
+    uint32_t trailer;
+    int part_fd = -1, table_fd = -1, failed = 0;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %u", file_name, destination, upload_id, &index) == 4)
+    {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0 || index >= table.chunks || (part_fd = open(part_path, O_WRONLY)) < 0 ||
+        (buffer = pool_acquire(&capacity)) == NULL)
+    {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the chunk so the connection stays in sync
+        snprintf(response, sizeof(response), "Chunk %u failed, no parallel upload of it was started\n", index);
+        send(client_socket, response, strlen(response), 0);
+        if (part_fd >= 0)
+        {
+            close(part_fd);
+        }
+        if (table_fd >= 0)
+        {
+            close(table_fd);
+        }
+        return;
+    }
+    offset = (long long)index * table.chunk_size;
+    expected = table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size;
+
+    // A chunk that runs past its range or cannot be written is still received to the end, the stream stays in step
+    while ((length = recv_chunk(client_socket, &buffer, &capacity)) > 0)
+    {
+        if (failed || received + length > expected)
+        {
+            failed = 1;
+            continue;
+        }
+        chunk.checksum = crc32c_update(chunk.checksum, buffer, length);
+        for (long written = 0; written < length; )
+        {
+            ssize_t result = pwrite(part_fd, buffer + written, length - written, offset + received + written);
+            if (result <= 0)
+            {
+                perror("Failed to write received chunk");
+                failed = 1;
+                break;
+            }
+            written += result;
+        }
+        received += length;
+    }
+    pool_release(buffer, capacity);
+    close(part_fd);
+    if (length < 0 || recv_all(client_socket, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != chunk.checksum ||
+        received != expected || failed ||
+        pwrite(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)index * sizeof(chunk)) != sizeof(chunk))
+    {
+        snprintf(response, sizeof(response), "Chunk %u failed\n", index);
+    }
+    else
+    {
+        snprintf(response, sizeof(response), "Chunk %u stored\n", index);
+    }
+    close(table_fd);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "ucommit <file> <destination> <upload ID> <CRC32C>", the end of a parallel upload: once every
+// chunk is stored, the chunk checksums are combined into the whole-file CRC32C and compared with the client's, and
+// the assembled file is renamed over the destination in one step, so no reader ever sees a partial file.
+// Missing chunks are listed in the reply and the upload stays open for them
+void handle_upload_commit(int client_socket, char *command)
+{
+    char file_name[COMMAND_WORD_MAX + 1] = "", destination[COMMAND_WORD_MAX + 1], upload_id[17], final_path[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table;
+    struct upload_chunk chunk;
+    unsigned int missing = 0;
+    size_t listed;
+    uint32_t expected, checksum = 0;
+    int part_fd, table_fd = -1;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %x", file_name, destination, upload_id, &expected) == 4)
+    {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0)
+    {
+        snprintf(response, sizeof(response), "No parallel upload of %s was started\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // List as many missing chunks as fit the reply, the client sends them and commits again
+    listed = snprintf(response, sizeof(response), "Missing chunks:");
+    for (unsigned int i = 0; i < table.chunks; i++)
+    {
+        long long offset = (long long)i * table.chunk_size;
+
+        if (pread(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)i * sizeof(chunk)) != sizeof(chunk) || !chunk.stored)
+        {
+            if (listed + 12 < sizeof(response))
+            {
+                listed += snprintf(response + listed, sizeof(response) - listed, " %u", i);
+            }
+            missing++;
+            continue;
+        }
+        checksum = crc32c_combine(checksum, chunk.checksum, table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size);
+    }
+    close(table_fd);
+    if (missing > 0)
+    {
+        strcpy(response + listed, "\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (checksum != expected)
+    {
+        unlink(part_path); // Never keep data that failed verification
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Checksum mismatch, upload of %s rejected\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    snprintf(final_path, sizeof(final_path), "%s/spdf/%s/%s", valid_home_dir(), destination, file_name);
+    if ((part_fd = open(part_path, O_RDONLY)) >= 0)
+    {
+        save_stored_checksum(part_fd, checksum); // Keep the verified checksum next to the file
+        close(part_fd);
+    }
+    if (part_fd < 0 || rename(part_path, final_path) != 0)
+    {
+        snprintf(response, sizeof(response), "Unable to store %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    unlink(table_path);
+    printf("Parallel upload of %s assembled from %u chunks, %lld bytes\n", final_path, table.chunks, table.size);
+    snprintf(final_path, sizeof(final_path), "%s/%s", destination, file_name);
+    display_cache_invalidate(final_path); // Now the path inside the store
+    snprintf(response, sizeof(response), "File %s successfully uploaded in %u chunks\n", file_name, table.chunks);
+    send(client_socket, response, strlen(response), 0);
 }
 
 // Function to handle the download process from the server to the client
 void process_download(int sock_client, char *file_name)
 {
-    char read_buffer[BUFFER_SIZE];              // Buffer to hold chunks of the file data to be sent to the client
     char file_full_path[BUFFER_SIZE];           // Buffer to hold the full path of the file to be downloaded
     int file_descriptor;                        // File descriptor for the file being read
-    int bytes_read;                             // Variable to store the number of bytes read from the file
     char response_message[BUFFER_SIZE];         // Buffer to hold responses sent back to the client
 
     // Construct the full path of the file to be sent
@@ -265,107 +1276,832 @@ void process_download(int sock_client, char *file_name)
     file_descriptor = open(file_full_path, O_RDONLY);
     if (file_descriptor < 0)
     {
-    //    perror("Error opening file for reading");
+        // No data follows the status, so the client never starts a file
+        send_download_status(sock_client, 0);
+        snprintf(response_message, sizeof(response_message), "File %s not found\n", file_name);
+        send(sock_client, response_message, strlen(response_message), 0);
         return;
     }
 
-    // Read and send the file in chunks
-    while ((bytes_read = read(file_descriptor, read_buffer, sizeof(read_buffer))) > 0)
+    // Read and send the file as adaptive chunks, the end-of-file chunk marks where the data stops
+    send_download_status(sock_client, 1);
+    send_file_chunks(sock_client, file_descriptor);
+    close(file_descriptor); // Close the file after sending
+
+    snprintf(response_message, sizeof(response_message), "File %s successfully downloaded\n", file_name);
+    send(sock_client, response_message, strlen(response_message), 0);
+}
+
+
+// Outcome of a batched rmfile in one store, sent back to Smain and merged into the reply for the client
+struct remove_summary
+{
+    int removed;                            // Files deleted
+    int failed;                             // Paths that could not be deleted
+    int listed;                             // Failures spelled out in failures[], at most RMFILE_MAX_REPORTED
+    char failures[RMFILE_REPORT_BYTES];     // One "path: reason" line per listed failure
+};
+
+// Function to count a path that could not be deleted, the first few are listed with their reason
+void remove_failure(struct remove_summary *summary, const char *path, const char *reason)
+{
+    size_t used = strlen(summary->failures);
+
+    summary->failed++;
+    if (summary->listed < RMFILE_MAX_REPORTED)
     {
-        // Sending the read data to the client
-        send(sock_client, read_buffer, bytes_read, 0);
+        snprintf(summary->failures + used, sizeof(summary->failures) - used, "%s: %s\n", path, reason);
+        summary->listed++;
+    }
+}
 
-        // If the number of bytes read is less than the buffer size, it indicates the end of the file
-        if (bytes_read < sizeof(read_buffer))
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary);
+
+// Function to delete one directory entry relative to an open directory
+// unlinkat() is tried first, so a plain file costs one system call; directories are only removed with -r.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void remove_entry(int dir_fd, const char *name, const char *path, int recursive, int matched, struct remove_summary *summary)
+{
+    if (unlinkat(dir_fd, name, 0) == 0)
+    {
+        summary->removed++;
+        display_cache_invalidate(path);
+    }
+    else if (errno == EISDIR)
+    {
+        if (recursive)
+        {
+            remove_tree_at(dir_fd, name, path, summary);
+        }
+        else if (!matched)
         {
-            break; // End of file reached
+            remove_failure(summary, path, "Is a directory, use rmfile -r");
         }
     }
+    else if (errno != ENOENT || (!matched && !recursive))
+    {
+        remove_failure(summary, path, strerror(errno));
+    }
+}
 
-    close(file_descriptor); // Close the file after sending
-    sleep(3); // Delay to ensure client-side processing
+// Function to delete a directory with everything below it, working on directory file descriptors throughout
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary)
+{
+    char child_path[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory;
+    int dir_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
 
-    snprintf(response_message, sizeof(response_message), "File %s successfully downloaded\n", file_name);
-    send(sock_client, response_message, strlen(response_message), 0);
+    if (dir_fd < 0 || (directory = fdopendir(dir_fd)) == NULL)
+    {
+        remove_failure(summary, path, strerror(errno));
+        if (dir_fd >= 0)
+        {
+            close(dir_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        remove_entry(dirfd(directory), entry->d_name, child_path, 1, 1, summary);
+    }
+    closedir(directory);
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT)
+    {
+        remove_failure(summary, path, strerror(errno));
+    }
+    display_cache_invalidate(path);
 }
 
+// Function to tell whether a path climbs out of the store with a ".." component
+int path_leaves_store(const char *path)
+{
+    size_t length = strlen(path);
 
-void handle_remove_file(int client_socket, char *file_name) {
-    char server_response[BUFFER_SIZE];   // Response to be sent back to the client
-    char full_file_path[BUFFER_SIZE];    // Full path to the file to be removed
+    return strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 || strstr(path, "/../") != NULL ||
+           (length >= 3 && strcmp(path + length - 3, "/..") == 0);
+}
 
-    // Construct the full path to the file
-    snprintf(full_file_path, sizeof(full_file_path), "%s/spdf/%s", valid_home_dir(), file_name);
+// Function to delete what one rmfile path names inside a store: a file, a glob in the last path component,
+// or with -r a directory tree. Paths that climb out of the store are refused
+void remove_pattern(const char *store_root, const char *pattern, int recursive, struct remove_summary *summary)
+{
+    char directory[BUFFER_SIZE], child_path[BUFFER_SIZE];
+    const char *name = strrchr(pattern, '/');
+    struct dirent *entry;
+    DIR *listing;
+    int dir_fd;
 
-    // Remove the file at the specified path
-    if (remove(full_file_path) == 0) {
-        // Notify client of successful deletion
-        snprintf(server_response, sizeof(server_response), "File %s deleted successfully.\n", file_name);
-    } else {
-        // Notify client of failure to delete
-        snprintf(server_response, sizeof(server_response), "Error: Unable to delete file %s.\n", file_name);
+    if (path_leaves_store(pattern))
+    {
+        remove_failure(summary, pattern, "Path leaves the store");
+        return;
+    }
+    snprintf(directory, sizeof(directory), "%s/%.*s", store_root, name != NULL ? (int)(name - pattern) : 0, pattern);
+    name = name != NULL ? name + 1 : pattern;
+    if ((dir_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        // A glob or tree that has nothing in this store is not an error, the other stores may hold its files
+        if (errno != ENOENT || (strpbrk(name, "*?[") == NULL && !recursive))
+        {
+            remove_failure(summary, pattern, strerror(errno));
+        }
+        return;
+    }
+    if (strpbrk(name, "*?[") == NULL)
+    {
+        remove_entry(dir_fd, name, pattern, recursive, 0, summary);
+        close(dir_fd);
+        return;
+    }
+    if ((listing = fdopendir(dir_fd)) == NULL)
+    {
+        remove_failure(summary, pattern, strerror(errno));
+        close(dir_fd);
+        return;
     }
+    while ((entry = readdir(listing)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fnmatch(name, entry->d_name, FNM_PERIOD) != 0)
+        {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%.*s%s", (int)(name - pattern), pattern, entry->d_name);
+        remove_entry(dirfd(listing), entry->d_name, child_path, recursive, 1, summary);
+    }
+    closedir(listing);
+}
 
-    // Send the response to the client
-    send(client_socket, server_response, strlen(server_response), 0);
+// Function to carry out the arguments of a batched rmfile in one store: "-r" and any number of paths or globs
+// Returns the number of paths handled
+int remove_batch(const char *store_dir, const char *arguments, struct remove_summary *summary)
+{
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *patterns[BUFFER_SIZE / 2], *save, *token;
+    int count = 0, recursive = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-r") == 0)
+        {
+            recursive = 1;
+        }
+        else
+        {
+            while (strlen(token) > 1 && token[strlen(token) - 1] == '/')
+            {
+                token[strlen(token) - 1] = '\0'; // "dir/" names the same directory as "dir"
+            }
+            patterns[count++] = token;
+        }
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    for (int i = 0; i < count; i++)
+    {
+        remove_pattern(store_root, patterns[i], recursive, summary);
+    }
+    return count;
 }
 
+// Function to handle a batched rmfile from Smain: "rmfile [-r] path..." with the paths that belong to this store
+// The reply is one BUFFER_SIZE frame: "removed <n> failed <m>" followed by the listed failures
+void handle_remove_file(int client_socket, char *command)
+{
+    struct remove_summary summary;
+    char reply[BUFFER_SIZE];
+
+    memset(&summary, 0, sizeof(summary));
+    remove_batch("spdf", command + strlen("rmfile"), &summary);
+    printf("rmfile removed %d files, %d failed\n", summary.removed, summary.failed);
+
+    memset(reply, 0, sizeof(reply));
+    snprintf(reply, sizeof(reply), "removed %d failed %d\n%s", summary.removed, summary.failed, summary.failures);
+    send(client_socket, reply, BUFFER_SIZE, 0);
+}
+
+// One mvfile or cpfile carried out inside a store, summed up like an rmfile: summary->removed counts the entries
+// moved or copied, a directory moved in one rename counting once
+struct relocation
+{
+    const char *store_root;             // Store directory the paths are relative to
+    const char *extension;              // Type of file the store holds, ".c", ".txt" or ".pdf"
+    int move;                           // mvfile when set, cpfile otherwise
+    int recursive;                      // cpfile -r: directories are copied with everything below them
+    struct remove_summary *summary;
+};
+
+// Function to copy one file inside a store without its data passing through this process: FICLONE shares the data
+// blocks on filesystems with reflinks (Btrfs, XFS), copy_file_range() copies in the kernel everywhere else.
+// The copy is built next to the target and renamed over it, and it keeps the source's stored checksum
+// Returns 0, or -1 with errno set
+int copy_file_at(int from_dir, const char *from_name, int to_dir, const char *to_name)
+{
+    char temp_name[BUFFER_SIZE];
+    struct stat info;
+    uint32_t checksum;
+    int in, out = -1, result = -1, saved_errno;
+
+    snprintf(temp_name, sizeof(temp_name), ".%.200s.copy", to_name);
+    if ((in = openat(from_dir, from_name, O_RDONLY | O_NOFOLLOW)) >= 0 && fstat(in, &info) == 0 &&
+        (out = openat(to_dir, temp_name, O_WRONLY | O_CREAT | O_TRUNC, info.st_mode & 0777)) >= 0)
+    {
+        result = 0;
+        if (ioctl(out, FICLONE, in) != 0)
+        {
+            for (off_t left = info.st_size; left > 0; left -= result)
+            {
+                ssize_t copied = copy_file_range(in, NULL, out, NULL, left, 0);
+
+                if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    copied = sendfile(out, in, NULL, left); // Kernels without copy_file_range() still copy in the kernel
+                }
+                if (copied <= 0)
+                {
+                    result = copied < 0 ? -1 : 0; // A source that got shorter while it was copied ends the copy
+                    break;
+                }
+                result = copied;
+            }
+            result = result < 0 ? -1 : 0;
+        }
+        if (result == 0 && load_stored_checksum(in, &checksum) == 0)
+        {
+            save_stored_checksum(out, checksum);
+        }
+    }
+    saved_errno = errno;
+    if (in >= 0)
+    {
+        close(in);
+    }
+    if (out >= 0 && close(out) != 0 && result == 0)
+    {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result == 0 && renameat(to_dir, temp_name, to_dir, to_name) != 0)
+    {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result != 0)
+    {
+        unlinkat(to_dir, temp_name, 0);
+    }
+    errno = saved_errno;
+    return result;
+}
+
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation);
+
+// Function to copy a directory with everything below it, working on directory file descriptors throughout
+void copy_tree_at(int from_parent, const char *from_name, const char *from_path, int to_parent, const char *to_name,
+                  const char *to_path, struct relocation *relocation)
+{
+    char from_child[BUFFER_SIZE], to_child[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory = NULL;
+    int from_fd = openat(from_parent, from_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW), to_fd = -1;
+
+    if (from_fd >= 0 && (mkdirat(to_parent, to_name, 0755) == 0 || errno == EEXIST))
+    {
+        to_fd = openat(to_parent, to_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (from_fd < 0 || to_fd < 0 || (directory = fdopendir(from_fd)) == NULL)
+    {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        if (from_fd >= 0)
+        {
+            close(from_fd);
+        }
+        if (to_fd >= 0)
+        {
+            close(to_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(from_child, sizeof(from_child), "%s/%s", from_path, entry->d_name);
+        snprintf(to_child, sizeof(to_child), "%s/%s", to_path, entry->d_name);
+        relocate_entry(dirfd(directory), entry->d_name, from_child, to_fd, entry->d_name, to_child, 1, relocation);
+    }
+    closedir(directory);
+    close(to_fd);
+}
+
+// Function to move or copy one directory entry between two open directories of a store. A move is one
+// renameat2(): a file replaces its target like an upload would, a directory never replaces an existing one.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation)
+{
+    struct stat info;
+
+    if (fstatat(from_dir, from_name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        if (errno != ENOENT || !matched)
+        {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+        }
+        return;
+    }
+    if (S_ISDIR(info.st_mode) && !relocation->move)
+    {
+        if (relocation->recursive)
+        {
+            copy_tree_at(from_dir, from_name, from_path, to_dir, to_name, to_path, relocation);
+        }
+        else if (!matched)
+        {
+            remove_failure(relocation->summary, from_path, "Is a directory, use cpfile -r");
+        }
+        return;
+    }
+    if (relocation->move)
+    {
+        if (renameat2(from_dir, from_name, to_dir, to_name, S_ISDIR(info.st_mode) ? RENAME_NOREPLACE : 0) != 0)
+        {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+            return;
+        }
+    }
+    else if (copy_file_at(from_dir, from_name, to_dir, to_name) != 0)
+    {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        return;
+    }
+    relocation->summary->removed++;
+    display_cache_invalidate(from_path);
+    display_cache_invalidate(to_path);
+}
+
+// Function to carry out one mvfile or cpfile inside a store. The source is a file, a glob in its last component or a
+// directory. A target ending in '/' is the directory everything goes into, and so is a target without the file
+// type of a single source file; otherwise the target is the source's new name. Target directories are created
+// when they are new
+void relocate_pattern(struct relocation *relocation, const char *source, const char *target)
+{
+    char source_dir[BUFFER_SIZE], target_dir[BUFFER_SIZE], target_name[BUFFER_SIZE], directory[BUFFER_SIZE * 2];
+    char from_path[BUFFER_SIZE * 2], to_path[BUFFER_SIZE * 2];
+    const char *name = strrchr(source, '/'), *slash;
+    size_t name_length, source_length = strlen(source), extension_length = strlen(relocation->extension);
+    struct dirent *entry;
+    DIR *listing;
+    int glob, typed, named, from_fd, to_fd;
+
+    if (path_leaves_store(source) || path_leaves_store(target))
+    {
+        remove_failure(relocation->summary, source, "Path leaves the store");
+        return;
+    }
+    snprintf(source_dir, sizeof(source_dir), "%.*s", name != NULL ? (int)(name - source) : 0, source);
+    name = name != NULL ? name + 1 : source;
+    name_length = strlen(name);
+    glob = strpbrk(name, "*?[") != NULL;
+    typed = name_length > extension_length && strcmp(name + name_length - extension_length, relocation->extension) == 0;
+    if (!glob && strncmp(target, source, source_length) == 0 && target[source_length] == '/')
+    {
+        remove_failure(relocation->summary, source, "Target is inside the source");
+        return;
+    }
+    if (glob || target[strlen(target) - 1] == '/' ||
+        (typed && (strlen(target) <= extension_length || strcmp(target + strlen(target) - extension_length, relocation->extension) != 0)))
+    {
+        snprintf(target_dir, sizeof(target_dir), "%s", target);
+        for (size_t length = strlen(target_dir); length > 1 && target_dir[length - 1] == '/'; length--)
+        {
+            target_dir[length - 1] = '\0';
+        }
+        snprintf(target_name, sizeof(target_name), "%s", name);
+    }
+    else
+    {
+        slash = strrchr(target, '/');
+        snprintf(target_dir, sizeof(target_dir), "%.*s", slash != NULL ? (int)(slash - target) : 0, target);
+        snprintf(target_name, sizeof(target_name), "%s", slash != NULL ? slash + 1 : target);
+    }
+    snprintf(to_path, sizeof(to_path), "%s%s%s", target_dir, *target_dir ? "/" : "", target_name);
+
+    // A missing file of this store's type is an error; a glob or directory that has nothing in this store is not,
+    // the other stores may hold its files
+    named = !glob && typed;
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, source_dir);
+    if ((from_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        if (errno != ENOENT || named)
+        {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        return;
+    }
+    if (!glob && faccessat(from_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+    {
+        if (named)
+        {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        close(from_fd);
+        return;
+    }
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, target_dir);
+    if (create_dir_if_new(directory) != 0 || (to_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        remove_failure(relocation->summary, target, strerror(errno));
+        close(from_fd);
+        return;
+    }
+    if (!glob)
+    {
+        relocate_entry(from_fd, name, source, to_fd, target_name, to_path, !named, relocation);
+        close(from_fd);
+    }
+    else if ((listing = fdopendir(from_fd)) == NULL)
+    {
+        remove_failure(relocation->summary, source, strerror(errno));
+        close(from_fd);
+    }
+    else
+    {
+        while ((entry = readdir(listing)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                fnmatch(name, entry->d_name, FNM_PERIOD) != 0)
+            {
+                continue;
+            }
+            snprintf(from_path, sizeof(from_path), "%s%s%s", source_dir, *source_dir ? "/" : "", entry->d_name);
+            snprintf(to_path, sizeof(to_path), "%s/%s", target_dir, entry->d_name);
+            relocate_entry(dirfd(listing), entry->d_name, from_path, to_fd, entry->d_name, to_path, 1, relocation);
+        }
+        closedir(listing);
+    }
+    close(to_fd);
+}
+
+// Function to carry out the arguments of an mvfile or cpfile in one store: "[-r] <source> <target>"
+// Returns -1 when they are not two paths
+int relocate_batch(const char *store_dir, const char *extension, const char *arguments, int move, struct remove_summary *summary)
+{
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *paths[2], *save, *token;
+    struct relocation relocation = {store_root, extension, move, 0, summary};
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-r") == 0)
+        {
+            relocation.recursive = 1;
+        }
+        else if (count < 2)
+        {
+            paths[count++] = token;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    if (count != 2)
+    {
+        return -1;
+    }
+    while (strlen(paths[0]) > 1 && paths[0][strlen(paths[0]) - 1] == '/')
+    {
+        paths[0][strlen(paths[0]) - 1] = '\0'; // "dir/" names the same directory as "dir"
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    relocate_pattern(&relocation, paths[0], paths[1]);
+    return 0;
+}
+
+// Function to handle an mvfile or cpfile from Smain: "[-r] <source> <target>" carried out inside this store
+// The reply is one BUFFER_SIZE frame like that of an rmfile: "moved <n> failed <m>" followed by the listed failures
+void handle_relocate(int client_socket, char *command, int move)
+{
+    struct remove_summary summary;
+    char reply[BUFFER_SIZE];
+
+    memset(&summary, 0, sizeof(summary));
+    if (relocate_batch("spdf", ".pdf", command + strlen("mvfile"), move, &summary) != 0)
+    {
+        remove_failure(&summary, move ? "mvfile" : "cpfile", "Expected a source and a target path");
+    }
+    printf("%s %d entries, %d failed\n", move ? "mvfile moved" : "cpfile copied", summary.removed, summary.failed);
+
+    memset(reply, 0, sizeof(reply));
+    snprintf(reply, sizeof(reply), "%s %d failed %d\n%s", move ? "moved" : "copied", summary.removed, summary.failed, summary.failures);
+    send(client_socket, reply, BUFFER_SIZE, 0);
+}
+
+// Function to stream every stored file with the given extension below one directory as archive entries
+// Each entry is a header chunk "<size> <mtime> <mode> <relative path>" followed by the file's chunk stream
+void stream_archive_entries(int client_socket, const char *root, const char *relative, const char *extension) {
+    char dir_path[BUFFER_SIZE];             // Directory being scanned
+    char entry_relative[BUFFER_SIZE];       // Entry path relative to the store root
+    char entry_path[BUFFER_SIZE * 2];       // Full path of the entry
+    char header[BUFFER_SIZE * 2];           // Entry header sent to Smain
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+    struct stat entry_info;
+    DIR *directory;
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+    if ((directory = opendir(dir_path)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(entry_relative, sizeof(entry_relative), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name);
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", root, entry_relative);
+        if (lstat(entry_path, &entry_info) != 0) {
+            continue;
+        }
+        if (S_ISDIR(entry_info.st_mode)) {
+            stream_archive_entries(client_socket, root, entry_relative, extension); // Descend like find does
+            continue;
+        }
+        size_t name_length = strlen(entry->d_name);
+        if (!S_ISREG(entry_info.st_mode) || name_length < extension_length ||
+            strcmp(entry->d_name + name_length - extension_length, extension) != 0) {
+            continue;
+        }
+
+        int file_descriptor = open(entry_path, O_RDONLY);
+        if (file_descriptor < 0 || fstat(file_descriptor, &entry_info) != 0) {
+            if (file_descriptor >= 0) {
+                close(file_descriptor);
+            }
+            continue;
+        }
+        snprintf(header, sizeof(header), "%lld %lld %o %s", (long long)entry_info.st_size,
+                 (long long)entry_info.st_mtime, entry_info.st_mode & 07777, entry_relative);
+        send_chunk(client_socket, header, strlen(header));
+        send_file_chunks(client_socket, file_descriptor);
+        close(file_descriptor);
+    }
+    closedir(directory);
+}
+
+// Function to stream all stored files of the requested type to Smain, which turns them into one tar archive
+// The listing ends with an empty header chunk; an unsupported type simply produces an empty listing
 void handle_create_tar(int client_socket, char *file_extension) {
-    char tar_command[BUFFER_SIZE];    // Command to create tar file
-    char client_message[BUFFER_SIZE]; // Message to be sent to the client
-    FILE *tar_file_pointer;
+    char store_root[BUFFER_SIZE];       // Root directory of this store
 
-    // Check if the file extension is supported
     if (strcmp(file_extension, ".pdf") == 0) {
-        // Construct the command to find .pdf files and create a tar archive
-        snprintf(tar_command, sizeof(tar_command), "find ~/spdf -name '*.pdf' | tar -cvf pdf_list.tar -T -");
-        system(tar_command); // Execute the command
-
-        // Open the tar file to check if it was created successfully
-        tar_file_pointer = fopen("pdf_list.tar", "rb");
-        if (tar_file_pointer) {
-            fclose(tar_file_pointer); // Close the file if it was opened successfully
-            snprintf(client_message, sizeof(client_message), "Tar file for %s files created successfully.\n", file_extension);
-        } else {
-            snprintf(client_message, sizeof(client_message), "Error: Failed to create tar file for %s files.\n", file_extension);
-        }
+        snprintf(store_root, sizeof(store_root), "%s/spdf", valid_home_dir());
+        stream_archive_entries(client_socket, store_root, "", file_extension);
     } else {
-        // If the file extension is unsupported, notify the client
-        snprintf(client_message, sizeof(client_message), "Error: Unsupported file type %s\n", file_extension);
+        printf("Unsupported archive type %s\n", file_extension);
     }
-
-    // Send the response to the client
-    send(client_socket, client_message, strlen(client_message), 0);
+    send_chunk(client_socket, NULL, 0); // End of the listing
 }
 
 void handle_display(int client_socket, char *pathname) {
     char command[BUFFER_SIZE]; // buffer to store the command to be excecuted
     char buffer[BUFFER_SIZE]; // buffer to store the output of the executed command
+    char list[BUFFER_SIZE] = ""; // names found, sent in one go since Smain reads the list with one recv()
+    char directory[BUFFER_SIZE * 2]; // where the store keeps the directory
+    struct display_stamp stamp; // what the display cache saw of it
     FILE *pipe; // file pointer to handle the pipe for reading command output
 
-    // Command to ensure only filenames are returned
-    snprintf(command, sizeof(command), "find %s/spdf/%s -maxdepth 1 -name '*.pdf' -exec basename {} \\;", valid_home_dir(), pathname);
+    // A directory unchanged since it was last listed is answered from the display cache
+    snprintf(directory, sizeof(directory), "%s/spdf/%s", valid_home_dir(), pathname);
+    if (display_cache_lookup(pathname, directory, list, sizeof(list), &stamp) >= 0) {
+        printf("Display of %s served from memory (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
+    } else {
+        // Command to ensure only filenames are returned
+        snprintf(command, sizeof(command), "find %s/spdf/%s -maxdepth 1 -name '*.pdf' -exec basename {} \\;", valid_home_dir(), pathname);
 
-    // Execute the command and open a pipe to read its output
-    pipe = popen(command, "r");
-    // check if the pipe was succesfully opened
-    if (pipe != NULL) {
-        int files_found = 0;
-        // Read file names and send to client
+        // Execute the command and open a pipe to read its output
+        pipe = popen(command, "r");
+        // check if the pipe was succesfully opened
+        if (pipe == NULL) {
+            perror("popen failed");
+            char error_msg[] = "Error executing find command.\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            return;
+        }
+        // Read file names into the list
         while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-            send(client_socket, buffer, strlen(buffer), 0);
-            files_found = 1;
+            size_t used = strlen(list);
+            snprintf(list + used, sizeof(list) - used, "%s", buffer);
         }
         pclose(pipe);
-
-        // If no files are found, send a message indicating no files available
-        if (!files_found) {
-            char no_files_msg[] = "No .pdf files found in the specified directory.\n";
-            send(client_socket, no_files_msg, strlen(no_files_msg), 0);
+        display_cache_store(&stamp, list, strlen(list));
+        if (display_cache != NULL) {
+            printf("Display of %s listed from the store (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
         }
+    }
+
+    // Send the file names to the client, or a message when no .pdf files were found
+    if (list[0] != '\0') {
+        send(client_socket, list, strlen(list), 0);
     } else {
-        perror("popen failed");
-        char error_msg[] = "Error executing find command.\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
+        char no_files_msg[] = "No .pdf files found in the specified directory.\n";
+        send(client_socket, no_files_msg, strlen(no_files_msg), 0);
+    }
+}
+
+// Function to describe one stored file as "<size> <mtime seconds> <mtime nanoseconds> <crc32c or ->" or "missing"
+void stat_stored_file(const char *file_path, char *line, size_t size)
+{
+    char checksum_text[16] = "-";       // Stored CRC32C, "-" when the file has none
+    struct stat file_info;
+    uint32_t checksum;
+    int file_descriptor = open(file_path, O_RDONLY);
+
+    if (file_descriptor >= 0 && fstat(file_descriptor, &file_info) == 0 && S_ISREG(file_info.st_mode))
+    {
+        if (load_stored_checksum(file_descriptor, &checksum) == 0)
+        {
+            snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+        }
+        snprintf(line, size, "%lld %lld %ld %s\n", (long long)file_info.st_size,
+                 (long long)file_info.st_mtim.tv_sec, file_info.st_mtim.tv_nsec, checksum_text);
+    }
+    else
+    {
+        snprintf(line, size, "missing\n");
+    }
+    if (file_descriptor >= 0)
+    {
+        close(file_descriptor);
+    }
+}
+
+// Function to report the size, modification time and stored checksum of files without sending their data
+// "stat <file>..." is answered with one line per file, in the order asked, all sent in one go
+void handle_stat(int client_socket, char *command)
+{
+    char arguments[BUFFER_SIZE], full_file_path[BUFFER_SIZE * 2];
+    char reply[STAT_MAX_PATHS * STAT_LINE_MAX];     // Lines sent back to Smain
+    char *save, *file_name;
+    size_t used = 0;
+    int count = 0;
+
+    snprintf(arguments, sizeof(arguments), "%s", command + strlen("stat"));
+    for (file_name = strtok_r(arguments, " ", &save); file_name != NULL && count < STAT_MAX_PATHS; file_name = strtok_r(NULL, " ", &save))
+    {
+        snprintf(full_file_path, sizeof(full_file_path), "%s/spdf/%s", valid_home_dir(), file_name);
+        stat_stored_file(full_file_path, reply + used, sizeof(reply) - used);
+        used += strlen(reply + used);
+        count++;
+    }
+    send(client_socket, reply, used, 0);
+}
+
+// Manifest lines collected into chunks before they are sent
+struct manifest_stream
+{
+    int sock;
+    char *buffer;                       // Pool buffer the lines are collected in
+    size_t capacity;
+    size_t used;
+    uint32_t checksum;                  // CRC32C of every byte sent, for the stream's trailer
+    long entries;                       // Files listed
+    int failed;                         // Sending failed, the rest of the walk is skipped
+};
+
+// Function to send the lines collected so far as one chunk
+void manifest_flush(struct manifest_stream *stream)
+{
+    if (stream->used > 0 && !stream->failed)
+    {
+        stream->checksum = crc32c_update(stream->checksum, stream->buffer, stream->used);
+        stream->failed = send_chunk(stream->sock, stream->buffer, stream->used) != 0;
+    }
+    stream->used = 0;
+}
+
+// Function to add whole lines to the manifest, sending a chunk first when they do not fit
+void manifest_add(struct manifest_stream *stream, const char *lines, size_t length)
+{
+    if (stream->used + length > stream->capacity)
+    {
+        manifest_flush(stream);
+    }
+    if (length > stream->capacity)
+    {
+        stream->checksum = crc32c_update(stream->checksum, lines, length);
+        stream->failed |= send_chunk(stream->sock, lines, length) != 0;
+        return;
+    }
+    memcpy(stream->buffer + stream->used, lines, length);
+    stream->used += length;
+}
+
+// Function to list every stored file of one type below an open directory as "<path> <size> <mtime> <crc32c or ->"
+// Paths are relative to the directory the manifest was asked for; the directory descriptor is consumed
+void manifest_walk(struct manifest_stream *stream, int directory_fd, const char *relative, const char *extension)
+{
+    DIR *directory = fdopendir(directory_fd);
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+
+    if (directory == NULL)
+    {
+        close(directory_fd);
+        return;
+    }
+    while (!stream->failed && (entry = readdir(directory)) != NULL)
+    {
+        char path[BUFFER_SIZE], line[BUFFER_SIZE + 64], checksum_text[16] = "-";
+        size_t name_length = strlen(entry->d_name);
+        struct stat file_info;
+        uint32_t checksum;
+        int child_fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+        if (entry->d_type == DT_DIR)
+        {
+            if ((child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0)
+            {
+                manifest_walk(stream, child_fd, path, extension);
+            }
+            continue;
+        }
+        if (name_length <= extension_length || strcmp(entry->d_name + name_length - extension_length, extension) != 0 ||
+            (child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW)) < 0)
+        {
+            continue;
+        }
+        if (fstat(child_fd, &file_info) == 0 && S_ISREG(file_info.st_mode))
+        {
+            if (load_stored_checksum(child_fd, &checksum) == 0)
+            {
+                snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+            }
+            manifest_add(stream, line, snprintf(line, sizeof(line), "%s %lld %lld %s\n", path, (long long)file_info.st_size,
+                                                (long long)file_info.st_mtim.tv_sec, checksum_text));
+            stream->entries++;
+        }
+        close(child_fd);
+    }
+    closedir(directory);
+}
+
+// Function to handle "manifest <directory>" from Smain: one line per stored file below the directory, as a chunk
+// stream, then a status line with the number of files
+void handle_manifest(int client_socket, char *directory)
+{
+    struct manifest_stream stream = {client_socket, NULL, POOL_MAX_CHUNK / 4, 0, 0, 0, 0};
+    char path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    int directory_fd;
+
+    snprintf(path, sizeof(path), "%s/spdf/%s", valid_home_dir(), directory);
+    stream.buffer = pool_acquire(&stream.capacity);
+    if (stream.buffer != NULL && strstr(directory, "..") == NULL && (directory_fd = open(path, O_RDONLY | O_DIRECTORY)) >= 0)
+    {
+        manifest_walk(&stream, directory_fd, "", ".pdf");
+        manifest_flush(&stream);
+    }
+    pool_release(stream.buffer, stream.capacity);
+    send_end_of_file(client_socket, stream.failed ? ~stream.checksum : stream.checksum);
+    snprintf(response, sizeof(response), "manifest %ld files\n", stream.entries);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to send one byte range of a stored file for a striped download, the command is "drange <file> <offset> <length>"
+void handle_range(int client_socket, char *file_name, char *command)
+{
+    char full_file_path[BUFFER_SIZE];   // Full path of the file being read
+    long long offset = 0, length = 0;
+    int file_descriptor;
+
+    snprintf(full_file_path, sizeof(full_file_path), "%s/spdf/%s", valid_home_dir(), file_name);
+    file_descriptor = open(full_file_path, O_RDONLY);
+    if (file_descriptor < 0 || sscanf(command, "%*s %*s %lld %lld", &offset, &length) != 2 || offset < 0 || length < 0)
+    {
+        send_end_of_file(client_socket, 1); // An empty stream with a wrong checksum makes the stripe fail
+    }
+    else
+    {
+        send_range_chunks(client_socket, file_descriptor, offset, length, NULL, NULL);
+    }
+    if (file_descriptor >= 0)
+    {
+        close(file_descriptor);
     }
 }
\ No newline at end of file
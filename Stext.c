@@ -1,3 +1,5 @@
+#define _GNU_SOURCE          // fallocate() and sync_file_range()
+#define _FILE_OFFSET_BITS 64  // 64-bit file sizes and offsets on 32-bit systems too
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +11,74 @@
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <sys/statvfs.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>  // FICLONE reflink copies for cpfile
+#include <linux/fs.h>   // ... and its request number
+#include <sys/sendfile.h> // In-kernel copies on kernels without copy_file_range()
+#include <pthread.h>
+#include <regex.h>
 
 #define TEXT_PORT 6012
 #define BUFFER_SIZE 1024
 #define SERVER_IP "127.0.1.6"
+#define SMAIN_ADDRESS "127.0.0.4"           // Smain, which this server registers with through heartbeats
+#define SMAIN_PORT 6009
+#define HEARTBEAT_INTERVAL 2                // Seconds between two heartbeats
+#define LOCAL_TRANSPORT_ENABLED 1           // Also take Smain's requests over a Unix socket when both run on one host
+#define RMFILE_MAX_REPORTED 8               // Failed paths listed in an rmfile reply, the rest are only counted
+#define RMFILE_REPORT_BYTES 640             // Room for the listed failures, so a reply fits one BUFFER_SIZE frame
+#define DELTA_MIN_BLOCK 1024                // Smallest block a delta upload matches, for files up to 1 MB
+#define DELTA_MAX_BLOCK (128 * 1024)        // Largest block, used from 16 GB up; in between the block is about sqrt(size)
+#define DELTA_SIGNATURE_BATCH 1024          // Block signatures sent per chunk
+#define STAT_MAX_PATHS 512                  // Paths one stat command can name, as many as fit one command frame
+#define STAT_LINE_MAX 64                    // Longest reply line for one path of a stat
+#define GREP_DEFAULT_LIMIT 1000             // Matching lines a grep returns unless -m asks for another number
+#define GREP_MAX_LIMIT 100000               // Largest -m a grep accepts
+#define GREP_MAX_THREADS 8                  // Threads one grep searches with, one per core up to this number
+#define GREP_MAX_FILES 65536                // Files one grep searches
+#define GREP_LINE_MAX 256                   // Longer matching lines are cut to this many bytes in the results
+#define GREP_BATCH 65536                    // Results of one file are sent in batches of about this size
+#define PACK_ENABLED 0                      // Append small .txt files to shared segment files, out of sight of the store directory
+#define PACK_DIR ".pack"                    // Segments and index of the pack, inside the store directory
+#define PACK_MAX_FILE (32 * 1024)           // Bigger files stay loose, below the size clients send as a delta upload
+#define PACK_SEGMENT_BYTES (64 * 1024 * 1024) // A segment takes appends until it holds this much
+#define PACK_MAX_SEGMENTS 1024              // Segment numbers in use at the same time
+#define PACK_INDEX_SLOTS 65536              // Hash slots of the index, a power of two; new files stay loose once 7/8 are used
+#define PACK_PATH_MAX 216                   // Longest packed path, files with longer paths stay loose
+#define PACK_COMPACT_RATIO 2                // A segment is compacted once less than half of it is live
+#define PACK_INDEX_MAGIC 0x6b636170u        // Marks an index written with this layout
+#define PACK_RECORD_MAGIC 0x64726370u       // Starts every record in a segment
+#define PACK_SLOT_EMPTY 0                   // States of an index slot: never used
+#define PACK_SLOT_USED 1                    // Holds a packed file
+#define PACK_SLOT_DELETED 2                 // The file was removed, probing continues past the slot
+#define PREALLOCATE_ENABLED 1               // Reserve the size a ufile announces with fallocate() before its data arrives
+#define UPLOAD_CHUNK_MIN (1024 * 1024)      // Smallest chunk of a parallel upload (1 MB)
+#define UPLOAD_CHUNK_MAX (256LL * 1024 * 1024) // Largest chunk of a parallel upload (256 MB)
+#define UPLOAD_MAX_CHUNKS 65536             // Most chunks one parallel upload is split into
+#define UPLOAD_TABLE_MAGIC 0x6b686375u      // Starts the chunk table of a parallel upload
+#define DISPLAY_CACHE_ENABLED 1             // Answer repeated displays of an unchanged directory from memory
+#define DISPLAY_CACHE_SLOTS 512             // Listings kept at most, about 1.3 KB each, so the cache stays under 1 MB
+#define DISPLAY_CACHE_WAYS 8                // Slots one directory's listing may take, the least recently used is replaced
+#define DISPLAY_PATH_MAX 256                // Longest directory path whose listing is kept
+#define DISPLAY_RACY_NS 1000000000LL        // A directory changed this recently is listed again, see display_cache_store()
+
+#include "crc32c.h"                 // CRC32C of file data, the same in every program
+#include "trace.h"                  // Request spans, the same in every program
+#include "chunks.h"                 // Buffer pool and chunked file transfers, the same in every program
+#include "command.h"                // Command frames and their words, the same in every server
 
 const char *valid_home_dir()
 {
@@ -55,286 +121,3085 @@ int create_dir_if_new(const char *directory_path) {
     return 0; // Return 0 to indicate success
 }
 
-// Declaring functions beforehand and then defining them later in the program based on their usage and requirement
-void process_client_request(int client_socket);
-void handle_upload_file(int client_socket, char *file_name, char *destination_dir, char *recv_buffer);
-void handle_download_file(int client_socket, char *file_name);
-void handle_remove_file(int client_socket, char *file_name);
-void handle_create_tar(int client_socket, char *file_extension);
-void handle_display(int client_socket, char *pathname);
 
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_address, client_address;
-    socklen_t client_address_len = sizeof(client_address);
+// Function to open the reply to a download with a status line: "data" when the file's chunk stream follows, "none"
+// when only the final message does. MSG_MORE holds the line back so it leaves in one segment with what follows
+int send_download_status(int sock, int found)
+{
+    const char *status = found ? "data\n" : "none\n";
 
-    // Creating a TCP socket
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Failed to create socket");
-        exit(EXIT_FAILURE);
-    }
+    return send(sock, status, strlen(status), MSG_MORE) == (ssize_t)strlen(status) ? 0 : -1;
+}
 
-    // Initialize server address structure
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(TEXT_PORT);
+// Function to read the file size a ufile frame announces after its destination, -1 when the client sent none
+long long announced_size(const char *frame) {
+    long long size;
 
-    // Convert IP address from string to binary form
-    if (inet_pton(AF_INET, SERVER_IP, &server_address.sin_addr) <= 0)
-    {
-        perror("Invalid Address\n");
-        close(server_socket);
-        exit(EXIT_FAILURE);
-    }
+    return sscanf(frame, "%*s %*s %*s %lld", &size) == 1 && size >= 0 ? size : -1;
+}
 
-    // Bind socket to the specified IP and port
-    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-        perror("Socket binding failed");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+// Function to reserve the disk space of an upload before its data arrives, so a huge file gets few large extents and
+// a full disk is noticed before any data is sent. The file keeps its size while the data comes in
+// Returns -1 when the space is not there; filesystems without fallocate() allocate as the data is written instead
+int preallocate_file(FILE *file, long long size) {
+    if (!PREALLOCATE_ENABLED || size <= 0 ||
+        fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, size) == 0 || errno == EOPNOTSUPP || errno == ENOSYS) {
+        return 0;
     }
+    return -1;
+}
 
-    // Start listening for incoming connections
-    if (listen(server_socket, 5) < 0)
-    {
-        perror("Not able to listen to client connection requests");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+// Function to give back the space reserved past the end of an upload that came in shorter than announced
+void trim_preallocated(FILE *file, long long size) {
+    off_t end;
+
+    if (size > 0 && fflush(file) == 0 && (end = ftello(file)) < size && ftruncate(fileno(file), end) != 0) {
+        perror("Failed to release preallocated space");
     }
+}
 
-    printf("Stext server running and waiting for connections on port %d...\n", TEXT_PORT);
+// One cached display listing, valid while its directory keeps the identity and change times it had when it was listed
+struct display_entry {
+    int used;                           // Slot holds a listing
+    char path[DISPLAY_PATH_MAX];        // Directory as the clients name it, repeated and trailing slashes dropped
+    int present;                        // The directory existed when it was listed, packed files need none
+    dev_t device;                       // Identity and change times of the directory when it was listed
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long last_used;       // display_cache->ticks at the last use, the oldest listing of a set makes room
+    size_t length;                      // Bytes of the listing
+    char listing[BUFFER_SIZE];
+};
 
-    // Main server loop to accept incoming connections
-    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len)) >= 0) {
-        printf("Connection established with a client.\n");
+// The display cache, one table every worker maps: sets of DISPLAY_CACHE_WAYS slots chosen by a hash of the path
+struct display_cache {
+    pthread_mutex_t lock;               // Process-shared lock guarding everything below
+    unsigned long long changes;         // Bumped by every invalidation, a listing made across one is not kept
+    unsigned long long ticks;           // Counts the uses of listings, for last_used
+    unsigned long hits;                 // Displays answered from the cache
+    unsigned long misses;               // Displays that listed the directory
+    unsigned long invalidations;        // Listings dropped because their directory changed
+    unsigned long evictions;            // Listings dropped to make room in a full set
+    struct display_entry entries[DISPLAY_CACHE_SLOTS];
+};
 
-        if (fork() == 0) {
-            // Inside the child process
-            close(server_socket);
-            process_client_request(client_socket);
-            close(client_socket);
-            exit(0);
-        } else {
-            // Inside the parent process
-            close(client_socket);
-            wait(NULL);
-        }
-    }
+// What display_cache_lookup() saw of a directory before it was listed, for display_cache_store()
+struct display_stamp {
+    int cacheable;                      // Caching is on and the path is short enough
+    char path[DISPLAY_PATH_MAX];
+    int present;
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    struct timespec ctime;
+    unsigned long long changes;         // display_cache->changes at the lookup
+};
 
-    if (client_socket < 0) {
-        perror("Failed to accept connection");
-        close(server_socket);
-        exit(EXIT_FAILURE);
+struct display_cache *display_cache;    // Mapped by display_cache_init(), NULL while every display lists afresh
+
+// Function to map the display cache before the first worker starts, so all of them share it
+int display_cache_init() {
+    pthread_mutexattr_t attributes;
+
+    display_cache = mmap(NULL, sizeof(struct display_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (display_cache == MAP_FAILED) {
+        perror("Failed to map the display cache");
+        display_cache = NULL;
+        return -1;
     }
+    memset(display_cache, 0, sizeof(struct display_cache));
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&display_cache->lock, &attributes) != 0) {
+        perror("Failed to create the display cache lock");
+        munmap(display_cache, sizeof(struct display_cache));
+        display_cache = NULL;
+        return -1;
+    }
+    pthread_mutexattr_destroy(&attributes);
+    printf("Display cache keeps up to %d listings in %zu KB\n", DISPLAY_CACHE_SLOTS, sizeof(struct display_cache) / 1024);
+    return 0;
+}
 
-    close(server_socket);
+// Function to turn a directory named by a client into its cache key, dropping repeated and trailing slashes
+// Returns -1 when it is too long to be cached
+int display_key(const char *path, char *key) {
+    size_t length = 0;
+
+    for (const char *p = path; *p != '\0'; p++) {
+        if (*p == '/' && (length == 0 || key[length - 1] == '/')) {
+            continue;
+        }
+        if (length == DISPLAY_PATH_MAX - 1) {
+            return -1;
+        }
+        key[length++] = *p;
+    }
+    while (length > 0 && key[length - 1] == '/') {
+        length--;
+    }
+    key[length] = '\0';
     return 0;
 }
 
+// Function to find the set of slots a key may use
+struct display_entry *display_set(const char *key) {
+    uint32_t hash = crc32c_update(0, key, strlen(key));
 
-void process_client_request(int client_socket) {
-    char recv_buffer[BUFFER_SIZE];  // Buffer to store received data
-    char cmd[BUFFER_SIZE];          // Buffer to store the command
-    char arg1[BUFFER_SIZE], arg2[BUFFER_SIZE];  // Buffers to store command arguments
+    return &display_cache->entries[hash % (DISPLAY_CACHE_SLOTS / DISPLAY_CACHE_WAYS) * DISPLAY_CACHE_WAYS];
+}
 
-    while (1) {
-        // Clear buffers before receiving new data
-        for (int i = 0; i < BUFFER_SIZE; i++)
-        {
-                recv_buffer[i] = 0;
-                cmd[i] = 0;
-                arg1[i] = 0;
-                arg2[i] = 0;
-        }
-
-        // Receive data from the client
-        int received_length = recv(client_socket, recv_buffer, BUFFER_SIZE, 0);
-        if (received_length <= 0) {
-       //     perror("Failed to receive data");
-            break;
-        }
+// Function to find the cached listing of a directory. directory is where the store keeps it; a listing is only used
+// while the directory has the identity and change times it had when it was listed, so changes made behind the
+// server's back are noticed too. *stamp records what was seen, for display_cache_store() after a miss
+// Returns the length of the listing copied to listing, -1 on a miss
+long display_cache_lookup(const char *path, const char *directory, char *listing, size_t size, struct display_stamp *stamp) {
+    struct display_entry *set;
+    struct stat info;
+    long length = -1;
 
-        // Ensure the received data is null-terminated
-        recv_buffer[received_length] = '\0';
+    stamp->cacheable = display_cache != NULL && display_key(path, stamp->path) == 0;
+    if (!stamp->cacheable) {
+        return -1;
+    }
+    memset(&info, 0, sizeof(info));
+    stamp->present = stat(directory, &info) == 0 && S_ISDIR(info.st_mode);
+    stamp->device = stamp->present ? info.st_dev : 0;
+    stamp->inode = stamp->present ? info.st_ino : 0;
+    stamp->mtime = stamp->present ? info.st_mtim : (struct timespec){0, 0};
+    stamp->ctime = stamp->present ? info.st_ctim : (struct timespec){0, 0};
+    set = display_set(stamp->path);
 
-        // Parse the received data into command and arguments
-        sscanf(recv_buffer, "%s %s %s", cmd, arg1, arg2);
+    pthread_mutex_lock(&display_cache->lock);
+    stamp->changes = display_cache->changes;
+    for (int i = 0; i < DISPLAY_CACHE_WAYS; i++) {
+        struct display_entry *entry = &set[i];
 
-        // Handle the specific command received from the client
-        if (strcmp(cmd, "ufile") == 0) {
-            handle_upload_file(client_socket, arg1, arg2, recv_buffer);         // to handle the ufile command
-        } else if (strcmp(cmd, "dfile") == 0) {
-            handle_download_file(client_socket, arg1);                          // to handle the dfile command
-        } else if (strcmp(cmd, "rmfile") == 0) {
-            handle_remove_file(client_socket, arg1);                            // to handle the rmfile command
-        } else if (strcmp(cmd, "dtar") == 0) {
-            handle_create_tar(client_socket, arg1);                             // to handle the dtar command
-        } else if (strcmp(cmd, "display") == 0) {
-            handle_display(client_socket, arg1);                                // to handle the display command
+        if (!entry->used || strcmp(entry->path, stamp->path) != 0) {
+            continue;
+        }
+        if (entry->present == stamp->present && entry->device == stamp->device && entry->inode == stamp->inode &&
+            entry->mtime.tv_sec == stamp->mtime.tv_sec && entry->mtime.tv_nsec == stamp->mtime.tv_nsec &&
+            entry->ctime.tv_sec == stamp->ctime.tv_sec && entry->ctime.tv_nsec == stamp->ctime.tv_nsec &&
+            entry->length < size) {
+            memcpy(listing, entry->listing, entry->length);
+            listing[entry->length] = '\0';
+            length = (long)entry->length;
+            entry->last_used = ++display_cache->ticks;
         } else {
-            // Send an error message to the client if the command is invalid
-            char *error_message = "Invalid command\n";
-            send(client_socket, error_message, strlen(error_message), 0);
+            entry->used = 0; // The directory changed since it was listed
+            display_cache->invalidations++;
         }
+        break;
+    }
+    if (length >= 0) {
+        display_cache->hits++;
+    } else {
+        display_cache->misses++;
     }
+    pthread_mutex_unlock(&display_cache->lock);
+    return length;
 }
 
+// Function to keep a listing made after display_cache_lookup() missed. It is not kept when an invalidation came in
+// meanwhile, nor when the directory changed in the last DISPLAY_RACY_NS: file times only move once per kernel clock
+// tick, so a second change in the tick of the first would leave them as they were
+void display_cache_store(const struct display_stamp *stamp, const char *listing, size_t length) {
+    struct display_entry *set, *slot = NULL;
+    struct timespec now;
+    long long changed_ns;
 
-void handle_upload_file(int client_socket, char *file_name, char *destination_dir, char *recv_buffer) {
-    char full_file_path[BUFFER_SIZE];        // Full path where the file will be stored
-    FILE *file_pointer;
-    char server_response[BUFFER_SIZE];       // Response to be sent back to the client
-    char full_destination_path[BUFFER_SIZE]; // Destination directory path
-    char file_content_buffer[BUFFER_SIZE];   // Buffer to store chunks of file content
-    int received_bytes;
+    if (!stamp->cacheable || length >= BUFFER_SIZE) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    changed_ns = (long long)stamp->mtime.tv_sec * 1000000000LL + stamp->mtime.tv_nsec;
+    if ((long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec > changed_ns) {
+        changed_ns = (long long)stamp->ctime.tv_sec * 1000000000LL + stamp->ctime.tv_nsec;
+    }
+    if (stamp->present && (long long)now.tv_sec * 1000000000LL + now.tv_nsec - changed_ns < DISPLAY_RACY_NS) {
+        return;
+    }
+    set = display_set(stamp->path);
 
-    // Construct the full destination directory path
-    snprintf(full_destination_path, sizeof(full_destination_path), "%s/stext/%s", valid_home_dir(), destination_dir);
-    if (create_dir_if_new(full_destination_path) != 0) {
-        return; // If directory creation fails, exit the function
+    pthread_mutex_lock(&display_cache->lock);
+    if (display_cache->changes == stamp->changes) {
+        // The directory's own slot when another worker listed it meanwhile, else a free one, else the least
+        // recently used of the set
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++) {
+            if (set[i].used && strcmp(set[i].path, stamp->path) == 0) {
+                slot = &set[i];
+            }
+        }
+        for (int i = 0; i < DISPLAY_CACHE_WAYS && slot == NULL; i++) {
+            if (!set[i].used) {
+                slot = &set[i];
+            }
+        }
+        if (slot == NULL) {
+            slot = &set[0];
+            for (int i = 1; i < DISPLAY_CACHE_WAYS; i++) {
+                slot = set[i].last_used < slot->last_used ? &set[i] : slot;
+            }
+            display_cache->evictions++;
+        }
+        slot->used = 1;
+        snprintf(slot->path, sizeof(slot->path), "%s", stamp->path);
+        slot->present = stamp->present;
+        slot->device = stamp->device;
+        slot->inode = stamp->inode;
+        slot->mtime = stamp->mtime;
+        slot->ctime = stamp->ctime;
+        slot->last_used = ++display_cache->ticks;
+        slot->length = length;
+        memcpy(slot->listing, listing, length);
     }
+    pthread_mutex_unlock(&display_cache->lock);
+}
 
-    // Construct the full file path with filename
-    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s/%s", valid_home_dir(), destination_dir, file_name);
+// Function to drop the listings a change to a stored path makes stale: that of the directory holding it, and for
+// a directory or a glob its own and all below it. Called once the change is done, which also keeps a listing made
+// meanwhile from being stored
+void display_cache_invalidate(const char *path) {
+    char key[DISPLAY_PATH_MAX];
+    char *slash;
+    size_t length, parent_length;
 
-    // Open the file for writing in binary mode
-    file_pointer = fopen(full_file_path, "wb");
-    if (file_pointer == NULL) {
-        snprintf(server_response, sizeof(server_response), "Unable to open file %s for writing\n", full_file_path);
-        send(client_socket, server_response, strlen(server_response), 0);
+    if (display_cache == NULL) {
         return;
     }
+    if (display_key(path, key) != 0) {
+        key[0] = '\0'; // Too long to compare, every listing goes
+    }
+    if ((slash = strrchr(key, '/')) != NULL && strpbrk(slash + 1, "*?[") != NULL) {
+        *slash = '\0'; // A glob may match directories, everything below its directory goes
+    }
+    length = strlen(key);
+    slash = strrchr(key, '/');
+    parent_length = slash != NULL ? (size_t)(slash - key) : 0;
 
-    printf("Receiving file: %s\n", full_file_path);
+    pthread_mutex_lock(&display_cache->lock);
+    display_cache->changes++;
+    for (int i = 0; i < DISPLAY_CACHE_SLOTS; i++) {
+        struct display_entry *entry = &display_cache->entries[i];
 
-    // Receive the file content from the client
-    while ((received_bytes = recv(client_socket, file_content_buffer, sizeof(file_content_buffer), 0)) > 0) {
-        printf("File has %d bytes\n", received_bytes);
-        fwrite(file_content_buffer, 1, received_bytes, file_pointer); // Write the received bytes to the file
-        if (received_bytes < sizeof(file_content_buffer)) {
-    //      printf("End of file detected\n");
-            break; // End of file reached
+        if (entry->used && (length == 0 ||
+            (strncmp(entry->path, key, length) == 0 && (entry->path[length] == '\0' || entry->path[length] == '/')) ||
+            (strlen(entry->path) == parent_length && strncmp(entry->path, key, parent_length) == 0))) {
+            entry->used = 0;
+            display_cache->invalidations++;
         }
     }
+    pthread_mutex_unlock(&display_cache->lock);
+}
 
-    fclose(file_pointer);
+// Header in front of every file appended to a pack segment, followed by the path and then the file data
+struct pack_record {
+    uint32_t magic;                     // PACK_RECORD_MAGIC, marks the start of a record
+    uint32_t path_length;               // Bytes of the path, which is not terminated
+    uint32_t length;                    // Bytes of file data after the path
+    uint32_t checksum;                  // CRC32C of the file data
+    int64_t mtime_ns;                   // When the file was stored, in nanoseconds since the epoch
+};
 
-    snprintf(server_response, sizeof(server_response), "File %s uploaded to Client Directory\n", file_name);
-    send(client_socket, server_response, strlen(server_response), 0); // Notify client of successful upload
+// One slot of the pack index: where the current version of a packed file is
+struct pack_entry {
+    uint32_t state;                     // PACK_SLOT_EMPTY, PACK_SLOT_USED or PACK_SLOT_DELETED
+    uint32_t segment;                   // Segment file holding the data
+    uint64_t offset;                    // Offset of the file data inside the segment
+    uint32_t length;
+    uint32_t checksum;
+    int64_t mtime_ns;
+    char path[PACK_PATH_MAX];           // Path relative to the store directory, "~smain/dir/file.txt"
+};
+
+// The pack index, a file every worker maps: segment bookkeeping followed by an open addressing hash table
+struct pack_index {
+    uint32_t magic;                     // PACK_INDEX_MAGIC once the index is set up
+    uint32_t slot_count;                // PACK_INDEX_SLOTS of the build that created the index
+    pthread_rwlock_t lock;              // Process-shared; lookups share it, appends, removals and compaction take it alone
+    uint32_t active_segment;            // Segment new records are appended to
+    int compacting;                     // Set while a worker compacts, so only one does at a time
+    uint32_t entries;                   // Slots holding a file
+    uint32_t deleted;                   // Slots of removed files, reclaimed when the table is rebuilt
+    uint32_t generation[PACK_MAX_SEGMENTS];     // Bumped when a segment number is used again, so stale descriptors are noticed
+    uint64_t segment_bytes[PACK_MAX_SEGMENTS];  // Bytes appended to each segment, 0 for a number not in use
+    uint64_t live_bytes[PACK_MAX_SEGMENTS];     // Bytes of the records the index still points to
+    struct pack_entry slots[PACK_INDEX_SLOTS];
+};
+
+struct pack_index *pack_index;          // Mapped by pack_init(), NULL while every file is stored loose
+char pack_root[BUFFER_SIZE];            // Store directory the packed paths are relative to
+int pack_write_fd = -1;                 // This worker's descriptor of the active segment, used under the index lock
+uint32_t pack_write_segment;            // Segment and generation pack_write_fd was opened for
+uint32_t pack_write_generation;
+
+// Function to name the file of a segment
+void pack_segment_path(uint32_t segment, char *path, size_t size) {
+    snprintf(path, size, "%s/%s/segment-%04u", pack_root, PACK_DIR, segment);
 }
 
-void handle_download_file(int client_socket, char *file_name) {
-    char file_read_buffer[BUFFER_SIZE];    // Buffer to hold file content being read
-    char full_file_path[BUFFER_SIZE];      // Full path to the file being downloaded
-    int file_descriptor;
-    int read_bytes;
-    char download_response[BUFFER_SIZE];   // Response to be sent back to the client
+// Function to map the pack index of a store, creating it on first use. An index written by a build with another
+// layout is started afresh. The lock and the compaction flag are reset here, before any worker runs, because a
+// worker killed while holding them would otherwise leave them taken for good
+int pack_init(const char *store_root) {
+    char path[BUFFER_SIZE * 2];
+    struct stat index_info;
+    uint32_t header[2];                 // Magic number and slot count of an existing index
+    pthread_rwlockattr_t attributes;
+    int index_fd;
 
-    // Construct the full path to the file
-    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s", valid_home_dir(), file_name);
-    printf("Downloading file from: %s\n", full_file_path);
+    snprintf(pack_root, sizeof(pack_root), "%s", store_root);
+    snprintf(path, sizeof(path), "%s/%s", store_root, PACK_DIR);
+    if (create_dir_if_new(path) != 0) {
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/index", store_root, PACK_DIR);
+    if ((index_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0 || fstat(index_fd, &index_info) != 0) {
+        perror("Failed to open the pack index");
+        if (index_fd >= 0) {
+            close(index_fd);
+        }
+        return -1;
+    }
 
-    // Open the file for reading
-    file_descriptor = open(full_file_path, O_RDONLY);
-    if (file_descriptor < 0) {
-    //    perror("Error: Failed to open file");
-        return;
+    // Truncating to zero first leaves a sparse, zeroed table without writing 16 MB
+    if (index_info.st_size != sizeof(struct pack_index) || pread(index_fd, header, sizeof(header), 0) != sizeof(header) ||
+        header[0] != PACK_INDEX_MAGIC || header[1] != PACK_INDEX_SLOTS) {
+        if (ftruncate(index_fd, 0) != 0 || ftruncate(index_fd, sizeof(struct pack_index)) != 0) {
+            perror("Failed to create the pack index");
+            close(index_fd);
+            return -1;
+        }
+    }
+    pack_index = mmap(NULL, sizeof(struct pack_index), PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    close(index_fd);
+    if (pack_index == MAP_FAILED) {
+        perror("Failed to map the pack index");
+        pack_index = NULL;
+        return -1;
+    }
+    pack_index->magic = PACK_INDEX_MAGIC;
+    pack_index->slot_count = PACK_INDEX_SLOTS;
+    pack_index->compacting = 0;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    if (pthread_rwlock_init(&pack_index->lock, &attributes) != 0) {
+        perror("Failed to create the pack index lock");
+        munmap(pack_index, sizeof(struct pack_index));
+        pack_index = NULL;
+        return -1;
     }
+    pthread_rwlockattr_destroy(&attributes);
+    printf("Pack storage in %s/%s holds %u files\n", store_root, PACK_DIR, pack_index->entries);
+    return 0;
+}
+
+// Function to turn a stored path into its index key: repeated slashes, "." components and a trailing slash are
+// dropped, so every spelling the file system accepts for a file finds the same entry. Returns -1 when it does not fit
+int pack_key(const char *path, char *key) {
+    size_t length = 0;
 
-    // Read the file content and send it to the client
-    while ((read_bytes = read(file_descriptor, file_read_buffer, sizeof(file_read_buffer))) > 0) {
-        send(client_socket, file_read_buffer, read_bytes, 0);
-        if (read_bytes < sizeof(file_read_buffer)) {
-            break; // End of file reached
+    while (*path) {
+        if (*path == '/' || (path[0] == '.' && (path[1] == '/' || path[1] == '\0'))) {
+            path++;
+            continue;
+        }
+        if (length > 0) {
+            key[length++] = '/';
+        }
+        while (*path && *path != '/') {
+            if (length >= PACK_PATH_MAX - 2) {
+                return -1;
+            }
+            key[length++] = *path++;
         }
     }
+    key[length] = '\0';
+    return 0;
+}
 
-    close(file_descriptor);
-    sleep(2); // Small delay of 2 seconds to ensure the file transmission is complete
+// Function to hash an index key, FNV-1a
+uint32_t pack_hash(const char *key) {
+    uint64_t hash = 14695981039346656037ULL;
 
-    snprintf(download_response, sizeof(download_response), "File %s downloaded successfully\n", file_name);
-    send(client_socket, download_response, strlen(download_response), 0); // Notify client of successful download
+    for (; *key; key++) {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
 }
 
+// Function to find the slot of a key, caller holds the index lock
+// Returns the slot holding the key, or NULL with *free_slot set to where the key would go (NULL when the table is full)
+struct pack_entry *pack_find(const char *key, struct pack_entry **free_slot) {
+    uint32_t slot = pack_hash(key) & (PACK_INDEX_SLOTS - 1);
+    struct pack_entry *reusable = NULL;
 
-void handle_remove_file(int client_socket, char *file_name) {
-    char server_response[BUFFER_SIZE];   // Response to be sent back to the client
-    char full_file_path[BUFFER_SIZE];    // Full path to the file to be removed
+    for (uint32_t probes = 0; probes < PACK_INDEX_SLOTS; probes++, slot = (slot + 1) & (PACK_INDEX_SLOTS - 1)) {
+        struct pack_entry *entry = &pack_index->slots[slot];
 
-    // Construct the full path to the file
-    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s", valid_home_dir(), file_name);
+        if (entry->state == PACK_SLOT_EMPTY) {
+            reusable = reusable != NULL ? reusable : entry;
+            break;
+        }
+        if (entry->state == PACK_SLOT_DELETED) {
+            reusable = reusable != NULL ? reusable : entry;
+        } else if (strcmp(entry->path, key) == 0) {
+            return entry;
+        }
+    }
+    if (free_slot != NULL) {
+        *free_slot = reusable;
+    }
+    return NULL;
+}
 
-    // Remove the file at the specified path
-    if (remove(full_file_path) == 0) {
-        // Notify client of successful deletion
-        snprintf(server_response, sizeof(server_response), "File %s deleted successfully.\n", file_name);
-    } else {
-        // Notify client of failure to delete
-        snprintf(server_response, sizeof(server_response), "Error: Unable to delete file %s.\n", file_name);
+// Function to give the bytes a file's record takes in its segment
+uint64_t pack_record_bytes(const struct pack_entry *entry) {
+    return sizeof(struct pack_record) + strlen(entry->path) + entry->length;
+}
+
+// Function to rebuild the hash table without the slots of removed files, caller holds the index lock alone
+void pack_rehash() {
+    struct pack_entry *live = malloc((pack_index->entries + 1) * sizeof(struct pack_entry));
+    struct pack_entry *slot;
+    uint32_t count = 0;
+
+    if (live == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < PACK_INDEX_SLOTS; i++) {
+        if (pack_index->slots[i].state == PACK_SLOT_USED) {
+            live[count++] = pack_index->slots[i];
+        }
+    }
+    memset(pack_index->slots, 0, sizeof(pack_index->slots));
+    for (uint32_t i = 0; i < count; i++) {
+        pack_find(live[i].path, &slot);
+        *slot = live[i];
     }
+    pack_index->entries = count;
+    pack_index->deleted = 0;
+    free(live);
+}
 
-    // Send the response to the client
-    send(client_socket, server_response, strlen(server_response), 0);
+// Function to append one record to the active segment, moving on to an unused segment number once it is full
+// Caller holds the index lock alone; *location gets where the data went. Returns -1 when nothing was appended
+int pack_append(const char *key, const char *data, uint32_t length, uint32_t checksum, int64_t mtime_ns, struct pack_entry *location) {
+    struct pack_record record = {PACK_RECORD_MAGIC, strlen(key), length, checksum, mtime_ns};
+    struct iovec parts[3] = {{&record, sizeof(record)}, {(void *)key, record.path_length}, {(void *)data, length}};
+    uint64_t record_bytes = sizeof(record) + record.path_length + length;
+    uint32_t segment = pack_index->active_segment;
+    char path[BUFFER_SIZE * 2];
+
+    if (pack_index->segment_bytes[segment] > 0 && pack_index->segment_bytes[segment] + record_bytes > PACK_SEGMENT_BYTES) {
+        uint32_t next = segment;
+
+        for (uint32_t i = 1; i < PACK_MAX_SEGMENTS && next == segment; i++) {
+            if (pack_index->segment_bytes[(segment + i) % PACK_MAX_SEGMENTS] == 0) {
+                next = (segment + i) % PACK_MAX_SEGMENTS;
+            }
+        }
+        if (next == segment) {
+            return -1; // Every segment number is in use, new files stay loose until compaction frees one
+        }
+        pack_index->active_segment = segment = next;
+        pack_index->generation[segment]++;
+    }
+    if (pack_write_fd < 0 || pack_write_segment != segment || pack_write_generation != pack_index->generation[segment]) {
+        if (pack_write_fd >= 0) {
+            close(pack_write_fd);
+        }
+        // A number used for the first time may still have a file from before the index was started afresh
+        pack_segment_path(segment, path, sizeof(path));
+        pack_write_fd = open(path, O_WRONLY | O_CREAT | (pack_index->segment_bytes[segment] == 0 ? O_TRUNC : 0), 0600);
+        if (pack_write_fd < 0) {
+            perror("Failed to open a pack segment");
+            return -1;
+        }
+        pack_write_segment = segment;
+        pack_write_generation = pack_index->generation[segment];
+    }
+    if (pwritev(pack_write_fd, parts, 3, pack_index->segment_bytes[segment]) != (ssize_t)record_bytes) {
+        perror("Failed to append to a pack segment");
+        return -1;
+    }
+    location->state = PACK_SLOT_USED;
+    location->segment = segment;
+    location->offset = pack_index->segment_bytes[segment] + sizeof(record) + record.path_length;
+    location->length = length;
+    location->checksum = checksum;
+    location->mtime_ns = mtime_ns;
+    snprintf(location->path, sizeof(location->path), "%s", key);
+    pack_index->segment_bytes[segment] += record_bytes;
+    pack_index->live_bytes[segment] += record_bytes;
+    return 0;
 }
 
-void handle_create_tar(int client_socket, char *file_extension) {
-    char tar_command[BUFFER_SIZE];    // Command to create tar file
-    char client_message[BUFFER_SIZE]; // Message to be sent to the client
-    FILE *tar_file_pointer;
+// Function to store a small file in the pack: its record is appended to the active segment, the index entry is pointed
+// at it and a loose copy of the same path is deleted. Returns -1 when the file has to be stored as a loose file instead
+int pack_store(const char *path, const char *data, size_t length, uint32_t checksum) {
+    char key[PACK_PATH_MAX], loose_path[BUFFER_SIZE * 2];
+    struct pack_entry *entry, *free_slot, location;
+    struct timespec now;
+    int result = -1;
 
-    // Check if the file extension is supported
-    if (strcmp(file_extension, ".txt") == 0) {
-        // Construct the command to find .txt files and create a tar archive
-        snprintf(tar_command, sizeof(tar_command), "find ~/stext -name '*.txt' | tar -cvf txt_list.tar -T -");
-        system(tar_command); // Execute the command
-
-        // Open the tar file to check if it was created successfully
-        tar_file_pointer = fopen("txt_list.tar", "rb");
-        if (tar_file_pointer) {
-            fclose(tar_file_pointer); // Close the file if it was opened successfully
-            snprintf(client_message, sizeof(client_message), "Tar file for %s files created successfully.\n", file_extension);
+    if (!PACK_ENABLED || pack_index == NULL || length > PACK_MAX_FILE || pack_key(path, key) != 0) {
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_rwlock_wrlock(&pack_index->lock);
+    entry = pack_find(key, &free_slot);
+    if (entry == NULL && pack_index->entries + pack_index->deleted >= PACK_INDEX_SLOTS / 8 * 7) {
+        // Probing gets slow in a table this full: reclaim the removed files' slots, or leave new files loose
+        if (pack_index->deleted > 0) {
+            pack_rehash();
+            pack_find(key, &free_slot);
+        }
+        if (pack_index->entries + pack_index->deleted >= PACK_INDEX_SLOTS / 8 * 7) {
+            free_slot = NULL;
+        }
+    }
+    if ((entry != NULL || free_slot != NULL) &&
+        pack_append(key, data, length, checksum, (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec, &location) == 0) {
+        if (entry != NULL) {
+            pack_index->live_bytes[entry->segment] -= pack_record_bytes(entry);
         } else {
-            snprintf(client_message, sizeof(client_message), "Error: Failed to create tar file for %s files.\n", file_extension);
+            entry = free_slot;
+            pack_index->deleted -= entry->state == PACK_SLOT_DELETED;
+            pack_index->entries++;
         }
-    } else {
-        // If the file extension is unsupported, notify the client
-        snprintf(client_message, sizeof(client_message), "Error: Unsupported file type %s\n", file_extension);
+        *entry = location;
+        result = 0;
     }
+    pthread_rwlock_unlock(&pack_index->lock);
 
-    // Send the response to the client
-    send(client_socket, client_message, strlen(client_message), 0);
+    if (result == 0) {
+        snprintf(loose_path, sizeof(loose_path), "%s/%s", pack_root, key);
+        unlink(loose_path);
+        display_cache_invalidate(key); // Packed files leave no trace in the directory's times
+    }
+    return result;
 }
 
-// Function to handle the display of .txt files in a specified directory
-void handle_display(int client_socket, char *pathname) {
-    char command[BUFFER_SIZE];                  // Buffer to hold the shell command string
-    char buffer[BUFFER_SIZE];                   // Buffer to store output data read from the command execution
-    FILE *pipe;                                 // File pointer for the pipe used to capture command output
+// Function to look a path up in the pack, returns 0 and copies its entry when the file is packed
+int pack_lookup(const char *path, struct pack_entry *found) {
+    char key[PACK_PATH_MAX];
+    struct pack_entry *entry;
+
+    if (pack_index == NULL || pack_key(path, key) != 0) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL && found != NULL) {
+        *found = *entry;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return entry != NULL ? 0 : -1;
+}
 
-    // Constructing a shell command to find all .txt files in the specified directory -maxdepth 1 limits the search to the specified directory (not recursive)
-    // -exec basename {} \\; ensures that only the filenames (without path) are returned
-    snprintf(command, sizeof(command), "find %s/stext/%s -maxdepth 1 -name '*.txt' -exec basename {} \\;", valid_home_dir(), pathname);
+// Function to open the segment holding a packed file, the data is `found->length` bytes at `found->offset`
+// The segment is opened under the index lock, so compaction can neither delete it nor reuse its number in between
+// Returns the descriptor, -1 when the file is not packed
+int pack_open_file(const char *path, struct pack_entry *found) {
+    char key[PACK_PATH_MAX], segment_path[BUFFER_SIZE * 2];
+    struct pack_entry *entry;
+    int file_descriptor = -1;
 
-    // Opening a pipe to execute the constructed shell command and read its output
-    pipe = popen(command, "r");
-    if (pipe != NULL) {
-        int files_found = 0;            // Flag to indicate whether any .txt files were found
-        // Reading file names and send to client
-        while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-            // Send the filename to the client through the socket
-            send(client_socket, buffer, strlen(buffer), 0);
-            files_found = 1;
+    if (pack_index == NULL || pack_key(path, key) != 0) {
+        return -1;
+    }
+    pthread_rwlock_rdlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL) {
+        *found = *entry;
+        pack_segment_path(entry->segment, segment_path, sizeof(segment_path));
+        file_descriptor = open(segment_path, O_RDONLY);
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return file_descriptor;
+}
+
+// Function to drop a file from the pack, its record becomes garbage for compaction. Returns 0 when it was packed
+int pack_remove(const char *path) {
+    char key[PACK_PATH_MAX];
+    struct pack_entry *entry;
+
+    if (pack_index == NULL || pack_key(path, key) != 0) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&pack_index->lock);
+    if ((entry = pack_find(key, NULL)) != NULL) {
+        pack_index->live_bytes[entry->segment] -= pack_record_bytes(entry);
+        entry->state = PACK_SLOT_DELETED;
+        pack_index->entries--;
+        pack_index->deleted++;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    if (entry != NULL) {
+        display_cache_invalidate(key);
+    }
+    return entry != NULL ? 0 : -1;
+}
+
+// Function to copy the entries of every packed file below a directory, "" for the whole store
+// Returns the number of entries in *listing, which the caller frees; a path relative to the directory starts
+// *skip bytes into the entry's path
+int pack_list(const char *directory, struct pack_entry **listing, size_t *skip) {
+    char key[PACK_PATH_MAX];
+    size_t key_length;
+    int count = 0, capacity = 0;
+
+    *listing = NULL;
+    *skip = 0;
+    if (pack_index == NULL || pack_key(directory, key) != 0) {
+        return 0;
+    }
+    key_length = strlen(key);
+    *skip = key_length > 0 ? key_length + 1 : 0;
+    pthread_rwlock_rdlock(&pack_index->lock);
+    for (uint32_t i = 0; i < PACK_INDEX_SLOTS; i++) {
+        struct pack_entry *entry = &pack_index->slots[i];
+
+        if (entry->state != PACK_SLOT_USED ||
+            (key_length > 0 && (strncmp(entry->path, key, key_length) != 0 || entry->path[key_length] != '/'))) {
+            continue;
         }
-        pclose(pipe);
+        if (count == capacity) {
+            struct pack_entry *bigger = realloc(*listing, (capacity > 0 ? capacity * 2 : 64) * sizeof(struct pack_entry));
+            if (bigger == NULL) {
+                break;
+            }
+            *listing = bigger;
+            capacity = capacity > 0 ? capacity * 2 : 64;
+        }
+        (*listing)[count++] = *entry;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    return count;
+}
 
-        // If no files are found, send a message indicating no files available
-        if (!files_found) {
-            char no_files_msg[] = "No .txt files found in the specified directory.\n";
-            send(client_socket, no_files_msg, strlen(no_files_msg), 0);
+// Function to move the records of one segment that the index still points to onto the active segment, then delete
+// the segment once nothing in it is live. The index lock is taken per record, so uploads and downloads carry on
+void pack_compact_segment(uint32_t segment, uint64_t size) {
+    char path[BUFFER_SIZE * 2], key[PACK_PATH_MAX];
+    char *buffer = malloc(PACK_PATH_MAX + PACK_MAX_FILE);
+    struct pack_record record;
+    struct pack_entry *entry, location;
+    uint64_t offset = 0;
+    long moved = 0;
+    int file_descriptor;
+
+    pack_segment_path(segment, path, sizeof(path));
+    if (buffer == NULL || (file_descriptor = open(path, O_RDONLY)) < 0) {
+        free(buffer);
+        return;
+    }
+    while (offset < size && pread(file_descriptor, &record, sizeof(record), offset) == sizeof(record)) {
+        size_t record_bytes = sizeof(record) + record.path_length + record.length;
+
+        // Anything else is the tail of an append that never made it into the index
+        if (record.magic != PACK_RECORD_MAGIC || record.path_length >= PACK_PATH_MAX || record.length > PACK_MAX_FILE ||
+            pread(file_descriptor, buffer, record.path_length + record.length, offset + sizeof(record)) !=
+            (ssize_t)(record.path_length + record.length)) {
+            break;
         }
-    } else {
-        perror("popen failed");
-        // Notify the client that an error occurred while executing the command
-        char error_msg[] = "Error executing find command.\n";
-        send(client_socket, error_msg, strlen(error_msg), 0);
+        memcpy(key, buffer, record.path_length);
+        key[record.path_length] = '\0';
+
+        pthread_rwlock_wrlock(&pack_index->lock);
+        entry = pack_find(key, NULL);
+        if (entry != NULL && entry->segment == segment && entry->offset == offset + sizeof(record) + record.path_length &&
+            pack_append(key, buffer + record.path_length, record.length, record.checksum, record.mtime_ns, &location) == 0) {
+            pack_index->live_bytes[segment] -= record_bytes;
+            *entry = location;
+            moved++;
+        }
+        pthread_rwlock_unlock(&pack_index->lock);
+        offset += record_bytes;
+    }
+    close(file_descriptor);
+    free(buffer);
+
+    pthread_rwlock_wrlock(&pack_index->lock);
+    if (pack_index->live_bytes[segment] == 0) {
+        unlink(path);
+        pack_index->segment_bytes[segment] = 0;
+    }
+    pthread_rwlock_unlock(&pack_index->lock);
+    printf("Compacted pack segment %u, %ld files moved\n", segment, moved);
+}
+
+// Function to compact every segment but the active one that is mostly garbage, in one worker at a time
+void pack_compact() {
+    if (pack_index == NULL || __atomic_exchange_n(&pack_index->compacting, 1, __ATOMIC_ACQUIRE) != 0) {
+        return;
+    }
+    for (uint32_t segment = 0; segment < PACK_MAX_SEGMENTS; segment++) {
+        uint64_t size;
+        int wanted;
+
+        pthread_rwlock_rdlock(&pack_index->lock);
+        size = pack_index->segment_bytes[segment];
+        wanted = segment != pack_index->active_segment && size > 0 &&
+                 pack_index->live_bytes[segment] * PACK_COMPACT_RATIO < size;
+        pthread_rwlock_unlock(&pack_index->lock);
+        if (wanted) {
+            pack_compact_segment(segment, size);
+        }
+    }
+    __atomic_store_n(&pack_index->compacting, 0, __ATOMIC_RELEASE);
+}
+
+// A file received for the .txt store: kept in memory while it is small enough for the pack, written to its loose
+// file once it grows past PACK_MAX_FILE
+struct pack_upload {
+    const char *loose_path;             // Where the file goes when it is too big for the pack
+    char *data;                         // The first PACK_MAX_FILE bytes
+    size_t used;
+    FILE *file;                         // Loose file, opened once the data no longer fits
+    long long size;                     // Size announced by the client, reserved for the loose file
+};
+
+// Function to receive a chunked file into a pack_upload, otherwise like recv_file_chunks()
+long long pack_receive(int sock, struct pack_upload *upload, uint32_t *checksum) {
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    long long total = 0;
+    long long released = 0;             // Loose file data handed to the disk so far
+    long length;
+    uint32_t computed = 0;
+    uint32_t trailer;
+
+    upload->used = 0;
+    upload->file = NULL;
+    if (buffer == NULL || (upload->data = malloc(PACK_MAX_FILE)) == NULL) {
+        pool_release(buffer, capacity);
+        return -1;
+    }
+    // A file announced too big for the pack goes loose from the start, with its space reserved before any data comes
+    if (upload->size > PACK_MAX_FILE &&
+        ((upload->file = fopen(upload->loose_path, "wb")) == NULL || preallocate_file(upload->file, upload->size) != 0)) {
+        perror("Cannot store the announced file"); // Keep draining so the connection stays in sync
+        total = -1;
+    }
+    while ((length = recv_chunk(sock, &buffer, &capacity)) > 0) {
+        computed = crc32c_update(computed, buffer, length);
+        if (total >= 0 && upload->file == NULL && upload->used + length <= PACK_MAX_FILE) {
+            memcpy(upload->data + upload->used, buffer, length);
+            upload->used += length;
+        } else if (total >= 0) {
+            if (upload->file == NULL && ((upload->file = fopen(upload->loose_path, "wb")) == NULL ||
+                                         preallocate_file(upload->file, upload->size) != 0 ||
+                                         fwrite(upload->data, 1, upload->used, upload->file) != upload->used)) {
+                total = -1;
+            }
+            if (total >= 0 && fwrite(buffer, 1, length, upload->file) != (size_t)length) {
+                total = -1;
+            }
+            if (total < 0) {
+                perror("Failed to write received data"); // Keep draining so the connection stays in sync
+            }
+        }
+        if (total >= 0) {
+            total += length;
+        }
+        if (upload->file != NULL && total >= 0) {
+            release_written_pages(upload->file, total, &released);
+        }
+    }
+    pool_release(buffer, capacity);
+    if (length < 0 || recv_all(sock, &trailer, sizeof(trailer)) != 0) {
+        return -1;
+    }
+    if (ntohl(trailer) != computed) {
+        fprintf(stderr, "Checksum mismatch: expected %08x, received data has %08x\n", ntohl(trailer), computed);
+        return total < 0 ? -1 : TRANSFER_CORRUPT;
+    }
+    *checksum = computed;
+    return total;
+}
+
+// Function to store a received file: packed when it stayed small, otherwise its loose file is finished and an older
+// packed version dropped. A file that failed verification is never kept. Returns `received` or -1 when storing failed
+long long pack_finish_upload(struct pack_upload *upload, const char *path, long long received, uint32_t checksum) {
+    if (received >= 0 && upload->file == NULL && pack_store(path, upload->data, upload->used, checksum) != 0) {
+        // The pack is full or unavailable, the file is stored loose after all
+        if ((upload->file = fopen(upload->loose_path, "wb")) == NULL ||
+            fwrite(upload->data, 1, upload->used, upload->file) != upload->used) {
+            received = -1;
+        }
+    }
+    if (upload->file != NULL) {
+        trim_preallocated(upload->file, upload->size);
+        if (received >= 0) {
+            save_stored_checksum(fileno(upload->file), checksum); // Keep the verified checksum next to the file
+        }
+        if (fclose(upload->file) != 0 && received >= 0) {
+            received = -1;
+        }
+        if (received < 0) {
+            unlink(upload->loose_path);
+        } else {
+            pack_remove(path);
+        }
+    }
+    free(upload->data);
+    return received;
+}
+
+// Declaring functions beforehand and then defining them later in the program based on their usage and requirement
+void process_client_request(int client_socket);
+void handle_upload_file(int client_socket, char *file_name, char *destination_dir, char *recv_buffer);
+void handle_delta_upload(int client_socket, char *file_name, char *destination_dir);
+void handle_download_file(int client_socket, char *file_name);
+void handle_remove_file(int client_socket, char *command);
+void handle_relocate(int client_socket, char *command, int move);
+void handle_create_tar(int client_socket, char *file_extension);
+void handle_display(int client_socket, char *pathname);
+void handle_grep(int client_socket, char *command);
+void handle_stat(int client_socket, char *command);
+void handle_manifest(int client_socket, char *directory);
+void handle_range(int client_socket, char *file_name, char *command);
+void handle_upload_begin(int client_socket, char *command);
+void handle_upload_chunk(int client_socket, char *command);
+void handle_upload_commit(int client_socket, char *command);
+
+// Load figures reported to Smain in every heartbeat, shared by all workers of this server
+struct server_load {
+    int active_transfers;       // Workers moving file data right now
+    int connections;            // Connections being served, including idle ones waiting for a command
+};
+
+struct server_load *load;                   // Shared mapping created in main()
+const char *listen_address = SERVER_IP;     // Address and port this server accepts on, from argv or the defaults
+int listen_port = TEXT_PORT;
+const char *smain_address = SMAIN_ADDRESS;  // Where heartbeats are sent
+char handoff_path[108];                     // Unix socket receiving handed-off client connections, empty when disabled
+int64_t trace_accepted_ns;                  // When the connection a new worker serves was accepted
+char local_path[108];                       // Abstract Unix socket for requests from a co-located Smain, empty when disabled
+
+// Function to connect to Smain for heartbeats, returns the socket or -1
+int connect_smain() {
+    struct sockaddr_in address;
+    int smain_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(SMAIN_PORT);
+    if (smain_socket < 0 || inet_pton(AF_INET, smain_address, &address.sin_addr) <= 0 ||
+        connect(smain_socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        if (smain_socket >= 0) {
+            close(smain_socket);
+        }
+        return -1;
+    }
+    return smain_socket;
+}
+
+// Function run by the heartbeat process: reports this server and its load to Smain every HEARTBEAT_INTERVAL seconds
+// The first heartbeat registers the server; the connection is reopened whenever Smain goes away,
+// and the process ends once the server it reports for has exited
+void run_heartbeats(pid_t server_pid) {
+    char frame[BUFFER_SIZE];
+    char store[BUFFER_SIZE];
+    struct statvfs disk;
+    int smain_socket = -1;
+
+    snprintf(store, sizeof(store), "%s/stext", valid_home_dir());
+    while (getppid() == server_pid) {
+        if (smain_socket < 0) {
+            smain_socket = connect_smain();
+        }
+        if (smain_socket >= 0) {
+            long long free_bytes = 0;
+            int active = __atomic_load_n(&load->active_transfers, __ATOMIC_RELAXED);
+            int connections = __atomic_load_n(&load->connections, __ATOMIC_RELAXED);
+
+            if (statvfs(store, &disk) == 0 || statvfs(valid_home_dir(), &disk) == 0) {
+                free_bytes = (long long)disk.f_bavail * disk.f_frsize;
+            }
+            memset(frame, 0, sizeof(frame));
+            snprintf(frame, sizeof(frame), "heartbeat .txt %s %d %d %d %lld %s %s", listen_address, listen_port,
+                     active, connections > active ? connections - active : 0, free_bytes,
+                     handoff_path[0] ? handoff_path : "-", local_path[0] ? local_path : "-");
+            if (send(smain_socket, frame, BUFFER_SIZE, MSG_NOSIGNAL) != BUFFER_SIZE) {
+                close(smain_socket);
+                smain_socket = -1;
+            }
+        }
+        sleep(HEARTBEAT_INTERVAL);
+    }
+    exit(0);
+}
+
+// Function to receive one handed-off request from Smain: the command frame with the client's socket attached
+// Returns the client socket, or -1 once Smain closed the handoff connection
+int recv_handoff(int unix_socket, char *frame) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {frame, BUFFER_SIZE};
+    struct msghdr message;
+    struct cmsghdr *header;
+    int client_socket = -1;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(unix_socket, &message, 0) != BUFFER_SIZE) {
+        return -1;
+    }
+    for (header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&client_socket, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    frame[BUFFER_SIZE - 1] = '\0';
+    return client_socket;
+}
+
+// Function to serve the requests Smain hands off on one Unix socket connection
+// The data moves straight between this worker and the client; the one-byte reply tells Smain the client
+// connection is back in its hands and the next command may be read from it
+void serve_handoffs(int unix_socket) {
+    char frame[BUFFER_SIZE];
+    struct command_words words;
+    int client_socket;
+    int64_t accepted_ns = trace_accepted_ns, ready_ns = trace_now();
+
+    while ((client_socket = recv_handoff(unix_socket, frame)) >= 0) {
+        char status = 0;
+        int64_t received_ns = trace_now();
+        int parsed = parse_command(frame, &words) == 0;
+
+        __atomic_add_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        if (parsed) {
+            trace_command(frame, words.command, &accepted_ns, ready_ns, received_ns);
+        }
+        if (!parsed) {
+            status = 1; // Smain answers the client itself
+        } else if (strcmp(words.command, "ufile") == 0) {
+            handle_upload_file(client_socket, words.argument1, words.argument2, frame);
+        } else if (strcmp(words.command, "dufile") == 0) {
+            handle_delta_upload(client_socket, words.argument1, words.argument2);
+        } else if (strcmp(words.command, "dfile") == 0) {
+            handle_download_file(client_socket, words.argument1);
+        } else if (strcmp(words.command, "drange") == 0) {
+            handle_range(client_socket, words.argument1, frame);
+        } else if (strcmp(words.command, "uchunk") == 0) {
+            handle_upload_chunk(client_socket, frame);
+        } else {
+            status = 1; // Not a command that can be handed off, Smain answers the client itself
+        }
+        __atomic_sub_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        if (parsed) {
+            trace_end(words.command, status == 0 ? 0 : -1);
+        }
+
+        // Smain shares the client connection, so a stream that broke off part way has to end it for Smain too
+        if (chunk_stream_broken(client_socket)) {
+            shutdown(client_socket, SHUT_RDWR);
+        }
+        close(client_socket);
+        if (send(unix_socket, &status, 1, MSG_NOSIGNAL) != 1) {
+            break;
+        }
+    }
+}
+
+// Function run by a Unix socket listener process: accepts the co-located Smain's connections and forks a worker
+// running serve() for each. The listener ends together with the server it belongs to
+void run_unix_listener(int unix_server, void (*serve)(int)) {
+    int unix_socket;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    while ((unix_socket = accept(unix_server, NULL, NULL)) >= 0) {
+        trace_accepted_ns = trace_now();
+        if (fork() == 0) {
+            close(unix_server);
+            __atomic_add_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            serve(unix_socket);
+            __atomic_sub_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            close(unix_socket);
+            trace_flush(1);
+            pool_destroy();
+            exit(0);
+        }
+        close(unix_socket);
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+    }
+    exit(0);
+}
+
+// Function to open a listening Unix socket of the given type, returns the socket or -1 after clearing path
+// A path starting with '@' names a socket in the abstract namespace, which needs no file and vanishes with the server
+int open_unix_listener(int socket_type, char *path) {
+    struct sockaddr_un address;
+    socklen_t length = sizeof(address);
+    int unix_server = socket(AF_UNIX, socket_type, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    if (path[0] == '@') {
+        address.sun_path[0] = '\0';
+        length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    } else {
+        unlink(path); // Left over from an earlier run
+    }
+    if (unix_server < 0 || bind(unix_server, (struct sockaddr *)&address, length) != 0 ||
+        listen(unix_server, SOMAXCONN) != 0) {
+        fprintf(stderr, "Cannot listen on Unix socket %s: %s\n", path, strerror(errno));
+        if (unix_server >= 0) {
+            close(unix_server);
+        }
+        path[0] = '\0';
+        return -1;
+    }
+    return unix_server;
+}
+
+// Usage: Stext [address port [smain_address]]
+// Further replicas are started with their own address or port and their own HOME, and register with Smain by themselves
+int main(int argc, char *argv[]) {
+    int server_socket, client_socket;
+    struct sockaddr_in server_address, client_address;
+    socklen_t client_address_len = sizeof(client_address);
+
+    crc32c_init(); // Prepare the checksum tables before any transfer
+    trace_init(TRACE_HOP_STEXT); // Workers inherit the trace file, their spans are appended to it
+
+    if (argc > 2) {
+        listen_address = argv[1];
+        listen_port = atoi(argv[2]);
+    }
+    if (argc > 3) {
+        smain_address = argv[3];
+    }
+    load = mmap(NULL, sizeof(struct server_load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (load == MAP_FAILED) {
+        perror("Failed to map the load counters");
+        exit(EXIT_FAILURE);
+    }
+    memset(load, 0, sizeof(struct server_load));
+    {
+        char store_root[BUFFER_SIZE], index_path[BUFFER_SIZE * 2];
+
+        // Without its index the pack is left out and every .txt file is stored loose. With packing off, the index of an
+        // earlier run is still mapped so the files packed then stay readable and removable; new files are stored loose
+        snprintf(store_root, sizeof(store_root), "%s/stext", valid_home_dir());
+        snprintf(index_path, sizeof(index_path), "%s/%s/index", store_root, PACK_DIR);
+        if (PACK_ENABLED || access(index_path, F_OK) == 0) {
+            pack_init(store_root);
+        }
+    }
+    if (DISPLAY_CACHE_ENABLED) {
+        display_cache_init(); // Without it every display lists its directory afresh
+    }
+
+    // Creating a TCP socket
+    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("Failed to create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Initialize server address structure
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(listen_port);
+
+    // Convert IP address from string to binary form
+    if (inet_pton(AF_INET, listen_address, &server_address.sin_addr) <= 0)
+    {
+        perror("Invalid Address\n");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Bind socket to the specified IP and port
+    if (bind(server_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+        perror("Socket binding failed");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    // Start listening for incoming connections
+    if (listen(server_socket, SOMAXCONN) < 0)
+    {
+        perror("Not able to listen to client connection requests");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Stext server running and waiting for connections on %s:%d...\n", listen_address, listen_port);
+
+    // Start the Unix socket listeners used by a co-located Smain, then the heartbeat process that registers this server
+    // Requests arrive over the local stream socket instead of TCP, handed-off client connections over the handoff socket
+    pid_t server_pid = getpid();
+    int unix_server;
+    snprintf(handoff_path, sizeof(handoff_path), "%s/.stext-%d.sock", valid_home_dir(), listen_port);
+    if ((unix_server = open_unix_listener(SOCK_SEQPACKET, handoff_path)) >= 0) {
+        if (fork() == 0) {
+            close(server_socket);
+            run_unix_listener(unix_server, serve_handoffs);
+        }
+        close(unix_server);
+    }
+    snprintf(local_path, sizeof(local_path), "@datasync-stext-%s-%d", listen_address, listen_port);
+    if (LOCAL_TRANSPORT_ENABLED && (unix_server = open_unix_listener(SOCK_STREAM, local_path)) >= 0) {
+        if (fork() == 0) {
+            close(server_socket);
+            run_unix_listener(unix_server, process_client_request);
+        }
+        close(unix_server);
+    } else {
+        local_path[0] = '\0';
+    }
+    if (fork() == 0) {
+        close(server_socket);
+        run_heartbeats(server_pid);
+    }
+
+    // Main server loop to accept incoming connections
+    while ((client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_address_len)) >= 0) {
+        trace_accepted_ns = trace_now();
+        printf("Connection established with a client.\n");
+
+        if (fork() == 0) {
+            // Inside the child process
+            close(server_socket);
+            __atomic_add_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            process_client_request(client_socket);
+            __atomic_sub_fetch(&load->connections, 1, __ATOMIC_RELAXED);
+            close(client_socket);
+            trace_flush(1);       // Write out the spans of this worker's requests
+            pool_report("Stext"); // Print the buffer pool counters of this worker
+            pool_destroy();
+            exit(0);
+        } else {
+            // Inside the parent process
+            close(client_socket);
+            // Reap finished workers without blocking, so the stripes of a striped download are served side by side
+            while (waitpid(-1, NULL, WNOHANG) > 0) {
+            }
+        }
+    }
+
+    if (client_socket < 0) {
+        perror("Failed to accept connection");
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    close(server_socket);
+    return 0;
+}
+
+
+void process_client_request(int client_socket) {
+    char recv_buffer[BUFFER_SIZE];  // Buffer to store received data
+    struct command_words words;     // The command and its arguments, split out of the frame
+    int64_t accepted_ns = trace_accepted_ns, ready_ns = trace_now(); // For the span of the wait for this worker
+
+    while (1) {
+        // Receive the command frame from the client, Smain always sends a full BUFFER_SIZE frame
+        // Nothing past the frame is read, the chunks of an upload that follow it stay in the socket for the handler
+        size_t frame_used = 0;
+        int64_t received_ns;
+        if (recv_command_frame(client_socket, recv_buffer, &frame_used, &received_ns, 1) != 0) {
+            break;
+        }
+
+        // Parse the received data into command and arguments
+        if (parse_command(recv_buffer, &words) != 0) {
+            // What follows an unreadable command cannot be told apart from the next one, so the connection ends here
+            char *error_message = "Command argument too long\n";
+            send(client_socket, error_message, strlen(error_message), 0);
+            break;
+        }
+        char *cmd = words.command, *arg1 = words.argument1, *arg2 = words.argument2;
+        trace_command(recv_buffer, cmd, &accepted_ns, ready_ns, received_ns); // Smain passed on the client's request ID
+
+        // Commands that move file data count as active transfers in the heartbeats
+        int transfer = strcmp(cmd, "ufile") == 0 || strcmp(cmd, "dufile") == 0 || strcmp(cmd, "dfile") == 0 || strcmp(cmd, "drange") == 0 || strcmp(cmd, "dtar") == 0 ||
+                       strcmp(cmd, "uchunk") == 0;
+        if (transfer) {
+            __atomic_add_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        }
+
+        // Handle the specific command received from the client
+        if (strcmp(cmd, "ufile") == 0) {
+            handle_upload_file(client_socket, arg1, arg2, recv_buffer);         // to handle the ufile command
+        } else if (strcmp(cmd, "dufile") == 0) {
+            handle_delta_upload(client_socket, arg1, arg2);                     // to handle a delta ufile
+        } else if (strcmp(cmd, "dfile") == 0) {
+            handle_download_file(client_socket, arg1);                          // to handle the dfile command
+        } else if (strcmp(cmd, "rmfile") == 0) {
+            handle_remove_file(client_socket, recv_buffer);                     // to handle the rmfile command
+        } else if (strcmp(cmd, "mvfile") == 0 || strcmp(cmd, "cpfile") == 0) {
+            handle_relocate(client_socket, recv_buffer, strcmp(cmd, "mvfile") == 0); // to move or copy inside the store
+        } else if (strcmp(cmd, "dtar") == 0) {
+            handle_create_tar(client_socket, arg1);                             // to handle the dtar command
+        } else if (strcmp(cmd, "grep") == 0) {
+            handle_grep(client_socket, recv_buffer);                            // to search the stored .txt files
+        } else if (strcmp(cmd, "display") == 0) {
+            handle_display(client_socket, arg1);                                // to handle the display command
+        } else if (strcmp(cmd, "stat") == 0) {
+            handle_stat(client_socket, recv_buffer);                            // to answer Smain's size/mtime query
+        } else if (strcmp(cmd, "drange") == 0) {
+            handle_range(client_socket, arg1, recv_buffer);                    // to send one stripe of a file
+        } else if (strcmp(cmd, "manifest") == 0) {
+            handle_manifest(client_socket, arg1);                               // to list a tree for Smain's manifest
+        } else if (strcmp(cmd, "ubegin") == 0) {
+            handle_upload_begin(client_socket, recv_buffer);                    // to start a parallel upload
+        } else if (strcmp(cmd, "uchunk") == 0) {
+            handle_upload_chunk(client_socket, recv_buffer);                    // to store one chunk of a parallel upload
+        } else if (strcmp(cmd, "ucommit") == 0) {
+            handle_upload_commit(client_socket, recv_buffer);                   // to assemble a parallel upload
+        } else {
+            // Send an error message to the client if the command is invalid
+            char *error_message = "Invalid command\n";
+            send(client_socket, error_message, strlen(error_message), 0);
+        }
+        if (transfer) {
+            __atomic_sub_fetch(&load->active_transfers, 1, __ATOMIC_RELAXED);
+        }
+
+        // The rest of a file whose chunk stream broke off must not be taken for the next commands
+        if (chunk_stream_broken(client_socket)) {
+            trace_end(cmd, -1);
+            break;
+        }
+        trace_end(cmd, 0);
+    }
+}
+
+
+void handle_upload_file(int client_socket, char *file_name, char *destination_dir, char *recv_buffer) {
+    char full_file_path[BUFFER_SIZE];        // Full path where the file will be stored
+    char relative[BUFFER_SIZE];              // Path inside the store, the key of a packed file
+    FILE *file_pointer;
+    char server_response[BUFFER_SIZE];       // Response to be sent back to the client
+    char full_destination_path[BUFFER_SIZE]; // Destination directory path
+    long long received_bytes;
+    uint32_t checksum;                       // Verified CRC32C of the received file
+    long long size = announced_size(recv_buffer); // File size the client announced, -1 from older clients
+
+    // Construct the full destination directory path
+    snprintf(full_destination_path, sizeof(full_destination_path), "%s/stext/%s", valid_home_dir(), destination_dir);
+    if (create_dir_if_new(full_destination_path) != 0) {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+        snprintf(server_response, sizeof(server_response), "Unable to create directory %s\n", destination_dir);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return; // If directory creation fails, exit the function
+    }
+
+    // Construct the full file path with filename
+    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s/%s", valid_home_dir(), destination_dir, file_name);
+    snprintf(relative, sizeof(relative), "%s/%s", destination_dir, file_name);
+
+    // With the pack, the file is held in memory while it is small and packed once it verifies
+    if (pack_index != NULL) {
+        struct pack_upload upload = {full_file_path, NULL, 0, NULL, size};
+
+        printf("Receiving file: %s\n", full_file_path);
+        received_bytes = pack_receive(client_socket, &upload, &checksum);
+        received_bytes = pack_finish_upload(&upload, relative, received_bytes, checksum);
+        file_pointer = NULL;
+    } else if ((file_pointer = fopen(full_file_path, "wb")) == NULL) { // Open the file for writing in binary mode
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+        snprintf(server_response, sizeof(server_response), "Unable to open file %s for writing\n", full_file_path);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    } else if (preallocate_file(file_pointer, size) != 0) {
+        fclose(file_pointer);
+        unlink(full_file_path);
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the file data so the connection stays in sync
+        snprintf(server_response, sizeof(server_response), "Cannot reserve %lld bytes for %s\n", size, file_name);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    } else {
+        printf("Receiving file: %s\n", full_file_path);
+
+        // Receive the chunked file content from the client
+        received_bytes = recv_file_chunks(client_socket, file_pointer, &checksum);
+        trim_preallocated(file_pointer, size);
+        if (received_bytes >= 0) {
+            save_stored_checksum(fileno(file_pointer), checksum); // Keep the verified checksum next to the file
+        }
+        fclose(file_pointer);
+    }
+    display_cache_invalidate(relative); // Listings of its directory are stale now, whatever the outcome
+    if (received_bytes == TRANSFER_CORRUPT) {
+        if (file_pointer != NULL) {
+            unlink(full_file_path); // Never keep data that failed verification
+        }
+        snprintf(server_response, sizeof(server_response), "Checksum mismatch, upload of %s rejected\n", file_name);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+    if (received_bytes < 0) {
+        snprintf(server_response, sizeof(server_response), "Failed to receive file %s\n", file_name);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+    printf("File has %lld bytes\n", received_bytes);
+
+    snprintf(server_response, sizeof(server_response), "File %s uploaded to Client Directory\n", file_name);
+    send(client_socket, server_response, strlen(server_response), 0); // Notify client of successful upload
+}
+
+// Chunk table of a parallel upload, kept next to the file being assembled so that every worker receiving one of its
+// chunks can record it there: this header, then one upload_chunk per chunk
+struct upload_table {
+    uint32_t magic;                     // UPLOAD_TABLE_MAGIC
+    uint32_t chunks;                    // Number of chunks the file is split into
+    long long size;                     // File size announced by ubegin
+    long long chunk_size;               // Bytes in every chunk but the last
+};
+
+// One chunk's entry in the table, written once the chunk arrived with a matching CRC32C
+struct upload_chunk {
+    uint32_t stored;                    // 1 once the chunk is in place
+    uint32_t checksum;                  // CRC32C of the chunk, combined into the whole-file checksum by ucommit
+};
+
+// Function to name the file a parallel upload is assembled in and its chunk table
+// The suffixes keep both out of display, dtar and manifest listings until ucommit renames the file into place
+void upload_paths(const char *destination, const char *file_name, const char *upload_id, char *part_path, char *table_path) {
+    snprintf(part_path, BUFFER_SIZE * 2, "%s/stext/%s/.%s.%s.upload", valid_home_dir(), destination, file_name, upload_id);
+    snprintf(table_path, BUFFER_SIZE * 2, "%s/stext/%s/.%s.%s.chunks", valid_home_dir(), destination, file_name, upload_id);
+}
+
+// Function to open the chunk table of a parallel upload and read its header, returns the descriptor or -1
+int open_upload_table(const char *table_path, struct upload_table *table) {
+    int table_fd = open(table_path, O_RDWR);
+
+    if (table_fd >= 0 && (pread(table_fd, table, sizeof(*table), 0) != sizeof(*table) || table->magic != UPLOAD_TABLE_MAGIC)) {
+        close(table_fd);
+        return -1;
+    }
+    return table_fd;
+}
+
+// Function to handle "ubegin <file> <destination> <size> <chunk size> <upload ID>", the start of a parallel upload:
+// the file is created at its full size with its space reserved, and an empty chunk table is written next to it.
+// A ubegin repeated with the same upload ID and layout keeps the chunks already stored, so an upload can be resumed
+void handle_upload_begin(int client_socket, char *command) {
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17], directory[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table, existing;
+    long long size, chunk_size;
+    int part_fd, table_fd;
+
+    if (sscanf(command, "%*s %512s %512s %lld %lld %16[0-9a-f]", file_name, destination, &size, &chunk_size, upload_id) != 5 ||
+        size < 0 || chunk_size < UPLOAD_CHUNK_MIN || chunk_size > UPLOAD_CHUNK_MAX || (size + chunk_size - 1) / chunk_size > UPLOAD_MAX_CHUNKS) {
+        snprintf(response, sizeof(response), "Invalid parallel upload request\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    table = (struct upload_table){UPLOAD_TABLE_MAGIC, (size + chunk_size - 1) / chunk_size, size, chunk_size};
+    snprintf(directory, sizeof(directory), "%s/stext/%s", valid_home_dir(), destination);
+    upload_paths(destination, file_name, upload_id, part_path, table_path);
+    if (create_dir_if_new(directory) != 0 || (part_fd = open(part_path, O_WRONLY | O_CREAT, 0644)) < 0) {
+        snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // Size the file up front so every chunk can be written into place, and reserve its space like a ufile does
+    if (ftruncate(part_fd, size) != 0 || (PREALLOCATE_ENABLED && size > 0 && fallocate(part_fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0 &&
+                                          errno != EOPNOTSUPP && errno != ENOSYS)) {
+        close(part_fd);
+        unlink(part_path);
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Cannot reserve %lld bytes for %s\n", size, file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    close(part_fd);
+
+    // Keep the table of an earlier ubegin of the same layout, start any other one with no chunk stored
+    table_fd = open_upload_table(table_path, &existing);
+    if (table_fd < 0 || existing.size != size || existing.chunk_size != chunk_size) {
+        if (table_fd >= 0) {
+            close(table_fd);
+        }
+        table_fd = open(table_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (table_fd < 0 || pwrite(table_fd, &table, sizeof(table), 0) != sizeof(table) ||
+            ftruncate(table_fd, sizeof(table) + (off_t)table.chunks * sizeof(struct upload_chunk)) != 0) {
+            if (table_fd >= 0) {
+                close(table_fd);
+            }
+            unlink(part_path);
+            unlink(table_path);
+            snprintf(response, sizeof(response), "Unable to create %s\n", file_name);
+            send(client_socket, response, strlen(response), 0);
+            return;
+        }
+    }
+    close(table_fd);
+    printf("Parallel upload of %s/%s started: %lld bytes in %u chunks\n", destination, file_name, size, table.chunks);
+    snprintf(response, sizeof(response), "Ready for %u chunks\n", table.chunks);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "uchunk <file> <destination> <upload ID> <index>" and the chunk stream after it: the data is
+// written into place with pwrite() and, when its CRC32C trailer matches, the chunk is marked stored in the table.
+// The chunks of one upload arrive on any number of connections at once, each only touches its own byte range
+void handle_upload_chunk(int client_socket, char *command) {
+    char file_name[COMMAND_WORD_MAX + 1], destination[COMMAND_WORD_MAX + 1], upload_id[17];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    struct upload_table table;
+    struct upload_chunk chunk = {1, 0};
+    size_t capacity = POOL_MAX_CHUNK;
+    char *buffer = NULL;
+    long long offset, expected, received = 0;
+    long length;
+    unsigned int index = 0;
+    uint32_t trailer;
+    int part_fd = -1, table_fd = -1, failed = 0;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %u", file_name, destination, upload_id, &index) == 4) {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0 || index >= table.chunks || (part_fd = open(part_path, O_WRONLY)) < 0 ||
+        (buffer = pool_acquire(&capacity)) == NULL) {
+        recv_file_chunks(client_socket, NULL, NULL); // Drain the chunk so the connection stays in sync
+        snprintf(response, sizeof(response), "Chunk %u failed, no parallel upload of it was started\n", index);
+        send(client_socket, response, strlen(response), 0);
+        if (part_fd >= 0) {
+            close(part_fd);
+        }
+        if (table_fd >= 0) {
+            close(table_fd);
+        }
+        return;
+    }
+    offset = (long long)index * table.chunk_size;
+    expected = table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size;
+
+    // A chunk that runs past its range or cannot be written is still received to the end, the stream stays in step
+    while ((length = recv_chunk(client_socket, &buffer, &capacity)) > 0) {
+        if (failed || received + length > expected) {
+            failed = 1;
+            continue;
+        }
+        chunk.checksum = crc32c_update(chunk.checksum, buffer, length);
+        for (long written = 0; written < length; ) {
+            ssize_t result = pwrite(part_fd, buffer + written, length - written, offset + received + written);
+            if (result <= 0) {
+                perror("Failed to write received chunk");
+                failed = 1;
+                break;
+            }
+            written += result;
+        }
+        received += length;
+    }
+    pool_release(buffer, capacity);
+    close(part_fd);
+    if (length < 0 || recv_all(client_socket, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != chunk.checksum ||
+        received != expected || failed ||
+        pwrite(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)index * sizeof(chunk)) != sizeof(chunk)) {
+        snprintf(response, sizeof(response), "Chunk %u failed\n", index);
+    } else {
+        snprintf(response, sizeof(response), "Chunk %u stored\n", index);
+    }
+    close(table_fd);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to handle "ucommit <file> <destination> <upload ID> <CRC32C>", the end of a parallel upload: once every
+// chunk is stored, the chunk checksums are combined into the whole-file CRC32C and compared with the client's, and
+// the assembled file is renamed over the destination in one step, so no reader ever sees a partial file.
+// Missing chunks are listed in the reply and the upload stays open for them
+void handle_upload_commit(int client_socket, char *command) {
+    char file_name[COMMAND_WORD_MAX + 1] = "", destination[COMMAND_WORD_MAX + 1], upload_id[17], final_path[BUFFER_SIZE * 2];
+    char part_path[BUFFER_SIZE * 2], table_path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    char relative[BUFFER_SIZE * 2];         // Path inside the store, the key of a packed file
+    struct upload_table table;
+    struct upload_chunk chunk;
+    unsigned int missing = 0;
+    size_t listed;
+    uint32_t expected, checksum = 0;
+    int part_fd, table_fd = -1;
+
+    if (sscanf(command, "%*s %512s %512s %16[0-9a-f] %x", file_name, destination, upload_id, &expected) == 4) {
+        upload_paths(destination, file_name, upload_id, part_path, table_path);
+        table_fd = open_upload_table(table_path, &table);
+    }
+    if (table_fd < 0) {
+        snprintf(response, sizeof(response), "No parallel upload of %s was started\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // List as many missing chunks as fit the reply, the client sends them and commits again
+    listed = snprintf(response, sizeof(response), "Missing chunks:");
+    for (unsigned int i = 0; i < table.chunks; i++) {
+        long long offset = (long long)i * table.chunk_size;
+
+        if (pread(table_fd, &chunk, sizeof(chunk), sizeof(table) + (off_t)i * sizeof(chunk)) != sizeof(chunk) || !chunk.stored) {
+            if (listed + 12 < sizeof(response)) {
+                listed += snprintf(response + listed, sizeof(response) - listed, " %u", i);
+            }
+            missing++;
+            continue;
+        }
+        checksum = crc32c_combine(checksum, chunk.checksum, table.size - offset < table.chunk_size ? table.size - offset : table.chunk_size);
+    }
+    close(table_fd);
+    if (missing > 0) {
+        strcpy(response + listed, "\n");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    if (checksum != expected) {
+        unlink(part_path); // Never keep data that failed verification
+        unlink(table_path);
+        snprintf(response, sizeof(response), "Checksum mismatch, upload of %s rejected\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    snprintf(final_path, sizeof(final_path), "%s/stext/%s/%s", valid_home_dir(), destination, file_name);
+    if ((part_fd = open(part_path, O_RDONLY)) >= 0) {
+        save_stored_checksum(part_fd, checksum); // Keep the verified checksum next to the file
+        close(part_fd);
+    }
+    if (part_fd < 0 || rename(part_path, final_path) != 0) {
+        snprintf(response, sizeof(response), "Unable to store %s\n", file_name);
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+    unlink(table_path);
+    snprintf(relative, sizeof(relative), "%s/%s", destination, file_name);
+    pack_remove(relative); // The loose file replaces any packed copy
+    display_cache_invalidate(relative);
+    printf("Parallel upload of %s assembled from %u chunks, %lld bytes\n", final_path, table.chunks, table.size);
+    snprintf(response, sizeof(response), "File %s successfully uploaded in %u chunks\n", file_name, table.chunks);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to pick the block size of a delta upload's signatures, about the square root of the stored file as rsync does
+int delta_block_size(long long size) {
+    int block = DELTA_MIN_BLOCK;
+
+    while ((long long)block * block < size && block < DELTA_MAX_BLOCK) {
+        block *= 2;
+    }
+    return block;
+}
+
+// Function to compute the weak checksum of a block: the sum of its bytes and the sum of those sums, 16 bits each
+// The client can roll it along its file one byte at a time to find blocks at any offset
+uint32_t delta_weak_checksum(const unsigned char *data, size_t length) {
+    uint32_t sum = 0, sum_of_sums = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        sum += data[i];
+        sum_of_sums += sum;
+    }
+    return (sum & 0xffff) | (sum_of_sums << 16);
+}
+
+// Function to send the signatures of the stored copy a delta upload is built against, file_descriptor is -1 without one
+// The stream holds the block size and file size, then the weak checksum and CRC32C of every whole block
+// Returns 0 when the signatures were sent; *block_size and *size describe the copy for apply_delta()
+int send_delta_signatures(int sock, int file_descriptor, int *block_size, long long *size) {
+    uint32_t entries[2 * DELTA_SIGNATURE_BATCH + 3];
+    const unsigned char *data = NULL;
+    struct stat file_info;
+    uint32_t checksum = 0;
+    long long blocks;
+    int used = 3, status = 0;
+
+    *size = file_descriptor >= 0 && fstat(file_descriptor, &file_info) == 0 ? file_info.st_size : 0;
+    *block_size = delta_block_size(*size);
+    if (*size > 0 && (data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, file_descriptor, 0)) == MAP_FAILED) {
+        data = NULL;
+        *size = 0; // Without a readable copy every byte is sent as literal data
+    }
+    if (data != NULL) {
+        madvise((void *)data, *size, MADV_SEQUENTIAL);
+    }
+    blocks = *size / *block_size;
+
+    // The header goes in front of the first batch: block size and the file size as two 32-bit halves
+    entries[0] = htonl(*block_size);
+    entries[1] = htonl((uint32_t)(*size >> 32));
+    entries[2] = htonl((uint32_t)*size);
+    for (long long i = 0; i < blocks && status == 0; i++) {
+        const unsigned char *block = data + i * *block_size;
+        entries[used++] = htonl(delta_weak_checksum(block, *block_size));
+        entries[used++] = htonl(crc32c_update(0, block, *block_size));
+        if (used >= 2 * DELTA_SIGNATURE_BATCH) {
+            checksum = crc32c_update(checksum, entries, used * sizeof(uint32_t));
+            status = send_chunk(sock, (const char *)entries, used * sizeof(uint32_t));
+            used = 0;
+        }
+    }
+    if (status == 0 && used > 0) {
+        checksum = crc32c_update(checksum, entries, used * sizeof(uint32_t));
+        status = send_chunk(sock, (const char *)entries, used * sizeof(uint32_t));
+    }
+    if (data != NULL) {
+        munmap((void *)data, *size);
+    }
+    return status == 0 ? send_end_of_file(sock, checksum) : -1;
+}
+
+// Chunk stream of delta instructions read as a byte stream, an instruction may span chunks
+struct delta_reader {
+    int sock;
+    char *buffer;                       // Pool buffer holding the current chunk
+    size_t capacity;
+    long length;                        // Bytes in the current chunk
+    long offset;                        // Bytes of the current chunk already read
+    uint32_t checksum;                  // CRC32C of every chunk received so far
+    int ended;                          // The end-of-file chunk arrived
+    int broken;                         // The connection failed, nothing more can be read
+};
+
+// Function to read exactly `length` bytes of the instruction stream, returns 0 or -1 when the stream ended or broke
+int delta_read(struct delta_reader *reader, void *data, size_t length) {
+    while (length > 0) {
+        size_t available;
+
+        if (reader->offset == reader->length) {
+            if (reader->ended || reader->broken || (reader->length = recv_chunk(reader->sock, &reader->buffer, &reader->capacity)) <= 0) {
+                reader->ended |= reader->length == 0;
+                reader->broken |= reader->length < 0;
+                reader->length = reader->offset = 0;
+                return -1;
+            }
+            reader->checksum = crc32c_update(reader->checksum, reader->buffer, reader->length);
+            reader->offset = 0;
+        }
+        available = reader->length - reader->offset;
+        available = available < length ? available : length;
+        memcpy(data, reader->buffer + reader->offset, available);
+        reader->offset += available;
+        data = (char *)data + available;
+        length -= available;
+    }
+    return 0;
+}
+
+// Function to rebuild a file from a delta upload into output_descriptor: 'C' copies a run of blocks of the stored copy,
+// 'L' carries literal bytes and 'E' ends with the size and CRC32C of the whole new file
+// Returns the size of the rebuilt file, -1 for a broken stream or TRANSFER_CORRUPT when the result does not verify;
+// *checksum gets the new file's CRC32C and *literal the bytes that came over the wire
+long long apply_delta(int sock, int old_descriptor, int block_size, long long old_size, int output_descriptor,
+                      uint32_t *checksum, long long *literal) {
+    struct delta_reader reader = {sock, NULL, POOL_MIN_CHUNK, 0, 0, 0, 0, 0};
+    size_t capacity = DELTA_MAX_BLOCK;
+    char *staging = pool_acquire(&capacity);
+    long long written = 0, expected_size = -1;
+    uint32_t computed = 0, expected_checksum = 0, fields[3], trailer;
+    unsigned char operation;
+    int failed = 0;
+
+    reader.buffer = pool_acquire(&reader.capacity);
+    *literal = 0;
+    while (!failed && staging != NULL && reader.buffer != NULL && delta_read(&reader, &operation, 1) == 0) {
+        if (operation == 'E') {
+            failed = delta_read(&reader, fields, 3 * sizeof(uint32_t)) != 0;
+            expected_size = ((long long)ntohl(fields[0]) << 32) | ntohl(fields[1]);
+            expected_checksum = ntohl(fields[2]);
+            break;
+        }
+        if ((operation != 'C' && operation != 'L') || delta_read(&reader, fields, (operation == 'C' ? 2 : 1) * sizeof(uint32_t)) != 0) {
+            failed = 1;
+            break;
+        }
+
+        // 'C' <first block> <block count> copies from the stored copy, 'L' <length> is followed by the literal bytes
+        long long offset = operation == 'C' ? (long long)ntohl(fields[0]) * block_size : 0;
+        long long remaining = operation == 'C' ? (long long)ntohl(fields[1]) * block_size : ntohl(fields[0]);
+        if (operation == 'C' && (old_descriptor < 0 || offset + remaining > old_size)) {
+            failed = 1;
+        }
+        *literal += operation == 'L' ? remaining : 0;
+        while (!failed && remaining > 0) {
+            size_t piece = remaining < (long long)capacity ? (size_t)remaining : capacity;
+            if (operation == 'C' ? pread(old_descriptor, staging, piece, offset) != (ssize_t)piece : delta_read(&reader, staging, piece) != 0) {
+                failed = 1;
+                break;
+            }
+            if (write(output_descriptor, staging, piece) != (ssize_t)piece) {
+                perror("Failed to write the rebuilt file");
+                failed = 1;
+                break;
+            }
+            computed = crc32c_update(computed, staging, piece);
+            written += piece;
+            offset += piece;
+            remaining -= piece;
+        }
+    }
+    pool_release(staging, capacity);
+
+    // 'E' has to be the last instruction; the rest of the stream is read in any case so the connection stays in step
+    failed |= expected_size < 0 || reader.offset != reader.length;
+    while (!reader.ended && !reader.broken && reader.buffer != NULL) {
+        long length = recv_chunk(sock, &reader.buffer, &reader.capacity);
+        reader.ended = length == 0;
+        reader.broken = length < 0;
+        failed |= length > 0;
+        reader.checksum = crc32c_update(reader.checksum, reader.buffer, length > 0 ? length : 0);
+    }
+    failed |= reader.broken || reader.buffer == NULL || recv_all(sock, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != reader.checksum;
+    pool_release(reader.buffer, reader.capacity);
+    if (failed) {
+        return -1;
+    }
+    if (written != expected_size || computed != expected_checksum) {
+        fprintf(stderr, "Rebuilt file does not match: %lld bytes with %08x, expected %lld bytes with %08x\n",
+                written, computed, expected_size, expected_checksum);
+        return TRANSFER_CORRUPT;
+    }
+    *checksum = computed;
+    return written;
+}
+
+// Function to handle "dufile <file> <destination>", an upload that only moves what changed since the stored copy
+// The block signatures of the stored copy go out first, then the client's block references and literal data rebuild
+// the new version in a temporary file that replaces the stored one once its CRC32C verifies
+void handle_delta_upload(int client_socket, char *file_name, char *destination_dir) {
+    char full_destination_path[BUFFER_SIZE], full_file_path[BUFFER_SIZE], temporary_path[BUFFER_SIZE + 32];
+    char server_response[BUFFER_SIZE], relative[BUFFER_SIZE];
+    int old_descriptor, output_descriptor, block_size;
+    long long old_size, rebuilt, literal;
+    uint32_t checksum;
+
+    snprintf(full_destination_path, sizeof(full_destination_path), "%s/stext/%s", valid_home_dir(), destination_dir);
+    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s/%s", valid_home_dir(), destination_dir, file_name);
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d.tmp", full_file_path, getpid());
+    if (create_dir_if_new(full_destination_path) != 0 ||
+        (output_descriptor = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        send_end_of_file(client_socket, 1); // Signatures that cannot verify make the client send nothing
+        snprintf(server_response, sizeof(server_response), "Unable to store file %s in %s\n", file_name, destination_dir);
+        send(client_socket, server_response, strlen(server_response), 0);
+        return;
+    }
+
+    printf("Receiving delta of file: %s\n", full_file_path);
+    old_descriptor = open(full_file_path, O_RDONLY);
+    if (send_delta_signatures(client_socket, old_descriptor, &block_size, &old_size) != 0) {
+        rebuilt = -1;
+    } else {
+        rebuilt = apply_delta(client_socket, old_descriptor, block_size, old_size, output_descriptor, &checksum, &literal);
+    }
+    if (rebuilt >= 0) {
+        save_stored_checksum(output_descriptor, checksum); // Keep the verified checksum next to the file
+    }
+    if (old_descriptor >= 0) {
+        close(old_descriptor);
+    }
+    close(output_descriptor);
+
+    // Only a verified file replaces the stored copy, which stays untouched otherwise
+    if (rebuilt >= 0 && rename(temporary_path, full_file_path) == 0) {
+        snprintf(relative, sizeof(relative), "%s/%s", destination_dir, file_name);
+        pack_remove(relative); // The loose file is the current version now
+        display_cache_invalidate(relative);
+        printf("Rebuilt %lld bytes, %lld of them sent by the client\n", rebuilt, literal);
+        snprintf(server_response, sizeof(server_response), "File %s uploaded to Client Directory (delta: %lld of %lld bytes sent)\n",
+                 file_name, literal, rebuilt);
+    } else if (rebuilt == TRANSFER_CORRUPT) {
+        unlink(temporary_path); // Never keep data that failed verification
+        snprintf(server_response, sizeof(server_response), "Checksum mismatch, upload of %s rejected\n", file_name);
+    } else {
+        unlink(temporary_path);
+        snprintf(server_response, sizeof(server_response), "Failed to receive file %s\n", file_name);
+    }
+    send(client_socket, server_response, strlen(server_response), 0);
+}
+
+void handle_download_file(int client_socket, char *file_name) {
+    char full_file_path[BUFFER_SIZE];      // Full path to the file being downloaded
+    int file_descriptor;
+    char download_response[BUFFER_SIZE];   // Response to be sent back to the client
+    struct pack_entry packed;
+
+    // Construct the full path to the file
+    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s", valid_home_dir(), file_name);
+    printf("Downloading file from: %s\n", full_file_path);
+
+    // A packed file is sent straight from its range of the segment
+    if ((file_descriptor = pack_open_file(file_name, &packed)) >= 0) {
+        send_download_status(client_socket, 1);
+        send_range_chunks(client_socket, file_descriptor, packed.offset, packed.length, &packed.checksum, NULL);
+        close(file_descriptor);
+        snprintf(download_response, sizeof(download_response), "File %s downloaded successfully\n", file_name);
+        send(client_socket, download_response, strlen(download_response), 0);
+        return;
+    }
+
+    // Open the file for reading
+    file_descriptor = open(full_file_path, O_RDONLY);
+    if (file_descriptor < 0) {
+        // No data follows the status, so the client never starts a file
+        send_download_status(client_socket, 0);
+        snprintf(download_response, sizeof(download_response), "File %s not found\n", file_name);
+        send(client_socket, download_response, strlen(download_response), 0);
+        return;
+    }
+
+    // Read the file content and send it to the client as adaptive chunks ending with the end-of-file chunk
+    send_download_status(client_socket, 1);
+    send_file_chunks(client_socket, file_descriptor);
+    close(file_descriptor);
+
+    snprintf(download_response, sizeof(download_response), "File %s downloaded successfully\n", file_name);
+    send(client_socket, download_response, strlen(download_response), 0); // Notify client of successful download
+}
+
+
+// Outcome of a batched rmfile in one store, sent back to Smain and merged into the reply for the client
+struct remove_summary {
+    int removed;                            // Files deleted
+    int failed;                             // Paths that could not be deleted
+    int listed;                             // Failures spelled out in failures[], at most RMFILE_MAX_REPORTED
+    char failures[RMFILE_REPORT_BYTES];     // One "path: reason" line per listed failure
+};
+
+// Function to count a path that could not be deleted, the first few are listed with their reason
+void remove_failure(struct remove_summary *summary, const char *path, const char *reason) {
+    size_t used = strlen(summary->failures);
+
+    summary->failed++;
+    if (summary->listed < RMFILE_MAX_REPORTED) {
+        snprintf(summary->failures + used, sizeof(summary->failures) - used, "%s: %s\n", path, reason);
+        summary->listed++;
+    }
+}
+
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary);
+
+// Function to delete one directory entry relative to an open directory
+// unlinkat() is tried first, so a plain file costs one system call; directories are only removed with -r.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void remove_entry(int dir_fd, const char *name, const char *path, int recursive, int matched, struct remove_summary *summary) {
+    if (unlinkat(dir_fd, name, 0) == 0) {
+        summary->removed++;
+        display_cache_invalidate(path);
+    } else if (errno == EISDIR) {
+        if (recursive) {
+            remove_tree_at(dir_fd, name, path, summary);
+        } else if (!matched) {
+            remove_failure(summary, path, "Is a directory, use rmfile -r");
+        }
+    } else if (errno != ENOENT || (!matched && !recursive)) {
+        remove_failure(summary, path, strerror(errno));
+    }
+}
+
+// Function to delete a directory with everything below it, working on directory file descriptors throughout
+void remove_tree_at(int parent_fd, const char *name, const char *path, struct remove_summary *summary) {
+    char child_path[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory;
+    int dir_fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+
+    if (dir_fd < 0 || (directory = fdopendir(dir_fd)) == NULL) {
+        remove_failure(summary, path, strerror(errno));
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+        remove_entry(dirfd(directory), entry->d_name, child_path, 1, 1, summary);
+    }
+    closedir(directory);
+    if (unlinkat(parent_fd, name, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+        remove_failure(summary, path, strerror(errno));
+    }
+    display_cache_invalidate(path);
+}
+
+// Function to delete the packed files an rmfile path names: the file itself, the files matching a glob in the last
+// path component and, with -r, everything below a matching directory. Returns the number of files removed
+int pack_remove_pattern(const char *pattern, int recursive, struct remove_summary *summary) {
+    char directory[BUFFER_SIZE], component[PACK_PATH_MAX];
+    const char *name = strrchr(pattern, '/');
+    struct pack_entry *listing;
+    size_t skip;
+    int count, removed = 0;
+
+    // A plain file name is one hash lookup, only globs and trees need a pass over the index
+    if (pack_remove(pattern) == 0) {
+        summary->removed++;
+        return 1;
+    }
+    if (strpbrk(pattern, "*?[") == NULL && !recursive) {
+        return 0;
+    }
+    snprintf(directory, sizeof(directory), "%.*s", name != NULL ? (int)(name - pattern) : 0, pattern);
+    name = name != NULL ? name + 1 : pattern;
+    count = pack_list(directory, &listing, &skip);
+    for (int i = 0; i < count; i++) {
+        const char *rest = listing[i].path + skip;
+        const char *slash = strchr(rest, '/');
+
+        snprintf(component, sizeof(component), "%.*s", slash != NULL ? (int)(slash - rest) : (int)strlen(rest), rest);
+        if ((slash == NULL || recursive) && fnmatch(name, component, FNM_PERIOD) == 0 && pack_remove(listing[i].path) == 0) {
+            summary->removed++;
+            removed++;
+        }
+    }
+    free(listing);
+    return removed;
+}
+
+// Function to tell whether a path climbs out of the store with a ".." component
+int path_leaves_store(const char *path) {
+    size_t length = strlen(path);
+
+    return strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0 || strstr(path, "/../") != NULL ||
+           (length >= 3 && strcmp(path + length - 3, "/..") == 0);
+}
+
+// Function to delete what one rmfile path names inside a store: a file, a glob in the last path component,
+// or with -r a directory tree. Paths that climb out of the store are refused
+void remove_pattern(const char *store_root, const char *pattern, int recursive, struct remove_summary *summary) {
+    char directory[BUFFER_SIZE], child_path[BUFFER_SIZE];
+    const char *name = strrchr(pattern, '/');
+    struct dirent *entry;
+    DIR *listing;
+    int dir_fd, packed;
+
+    if (path_leaves_store(pattern)) {
+        remove_failure(summary, pattern, "Path leaves the store");
+        return;
+    }
+    packed = pack_remove_pattern(pattern, recursive, summary);
+    snprintf(directory, sizeof(directory), "%s/%.*s", store_root, name != NULL ? (int)(name - pattern) : 0, pattern);
+    name = name != NULL ? name + 1 : pattern;
+    if ((dir_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0) {
+        // A glob or tree that has nothing in this store is not an error, the other stores may hold its files
+        if (errno != ENOENT || (strpbrk(name, "*?[") == NULL && !recursive && packed == 0)) {
+            remove_failure(summary, pattern, strerror(errno));
+        }
+        return;
+    }
+    if (strpbrk(name, "*?[") == NULL) {
+        // Once the pack held the file, a loose file of that name is not expected any more
+        remove_entry(dir_fd, name, pattern, recursive, packed > 0, summary);
+        close(dir_fd);
+        return;
+    }
+    if ((listing = fdopendir(dir_fd)) == NULL) {
+        remove_failure(summary, pattern, strerror(errno));
+        close(dir_fd);
+        return;
+    }
+    while ((entry = readdir(listing)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            fnmatch(name, entry->d_name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        snprintf(child_path, sizeof(child_path), "%.*s%s", (int)(name - pattern), pattern, entry->d_name);
+        remove_entry(dirfd(listing), entry->d_name, child_path, recursive, 1, summary);
+    }
+    closedir(listing);
+}
+
+// Function to carry out the arguments of a batched rmfile in one store: "-r" and any number of paths or globs
+// Returns the number of paths handled
+int remove_batch(const char *store_dir, const char *arguments, struct remove_summary *summary) {
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *patterns[BUFFER_SIZE / 2], *save, *token;
+    int count = 0, recursive = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save)) {
+        if (strcmp(token, "-r") == 0) {
+            recursive = 1;
+        } else {
+            while (strlen(token) > 1 && token[strlen(token) - 1] == '/') {
+                token[strlen(token) - 1] = '\0'; // "dir/" names the same directory as "dir"
+            }
+            patterns[count++] = token;
+        }
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    for (int i = 0; i < count; i++) {
+        remove_pattern(store_root, patterns[i], recursive, summary);
+    }
+    return count;
+}
+
+// Function to handle a batched rmfile from Smain: "rmfile [-r] path..." with the paths that belong to this store
+// The reply is one BUFFER_SIZE frame: "removed <n> failed <m>" followed by the listed failures
+void handle_remove_file(int client_socket, char *command) {
+    struct remove_summary summary;
+    char reply[BUFFER_SIZE];
+
+    memset(&summary, 0, sizeof(summary));
+    remove_batch("stext", command + strlen("rmfile"), &summary);
+    printf("rmfile removed %d files, %d failed\n", summary.removed, summary.failed);
+
+    memset(reply, 0, sizeof(reply));
+    snprintf(reply, sizeof(reply), "removed %d failed %d\n%s", summary.removed, summary.failed, summary.failures);
+    send(client_socket, reply, BUFFER_SIZE, 0);
+
+    // The reply is out, so the segments the removals left mostly empty are compacted without holding Smain up
+    pack_compact();
+}
+
+// One mvfile or cpfile carried out inside a store, summed up like an rmfile: summary->removed counts the entries
+// moved or copied, a directory moved in one rename counting once
+struct relocation {
+    const char *store_root;             // Store directory the paths are relative to
+    const char *extension;              // Type of file the store holds, ".c", ".txt" or ".pdf"
+    int move;                           // mvfile when set, cpfile otherwise
+    int recursive;                      // cpfile -r: directories are copied with everything below them
+    struct remove_summary *summary;
+};
+
+// Function to copy one file inside a store without its data passing through this process: FICLONE shares the data
+// blocks on filesystems with reflinks (Btrfs, XFS), copy_file_range() copies in the kernel everywhere else.
+// The copy is built next to the target and renamed over it, and it keeps the source's stored checksum
+// Returns 0, or -1 with errno set
+int copy_file_at(int from_dir, const char *from_name, int to_dir, const char *to_name) {
+    char temp_name[BUFFER_SIZE];
+    struct stat info;
+    uint32_t checksum;
+    int in, out = -1, result = -1, saved_errno;
+
+    snprintf(temp_name, sizeof(temp_name), ".%.200s.copy", to_name);
+    if ((in = openat(from_dir, from_name, O_RDONLY | O_NOFOLLOW)) >= 0 && fstat(in, &info) == 0 &&
+        (out = openat(to_dir, temp_name, O_WRONLY | O_CREAT | O_TRUNC, info.st_mode & 0777)) >= 0) {
+        result = 0;
+        if (ioctl(out, FICLONE, in) != 0) {
+            for (off_t left = info.st_size; left > 0; left -= result) {
+                ssize_t copied = copy_file_range(in, NULL, out, NULL, left, 0);
+
+                if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    copied = sendfile(out, in, NULL, left); // Kernels without copy_file_range() still copy in the kernel
+                }
+                if (copied <= 0) {
+                    result = copied < 0 ? -1 : 0; // A source that got shorter while it was copied ends the copy
+                    break;
+                }
+                result = copied;
+            }
+            result = result < 0 ? -1 : 0;
+        }
+        if (result == 0 && load_stored_checksum(in, &checksum) == 0) {
+            save_stored_checksum(out, checksum);
+        }
+    }
+    saved_errno = errno;
+    if (in >= 0) {
+        close(in);
+    }
+    if (out >= 0 && close(out) != 0 && result == 0) {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result == 0 && renameat(to_dir, temp_name, to_dir, to_name) != 0) {
+        result = -1;
+        saved_errno = errno;
+    }
+    if (out >= 0 && result != 0) {
+        unlinkat(to_dir, temp_name, 0);
+    }
+    errno = saved_errno;
+    return result;
+}
+
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation);
+
+// Function to copy a directory with everything below it, working on directory file descriptors throughout
+void copy_tree_at(int from_parent, const char *from_name, const char *from_path, int to_parent, const char *to_name,
+                  const char *to_path, struct relocation *relocation) {
+    char from_child[BUFFER_SIZE], to_child[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory = NULL;
+    int from_fd = openat(from_parent, from_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW), to_fd = -1;
+
+    if (from_fd >= 0 && (mkdirat(to_parent, to_name, 0755) == 0 || errno == EEXIST)) {
+        to_fd = openat(to_parent, to_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    }
+    if (from_fd < 0 || to_fd < 0 || (directory = fdopendir(from_fd)) == NULL) {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        if (from_fd >= 0) {
+            close(from_fd);
+        }
+        if (to_fd >= 0) {
+            close(to_fd);
+        }
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(from_child, sizeof(from_child), "%s/%s", from_path, entry->d_name);
+        snprintf(to_child, sizeof(to_child), "%s/%s", to_path, entry->d_name);
+        relocate_entry(dirfd(directory), entry->d_name, from_child, to_fd, entry->d_name, to_child, 1, relocation);
+    }
+    closedir(directory);
+    close(to_fd);
+}
+
+// Function to move or copy one directory entry between two open directories of a store. A move is one
+// renameat2(): a file replaces its target like an upload would, a directory never replaces an existing one.
+// A missing entry is only an error for a path the user named directly, not for glob matches or inside a tree
+void relocate_entry(int from_dir, const char *from_name, const char *from_path, int to_dir, const char *to_name,
+                    const char *to_path, int matched, struct relocation *relocation) {
+    struct stat info;
+
+    if (fstatat(from_dir, from_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (errno != ENOENT || !matched) {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+        }
+        return;
+    }
+    if (S_ISDIR(info.st_mode) && !relocation->move) {
+        if (relocation->recursive) {
+            copy_tree_at(from_dir, from_name, from_path, to_dir, to_name, to_path, relocation);
+        } else if (!matched) {
+            remove_failure(relocation->summary, from_path, "Is a directory, use cpfile -r");
+        }
+        return;
+    }
+    if (relocation->move) {
+        if (renameat2(from_dir, from_name, to_dir, to_name, S_ISDIR(info.st_mode) ? RENAME_NOREPLACE : 0) != 0) {
+            remove_failure(relocation->summary, from_path, strerror(errno));
+            return;
+        }
+    } else if (copy_file_at(from_dir, from_name, to_dir, to_name) != 0) {
+        remove_failure(relocation->summary, from_path, strerror(errno));
+        return;
+    }
+    relocation->summary->removed++;
+    display_cache_invalidate(from_path);
+    display_cache_invalidate(to_path);
+    if (!S_ISDIR(info.st_mode)) {
+        pack_remove(to_path); // The loose file replaces any packed copy
+    }
+}
+
+// Function to store a copy of a packed file under another path: in the pack, or as a loose file when the pack
+// cannot take the new path. Returns 0 once the copy is stored
+int pack_copy(const char *store_root, const char *from, const char *to) {
+    char loose_path[BUFFER_SIZE * 2];
+    struct pack_entry found;
+    char *data;
+    int segment_fd = pack_open_file(from, &found), result = -1;
+    FILE *file;
+
+    if (segment_fd < 0) {
+        return -1;
+    }
+    if ((data = malloc(found.length + 1)) != NULL && pread(segment_fd, data, found.length, found.offset) == (ssize_t)found.length) {
+        result = pack_store(to, data, found.length, found.checksum);
+        snprintf(loose_path, sizeof(loose_path), "%s/%s", store_root, to);
+        if (result != 0 && (file = fopen(loose_path, "wb")) != NULL) {
+            result = fwrite(data, 1, found.length, file) == found.length ? 0 : -1;
+            save_stored_checksum(fileno(file), found.checksum);
+            if (fclose(file) != 0) {
+                result = -1;
+            }
+        }
+    }
+    free(data);
+    close(segment_fd);
+    return result;
+}
+
+// Function to move or copy the packed files a source names: the file itself, the files matching a glob in its last
+// component, or every file below a directory. They are stored again under the target's path, small as they are,
+// and a move drops the old entries. base is where a path relative to source_dir lands; returns the files handled
+int pack_relocate_pattern(const char *source_dir, const char *name, const char *base, const char *target,
+                          struct relocation *relocation) {
+    char from_path[BUFFER_SIZE], to_path[BUFFER_SIZE * 2], component[PACK_PATH_MAX];
+    int glob = strpbrk(name, "*?[") != NULL, count, handled = 0;
+    struct pack_entry *listing;
+    size_t skip;
+
+    // A single file is one hash lookup, only globs and directories need a pass over the index
+    snprintf(from_path, sizeof(from_path), "%s%s%s", source_dir, *source_dir ? "/" : "", name);
+    if (!glob && pack_copy(relocation->store_root, from_path, target) == 0) {
+        if (relocation->move) {
+            pack_remove(from_path);
+        }
+        relocation->summary->removed++;
+        return 1;
+    }
+    if (pack_index == NULL || (!glob && !relocation->move && !relocation->recursive)) {
+        return 0;
+    }
+    count = pack_list(glob ? source_dir : from_path, &listing, &skip);
+    for (int i = 0; i < count; i++) {
+        const char *rest = listing[i].path + skip;
+        const char *slash = strchr(rest, '/');
+
+        snprintf(component, sizeof(component), "%.*s", slash != NULL ? (int)(slash - rest) : (int)strlen(rest), rest);
+        if (glob && (fnmatch(name, component, FNM_PERIOD) != 0 || (slash != NULL && !relocation->move && !relocation->recursive))) {
+            continue;
+        }
+        snprintf(to_path, sizeof(to_path), "%s/%s", base, rest);
+        if (pack_copy(relocation->store_root, listing[i].path, to_path) != 0) {
+            remove_failure(relocation->summary, listing[i].path, "Cannot store the packed file's copy");
+            continue;
+        }
+        if (relocation->move) {
+            pack_remove(listing[i].path);
+        }
+        relocation->summary->removed++;
+        handled++;
+    }
+    free(listing);
+    return handled;
+}
+
+// Function to carry out one mvfile or cpfile inside a store. The source is a file, a glob in its last component or a
+// directory. A target ending in '/' is the directory everything goes into, and so is a target without the file
+// type of a single source file; otherwise the target is the source's new name. Target directories are created
+// when they are new
+void relocate_pattern(struct relocation *relocation, const char *source, const char *target) {
+    char source_dir[BUFFER_SIZE], target_dir[BUFFER_SIZE], target_name[BUFFER_SIZE], directory[BUFFER_SIZE * 2];
+    char from_path[BUFFER_SIZE * 2], to_path[BUFFER_SIZE * 2], base[BUFFER_SIZE * 2];
+    const char *name = strrchr(source, '/'), *slash;
+    size_t name_length, source_length = strlen(source), extension_length = strlen(relocation->extension);
+    struct dirent *entry;
+    DIR *listing;
+    int glob, typed, packed, named, from_fd, to_fd;
+
+    if (path_leaves_store(source) || path_leaves_store(target)) {
+        remove_failure(relocation->summary, source, "Path leaves the store");
+        return;
+    }
+    snprintf(source_dir, sizeof(source_dir), "%.*s", name != NULL ? (int)(name - source) : 0, source);
+    name = name != NULL ? name + 1 : source;
+    name_length = strlen(name);
+    glob = strpbrk(name, "*?[") != NULL;
+    typed = name_length > extension_length && strcmp(name + name_length - extension_length, relocation->extension) == 0;
+    if (!glob && strncmp(target, source, source_length) == 0 && target[source_length] == '/') {
+        remove_failure(relocation->summary, source, "Target is inside the source");
+        return;
+    }
+    if (glob || target[strlen(target) - 1] == '/' ||
+        (typed && (strlen(target) <= extension_length || strcmp(target + strlen(target) - extension_length, relocation->extension) != 0))) {
+        snprintf(target_dir, sizeof(target_dir), "%s", target);
+        for (size_t length = strlen(target_dir); length > 1 && target_dir[length - 1] == '/'; length--) {
+            target_dir[length - 1] = '\0';
+        }
+        snprintf(target_name, sizeof(target_name), "%s", name);
+    } else {
+        slash = strrchr(target, '/');
+        snprintf(target_dir, sizeof(target_dir), "%.*s", slash != NULL ? (int)(slash - target) : 0, target);
+        snprintf(target_name, sizeof(target_name), "%s", slash != NULL ? slash + 1 : target);
+    }
+    snprintf(to_path, sizeof(to_path), "%s%s%s", target_dir, *target_dir ? "/" : "", target_name);
+    snprintf(base, sizeof(base), "%s", glob ? target_dir : to_path);
+
+    // A file of this store's type that is neither packed nor loose is an error; a glob or directory that has
+    // nothing in this store is not, the other stores may hold its files
+    packed = pack_relocate_pattern(source_dir, name, base, to_path, relocation);
+    named = !glob && packed == 0 && typed;
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, source_dir);
+    if ((from_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0) {
+        if (errno != ENOENT || named) {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        return;
+    }
+    if (!glob && faccessat(from_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) != 0) {
+        if (named) {
+            remove_failure(relocation->summary, source, strerror(errno));
+        }
+        close(from_fd);
+        return;
+    }
+    snprintf(directory, sizeof(directory), "%s/%s", relocation->store_root, target_dir);
+    if (create_dir_if_new(directory) != 0 || (to_fd = open(directory, O_RDONLY | O_DIRECTORY)) < 0) {
+        remove_failure(relocation->summary, target, strerror(errno));
+        close(from_fd);
+        return;
+    }
+    if (!glob) {
+        relocate_entry(from_fd, name, source, to_fd, target_name, to_path, !named, relocation);
+        close(from_fd);
+    } else if ((listing = fdopendir(from_fd)) == NULL) {
+        remove_failure(relocation->summary, source, strerror(errno));
+        close(from_fd);
+    } else {
+        while ((entry = readdir(listing)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                fnmatch(name, entry->d_name, FNM_PERIOD) != 0) {
+                continue;
+            }
+            snprintf(from_path, sizeof(from_path), "%s%s%s", source_dir, *source_dir ? "/" : "", entry->d_name);
+            snprintf(to_path, sizeof(to_path), "%s/%s", target_dir, entry->d_name);
+            relocate_entry(dirfd(listing), entry->d_name, from_path, to_fd, entry->d_name, to_path, 1, relocation);
+        }
+        closedir(listing);
+    }
+    close(to_fd);
+}
+
+// Function to carry out the arguments of an mvfile or cpfile in one store: "[-r] <source> <target>"
+// Returns -1 when they are not two paths
+int relocate_batch(const char *store_dir, const char *extension, const char *arguments, int move, struct remove_summary *summary) {
+    char copy[BUFFER_SIZE], store_root[BUFFER_SIZE];
+    char *paths[2], *save, *token;
+    struct relocation relocation = {store_root, extension, move, 0, summary};
+    int count = 0;
+
+    snprintf(copy, sizeof(copy), "%s", arguments);
+    for (token = strtok_r(copy, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save)) {
+        if (strcmp(token, "-r") == 0) {
+            relocation.recursive = 1;
+        } else if (count < 2) {
+            paths[count++] = token;
+        } else {
+            return -1;
+        }
+    }
+    if (count != 2) {
+        return -1;
+    }
+    while (strlen(paths[0]) > 1 && paths[0][strlen(paths[0]) - 1] == '/') {
+        paths[0][strlen(paths[0]) - 1] = '\0'; // "dir/" names the same directory as "dir"
+    }
+    snprintf(store_root, sizeof(store_root), "%s/%s", valid_home_dir(), store_dir);
+    relocate_pattern(&relocation, paths[0], paths[1]);
+    return 0;
+}
+
+// Function to handle an mvfile or cpfile from Smain: "[-r] <source> <target>" carried out inside this store
+// The reply is one BUFFER_SIZE frame like that of an rmfile: "moved <n> failed <m>" followed by the listed failures
+void handle_relocate(int client_socket, char *command, int move) {
+    struct remove_summary summary;
+    char reply[BUFFER_SIZE];
+
+    memset(&summary, 0, sizeof(summary));
+    if (relocate_batch("stext", ".txt", command + strlen("mvfile"), move, &summary) != 0) {
+        remove_failure(&summary, move ? "mvfile" : "cpfile", "Expected a source and a target path");
+    }
+    printf("%s %d entries, %d failed\n", move ? "mvfile moved" : "cpfile copied", summary.removed, summary.failed);
+
+    memset(reply, 0, sizeof(reply));
+    snprintf(reply, sizeof(reply), "%s %d failed %d\n%s", move ? "moved" : "copied", summary.removed, summary.failed, summary.failures);
+    send(client_socket, reply, BUFFER_SIZE, 0);
+
+    // A move leaves the old records of packed files behind, they are compacted once the reply is out
+    if (move) {
+        pack_compact();
+    }
+}
+
+// Function to stream every stored file with the given extension below one directory as archive entries
+// Each entry is a header chunk "<size> <mtime> <mode> <relative path>" followed by the file's chunk stream
+void stream_archive_entries(int client_socket, const char *root, const char *relative, const char *extension) {
+    char dir_path[BUFFER_SIZE];             // Directory being scanned
+    char entry_relative[BUFFER_SIZE];       // Entry path relative to the store root
+    char entry_path[BUFFER_SIZE * 2];       // Full path of the entry
+    char header[BUFFER_SIZE * 2];           // Entry header sent to Smain
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+    struct stat entry_info;
+    DIR *directory;
+
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", root, relative);
+    if ((directory = opendir(dir_path)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(entry_relative, sizeof(entry_relative), relative[0] ? "%s/%s" : "%s%s", relative, entry->d_name);
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", root, entry_relative);
+        if (lstat(entry_path, &entry_info) != 0) {
+            continue;
+        }
+        if (S_ISDIR(entry_info.st_mode)) {
+            stream_archive_entries(client_socket, root, entry_relative, extension); // Descend like find does
+            continue;
+        }
+        size_t name_length = strlen(entry->d_name);
+        if (!S_ISREG(entry_info.st_mode) || name_length < extension_length ||
+            strcmp(entry->d_name + name_length - extension_length, extension) != 0) {
+            continue;
+        }
+
+        int file_descriptor = open(entry_path, O_RDONLY);
+        if (file_descriptor < 0 || fstat(file_descriptor, &entry_info) != 0) {
+            if (file_descriptor >= 0) {
+                close(file_descriptor);
+            }
+            continue;
+        }
+        snprintf(header, sizeof(header), "%lld %lld %o %s", (long long)entry_info.st_size,
+                 (long long)entry_info.st_mtime, entry_info.st_mode & 07777, entry_relative);
+        send_chunk(client_socket, header, strlen(header));
+        send_file_chunks(client_socket, file_descriptor);
+        close(file_descriptor);
+    }
+    closedir(directory);
+}
+
+// Function to stream every packed file with the given extension as archive entries, read from its segment
+void stream_archive_packed(int client_socket, const char *extension) {
+    char header[BUFFER_SIZE];               // Entry header sent to Smain
+    size_t extension_length = strlen(extension), skip;
+    struct pack_entry *listing, packed;
+    int count = pack_list("", &listing, &skip);
+
+    for (int i = 0; i < count; i++) {
+        size_t path_length = strlen(listing[i].path);
+        int file_descriptor;
+
+        // The file is looked up again, it may have been replaced or removed since the listing
+        if (path_length <= extension_length || strcmp(listing[i].path + path_length - extension_length, extension) != 0 ||
+            (file_descriptor = pack_open_file(listing[i].path, &packed)) < 0) {
+            continue;
+        }
+        snprintf(header, sizeof(header), "%u %lld %o %s", packed.length, (long long)(packed.mtime_ns / 1000000000LL),
+                 0644, packed.path);
+        send_chunk(client_socket, header, strlen(header));
+        send_range_chunks(client_socket, file_descriptor, packed.offset, packed.length, &packed.checksum, NULL);
+        close(file_descriptor);
+    }
+    free(listing);
+}
+
+// Function to stream all stored files of the requested type to Smain, which turns them into one tar archive
+// The listing ends with an empty header chunk; an unsupported type simply produces an empty listing
+void handle_create_tar(int client_socket, char *file_extension) {
+    char store_root[BUFFER_SIZE];       // Root directory of this store
+
+    if (strcmp(file_extension, ".txt") == 0) {
+        snprintf(store_root, sizeof(store_root), "%s/stext", valid_home_dir());
+        stream_archive_entries(client_socket, store_root, "", file_extension);
+        stream_archive_packed(client_socket, file_extension);
+    } else {
+        printf("Unsupported archive type %s\n", file_extension);
+    }
+    send_chunk(client_socket, NULL, 0); // End of the listing
+}
+
+// One grep request: what to look for, the files to search and the result stream shared by the search threads
+struct grep_search {
+    char pattern[BUFFER_SIZE];          // Substring or, with -E/-i, POSIX extended regular expression
+    size_t length;
+    int use_regex;
+    regex_t regex;
+    size_t rare_offset;                 // Position of the pattern's least common byte, which memchr() looks for first
+    const char *store_root;             // Store directory the relative paths below start from
+    char **files;                       // Files to search, relative to the store
+    int file_count;
+    int file_capacity;
+    int next_file;                      // Next file to search, taken with an atomic increment
+    int sock;                           // Stream the matching lines go to
+    pthread_mutex_t lock;               // Held while a batch is sent, so lines of different files never mix
+    uint32_t checksum;                  // CRC32C of every result byte sent so far
+    long limit;                         // Matching lines to send before the search stops
+    long matches;                       // Matching lines sent
+    long matched_files;                 // Files that contributed at least one line
+    int stopped;                        // Limit reached or sending failed, the search threads finish early
+    int failed;                         // Sending to the client failed
+};
+
+// Function to rank how common a byte is in source code and text, 0 for bytes outside the list
+int grep_byte_rank(unsigned char byte) {
+    static const char common[] = " etaoinsrhldcumfpgwybvkxjqzETAOINSRHLDCUMFPGWYBVKXJQZ_;,.()0123456789\n\t=*{}\"'";
+    const char *found = byte != 0 ? strchr(common, byte) : NULL;
+
+    return found != NULL ? (int)(sizeof(common) - (found - common)) : 0;
+}
+
+// Function to read "[-i] [-E] [-m limit] pattern [path]" into a search, returns the path to search or NULL
+// -i searches without regard to case, -E takes the pattern as an extended regular expression
+const char *grep_parse(struct grep_search *search, char *arguments, const char *default_path) {
+    char *save, *token, *path = NULL;
+    int ignore_case = 0, have_pattern = 0;
+
+    search->limit = GREP_DEFAULT_LIMIT;
+    for (token = strtok_r(arguments, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save)) {
+        if (!have_pattern && strcmp(token, "-i") == 0) {
+            ignore_case = 1;
+        } else if (!have_pattern && strcmp(token, "-E") == 0) {
+            search->use_regex = 1;
+        } else if (!have_pattern && strcmp(token, "-m") == 0 && (token = strtok_r(NULL, " ", &save)) != NULL) {
+            search->limit = atol(token);
+        } else if (!have_pattern) {
+            snprintf(search->pattern, sizeof(search->pattern), "%s", token);
+            have_pattern = 1;
+        } else if (path == NULL) {
+            path = token;
+        }
+    }
+    if (!have_pattern || search->limit <= 0 || (path != NULL && strstr(path, "..") != NULL)) {
+        return NULL;
+    }
+    search->limit = search->limit > GREP_MAX_LIMIT ? GREP_MAX_LIMIT : search->limit;
+    search->length = strlen(search->pattern);
+
+    if (ignore_case && !search->use_regex) {
+        // A case-insensitive substring is searched as a regular expression with its special characters escaped
+        char escaped[BUFFER_SIZE];
+        size_t used = 0;
+        for (size_t i = 0; i < search->length && used + 2 < sizeof(escaped); i++) {
+            if (strchr("\\.[]()*+?{}|^$", search->pattern[i]) != NULL) {
+                escaped[used++] = '\\';
+            }
+            escaped[used++] = search->pattern[i];
+        }
+        escaped[used] = '\0';
+        snprintf(search->pattern, sizeof(search->pattern), "%s", escaped);
+        search->use_regex = 1;
+    }
+    if (search->use_regex) {
+        if (regcomp(&search->regex, search->pattern, REG_EXTENDED | REG_NEWLINE | (ignore_case ? REG_ICASE : 0)) != 0) {
+            search->use_regex = 0;
+            return NULL;
+        }
+    } else {
+        for (size_t i = 1; i < search->length; i++) {
+            if (grep_byte_rank(search->pattern[i]) < grep_byte_rank(search->pattern[search->rare_offset])) {
+                search->rare_offset = i;
+            }
+        }
+    }
+    return path != NULL ? path : default_path;
+}
+
+// Function to add one file to the search, returns -1 when the list cannot grow
+int grep_add_file(struct grep_search *search, const char *relative) {
+    if (search->file_count == search->file_capacity) {
+        int capacity = search->file_capacity > 0 ? search->file_capacity * 2 : 64;
+        char **files = realloc(search->files, capacity * sizeof(char *));
+        if (files == NULL) {
+            return -1;
+        }
+        search->files = files;
+        search->file_capacity = capacity;
+    }
+    if ((search->files[search->file_count] = strdup(relative)) != NULL) {
+        search->file_count++;
+    }
+    return 0;
+}
+
+// Function to add the files of one type below a directory of the store to the search, depth first
+void grep_collect(struct grep_search *search, const char *relative, const char *extension) {
+    char path[BUFFER_SIZE], child[BUFFER_SIZE];
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+    DIR *directory;
+
+    snprintf(path, sizeof(path), "%s/%s", search->store_root, relative);
+    if ((directory = opendir(path)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL && search->file_count < GREP_MAX_FILES) {
+        size_t name_length = strlen(entry->d_name);
+
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s/%s", relative, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            grep_collect(search, child, extension);
+        } else if (name_length > extension_length && strcmp(entry->d_name + name_length - extension_length, extension) == 0 &&
+                   grep_add_file(search, child) != 0) {
+            break;
+        }
+    }
+    closedir(directory);
+}
+
+// Function to add the packed files of one type below a directory to the search
+void grep_collect_packed(struct grep_search *search, const char *relative, const char *extension) {
+    size_t extension_length = strlen(extension), skip;
+    struct pack_entry *listing;
+    int count = pack_list(relative, &listing, &skip);
+
+    for (int i = 0; i < count && search->file_count < GREP_MAX_FILES; i++) {
+        size_t path_length = strlen(listing[i].path);
+
+        if (path_length > extension_length && strcmp(listing[i].path + path_length - extension_length, extension) == 0 &&
+            grep_add_file(search, listing[i].path) != 0) {
+            break;
+        }
+    }
+    free(listing);
+}
+
+// Function to send a batch of whole matching lines, cut at the limit; returns the bytes sent, less than length once cut
+long grep_emit(struct grep_search *search, const char *data, size_t length, int new_file) {
+    const char *end = data, *newline;
+    long lines = 0;
+
+    pthread_mutex_lock(&search->lock);
+    while (lines < search->limit - search->matches && (newline = memchr(end, '\n', data + length - end)) != NULL) {
+        end = newline + 1;
+        lines++;
+    }
+    if (search->stopped || lines == 0) {
+        end = data;
+    } else {
+        search->checksum = crc32c_update(search->checksum, data, end - data);
+        if (send_chunk(search->sock, data, end - data) != 0) {
+            search->failed = 1;
+        }
+        search->matches += lines;
+        search->matched_files += new_file;
+    }
+    if (search->failed || search->matches >= search->limit) {
+        __atomic_store_n(&search->stopped, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&search->lock);
+    return end - data;
+}
+
+// Function to find the next occurrence of the substring between data and end
+// memchr(), vectorised by the C library, skips to the next place the pattern's rarest byte occurs and memcmp() confirms
+const char *grep_find(const struct grep_search *search, const char *data, const char *end) {
+    const char *candidate = data + search->rare_offset;
+
+    while (candidate < end && (candidate = memchr(candidate, search->pattern[search->rare_offset], end - candidate)) != NULL) {
+        const char *start = candidate - search->rare_offset;
+        if (start + search->length <= end && memcmp(start, search->pattern, search->length) == 0) {
+            return start;
+        }
+        candidate++;
+    }
+    return NULL;
+}
+
+// Function to search one mapped file and send its matching lines as "path:line:text"
+void grep_file(struct grep_search *search, const char *relative) {
+    char batch[GREP_BATCH + BUFFER_SIZE + GREP_LINE_MAX + 64];
+    char path[BUFFER_SIZE];
+    size_t used = 0;
+    struct stat status;
+    struct pack_entry packed;
+    const char *mapping, *data, *end, *position, *counted;
+    size_t size = 0, lead = 0;          // File size, and bytes of the segment mapped in front of a packed file
+    off_t start = 0;                    // Where the mapping starts, page aligned
+    long line_number = 1;
+    int new_file = 1;
+    int file_descriptor;
+
+    // A packed file is mapped from its segment, starting at the page that holds its first byte
+    snprintf(path, sizeof(path), "%s/%s", search->store_root, relative);
+    if ((file_descriptor = pack_open_file(relative, &packed)) >= 0) {
+        lead = packed.offset % sysconf(_SC_PAGESIZE);
+        start = packed.offset - lead;
+        size = packed.length;
+    } else if ((file_descriptor = open(path, O_RDONLY)) < 0) {
+        return;
+    } else if (fstat(file_descriptor, &status) == 0) {
+        size = status.st_size;
+    }
+    if (size == 0 || (mapping = mmap(NULL, lead + size, PROT_READ, MAP_PRIVATE, file_descriptor, start)) == MAP_FAILED) {
+        close(file_descriptor);
+        return;
+    }
+    close(file_descriptor);
+    madvise((void *)mapping, lead + size, MADV_SEQUENTIAL);
+    data = mapping + lead;
+    end = data + size;
+    position = counted = data;
+
+    while (position < end && !__atomic_load_n(&search->stopped, __ATOMIC_RELAXED)) {
+        const char *line_start, *line_end;
+
+        if (search->use_regex) {
+            // Line by line, REG_STARTEND lets regexec() work on the mapping without copying lines out
+            regmatch_t match;
+            line_start = position;
+            line_end = memchr(position, '\n', end - position);
+            line_end = line_end != NULL ? line_end : end;
+            match.rm_so = 0;
+            match.rm_eo = line_end - line_start;
+            position = line_end + 1;
+            if (regexec(&search->regex, line_start, 1, &match, REG_STARTEND) != 0) {
+                line_number++;
+                counted = position;
+                continue;
+            }
+        } else {
+            const char *found = grep_find(search, position, end);
+            if (found == NULL) {
+                break;
+            }
+            line_start = found;
+            while (line_start > data && line_start[-1] != '\n') {
+                line_start--;
+            }
+            line_end = memchr(found, '\n', end - found);
+            line_end = line_end != NULL ? line_end : end;
+            position = line_end + 1;
+        }
+
+        // Count the lines skipped since the last match
+        while (counted < line_start && (counted = memchr(counted, '\n', line_start - counted)) != NULL) {
+            counted++;
+            line_number++;
+        }
+        counted = position;
+
+        used += snprintf(batch + used, sizeof(batch) - used, "%s:%ld:%.*s\n", relative, line_number, (int)(line_end - line_start > GREP_LINE_MAX ? GREP_LINE_MAX : line_end - line_start), line_start);
+        line_number++;
+        if (used >= GREP_BATCH) {
+            grep_emit(search, batch, used, new_file);
+            used = 0;
+            new_file = 0;
+        }
+    }
+    if (used > 0) {
+        grep_emit(search, batch, used, new_file);
+    }
+    munmap((void *)mapping, lead + size);
+}
+
+// Function run by every search thread: takes the next unsearched file until none is left or the search stopped
+void *grep_worker(void *argument) {
+    struct grep_search *search = argument;
+    int index;
+
+    while (!__atomic_load_n(&search->stopped, __ATOMIC_RELAXED) && (index = __atomic_fetch_add(&search->next_file, 1, __ATOMIC_RELAXED)) < search->file_count) {
+        grep_file(search, search->files[index]);
+    }
+    return NULL;
+}
+
+// Function to search all collected files with up to GREP_MAX_THREADS threads, one per core
+void grep_run(struct grep_search *search) {
+    pthread_t threads[GREP_MAX_THREADS];
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = 0;
+
+    cores = cores < 1 ? 1 : cores > GREP_MAX_THREADS ? GREP_MAX_THREADS : cores;
+    while (thread_count < cores - 1 && thread_count < search->file_count - 1 &&
+           pthread_create(&threads[thread_count], NULL, grep_worker, search) == 0) {
+        thread_count++;
+    }
+    grep_worker(search); // The calling thread searches too
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Function to release what a search allocated
+void grep_free(struct grep_search *search) {
+    for (int i = 0; i < search->file_count; i++) {
+        free(search->files[i]);
+    }
+    free(search->files);
+    if (search->use_regex) {
+        regfree(&search->regex);
+    }
+    pthread_mutex_destroy(&search->lock);
+}
+
+// Function to handle "grep [-i] [-E] [-m limit] pattern [path]" from Smain over this store's .txt files
+// Matching lines are streamed as "path:line:text" chunks ending with the CRC32C trailer, then a status line with the totals
+void handle_grep(int client_socket, char *command) {
+    struct grep_search search;
+    char arguments[BUFFER_SIZE], store_root[BUFFER_SIZE], response[BUFFER_SIZE];
+    const char *path;
+
+    memset(&search, 0, sizeof(search));
+    pthread_mutex_init(&search.lock, NULL);
+    snprintf(arguments, sizeof(arguments), "%s", command + strlen("grep"));
+    snprintf(store_root, sizeof(store_root), "%s/stext", valid_home_dir());
+    search.store_root = store_root;
+    search.sock = client_socket;
+
+    if ((path = grep_parse(&search, arguments, "~smain")) == NULL) {
+        send_end_of_file(client_socket, 1);
+        snprintf(response, sizeof(response), "Usage: grep [-i] [-E] [-m limit] pattern [path]\n");
+    } else {
+        grep_collect(&search, path, ".txt");
+        grep_collect_packed(&search, path, ".txt");
+        grep_run(&search);
+        send_end_of_file(client_socket, search.checksum);
+        printf("grep found %ld matching lines in %ld files\n", search.matches, search.matched_files);
+        snprintf(response, sizeof(response), "grep found %ld matching lines in %ld files\n", search.matches, search.matched_files);
+    }
+    send(client_socket, response, strlen(response), 0);
+    grep_free(&search);
+}
+
+// Function to handle the display of .txt files in a specified directory
+void handle_display(int client_socket, char *pathname) {
+    char command[BUFFER_SIZE];                  // Buffer to hold the shell command string
+    char buffer[BUFFER_SIZE];                   // Buffer to store output data read from the command execution
+    char list[BUFFER_SIZE] = "";                // Names found, sent in one go since Smain reads the list with one recv()
+    char directory[BUFFER_SIZE * 2];            // Where the store keeps the directory
+    struct display_stamp stamp;                 // What the display cache saw of it
+    FILE *pipe;                                 // File pointer for the pipe used to capture command output
+
+    // A directory unchanged since it was last listed is answered from the display cache
+    snprintf(directory, sizeof(directory), "%s/stext/%s", valid_home_dir(), pathname);
+    if (display_cache_lookup(pathname, directory, list, sizeof(list), &stamp) >= 0) {
+        printf("Display of %s served from memory (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
+    } else {
+        // Constructing a shell command to find all .txt files in the specified directory -maxdepth 1 limits the search to the specified directory (not recursive)
+        // -exec basename {} \\; ensures that only the filenames (without path) are returned
+        snprintf(command, sizeof(command), "find %s/stext/%s -maxdepth 1 -name '*.txt' -exec basename {} \\;", valid_home_dir(), pathname);
+
+        // Opening a pipe to execute the constructed shell command and read its output
+        pipe = popen(command, "r");
+        if (pipe == NULL) {
+            perror("popen failed");
+            // Notify the client that an error occurred while executing the command
+            char error_msg[] = "Error executing find command.\n";
+            send(client_socket, error_msg, strlen(error_msg), 0);
+            return;
+        }
+        // Reading file names into the list
+        while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
+            size_t used = strlen(list);
+            snprintf(list + used, sizeof(list) - used, "%s", buffer);
+        }
+        pclose(pipe);
+
+        // Packed .txt files are not in the directory, the pack index lists the ones directly inside it
+        struct pack_entry *packed;
+        size_t skip;
+        int packed_count = pack_list(pathname, &packed, &skip);
+        for (int i = 0; i < packed_count; i++) {
+            const char *name = packed[i].path + skip;
+            size_t used = strlen(list), length = strlen(name);
+            if (strchr(name, '/') == NULL && length > 4 && strcmp(name + length - 4, ".txt") == 0) {
+                snprintf(list + used, sizeof(list) - used, "%s\n", name);
+            }
+        }
+        free(packed);
+        display_cache_store(&stamp, list, strlen(list));
+        if (display_cache != NULL) {
+            printf("Display of %s listed from the store (%lu hits, %lu misses)\n", pathname, display_cache->hits, display_cache->misses);
+        }
+    }
+
+    // Send the filenames to the client through the socket, or a message when no .txt files were found
+    if (list[0] != '\0') {
+        send(client_socket, list, strlen(list), 0);
+    } else {
+        char no_files_msg[] = "No .txt files found in the specified directory.\n";
+        send(client_socket, no_files_msg, strlen(no_files_msg), 0);
+    }
+}
+
+// Function to describe one stored file as "<size> <mtime seconds> <mtime nanoseconds> <crc32c or ->" or "missing"
+void stat_stored_file(const char *file_path, char *line, size_t size) {
+    char checksum_text[16] = "-";       // Stored CRC32C, "-" when the file has none
+    struct stat file_info;
+    uint32_t checksum;
+    int file_descriptor = open(file_path, O_RDONLY);
+
+    if (file_descriptor >= 0 && fstat(file_descriptor, &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+        if (load_stored_checksum(file_descriptor, &checksum) == 0) {
+            snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+        }
+        snprintf(line, size, "%lld %lld %ld %s\n", (long long)file_info.st_size,
+                 (long long)file_info.st_mtim.tv_sec, file_info.st_mtim.tv_nsec, checksum_text);
+    } else {
+        snprintf(line, size, "missing\n");
+    }
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
+    }
+}
+
+// Function to describe a packed file like stat_stored_file(), returns -1 when the file is not packed
+int pack_stat_file(const char *path, char *line, size_t size) {
+    struct pack_entry packed;
+
+    if (pack_lookup(path, &packed) != 0) {
+        return -1;
+    }
+    snprintf(line, size, "%u %lld %lld %08x\n", packed.length, (long long)(packed.mtime_ns / 1000000000LL),
+             (long long)(packed.mtime_ns % 1000000000LL), packed.checksum);
+    return 0;
+}
+
+// Function to report the size, modification time and stored checksum of files without sending their data
+// "stat <file>..." is answered with one line per file, in the order asked, all sent in one go
+void handle_stat(int client_socket, char *command) {
+    char arguments[BUFFER_SIZE], full_file_path[BUFFER_SIZE * 2];
+    char reply[STAT_MAX_PATHS * STAT_LINE_MAX];     // Lines sent back to Smain
+    char *save, *file_name;
+    size_t used = 0;
+    int count = 0;
+
+    snprintf(arguments, sizeof(arguments), "%s", command + strlen("stat"));
+    for (file_name = strtok_r(arguments, " ", &save); file_name != NULL && count < STAT_MAX_PATHS; file_name = strtok_r(NULL, " ", &save)) {
+        snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s", valid_home_dir(), file_name);
+        if (pack_stat_file(file_name, reply + used, sizeof(reply) - used) != 0) {
+            stat_stored_file(full_file_path, reply + used, sizeof(reply) - used);
+        }
+        used += strlen(reply + used);
+        count++;
+    }
+    send(client_socket, reply, used, 0);
+}
+
+// Manifest lines collected into chunks before they are sent
+struct manifest_stream {
+    int sock;
+    char *buffer;                       // Pool buffer the lines are collected in
+    size_t capacity;
+    size_t used;
+    uint32_t checksum;                  // CRC32C of every byte sent, for the stream's trailer
+    long entries;                       // Files listed
+    int failed;                         // Sending failed, the rest of the walk is skipped
+};
+
+// Function to send the lines collected so far as one chunk
+void manifest_flush(struct manifest_stream *stream) {
+    if (stream->used > 0 && !stream->failed) {
+        stream->checksum = crc32c_update(stream->checksum, stream->buffer, stream->used);
+        stream->failed = send_chunk(stream->sock, stream->buffer, stream->used) != 0;
+    }
+    stream->used = 0;
+}
+
+// Function to add whole lines to the manifest, sending a chunk first when they do not fit
+void manifest_add(struct manifest_stream *stream, const char *lines, size_t length) {
+    if (stream->used + length > stream->capacity) {
+        manifest_flush(stream);
+    }
+    if (length > stream->capacity) {
+        stream->checksum = crc32c_update(stream->checksum, lines, length);
+        stream->failed |= send_chunk(stream->sock, lines, length) != 0;
+        return;
+    }
+    memcpy(stream->buffer + stream->used, lines, length);
+    stream->used += length;
+}
+
+// Function to list every stored file of one type below an open directory as "<path> <size> <mtime> <crc32c or ->"
+// Paths are relative to the directory the manifest was asked for; the directory descriptor is consumed
+void manifest_walk(struct manifest_stream *stream, int directory_fd, const char *relative, const char *extension) {
+    DIR *directory = fdopendir(directory_fd);
+    size_t extension_length = strlen(extension);
+    struct dirent *entry;
+
+    if (directory == NULL) {
+        close(directory_fd);
+        return;
+    }
+    while (!stream->failed && (entry = readdir(directory)) != NULL) {
+        char path[BUFFER_SIZE], line[BUFFER_SIZE + 64], checksum_text[16] = "-";
+        size_t name_length = strlen(entry->d_name);
+        struct stat file_info;
+        uint32_t checksum;
+        int child_fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            if ((child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0) {
+                manifest_walk(stream, child_fd, path, extension);
+            }
+            continue;
+        }
+        if (name_length <= extension_length || strcmp(entry->d_name + name_length - extension_length, extension) != 0 ||
+            (child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_NONBLOCK | O_NOFOLLOW)) < 0) {
+            continue;
+        }
+        if (fstat(child_fd, &file_info) == 0 && S_ISREG(file_info.st_mode)) {
+            if (load_stored_checksum(child_fd, &checksum) == 0) {
+                snprintf(checksum_text, sizeof(checksum_text), "%08x", checksum);
+            }
+            manifest_add(stream, line, snprintf(line, sizeof(line), "%s %lld %lld %s\n", path, (long long)file_info.st_size,
+                                                (long long)file_info.st_mtim.tv_sec, checksum_text));
+            stream->entries++;
+        }
+        close(child_fd);
+    }
+    closedir(directory);
+}
+
+// Function to list the packed files of one type below a directory like manifest_walk() does for loose files
+void manifest_add_packed(struct manifest_stream *stream, const char *directory, const char *extension) {
+    char line[PACK_PATH_MAX + 64];
+    size_t extension_length = strlen(extension), skip;
+    struct pack_entry *listing;
+    int count = pack_list(directory, &listing, &skip);
+
+    for (int i = 0; i < count && !stream->failed; i++) {
+        size_t path_length = strlen(listing[i].path);
+
+        if (path_length > extension_length && strcmp(listing[i].path + path_length - extension_length, extension) == 0) {
+            manifest_add(stream, line, snprintf(line, sizeof(line), "%s %u %lld %08x\n", listing[i].path + skip, listing[i].length,
+                                                (long long)(listing[i].mtime_ns / 1000000000LL), listing[i].checksum));
+            stream->entries++;
+        }
+    }
+    free(listing);
+}
+
+// Function to handle "manifest <directory>" from Smain: one line per stored file below the directory, as a chunk
+// stream, then a status line with the number of files
+void handle_manifest(int client_socket, char *directory) {
+    struct manifest_stream stream = {client_socket, NULL, POOL_MAX_CHUNK / 4, 0, 0, 0, 0};
+    char path[BUFFER_SIZE * 2], response[BUFFER_SIZE];
+    int directory_fd;
+
+    snprintf(path, sizeof(path), "%s/stext/%s", valid_home_dir(), directory);
+    stream.buffer = pool_acquire(&stream.capacity);
+    if (stream.buffer != NULL && strstr(directory, "..") == NULL) {
+        if ((directory_fd = open(path, O_RDONLY | O_DIRECTORY)) >= 0) {
+            manifest_walk(&stream, directory_fd, "", ".txt");
+        }
+        manifest_add_packed(&stream, directory, ".txt");
+        manifest_flush(&stream);
+    }
+    pool_release(stream.buffer, stream.capacity);
+    send_end_of_file(client_socket, stream.failed ? ~stream.checksum : stream.checksum);
+    snprintf(response, sizeof(response), "manifest %ld files\n", stream.entries);
+    send(client_socket, response, strlen(response), 0);
+}
+
+// Function to send one byte range of a stored file for a striped download, the command is "drange <file> <offset> <length>"
+void handle_range(int client_socket, char *file_name, char *command) {
+    char full_file_path[BUFFER_SIZE];   // Full path of the file being read
+    long long offset = 0, length = 0;
+    struct pack_entry packed;
+    int file_descriptor, is_packed = 1;
+
+    snprintf(full_file_path, sizeof(full_file_path), "%s/stext/%s", valid_home_dir(), file_name);
+    if ((file_descriptor = pack_open_file(file_name, &packed)) < 0) {
+        is_packed = 0;
+        file_descriptor = open(full_file_path, O_RDONLY);
+    }
+    if (file_descriptor < 0 || sscanf(command, "%*s %*s %lld %lld", &offset, &length) != 2 || offset < 0 || length < 0) {
+        send_end_of_file(client_socket, 1); // An empty stream with a wrong checksum makes the stripe fail
+    } else {
+        if (is_packed) {
+            // The range is clipped to the packed file, reading on would return the next record of the segment
+            offset = offset < packed.length ? offset : packed.length;
+            length = length < packed.length - offset ? length : packed.length - offset;
+            offset += packed.offset;
+        }
+        send_range_chunks(client_socket, file_descriptor, offset, length, NULL, NULL);
+    }
+    if (file_descriptor >= 0) {
+        close(file_descriptor);
     }
 }
\ No newline at end of file
@@ -0,0 +1,686 @@
+// Buffer pool and chunked file transfers shared by Smain, Spdf, Stext and client24s: per-worker slabs of power-of-two
+// buffers, chunks that grow and shrink with the throughput, and the length-prefixed chunk stream with its CRC32C trailer
+// Every program is built from a single source file that includes this header once, after crc32c.h and trace.h
+#ifndef CHUNKS_H
+#define CHUNKS_H
+
+#include <stdio.h>      // Standard input/output operations
+#include <stdlib.h>     // strtoul() for stored checksums
+#include <string.h>     // String handling functions
+#include <errno.h>      // System error numbers
+#include <stdint.h>     // Fixed width integer types for chunk headers
+#include <time.h>       // Clock used to measure chunk throughput
+#include <fcntl.h>      // sync_file_range() and posix_fadvise() for large received files
+#include <unistd.h>     // UNIX standard function definitions
+#include <arpa/inet.h>  // Byte order of chunk headers and trailers
+#include <sys/socket.h> // Socket definitions and functions
+#include <sys/mman.h>   // Slab mapping for the buffer pool
+#include <sys/uio.h>    // Vectored I/O for chunk headers and payloads
+#include <sys/xattr.h>  // Checksums stored as extended attributes
+#include "crc32c.h"
+#include "trace.h"
+
+#define POOL_MIN_CHUNK 4096                 // Smallest transfer chunk handed out by the buffer pool (4 KB)
+#define POOL_MAX_CHUNK (1024 * 1024)        // Largest transfer chunk handed out by the buffer pool (1 MB)
+#define POOL_CLASSES 9                      // Power-of-two size classes from POOL_MIN_CHUNK up to POOL_MAX_CHUNK
+#define POOL_SLAB_SIZE (2 * 1024 * 1024)    // Buffers are carved out of 2 MB slabs so one huge page can back a slab
+#define POOL_MEMORY_CAP (64 * 1024 * 1024)  // Upper limit on slab memory mapped by one worker (process or thread)
+#define POOL_MAX_SLABS (POOL_MEMORY_CAP / POOL_SLAB_SIZE)
+#define POOL_IDLE_SLABS 2                   // Slabs a worker thread keeps between commands, see pool_trim()
+#define POOL_HUGEPAGES 1                    // Try hugepage-backed slabs first, falling back to regular pages
+#define CHUNK_FAST_NS 2000000L              // A full chunk moved in under 2 ms doubles the chunk size
+#define CHUNK_SLOW_NS 50000000L             // A chunk taking more than 50 ms halves the chunk size
+#define CHECKSUM_XATTR "user.datasync.crc32c" // Extended attribute holding the CRC32C of a stored file
+#define TRANSFER_CORRUPT -2                 // Returned by receive functions when the CRC32C trailer does not match
+#define LARGE_FILE_BYTES (256LL * 1024 * 1024) // Files received past this size stop piling up in the page cache:
+#define LARGE_FILE_WINDOW (32LL * 1024 * 1024) // ... every 32 MB written go to disk, and the data before them out of the cache
+
+// Usage counters kept by every worker's buffer pool
+struct pool_stats
+{
+    unsigned long slabs_mapped;     // Number of slabs mapped by this worker
+    unsigned long hugepage_slabs;   // How many of those slabs are backed by huge pages
+    unsigned long requests;         // Number of buffers handed out
+    unsigned long reused;           // Requests served from a free list without mapping a new slab
+    unsigned long in_use;           // Buffers currently handed out
+    unsigned long peak_in_use;      // Highest value in_use has reached
+    unsigned long cap_rejections;   // Requests shrunk or refused because of POOL_MEMORY_CAP
+};
+
+// Per-worker pool: one free list per power-of-two size class, buffers carved out of 2 MB slabs
+struct buffer_pool
+{
+    void *free_list[POOL_CLASSES];  // Free buffers of each class, the link pointer lives inside the buffer itself
+    void *slabs[POOL_MAX_SLABS];    // Every slab mapped so far, so the worker can unmap them when it is done
+    struct pool_stats stats;
+};
+
+static __thread struct buffer_pool worker_pool; // Each worker (process or thread) owns its own slabs, so no locking is needed
+
+// Function to find the smallest size class that can hold the requested number of bytes
+int pool_class(size_t size)
+{
+    int size_class = 0;
+
+    while (size_class < POOL_CLASSES - 1 && ((size_t)POOL_MIN_CHUNK << size_class) < size)
+    {
+        size_class++;
+    }
+    return size_class;
+}
+
+// Function to map one more slab and split it into free buffers of the given size class
+int pool_grow(int size_class)
+{
+    size_t buffer_size = (size_t)POOL_MIN_CHUNK << size_class;
+    void *slab = MAP_FAILED;
+
+    // Respect the memory cap before mapping anything
+    if (worker_pool.stats.slabs_mapped >= POOL_MAX_SLABS)
+    {
+        return -1;
+    }
+
+#ifdef MAP_HUGETLB
+    // Prefer an explicit huge page when they are reserved on this host
+    if (POOL_HUGEPAGES)
+    {
+        slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED)
+        {
+            worker_pool.stats.hugepage_slabs++;
+        }
+    }
+#endif
+    if (slab == MAP_FAILED)
+    {
+        slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+        {
+            perror("Failed to map buffer slab");
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        // Without reserved huge pages, ask for transparent huge pages instead
+        if (POOL_HUGEPAGES)
+        {
+            madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    worker_pool.slabs[worker_pool.stats.slabs_mapped++] = slab;
+
+    // Thread every buffer of the slab onto the free list of its class
+    for (size_t offset = 0; offset + buffer_size <= POOL_SLAB_SIZE; offset += buffer_size)
+    {
+        void *buffer = (char *)slab + offset;
+        *(void **)buffer = worker_pool.free_list[size_class];
+        worker_pool.free_list[size_class] = buffer;
+    }
+    return 0;
+}
+
+// Function to hand out a page-aligned buffer of at least *size bytes
+// When the memory cap is reached a smaller buffer is returned and *size is updated, NULL means nothing is left
+char *pool_acquire(size_t *size)
+{
+    int size_class = pool_class(*size);
+    int rejected = 0;
+    void *buffer;
+
+    worker_pool.stats.requests++;
+    for (; size_class >= 0; size_class--)
+    {
+        if (worker_pool.free_list[size_class] != NULL)
+        {
+            worker_pool.stats.reused++;
+            break;
+        }
+        if (pool_grow(size_class) == 0)
+        {
+            break;
+        }
+        rejected = 1; // Could not map another slab, try a smaller class that may still have free buffers
+    }
+    if (rejected)
+    {
+        worker_pool.stats.cap_rejections++;
+    }
+    if (size_class < 0)
+    {
+        return NULL;
+    }
+
+    // Pop the buffer from the free list
+    buffer = worker_pool.free_list[size_class];
+    worker_pool.free_list[size_class] = *(void **)buffer;
+
+    worker_pool.stats.in_use++;
+    if (worker_pool.stats.in_use > worker_pool.stats.peak_in_use)
+    {
+        worker_pool.stats.peak_in_use = worker_pool.stats.in_use;
+    }
+    *size = (size_t)POOL_MIN_CHUNK << size_class;
+    return buffer;
+}
+
+// Function to give a buffer back to the free list of its size class
+void pool_release(char *buffer, size_t size)
+{
+    int size_class = pool_class(size);
+
+    if (buffer == NULL)
+    {
+        return;
+    }
+    *(void **)buffer = worker_pool.free_list[size_class];
+    worker_pool.free_list[size_class] = buffer;
+    worker_pool.stats.in_use--;
+}
+
+// Function to print the usage counters of the calling worker's pool
+void pool_report(const char *worker_name)
+{
+    struct pool_stats *stats = &worker_pool.stats;
+
+    printf("%s buffer pool: %lu slabs (%lu huge, %lu KB of %lu KB cap), %lu requests, %lu reused, peak %lu buffers, %lu cap rejections\n",
+           worker_name, stats->slabs_mapped, stats->hugepage_slabs, stats->slabs_mapped * (POOL_SLAB_SIZE / 1024),
+           (unsigned long)POOL_MEMORY_CAP / 1024, stats->requests, stats->reused, stats->peak_in_use, stats->cap_rejections);
+}
+
+// Function to unmap every slab of the calling worker once it has finished serving its client
+void pool_destroy()
+{
+    for (unsigned long i = 0; i < worker_pool.stats.slabs_mapped; i++)
+    {
+        munmap(worker_pool.slabs[i], POOL_SLAB_SIZE);
+    }
+    memset(&worker_pool, 0, sizeof(worker_pool));
+}
+
+// Function to unmap the slabs of a worker thread that serves many clients once it is idle between commands, so a
+// transfer that ramped up its chunks does not keep its slabs. A worker that holds few slabs keeps them for reuse
+void pool_trim()
+{
+    if (worker_pool.stats.in_use > 0 || worker_pool.stats.slabs_mapped <= POOL_IDLE_SLABS)
+    {
+        return;
+    }
+    for (unsigned long i = 0; i < worker_pool.stats.slabs_mapped; i++)
+    {
+        munmap(worker_pool.slabs[i], POOL_SLAB_SIZE);
+    }
+    memset(worker_pool.free_list, 0, sizeof(worker_pool.free_list));
+    worker_pool.stats.slabs_mapped = 0;
+    worker_pool.stats.hugepage_slabs = 0;
+}
+
+// Tracks how fast chunks move so the next chunk can be sized from observed throughput
+struct chunk_sizer
+{
+    size_t size;                // Size the next chunk should have
+    size_t capacity;            // Size of the pool buffer currently held for the transfer
+    char *buffer;               // Pool buffer used for the transfer
+    struct timespec started;    // When the current chunk started moving
+};
+
+// Function to start an adaptive transfer at the smallest chunk size
+int chunk_sizer_init(struct chunk_sizer *sizer)
+{
+    sizer->size = POOL_MIN_CHUNK;
+    sizer->capacity = POOL_MIN_CHUNK;
+    sizer->buffer = pool_acquire(&sizer->capacity);
+    clock_gettime(CLOCK_MONOTONIC, &sizer->started);
+    return sizer->buffer != NULL ? 0 : -1;
+}
+
+// Function to adapt the chunk size once `moved` bytes went through
+// A full chunk that moved in under CHUNK_FAST_NS doubles the size (4 KB up to 1 MB), one slower than CHUNK_SLOW_NS halves it
+void chunk_sizer_update(struct chunk_sizer *sizer, size_t moved)
+{
+    struct timespec now;
+    long elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - sizer->started.tv_sec) * 1000000000L + (now.tv_nsec - sizer->started.tv_nsec);
+    sizer->started = now;
+
+    if (moved == sizer->size && elapsed < CHUNK_FAST_NS && sizer->size < POOL_MAX_CHUNK)
+    {
+        sizer->size *= 2;
+    }
+    else if (elapsed > CHUNK_SLOW_NS && sizer->size > POOL_MIN_CHUNK)
+    {
+        sizer->size /= 2;
+    }
+
+    // Swap the pool buffer when the chunk size changed; under the memory cap keep whatever the pool can give
+    if (sizer->size != sizer->capacity)
+    {
+        size_t capacity = sizer->size;
+        char *buffer = pool_acquire(&capacity);
+
+        if (buffer != NULL)
+        {
+            pool_release(sizer->buffer, sizer->capacity);
+            sizer->buffer = buffer;
+            sizer->capacity = capacity;
+        }
+        sizer->size = sizer->capacity;
+    }
+}
+
+// Function to give the transfer buffer back to the pool
+void chunk_sizer_done(struct chunk_sizer *sizer)
+{
+    pool_release(sizer->buffer, sizer->capacity);
+    sizer->buffer = NULL;
+}
+
+// Function to write the whole iovec array, resuming after partial writes
+int writev_all(int sock, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0)
+    {
+        ssize_t written = writev(sock, iov, iov_count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        // Skip the parts of the iovec that went out completely and trim the first partial one
+        while (iov_count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Function to receive exactly `length` bytes, returns -1 if the peer disconnects first
+int recv_all(int sock, void *data, size_t length)
+{
+    size_t received = 0;
+
+    while (received < length)
+    {
+        ssize_t count = recv(sock, (char *)data + received, length - received, 0);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return -1;
+        }
+        received += count;
+    }
+    return 0;
+}
+
+// Function to receive exactly length bytes like recv_all() and extend a CRC32C over them piece by piece, each piece
+// right after it arrives while it is still in the CPU cache rather than once the whole chunk is in
+int recv_all_checksummed(int sock, void *data, size_t length, uint32_t *checksum)
+{
+    size_t received = 0;
+
+    while (received < length)
+    {
+        ssize_t count = recv(sock, (char *)data + received, length - received, 0);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return -1;
+        }
+        *checksum = crc32c_update(*checksum, (char *)data + received, count);
+        received += count;
+    }
+    return 0;
+}
+
+// Function to send one chunk of file data: a 4-byte length header joined with its payload in a single writev()
+// A chunk of length 0 marks the end of the file
+int send_chunk(int sock, const char *data, uint32_t length)
+{
+    uint32_t header = htonl(length);
+    struct iovec iov[2];
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+    trace_bytes(length);
+    return writev_all(sock, iov, length > 0 ? 2 : 1);
+}
+
+static __thread int chunk_broken_socket = -1; // Socket whose chunk stream failed part way on this thread, see chunk_stream_broken()
+static __thread int chunk_rest_socket = -1;   // Socket whose last chunk did not fit the buffer and is handed out in pieces
+static __thread uint32_t chunk_rest;          // Bytes of that chunk still in the socket
+
+// Function to receive one chunk into a pool buffer, growing the buffer when the sender used a bigger chunk
+// When the pool has no buffer big enough left, the chunk is handed out in pieces that fill the buffer over the
+// following calls, so the caller sees smaller chunks carrying the same data
+// With a checksum given, the CRC32C is extended over the chunk as it arrives
+// Returns the chunk length (0 at the end of the file) or -1 on error, after which the rest of the stream is
+// still in the socket and the connection is out of step
+long recv_chunk_checked(int sock, char **buffer, size_t *capacity, uint32_t *checksum)
+{
+    uint32_t header;
+    uint32_t length;
+
+    if (chunk_rest > 0 && chunk_rest_socket == sock)
+    {
+        length = chunk_rest < *capacity ? chunk_rest : (uint32_t)*capacity;
+        chunk_rest -= length;
+    }
+    else
+    {
+        if (recv_all(sock, &header, sizeof(header)) != 0)
+        {
+            chunk_broken_socket = sock;
+            return -1;
+        }
+        length = ntohl(header);
+        if (length > POOL_MAX_CHUNK)
+        {
+            fprintf(stderr, "Chunk of %u bytes exceeds the %d byte limit\n", length, POOL_MAX_CHUNK);
+            chunk_broken_socket = sock;
+            return -1;
+        }
+        if (length > *capacity)
+        {
+            size_t wanted = length;
+            char *bigger = pool_acquire(&wanted);
+
+            // The pool may only have a smaller buffer left, which still beats the one held
+            if (bigger != NULL && wanted > *capacity)
+            {
+                pool_release(*buffer, *capacity);
+                *buffer = bigger;
+                *capacity = wanted;
+            }
+            else
+            {
+                pool_release(bigger, wanted);
+            }
+        }
+        if (length > *capacity)
+        {
+            chunk_rest_socket = sock;
+            chunk_rest = length - (uint32_t)*capacity;
+            length = (uint32_t)*capacity;
+        }
+    }
+    if (length > 0 && (checksum != NULL ? recv_all_checksummed(sock, *buffer, length, checksum)
+                                        : recv_all(sock, *buffer, length)) != 0)
+    {
+        chunk_rest = 0;
+        chunk_broken_socket = sock;
+        return -1;
+    }
+    trace_bytes(length);
+    return length;
+}
+
+// Function to receive one chunk without checksumming it, see recv_chunk_checked()
+long recv_chunk(int sock, char **buffer, size_t *capacity)
+{
+    return recv_chunk_checked(sock, buffer, capacity, NULL);
+}
+
+// Function to tell whether a chunk stream received from a socket by this thread failed or was left part way,
+// and forget it. What is left of such a stream would be read as commands, so the connection has to be dropped
+int chunk_stream_broken(int sock)
+{
+    int broken = chunk_broken_socket == sock || (chunk_rest > 0 && chunk_rest_socket == sock);
+
+    chunk_broken_socket = -1;
+    chunk_rest = 0;
+    return broken;
+}
+
+// Function to read the checksum recorded for a stored file when it was uploaded, returns 0 when there is one
+int load_stored_checksum(int file_descriptor, uint32_t *checksum)
+{
+    char value[16];
+    ssize_t length = fgetxattr(file_descriptor, CHECKSUM_XATTR, value, sizeof(value) - 1);
+
+    if (length <= 0)
+    {
+        return -1;
+    }
+    value[length] = '\0';
+    *checksum = (uint32_t)strtoul(value, NULL, 16);
+    return 0;
+}
+
+// Function to record the checksum of a stored file next to its data as an extended attribute
+void save_stored_checksum(int file_descriptor, uint32_t checksum)
+{
+    char value[16];
+
+    snprintf(value, sizeof(value), "%08x", checksum);
+    if (fsetxattr(file_descriptor, CHECKSUM_XATTR, value, strlen(value), 0) != 0 && errno != ENOTSUP)
+    {
+        perror("Failed to store checksum");
+    }
+}
+
+// Function to end a chunked file stream: the end-of-file chunk joined with the 4-byte CRC32C trailer of the whole file
+int send_end_of_file(int sock, uint32_t checksum)
+{
+    uint32_t trailer[2] = {0, htonl(checksum)};
+    struct iovec iov;
+
+    iov.iov_base = trailer;
+    iov.iov_len = sizeof(trailer);
+    return writev_all(sock, &iov, 1);
+}
+
+// Function a program that shows the progress of its transfers sets, called with the file data every
+// send_file_chunks() and recv_file_chunks() moves
+void (*chunk_progress)(long long moved);
+
+// Function to stream an open file as adaptive chunks, the end-of-file chunk and the CRC32C trailer
+// The checksum is computed while streaming; when the file carries a stored checksum that one is sent instead,
+// so the receiver also catches data that changed on disk after the upload
+// Returns the number of file bytes sent or -1 on error
+long long send_file_chunks(int sock, int file_descriptor)
+{
+    struct chunk_sizer sizer;
+    long long total = 0;
+    ssize_t bytes_read;
+    uint32_t checksum = 0;
+    uint32_t stored_checksum;
+
+    if (chunk_sizer_init(&sizer) != 0)
+    {
+        return -1;
+    }
+    while ((bytes_read = trace_file_read(file_descriptor, sizer.buffer, sizer.size, -1)) > 0)
+    {
+        checksum = crc32c_update(checksum, sizer.buffer, bytes_read);
+        if (send_chunk(sock, sizer.buffer, bytes_read) != 0)
+        {
+            chunk_sizer_done(&sizer);
+            return -1;
+        }
+        total += bytes_read;
+        chunk_sizer_update(&sizer, bytes_read);
+        if (chunk_progress != NULL)
+        {
+            chunk_progress(bytes_read);
+        }
+    }
+    chunk_sizer_done(&sizer);
+
+    if (load_stored_checksum(file_descriptor, &stored_checksum) == 0)
+    {
+        if (stored_checksum != checksum)
+        {
+            fprintf(stderr, "Stored checksum %08x does not match the data read (%08x)\n", stored_checksum, checksum);
+        }
+        checksum = stored_checksum;
+    }
+    if (bytes_read < 0)
+    {
+        checksum = ~checksum; // Make sure a read error can never pass verification
+    }
+
+    // Always terminate the stream so the receiver is never left waiting, even after a read error
+    if (send_end_of_file(sock, checksum) != 0 || bytes_read < 0)
+    {
+        return -1;
+    }
+    return total;
+}
+
+// Function to stream `length` bytes of an open file starting at `offset`, for one stripe of a striped download or a
+// packed file. pread() leaves the file position alone, so stripes never depend on each other; the trailer carries the
+// CRC32C of the range, or stored_checksum when given, the one recorded for a packed file when it was uploaded
+// range_checksum (if not NULL) gets the CRC32C of the data read, for the chunks of a parallel upload
+// Returns the number of bytes sent or -1 on error, also when the file ends before the range does
+long long send_range_chunks(int sock, int file_descriptor, long long offset, long long length,
+                            const uint32_t *stored_checksum, uint32_t *range_checksum)
+{
+    struct chunk_sizer sizer;
+    long long total = 0;
+    ssize_t bytes_read = 0;
+    uint32_t checksum = 0;
+
+    if (chunk_sizer_init(&sizer) != 0)
+    {
+        return -1;
+    }
+    while (total < length)
+    {
+        size_t wanted = length - total < (long long)sizer.size ? (size_t)(length - total) : sizer.size;
+
+        if ((bytes_read = trace_file_read(file_descriptor, sizer.buffer, wanted, offset + total)) <= 0)
+        {
+            break;
+        }
+        checksum = crc32c_update(checksum, sizer.buffer, bytes_read);
+        if (send_chunk(sock, sizer.buffer, bytes_read) != 0)
+        {
+            chunk_sizer_done(&sizer);
+            return -1;
+        }
+        total += bytes_read;
+        chunk_sizer_update(&sizer, bytes_read);
+    }
+    chunk_sizer_done(&sizer);
+
+    if (range_checksum != NULL)
+    {
+        *range_checksum = checksum;
+    }
+    if (stored_checksum != NULL)
+    {
+        if (total == length && *stored_checksum != checksum)
+        {
+            fprintf(stderr, "Stored checksum %08x does not match the data read (%08x)\n", *stored_checksum, checksum);
+        }
+        checksum = *stored_checksum;
+    }
+    if (bytes_read < 0 || total < length)
+    {
+        checksum = ~checksum; // Make sure a read error or a range cut short can never pass verification
+    }
+    if (send_end_of_file(sock, checksum) != 0 || bytes_read < 0 || total < length)
+    {
+        return -1;
+    }
+    return total;
+}
+
+// Function to keep a huge received file from filling the page cache with dirty data: past LARGE_FILE_BYTES, every
+// LARGE_FILE_WINDOW written is handed to the disk and what was handed over before is waited for and dropped from the
+// cache. The writer runs at disk speed instead of piling up dirty pages, and other files keep their cached data
+void release_written_pages(FILE *file, long long written, long long *released)
+{
+    int file_descriptor = fileno(file);
+
+    if (written < LARGE_FILE_BYTES || written - *released < LARGE_FILE_WINDOW || fflush(file) != 0)
+    {
+        return;
+    }
+    sync_file_range(file_descriptor, *released, written - *released, SYNC_FILE_RANGE_WRITE);
+    if (*released > 0 &&
+        sync_file_range(file_descriptor, 0, *released, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+    {
+        posix_fadvise(file_descriptor, 0, *released, POSIX_FADV_DONTNEED);
+    }
+    *released = written;
+}
+
+// Function to receive chunks until the end-of-file chunk, writing them to file_pointer (NULL just drains the stream)
+// The CRC32C is computed while receiving and compared with the sender's trailer; *checksum gets the verified value
+// Returns the number of file bytes received, -1 on error or TRANSFER_CORRUPT when the checksum does not match
+long long recv_file_chunks(int sock, FILE *file_pointer, uint32_t *checksum)
+{
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    long long total = 0;
+    long long released = 0;             // File data handed to the disk so far
+    long length;
+    uint32_t computed = 0;
+    uint32_t trailer;
+
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+    while ((length = recv_chunk_checked(sock, &buffer, &capacity, &computed)) > 0)
+    {
+        if (file_pointer != NULL && trace_file_write(buffer, length, file_pointer) != (size_t)length)
+        {
+            perror("Failed to write received data");
+            file_pointer = NULL; // Keep draining so the connection stays in sync
+            total = -1;
+        }
+        if (total >= 0)
+        {
+            total += length;
+        }
+        if (file_pointer != NULL)
+        {
+            release_written_pages(file_pointer, total, &released);
+        }
+        if (chunk_progress != NULL)
+        {
+            chunk_progress(length);
+        }
+    }
+    pool_release(buffer, capacity);
+    if (length < 0 || recv_all(sock, &trailer, sizeof(trailer)) != 0)
+    {
+        return -1;
+    }
+    if (ntohl(trailer) != computed)
+    {
+        fprintf(stderr, "Checksum mismatch: expected %08x, received data has %08x\n", ntohl(trailer), computed);
+        return total < 0 ? -1 : TRANSFER_CORRUPT;
+    }
+    if (checksum != NULL)
+    {
+        *checksum = computed;
+    }
+    return total;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE          // fallocate() and sync_file_range()
+#define _FILE_OFFSET_BITS 64  // 64-bit file sizes and offsets on 32-bit systems too
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -7,10 +9,137 @@
 #include <limits.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
 
 #define PATH_MAX 4096
 #define PORT 6009
 #define BUFFER_SIZE 1024
+#define SERVER_ADDRESS "127.0.0.4"          // Address Smain is reached at
+#define BENCH_REQUESTS 5000                 // Request/reply round trips timed per transport
+#define BENCH_CONNECTS 1000                 // Connect + request round trips timed per transport
+#define BENCH_STREAM_RUNS 5                 // Stream runs with and without checksum, taken in turn, best one counts
+#define DELTA_MIN_BYTES (64 * 1024)         // .c and .txt files from this size up are uploaded as a delta against the server's copy
+#define DELTA_LITERAL_MAX (1024 * 1024)     // Longest literal instruction of a delta upload
+#define STRIPE_MAX_CONNECTIONS 16           // Most connections a striped download opens
+#define STRIPE_MIN_BYTES (4 * 1024 * 1024)  // Smallest stripe worth its own connection (4 MB)
+#define STRIPE_ATTEMPTS 4                   // Tries per stripe before the download is given up
+#define STRIPE_RETRY_MS 250                 // Wait before the first retry of a stripe, doubled for each further one
+#define UPLOAD_CHUNK_BYTES (16 * 1024 * 1024) // Chunk of a parallel upload, each one sent on a connection of its own (16 MB)
+#define UPLOAD_MAX_CHUNKS 65536             // Most chunks a server takes for one file, bigger files get bigger chunks
+#define USYNC_CONNECTIONS 4                 // Upload connections of a usync, each with one reply in flight
+#define USYNC_MAX_THREADS 64                // Most threads hashing or uploading the files of a usync
+#define USYNC_SAME 0                        // usync file states: the server's copy is up to date
+#define USYNC_NEW 1                         // The server has no copy
+#define USYNC_CHANGED 2                     // The server's copy differs
+#define USYNC_CHECK 3                       // Same size, the contents are hashed to decide
+#define USYNC_UPLOADED 4                    // Sent and confirmed by the server
+#define USYNC_FAILED 5                      // Sent and refused by the server
+#define WATCH_REMOVE 6                      // Watch changes: a file was deleted or moved away
+#define WATCH_REMOVE_DIR 7                  // A directory was deleted or moved away
+#define WATCH_DEBOUNCE_MS 100               // A watch sends its changes once the tree has been quiet this long
+#define WATCH_MAX_DELAY_MS 500              // Longest a change waits while further events keep coming
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE)
+#define PROGRESS_MIN_BYTES (64LL * 1024 * 1024) // Uploads and downloads from this size up show their progress
+#define PROGRESS_INTERVAL_MS 500            // Time between two progress updates
+
+#include "crc32c.h"                 // CRC32C of file data, the same in every program
+#define TRACE_SHARED_CONTEXT 1              // The stripe and usync threads of a command count into its one trace context
+#include "trace.h"                  // Request spans, the same in every program
+#include "chunks.h"                 // Buffer pool and chunked file transfers, the same in every program
+
+// Function to choose the ID of a new request, unique across the clients of a host without any coordination
+uint64_t trace_new_request()
+{
+    static uint64_t base, count;
+
+    if (base == 0)
+    {
+        base = (uint64_t)trace_now() ^ ((uint64_t)getpid() << 40);
+    }
+    count++;
+    return base + count != 0 ? base + count : base + ++count;
+}
+
+
+// Progress of the upload or download the user is waiting for, shown for files of PROGRESS_MIN_BYTES and up
+struct transfer_progress
+{
+    const char *name;                   // File being moved, NULL while no progress is shown
+    long long total;                    // Its size, -1 when the other side does not announce it
+    long long done;
+    int shown;                          // A progress line was printed and still needs its line end
+    struct timespec started, last;
+};
+
+struct transfer_progress progress;
+
+// Function to start showing the progress of a transfer; only the thread running the user's command moves data then
+void progress_start(const char *name, long long total)
+{
+    progress.name = name;
+    progress.total = total;
+    progress.done = 0;
+    progress.shown = 0;
+    clock_gettime(CLOCK_MONOTONIC, &progress.started);
+    progress.last = progress.started;
+}
+
+// Function to count moved file data and redraw the progress line now and then
+void progress_update(long long moved)
+{
+    struct timespec now;
+    double elapsed;
+
+    if (progress.name == NULL)
+    {
+        return;
+    }
+    progress.done += moved;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (progress.done < PROGRESS_MIN_BYTES ||
+        (now.tv_sec - progress.last.tv_sec) * 1000 + (now.tv_nsec - progress.last.tv_nsec) / 1000000 < PROGRESS_INTERVAL_MS)
+    {
+        return;
+    }
+    progress.last = now;
+    elapsed = (now.tv_sec - progress.started.tv_sec) + (now.tv_nsec - progress.started.tv_nsec) / 1e9;
+    if (progress.total > 0)
+    {
+        printf("\r%s: %lld of %lld MB (%d%%), %.1f MB/s   ", progress.name, progress.done >> 20, progress.total >> 20,
+               (int)(progress.done * 100 / progress.total), progress.done / 1048576.0 / elapsed);
+    }
+    else
+    {
+        printf("\r%s: %lld MB, %.1f MB/s   ", progress.name, progress.done >> 20, progress.done / 1048576.0 / elapsed);
+    }
+    fflush(stdout);
+    progress.shown = 1;
+}
+
+// Function to stop showing progress, ending the progress line if one was printed
+void progress_done()
+{
+    if (progress.shown)
+    {
+        printf("\n");
+    }
+    progress.name = NULL;
+}
 
 //void parse_path(const char *path, char *dir_name, char *fname);
 
@@ -19,11 +148,13 @@ void transmit_command(int sock_fd, const char *cmd, const char *param1, const ch
     // Buffer to store the command string
     char cmd_buffer[BUFFER_SIZE];
 
-    // Format the command and arguments into a single string
+    // Format the command and arguments into a single string, padded with zeros to a full frame
+    memset(cmd_buffer, 0, sizeof(cmd_buffer));
     snprintf(cmd_buffer, sizeof(cmd_buffer), "%s %s %s", cmd, param1, param2);
+    trace_stamp_frame(cmd_buffer, trace_context.request); // The servers record their spans under the ID of this command
 
-    // Send the command to the client socket
-    if (send(sock_fd, cmd_buffer, strlen(cmd_buffer), 0) == -1)
+    // Send the whole BUFFER_SIZE frame so the server can tell the command apart from the file data after it
+    if (send(sock_fd, cmd_buffer, sizeof(cmd_buffer), 0) == -1)
     {
         // Error handling for send failure
         perror("transmit_command failed");
@@ -31,47 +162,324 @@ void transmit_command(int sock_fd, const char *cmd, const char *param1, const ch
 }
 
 
-void transfer_file(int sock_fd, const char *file_name)
+// Function to upload a local file as `name` into the server directory `destination`: the ufile command frame
+// announces the size of the file after the destination, so the server can reserve the space before the data comes
+void transfer_file(int sock_fd, const char *file_name, const char *name, const char *destination)
 {
-    // Buffer for reading the file contents
-    char file_buffer[BUFFER_SIZE];
+    char arguments[BUFFER_SIZE];
+    struct stat file_info;
 
     // Open the file in read-only mode
     int fd = open(file_name, O_RDONLY);
-    if (fd < 0)
+    if (fd < 0 || fstat(fd, &file_info) != 0)
     {
         // Error handling if the file cannot be opened
         perror("Unable to open file");
+        transmit_command(sock_fd, "ufile", name, destination);
+        send_end_of_file(sock_fd, 0); // End the (empty) file stream so the server does not wait
+        if (fd >= 0)
+        {
+            close(fd);
+        }
         return;
     }
 
-    // Obtain the file size using lseek
-    off_t size = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET); // Reset file pointer to the beginning
-
     // Check if the file is empty
-    if (size == 0)
+    if (file_info.st_size == 0)
     {
         printf("Empty file: %s\n", file_name);
-        send(sock_fd, "", 1, 0); // Send an empty string if the file is empty
     }
-    else
+
+    // Read and send the file contents as adaptive chunks followed by the end-of-file chunk
+    snprintf(arguments, sizeof(arguments), "%s %lld", destination, (long long)file_info.st_size);
+    transmit_command(sock_fd, "ufile", name, arguments);
+    progress_start(name, file_info.st_size);
+    if (send_file_chunks(sock_fd, fd) < 0)
     {
-        // Read and send the file contents in chunks
-        ssize_t bytes_read;
-        while ((bytes_read = read(fd, file_buffer, sizeof(file_buffer))) > 0)
+        // Error handling for send failure
+        perror("transfer_file error");
+    }
+    progress_done();
+
+    // Close the file descriptor
+    close(fd);
+}
+
+
+// Instruction stream of a delta upload, sent as chunks of up to one pool buffer
+struct delta_writer
+{
+    int sock;
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    uint32_t checksum;                  // CRC32C of every instruction byte sent, for the stream's trailer
+    int failed;
+};
+
+// Function to append bytes to the instruction stream, sending a chunk whenever the buffer is full
+void delta_put(struct delta_writer *writer, const void *data, size_t length)
+{
+    while (length > 0 && !writer->failed)
+    {
+        size_t piece = writer->capacity - writer->used < length ? writer->capacity - writer->used : length;
+
+        memcpy(writer->buffer + writer->used, data, piece);
+        writer->used += piece;
+        data = (const char *)data + piece;
+        length -= piece;
+        if (writer->used == writer->capacity)
+        {
+            writer->checksum = crc32c_update(writer->checksum, writer->buffer, writer->used);
+            writer->failed = send_chunk(writer->sock, writer->buffer, writer->used) != 0;
+            writer->used = 0;
+        }
+    }
+}
+
+// Function to add one instruction: 'C' <first block> <count>, 'L' <length> before literal bytes, or 'E' with the new
+// file's size and CRC32C
+void delta_instruction(struct delta_writer *writer, char operation, const uint32_t *fields, int field_count)
+{
+    uint32_t encoded[3];
+
+    for (int i = 0; i < field_count; i++)
+    {
+        encoded[i] = htonl(fields[i]);
+    }
+    delta_put(writer, &operation, 1);
+    delta_put(writer, encoded, field_count * sizeof(uint32_t));
+}
+
+// Function to send the bytes the server has no block for, as literal instructions of at most DELTA_LITERAL_MAX bytes
+void delta_literal(struct delta_writer *writer, const unsigned char *data, long long length)
+{
+    while (length > 0)
+    {
+        uint32_t piece = length < DELTA_LITERAL_MAX ? (uint32_t)length : DELTA_LITERAL_MAX;
+
+        delta_instruction(writer, 'L', &piece, 1);
+        delta_put(writer, data, piece);
+        data += piece;
+        length -= piece;
+    }
+}
+
+// Function to receive the block signatures of the server's copy into a malloc()ed array, NULL when they did not verify
+// The array starts with the block size and file size, then holds a weak checksum and a CRC32C per block
+uint32_t *receive_delta_signatures(int sock_fd, long *words)
+{
+    size_t capacity = POOL_MIN_CHUNK, allocated = 0, used = 0;
+    char *buffer = pool_acquire(&capacity);
+    char *signatures = NULL;
+    uint32_t checksum = 0, trailer;
+    long length;
+
+    while (buffer != NULL && (length = recv_chunk(sock_fd, &buffer, &capacity)) > 0)
+    {
+        if (used + length > allocated)
+        {
+            char *grown = realloc(signatures, (used + length) * 2);
+            if (grown == NULL)
+            {
+                length = -1;
+                break;
+            }
+            signatures = grown;
+            allocated = (used + length) * 2;
+        }
+        memcpy(signatures + used, buffer, length);
+        checksum = crc32c_update(checksum, buffer, length);
+        used += length;
+    }
+    pool_release(buffer, capacity);
+    if (buffer == NULL || length < 0 || recv_all(sock_fd, &trailer, sizeof(trailer)) != 0 || ntohl(trailer) != checksum ||
+        used < 3 * sizeof(uint32_t) || used % (2 * sizeof(uint32_t)) != sizeof(uint32_t))
+    {
+        free(signatures);
+        return NULL;
+    }
+    *words = used / sizeof(uint32_t);
+    return (uint32_t *)signatures;
+}
+
+// Function to upload a .c or .txt file as a delta against the copy the server already has, after "dufile" was sent
+// The file is scanned with the rolling weak checksum of every block-sized window; a window whose weak checksum and
+// CRC32C match a block of the server's copy becomes a block reference, everything else is sent as literal data
+void delta_upload(int sock_fd, const char *file_name)
+{
+    struct delta_writer writer = {sock_fd, NULL, POOL_MAX_CHUNK, 0, 0, 0};
+    const unsigned char *data = NULL;
+    uint32_t *signatures, fields[3], sum = 0, sum_of_sums = 0;
+    int *heads = NULL, *next = NULL;
+    long words, blocks, mask = 15;
+    long long size, position = 0, literal_start = 0, run_first = -1, run_count = 0, matched = 0;
+    struct stat file_info;
+    int block, fd, have_sums = 0;
+
+    // The server sends its signatures right after the command; without them it sends nothing else but its reply
+    if ((signatures = receive_delta_signatures(sock_fd, &words)) == NULL)
+    {
+        printf("The server sent no usable block signatures for %s\n", file_name);
+        return;
+    }
+    block = ntohl(signatures[0]);
+    blocks = (words - 3) / 2;
+    for (long i = 0; i < words; i++)
+    {
+        signatures[i] = ntohl(signatures[i]);
+    }
+
+    // Open the local file; if that fails, an unverifiable instruction stream makes the server keep its copy
+    fd = open(file_name, O_RDONLY);
+    size = fd >= 0 && fstat(fd, &file_info) == 0 ? file_info.st_size : -1;
+    if (size > 0 && (data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        size = -1;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    writer.buffer = pool_acquire(&writer.capacity);
+    if (size < 0 || writer.buffer == NULL || block <= 0)
+    {
+        perror("Unable to read file");
+        send_end_of_file(sock_fd, 1);
+        pool_release(writer.buffer, writer.capacity);
+        free(signatures);
+        return;
+    }
+
+    // Hash table from weak checksum to the server's blocks, chained through next[]
+    while (mask < 2 * blocks)
+    {
+        mask = mask * 2 + 1;
+    }
+    heads = malloc((mask + 1) * sizeof(int));
+    next = malloc((blocks + 1) * sizeof(int));
+    for (long i = 0; heads != NULL && i <= mask; i++)
+    {
+        heads[i] = -1;
+    }
+    for (long i = blocks - 1; heads != NULL && next != NULL && i >= 0; i--)
+    {
+        uint32_t weak = signatures[3 + 2 * i];
+        next[i] = heads[(weak ^ (weak >> 16)) & mask];
+        heads[(weak ^ (weak >> 16)) & mask] = i;
+    }
+    if (heads == NULL || next == NULL)
+    {
+        blocks = 0; // Without the table the whole file goes as literal data
+    }
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    while (blocks > 0 && position + block <= size)
+    {
+        uint32_t weak, strong = 0;
+        int strong_known = 0;
+        long match = -1;
+
+        if (!have_sums)
+        {
+            sum = sum_of_sums = 0;
+            for (int i = 0; i < block; i++)
+            {
+                sum += data[position + i];
+                sum_of_sums += sum;
+            }
+            have_sums = 1;
+        }
+        weak = (sum & 0xffff) | (sum_of_sums << 16);
+        for (long i = heads[(weak ^ (weak >> 16)) & mask]; i >= 0; i = next[i])
         {
-            if (send(sock_fd, file_buffer, bytes_read, 0) == -1)
+            if (signatures[3 + 2 * i] != weak)
             {
-                // Error handling for send failure
-                perror("transfer_file error");
                 continue;
             }
+            if (!strong_known)
+            {
+                strong = crc32c_update(0, data + position, block);
+                strong_known = 1;
+            }
+            // Any matching block will do, but the one right after the current run keeps the run a single instruction
+            if (strong == signatures[4 + 2 * i])
+            {
+                match = i;
+                if (i == run_first + run_count)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (match >= 0)
+        {
+            if (position > literal_start || run_first + run_count != match)
+            {
+                if (run_count > 0)
+                {
+                    fields[0] = run_first;
+                    fields[1] = run_count;
+                    delta_instruction(&writer, 'C', fields, 2);
+                }
+                delta_literal(&writer, data + literal_start, position - literal_start);
+                run_first = match;
+                run_count = 0;
+            }
+            run_count++;
+            matched += block;
+            position += block;
+            literal_start = position;
+            have_sums = 0;
+        }
+        else
+        {
+            // Roll the window one byte on: drop the first byte, add the one after the window
+            if (position + block < size)
+            {
+                sum += data[position + block] - data[position];
+                sum_of_sums += sum - (uint32_t)block * data[position];
+            }
+            position++;
         }
     }
+    if (run_count > 0)
+    {
+        fields[0] = run_first;
+        fields[1] = run_count;
+        delta_instruction(&writer, 'C', fields, 2);
+    }
+    delta_literal(&writer, data + literal_start, size - literal_start);
 
-    // Close the file descriptor
-    close(fd);
+    // The end instruction carries what the server checks its rebuilt file against
+    fields[0] = (uint32_t)(size >> 32);
+    fields[1] = (uint32_t)size;
+    fields[2] = crc32c_update(0, data, size);
+    delta_instruction(&writer, 'E', fields, 3);
+    if (writer.used > 0 && !writer.failed)
+    {
+        writer.checksum = crc32c_update(writer.checksum, writer.buffer, writer.used);
+        writer.failed = send_chunk(sock_fd, writer.buffer, writer.used) != 0;
+    }
+    if (writer.failed || send_end_of_file(sock_fd, writer.checksum) != 0)
+    {
+        perror("delta_upload error");
+    }
+    else
+    {
+        printf("Delta upload of %s: %lld of %lld bytes matched the server's copy, %lld sent as literal data\n",
+               file_name, matched, size, size - matched);
+    }
+
+    if (data != NULL)
+    {
+        munmap((void *)data, size);
+    }
+    pool_release(writer.buffer, writer.capacity);
+    free(heads);
+    free(next);
+    free(signatures);
 }
 
 
@@ -164,15 +572,53 @@ int create_dir_if_new(const char *dir_path)
 }
 
 
+// Function to read a single reply line from the server up to and including the newline
+int recv_line(int sock, char *line, size_t size)
+{
+    size_t length = 0;
+
+    while (length < size - 1)
+    {
+        if (recv(sock, line + length, 1, 0) != 1)
+        {
+            return -1;
+        }
+        if (line[length++] == '\n')
+        {
+            break;
+        }
+    }
+    line[length] = '\0';
+    return 0;
+}
+
+// Function to read the status line that opens the reply to a download
+// Returns 1 when the file's chunk stream follows, 0 when only the final message does, -1 when the server went away
+int recv_download_status(int sock)
+{
+    char status[16];
+
+    if (recv_line(sock, status, sizeof(status)) != 0)
+    {
+        return -1;
+    }
+    return strcmp(status, "data\n") == 0;
+}
+
 void download_file(int sock_fd, const char *file_name)
 {
-    char recv_buffer[BUFFER_SIZE];
     FILE *output_file;
-    ssize_t bytes_read;
+    long long bytes_read;
     char final_filename[BUFFER_SIZE];
     char full_path[BUFFER_SIZE];
     char current_dir[PATH_MAX];
 
+    // A file that is not there, or a busy server, sends no data; its final message says why
+    if (recv_download_status(sock_fd) != 1)
+    {
+        return;
+    }
+
     // Get the current working directory
     getcwd(current_dir, sizeof(current_dir));
 
@@ -198,161 +644,2160 @@ void download_file(int sock_fd, const char *file_name)
     {
         // Handle error if the file cannot be opened
         perror("Error opening file for writing");
+        recv_file_chunks(sock_fd, NULL, NULL); // Drain the file data so the connection stays in sync
         return;
     }
 
     printf("Receiving file: %s\n", final_filename);
 
-    // Receive data from the client in chunks and write to the file
-    while ((bytes_read = recv(sock_fd, recv_buffer, sizeof(recv_buffer), 0)) >= 0)
-    {
-        fwrite(recv_buffer, 1, bytes_read, output_file);
-        if (bytes_read < sizeof(recv_buffer))
-        {
-            break; // End of file reached
-        }
-    }
-
-    // Handle error if receiving fails
-    if (bytes_read < 0)
-    {
-        perror("Error receiving file");
-    }
+    // Receive the chunked file data from the server and write it to the file
+    progress_start(final_filename, -1);
+    bytes_read = recv_file_chunks(sock_fd, output_file, NULL);
+    progress_done();
 
     // Close the file after receiving is complete
     fclose(output_file);
-}
-
 
-int execute_command(int sock_fd, const char *cmd, const char *arg1, const char *arg2)
-{
-    // Handle the "ufile" command: upload a file from the client
-    if (strcmp(cmd, "ufile") == 0)
-    {
-        transmit_command(sock_fd, cmd, arg1, arg2);
-        transfer_file(sock_fd, arg1);
-    }
-    // Handle the "dfile" command: download a file to the client
-    else if (strcmp(cmd, "dfile") == 0)
-    {
-        transmit_command(sock_fd, cmd, arg1, arg2);
-        download_file(sock_fd, arg1);
-    }
-    // Handle the "rmfile" command: remove a file
-    else if (strcmp(cmd, "rmfile") == 0)
-    {
-        transmit_command(sock_fd, cmd, arg1, arg2);
-    }
-    // Handle the "dtar" and "display" commands
-    else if (strcmp(cmd, "dtar") == 0 || strcmp(cmd, "display") == 0)
+    // Handle error if receiving fails or the data does not match the server's checksum
+    if (bytes_read == TRANSFER_CORRUPT)
     {
-        transmit_command(sock_fd, cmd, arg1, arg2);
+        printf("Checksum mismatch, removing corrupt download %s\n", final_filename);
+        unlink(final_filename);
     }
-    // Handle unknown commands
-    else
+    else if (bytes_read < 0)
     {
-        printf("Invalid command received: %s\n", cmd);
-        return -1;
+        perror("Error receiving file");
     }
-    return 0;
 }
 
+// Function to return the seconds elapsed since start
+double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-int main()
+// Function to open a new connection to Smain, returns the socket or -1 on error
+int open_server_connection()
 {
-    int sock_fd;                        // Socket file descriptor for communication with the server
     struct sockaddr_in server_info;     // Structure to store server's address information
-    char cmd[BUFFER_SIZE], param1[BUFFER_SIZE], param2[BUFFER_SIZE];            // Buffers to store the command and its arguments
-    char *cmd_token;                    // Pointer used for tokenizing user input
-    char user_input[BUFFER_SIZE];       // Buffer to store the raw user input
+    int sock_fd;
+    int no_delay = 1;
 
     // Creating a TCP socket
     if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
         perror("Failed to create socket");
-        exit(EXIT_FAILURE);             // Exit the program with a failure status
+        return -1;
+    }
+    if (chunk_rest_socket == sock_fd)
+    {
+        chunk_rest = 0; // Pieces of a chunk left on a closed connection that had the same descriptor
     }
 
+    // A small upload is a command frame, one chunk and the trailer; Nagle would hold the last of these writes until
+    // the server's delayed acknowledgement, 40 ms per file
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
     // Configure the server address structure
     server_info.sin_family = AF_INET;
     server_info.sin_port = htons(PORT);
 
     // Convert IP address from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.4", &server_info.sin_addr) <= 0)
+    if (inet_pton(AF_INET, SERVER_ADDRESS, &server_info.sin_addr) <= 0)
     {
         perror("Invalid server IP address");
-        exit(EXIT_FAILURE);
+        close(sock_fd);
+        return -1;
     }
 
     // Establish connection to the server
     if (connect(sock_fd, (struct sockaddr *)&server_info, sizeof(server_info)) < 0)
     {
         perror("Could not connect to the server");
-        exit(EXIT_FAILURE);
+        close(sock_fd);
+        return -1;
     }
+    return sock_fd;
+}
 
-    // Display usage instructions for various commands
-    printf("Usage for ufile: ufile filename_in_client filepath_in_smain \n");
-    printf("Usage for dfile: dfile filepath_in_smain/filename \n");
-    printf("Usage for rmfile: rmfile filepath_in_smain/filename \n");
-    printf("Usage for dtar command: dtar file_extension (Eg: dtar .c/.pdf/txt) \n");
-    printf("Usage for display command: display filepath/pathname (inside smain) \n");
-    while (1)
-    {
-        // Prompt the user for input
-        printf("\nEnter command: ");
-        if (fgets(user_input, sizeof(user_input), stdin) == NULL)
-        {
-            perror("Not able to read the input");
-            continue;           // Skipping the rest of the loop and prompt the user again
-        }
+// One byte range of a striped download, received on its own connection
+struct stripe
+{
+    const char *file_name;      // File being downloaded, as named in smain
+    int file_descriptor;        // Output file shared by all stripes, written with pwrite()
+    long long offset;           // Where the stripe starts in the file
+    long long length;           // Number of bytes in the stripe
+    long long received;         // Bytes written so far
+    uint32_t checksum;          // CRC32C of the stripe, used to rebuild the whole-file checksum
+    int status;                 // 0 when the stripe arrived intact, -1 on error, TRANSFER_CORRUPT on a checksum mismatch
+};
 
-        // Remove the newline character from the input
-        user_input[strcspn(user_input, "\n")] = 0;
+// Function to request one stripe's range and write its chunks into place, sets stripe->status
+void fetch_stripe(struct stripe *stripe)
+{
+    char range[64];
+    size_t capacity = POOL_MAX_CHUNK;   // One largest-class buffer per stripe: chunks never need a bigger one, and a
+                                        // thread that never walks through the smaller classes maps a single slab
+    char *buffer = NULL;
+    long length = -1;
+    uint32_t trailer;
+    int sock_fd;
 
-        // Tokenize the input string to extract the command and arguments
-        cmd_token = strtok(user_input, " ");
-        if (cmd_token == NULL)
-        {
-            printf("No command entered. Please try again.\n");
-            continue;
-        }
+    stripe->status = -1;
+    stripe->received = 0;
+    stripe->checksum = 0;
+    if ((sock_fd = open_server_connection()) < 0)
+    {
+        return;
+    }
+    snprintf(range, sizeof(range), "%lld %lld", stripe->offset, stripe->length);
+    transmit_command(sock_fd, "drange", stripe->file_name, range);
 
-        // Copy the command and arguments into respective buffers
-        strncpy(cmd, cmd_token, sizeof(cmd));
-        cmd_token = strtok(NULL, " ");
-        if (cmd_token != NULL)
+    if ((buffer = pool_acquire(&capacity)) != NULL)
+    {
+        while ((length = recv_chunk(sock_fd, &buffer, &capacity)) > 0)
         {
-            strncpy(param1, cmd_token, sizeof(param1));
-            cmd_token = strtok(NULL, " ");
-            if (cmd_token != NULL)
+            if (stripe->received + length > stripe->length)
             {
-                // Copy the second argument into the 'param2' buffer
-                strncpy(param2, cmd_token, sizeof(param2));
+                length = -1; // The server sent more than was asked for
+                break;
             }
-            else
+            stripe->checksum = crc32c_update(stripe->checksum, buffer, length);
+            for (long written = 0; written < length; )
             {
-                param2[0] = '\0';       // If no second argument, set 'param2' to an empty string
+                ssize_t result = pwrite(stripe->file_descriptor, buffer + written, length - written,
+                                        stripe->offset + stripe->received + written);
+                if (result <= 0)
+                {
+                    perror("Error writing stripe");
+                    length = -1;
+                    break;
+                }
+                written += result;
             }
+            if (length < 0)
+            {
+                break;
+            }
+            stripe->received += length;
         }
-        else
-        {
-            param1[0] = '\0';           // If no first argument, set 'param1' to an empty string
-            param2[0] = '\0';
-        }
-
-        // Execute the command by calling the appropriate handler
+        pool_release(buffer, capacity);
+    }
+    if (length == 0 && recv_all(sock_fd, &trailer, sizeof(trailer)) == 0)
+    {
+        stripe->status = ntohl(trailer) == stripe->checksum && stripe->received == stripe->length ? 0 : TRANSFER_CORRUPT;
+    }
+    close(sock_fd);
+}
+
+// Function run by one stripe thread; a stripe that failed, for example because Smain was busy, is retried with backoff
+void *receive_stripe(void *argument)
+{
+    struct stripe *stripe = argument;
+
+    for (int attempt = 0; attempt < STRIPE_ATTEMPTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            usleep(STRIPE_RETRY_MS * 1000 << (attempt - 1));
+        }
+        fetch_stripe(stripe);
+        if (stripe->status == 0)
+        {
+            break;
+        }
+    }
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to download a file over several connections at once, each one carrying a disjoint byte range
+// The stripes are written into place with pwrite() and their CRC32Cs combined into the whole-file checksum,
+// which is compared with the checksum stored on the server when the file was uploaded
+// Returns 1 when the download was handled here, or 0 after falling back to a plain dfile for small files
+int striped_download(int sock_fd, const char *file_name, int connections)
+{
+    struct stripe stripes[STRIPE_MAX_CONNECTIONS];
+    pthread_t threads[STRIPE_MAX_CONNECTIONS];
+    int started[STRIPE_MAX_CONNECTIONS];
+    char reply[BUFFER_SIZE], stored_text[16];
+    char current_dir[PATH_MAX], full_path[BUFFER_SIZE * 2], final_filename[BUFFER_SIZE];
+    char directory_name[1024], base_file_name[1024], file_extension[1024];
+    long long size, mtime_sec, stripe_length;
+    long mtime_nsec;
+    uint32_t checksum = 0;
+    struct timespec start;
+    int file_descriptor, failed = 0;
+
+    // Ask for the size and stored checksum first
+    transmit_command(sock_fd, "stat", file_name, "");
+    if (recv_line(sock_fd, reply, sizeof(reply)) != 0)
+    {
+        printf("Server disconnected.\n");
+        return 1;
+    }
+    if (sscanf(reply, "%lld %lld %ld %15s", &size, &mtime_sec, &mtime_nsec, stored_text) != 4)
+    {
+        printf("File %s not found\n", file_name);
+        return 1;
+    }
+
+    // Small files gain nothing from extra connections
+    if (connections > STRIPE_MAX_CONNECTIONS)
+    {
+        connections = STRIPE_MAX_CONNECTIONS;
+    }
+    if (connections > size / STRIPE_MIN_BYTES)
+    {
+        connections = size / STRIPE_MIN_BYTES;
+    }
+    if (connections < 2)
+    {
+        transmit_command(sock_fd, "dfile", file_name, "");
+        download_file(sock_fd, file_name);
+        return 0;
+    }
+
+    // Name the output like a plain download and size it up front so every stripe can write into place
+    getcwd(current_dir, sizeof(current_dir));
+    extract_path_components(file_name, directory_name, base_file_name, file_extension);
+    if (snprintf(full_path, sizeof(full_path), "%s/%s%s", current_dir, base_file_name, file_extension) >= (int)sizeof(final_filename))
+    {
+        fprintf(stderr, "Local path for %s is too long\n", file_name);
+        return 1;
+    }
+    generate_unique_filename(full_path, final_filename);
+    file_descriptor = open(final_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_descriptor < 0 || ftruncate(file_descriptor, size) != 0)
+    {
+        perror("Error opening file for writing");
+        if (file_descriptor >= 0)
+        {
+            close(file_descriptor);
+            unlink(final_filename);
+        }
+        return 1;
+    }
+
+    // Split the file into equal stripes aligned to 64 KB, the last one takes the remainder
+    stripe_length = (size / connections + 65535) & ~65535LL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("Receiving file: %s over %d connections\n", final_filename, connections);
+    for (int i = 0; i < connections; i++)
+    {
+        long long offset = i * stripe_length;
+
+        stripes[i] = (struct stripe){file_name, file_descriptor, offset < size ? offset : size, 0, 0, 0, 0};
+        stripes[i].length = offset + stripe_length < size ? stripe_length : size - stripes[i].offset;
+        started[i] = pthread_create(&threads[i], NULL, receive_stripe, &stripes[i]) == 0;
+        if (!started[i])
+        {
+            receive_stripe(&stripes[i]);
+        }
+    }
+    for (int i = 0; i < connections; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+        if (stripes[i].status != 0)
+        {
+            printf("Stripe %d (%lld bytes at %lld) %s\n", i, stripes[i].length, stripes[i].offset,
+                   stripes[i].status == TRANSFER_CORRUPT ? "failed its checksum" : "failed");
+            failed = 1;
+        }
+        checksum = crc32c_combine(checksum, stripes[i].checksum, stripes[i].length);
+    }
+    close(file_descriptor);
+
+    // Compare the whole file with the checksum recorded at upload time, when the server has one
+    if (!failed && strcmp(stored_text, "-") != 0 && (uint32_t)strtoul(stored_text, NULL, 16) != checksum)
+    {
+        printf("Whole-file checksum %08x does not match the stored %s\n", checksum, stored_text);
+        failed = 1;
+    }
+    if (failed)
+    {
+        printf("Removing incomplete download %s\n", final_filename);
+        unlink(final_filename);
+        return 1;
+    }
+
+    double seconds = seconds_since(&start);
+    printf("File %s downloaded: %lld bytes in %.2f s (%.1f MB/s), checksum %08x%s\n", file_name, size, seconds,
+           seconds > 0 ? size / seconds / (1024 * 1024) : 0.0, checksum,
+           strcmp(stored_text, "-") != 0 ? " verified" : " (no stored checksum, stripes verified individually)");
+    return 1;
+}
+
+// A parallel upload, shared by the threads that send its chunks; each thread takes the next chunk of pending[]
+struct parallel_upload
+{
+    const char *name;           // File name and destination as given to ufile
+    const char *destination;
+    char id[17];                // Upload ID, names the server's chunk table
+    int file_descriptor;        // Local file, read with pread()
+    long long size;
+    long long chunk_size;       // Bytes in every chunk but the last
+    unsigned int chunks;
+    unsigned int *pending;      // Chunks still to send
+    unsigned int pending_count;
+    unsigned int next;          // Index into pending[] of the next chunk to take, advanced atomically
+    uint32_t *checksums;        // CRC32C of every chunk as sent, combined into the whole-file checksum
+    int failed;                 // Chunks that failed all their attempts
+};
+
+// Function to send one chunk of a parallel upload on its own connection, returns 0 once the server stored it
+int send_upload_chunk(struct parallel_upload *upload, unsigned int index)
+{
+    char arguments[BUFFER_SIZE], reply[BUFFER_SIZE];
+    long long offset = (long long)index * upload->chunk_size;
+    long long length = upload->size - offset < upload->chunk_size ? upload->size - offset : upload->chunk_size;
+    int sock_fd, status = -1;
+
+    if ((sock_fd = open_server_connection()) < 0)
+    {
+        return -1;
+    }
+    snprintf(arguments, sizeof(arguments), "%s %s %u", upload->destination, upload->id, index);
+    transmit_command(sock_fd, "uchunk", upload->name, arguments);
+    if (send_range_chunks(sock_fd, upload->file_descriptor, offset, length, NULL, &upload->checksums[index]) == length &&
+        recv_line(sock_fd, reply, sizeof(reply)) == 0 && strstr(reply, "stored") != NULL)
+    {
+        status = 0;
+    }
+    close(sock_fd);
+    return status;
+}
+
+// Function run by one upload thread: takes chunks until none are left, retrying each one with backoff, for example
+// while Smain is busy
+void *send_upload_chunks(void *argument)
+{
+    struct parallel_upload *upload = argument;
+    unsigned int next;
+
+    while ((next = __atomic_fetch_add(&upload->next, 1, __ATOMIC_RELAXED)) < upload->pending_count)
+    {
+        int attempt;
+
+        for (attempt = 0; attempt < STRIPE_ATTEMPTS; attempt++)
+        {
+            if (attempt > 0)
+            {
+                usleep(STRIPE_RETRY_MS * 1000 << (attempt - 1));
+            }
+            if (send_upload_chunk(upload, upload->pending[next]) == 0)
+            {
+                break;
+            }
+        }
+        if (attempt == STRIPE_ATTEMPTS)
+        {
+            __atomic_add_fetch(&upload->failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to upload a file over several connections at once: the file is split into UPLOAD_CHUNK_BYTES chunks that
+// the server writes into place with pwrite(), each verified by its own CRC32C. ucommit has the server combine the
+// chunk checksums into the whole-file checksum, compare it with the one computed here and rename the file into place;
+// chunks it reports missing are sent again before the next commit
+// Returns 1 when the upload was handled here, or 0 after falling back to a plain ufile for small files
+int striped_upload(int sock_fd, const char *file_name, const char *destination, int connections)
+{
+    struct parallel_upload upload = {file_name, destination, "", -1, 0, UPLOAD_CHUNK_BYTES, 0, NULL, 0, 0, NULL, 0};
+    pthread_t threads[STRIPE_MAX_CONNECTIONS];
+    int started[STRIPE_MAX_CONNECTIONS];
+    char arguments[BUFFER_SIZE], reply[BUFFER_SIZE];
+    struct stat file_info;
+    struct timespec start;
+    uint32_t checksum = 0;
+    unsigned int ready;
+
+    if ((upload.file_descriptor = open(file_name, O_RDONLY)) < 0 || fstat(upload.file_descriptor, &file_info) != 0)
+    {
+        if (upload.file_descriptor >= 0)
+        {
+            close(upload.file_descriptor);
+        }
+        transfer_file(sock_fd, file_name, file_name, destination); // Reports the error and keeps the server in step
+        return 0;
+    }
+    upload.size = file_info.st_size;
+
+    // Small files gain nothing from extra connections
+    if (connections > STRIPE_MAX_CONNECTIONS)
+    {
+        connections = STRIPE_MAX_CONNECTIONS;
+    }
+    if (connections > (upload.size + upload.chunk_size - 1) / upload.chunk_size)
+    {
+        connections = (upload.size + upload.chunk_size - 1) / upload.chunk_size;
+    }
+    if (connections < 2)
+    {
+        close(upload.file_descriptor);
+        transfer_file(sock_fd, file_name, file_name, destination);
+        return 0;
+    }
+
+    // Files too big for UPLOAD_MAX_CHUNKS chunks get bigger ones, in whole megabytes
+    if (upload.size / upload.chunk_size >= UPLOAD_MAX_CHUNKS)
+    {
+        upload.chunk_size = ((upload.size / UPLOAD_MAX_CHUNKS >> 20) + 1) << 20;
+    }
+    upload.chunks = (upload.size + upload.chunk_size - 1) / upload.chunk_size;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(upload.id, sizeof(upload.id), "%08x%08lx", (unsigned int)getpid(), (unsigned long)(start.tv_nsec ^ start.tv_sec) & 0xffffffffUL);
+    upload.pending = malloc(upload.chunks * sizeof(*upload.pending));
+    upload.checksums = calloc(upload.chunks, sizeof(*upload.checksums));
+    if (upload.pending == NULL || upload.checksums == NULL)
+    {
+        perror("Out of memory");
+        free(upload.pending);
+        free(upload.checksums);
+        close(upload.file_descriptor);
+        return 1;
+    }
+
+    snprintf(arguments, sizeof(arguments), "%s %lld %lld %s", destination, upload.size, upload.chunk_size, upload.id);
+    transmit_command(sock_fd, "ubegin", file_name, arguments);
+    if (recv_line(sock_fd, reply, sizeof(reply)) != 0 || sscanf(reply, "Ready for %u chunks", &ready) != 1 || ready != upload.chunks)
+    {
+        printf("%s", reply[0] != '\0' ? reply : "Server disconnected.\n");
+        free(upload.pending);
+        free(upload.checksums);
+        close(upload.file_descriptor);
+        return 1;
+    }
+    for (unsigned int i = 0; i < upload.chunks; i++)
+    {
+        upload.pending[i] = i;
+    }
+    upload.pending_count = upload.chunks;
+    printf("Sending file: %s in %u chunks over %d connections\n", file_name, upload.chunks, connections);
+
+    for (int round = 0; round < STRIPE_ATTEMPTS && upload.pending_count > 0; round++)
+    {
+        char *missing;
+
+        upload.next = 0;
+        upload.failed = 0;
+        for (int i = 0; i < connections; i++)
+        {
+            started[i] = pthread_create(&threads[i], NULL, send_upload_chunks, &upload) == 0;
+            if (!started[i])
+            {
+                send_upload_chunks(&upload);
+            }
+        }
+        for (int i = 0; i < connections; i++)
+        {
+            if (started[i])
+            {
+                pthread_join(threads[i], NULL);
+            }
+        }
+        if (upload.failed > 0)
+        {
+            printf("%d chunks of %s failed, the upload stays open on the server\n", upload.failed, file_name);
+            break;
+        }
+
+        // Commit with the whole-file checksum, the server answers with the chunks it is still missing, if any
+        checksum = 0;
+        for (unsigned int i = 0; i < upload.chunks; i++)
+        {
+            long long offset = (long long)i * upload.chunk_size;
+            checksum = crc32c_combine(checksum, upload.checksums[i], upload.size - offset < upload.chunk_size ? upload.size - offset : upload.chunk_size);
+        }
+        snprintf(arguments, sizeof(arguments), "%s %s %08x", destination, upload.id, checksum);
+        transmit_command(sock_fd, "ucommit", file_name, arguments);
+        if (recv_line(sock_fd, reply, sizeof(reply)) != 0)
+        {
+            printf("Server disconnected.\n");
+            break;
+        }
+        upload.pending_count = 0;
+        if ((missing = strstr(reply, "Missing chunks:")) == NULL)
+        {
+            double seconds = seconds_since(&start);
+            printf("%s", reply);
+            if (strstr(reply, "uploaded") != NULL)
+            {
+                printf("%lld bytes in %.2f s (%.1f MB/s), checksum %08x\n", upload.size, seconds,
+                       seconds > 0 ? upload.size / seconds / (1024 * 1024) : 0.0, checksum);
+            }
+            break;
+        }
+        for (char *end, *number = missing + strlen("Missing chunks:"); ; number = end)
+        {
+            unsigned long index = strtoul(number, &end, 10);
+            if (end == number || index >= upload.chunks)
+            {
+                break;
+            }
+            upload.pending[upload.pending_count++] = index;
+        }
+        if (upload.pending_count == 0)
+        {
+            printf("%s", reply);
+            break;
+        }
+        printf("Resending %u chunks the server is missing\n", upload.pending_count);
+    }
+    free(upload.pending);
+    free(upload.checksums);
+    close(upload.file_descriptor);
+    return 1;
+}
+
+// Function to receive the tar archive built by a dtar command into the current directory
+void download_archive(int sock_fd, const char *file_type)
+{
+    char current_dir[1024];
+    char full_path[2048];
+    char final_filename[1024];
+    const char *archive_name;
+    FILE *output_file;
+    long long bytes_read;
+
+    // Name the archive after the requested file type
+    if (strcmp(file_type, ".c") == 0)
+    {
+        archive_name = "c_list.tar";
+    }
+    else if (strcmp(file_type, ".pdf") == 0)
+    {
+        archive_name = "pdf_list.tar";
+    }
+    else if (strcmp(file_type, ".txt") == 0)
+    {
+        archive_name = "txt_list.tar";
+    }
+    else
+    {
+        archive_name = "all_files.tar";
+    }
+
+    if (getcwd(current_dir, sizeof(current_dir)) == NULL)
+    {
+        perror("getcwd error");
+        recv_file_chunks(sock_fd, NULL, NULL);
+        return;
+    }
+    snprintf(full_path, sizeof(full_path), "%s/%s", current_dir, archive_name);
+    generate_unique_filename(full_path, final_filename);
+
+    output_file = fopen(final_filename, "wb");
+    if (output_file == NULL)
+    {
+        perror("Error opening archive for writing");
+        recv_file_chunks(sock_fd, NULL, NULL); // Drain the archive so the connection stays in sync
+        return;
+    }
+
+    bytes_read = recv_file_chunks(sock_fd, output_file, NULL);
+    fclose(output_file);
+
+    // An empty stream means the server refused the request; its status message explains why
+    if (bytes_read == TRANSFER_CORRUPT)
+    {
+        printf("Checksum mismatch, removing corrupt archive %s\n", final_filename);
+        unlink(final_filename);
+    }
+    else if (bytes_read <= 0)
+    {
+        if (bytes_read < 0)
+        {
+            perror("Error receiving archive");
+        }
+        unlink(final_filename);
+    }
+    else
+    {
+        printf("Received archive: %s (%lld bytes)\n", final_filename, bytes_read);
+    }
+}
+
+
+// Function to print a reply streamed as text chunks, such as grep's matching lines, as it arrives
+// The status message with the totals follows the stream
+void receive_text_stream(int sock_fd)
+{
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity);
+    uint32_t checksum = 0, trailer;
+    long length, received = 0;
+
+    while (buffer != NULL && (length = recv_chunk(sock_fd, &buffer, &capacity)) > 0)
+    {
+        fwrite(buffer, 1, length, stdout);
+        checksum = crc32c_update(checksum, buffer, length);
+        received += length;
+    }
+    fflush(stdout);
+    if (buffer == NULL || length < 0 || recv_all(sock_fd, &trailer, sizeof(trailer)) != 0)
+    {
+        printf("The reply was cut off\n");
+    }
+    else if (ntohl(trailer) != checksum && received > 0)
+    {
+        printf("Checksum mismatch, the reply above may be damaged\n");
+    }
+    pool_release(buffer, capacity);
+}
+
+
+// One file of a usync, found in the local directory or listed in the server's manifest
+struct usync_file
+{
+    char *path;                         // Path relative to the synced directory
+    long long size;
+    long long mtime;                    // Local: last modification, server: when the stored copy was written
+    uint32_t checksum;                  // Stored CRC32C of the server's copy, also copied into the matching local entry
+    int has_checksum;                   // The server's copy has a stored checksum
+    int state;                          // USYNC_* state of a local file; for a server file whether a local file matched it
+};
+
+// Files on one side of a usync
+struct usync_list
+{
+    struct usync_file *files;
+    long count;
+    long capacity;
+};
+
+// Local files hashed or uploaded by a usync's threads, each thread takes the next entry with an atomic add
+struct usync_job
+{
+    struct usync_file *files;
+    long *work;                         // Indexes into files of the entries to hash or upload
+    long work_count;
+    long next;
+    const char *local_dir;
+    const char *remote_dir;
+};
+
+// Function to add a file to a usync list, returns the new entry or NULL when out of memory
+struct usync_file *usync_add(struct usync_list *list, char *path, long long size, long long mtime)
+{
+    if (list->count == list->capacity)
+    {
+        long capacity = list->capacity > 0 ? list->capacity * 2 : 1024;
+        struct usync_file *files = realloc(list->files, capacity * sizeof(*files));
+
+        if (files == NULL)
+        {
+            return NULL;
+        }
+        list->files = files;
+        list->capacity = capacity;
+    }
+    memset(&list->files[list->count], 0, sizeof(list->files[0]));
+    list->files[list->count].path = path;
+    list->files[list->count].size = size;
+    list->files[list->count].mtime = mtime;
+    return &list->files[list->count++];
+}
+
+// Function to order usync files by path, for qsort() and bsearch()
+int usync_compare(const void *first, const void *second)
+{
+    return strcmp(((const struct usync_file *)first)->path, ((const struct usync_file *)second)->path);
+}
+
+// Function to collect the .c, .txt and .pdf files below an open local directory, the directory descriptor is consumed
+// Returns -1 when the list could not grow
+int usync_walk(struct usync_list *list, int directory_fd, const char *relative)
+{
+    DIR *directory = fdopendir(directory_fd);
+    struct dirent *entry;
+    int result = 0;
+
+    if (directory == NULL)
+    {
+        close(directory_fd);
+        return 0;
+    }
+    while (result == 0 && (entry = readdir(directory)) != NULL)
+    {
+        const char *extension = strrchr(entry->d_name, '.');
+        char path[BUFFER_SIZE];
+        struct stat file_info;
+        int child_fd;
+
+        // A name with a space cannot be sent in a command frame
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strchr(entry->d_name, ' ') != NULL ||
+            fstatat(dirfd(directory), entry->d_name, &file_info, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+        if (S_ISDIR(file_info.st_mode))
+        {
+            if ((child_fd = openat(dirfd(directory), entry->d_name, O_RDONLY | O_DIRECTORY)) >= 0)
+            {
+                result = usync_walk(list, child_fd, path);
+            }
+        }
+        else if (S_ISREG(file_info.st_mode) && extension != NULL &&
+                 (strcmp(extension, ".c") == 0 || strcmp(extension, ".txt") == 0 || strcmp(extension, ".pdf") == 0))
+        {
+            char *copy = strdup(path);
+
+            if (copy == NULL || usync_add(list, copy, file_info.st_size, file_info.st_mtim.tv_sec) == NULL)
+            {
+                free(copy);
+                result = -1;
+            }
+        }
+    }
+    closedir(directory);
+    return result;
+}
+
+// Function to fetch the server's manifest of a directory as a list sorted by path
+// The entries point into *text, which the caller frees; returns -1 when the manifest is incomplete
+int usync_fetch_manifest(int sock_fd, const char *remote_dir, struct usync_list *remote, char **text)
+{
+    size_t capacity = POOL_MIN_CHUNK, used = 0, allocated = 0;
+    char *buffer = pool_acquire(&capacity);
+    char status[BUFFER_SIZE], *line, *save, *field[3];
+    uint32_t checksum = 0, trailer;
+    long length = -1;
+    int stored = 1;
+
+    *text = NULL;
+    transmit_command(sock_fd, "manifest", remote_dir, "");
+    while (buffer != NULL && (length = recv_chunk(sock_fd, &buffer, &capacity)) > 0)
+    {
+        checksum = crc32c_update(checksum, buffer, length);
+        if (stored && used + length + 1 > allocated)
+        {
+            size_t grown = allocated * 2 > used + length + 1 ? allocated * 2 : used + length + 1;
+            char *bigger = realloc(*text, grown);
+
+            stored = bigger != NULL;
+            *text = bigger != NULL ? bigger : *text;
+            allocated = grown;
+        }
+        if (stored)
+        {
+            memcpy(*text + used, buffer, length);
+            used += length;
+        }
+    }
+    pool_release(buffer, capacity);
+    if (buffer == NULL || length != 0 || recv_all(sock_fd, &trailer, sizeof(trailer)) != 0 ||
+        recv_line(sock_fd, status, sizeof(status)) != 0)
+    {
+        printf("The manifest of %s was cut off\n", remote_dir);
+        return -1;
+    }
+    if (ntohl(trailer) != checksum || !stored)
+    {
+        printf("No usable manifest of %s: %s", remote_dir, stored ? status : "out of memory\n");
+        return -1;
+    }
+    if (*text == NULL)
+    {
+        return 0;                       // An empty or missing directory
+    }
+
+    // Every line is "<path> <size> <mtime> <crc32c or ->", the fields are taken from the end
+    (*text)[used] = '\0';
+    for (line = strtok_r(*text, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save))
+    {
+        struct usync_file *file;
+        int i;
+
+        for (i = 2; i >= 0 && (field[i] = strrchr(line, ' ')) != NULL; i--)
+        {
+            *field[i]++ = '\0';
+        }
+        if (i >= 0 || (file = usync_add(remote, line, atoll(field[0]), atoll(field[1]))) == NULL)
+        {
+            continue;
+        }
+        file->has_checksum = strcmp(field[2], "-") != 0;
+        file->checksum = strtoul(field[2], NULL, 16);
+    }
+    qsort(remote->files, remote->count, sizeof(remote->files[0]), usync_compare);
+    return 0;
+}
+
+// Function run by the threads hashing local files whose size matches the server's copy
+void *usync_hash_thread(void *argument)
+{
+    struct usync_job *job = argument;
+    long index;
+
+    while ((index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->work_count)
+    {
+        struct usync_file *file = &job->files[job->work[index]];
+        char path[PATH_MAX];
+        uint32_t checksum = 0;
+        void *data = NULL;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", job->local_dir, file->path);
+        file->state = USYNC_CHANGED;    // A file that cannot be read is left to the upload to report
+        if ((fd = open(path, O_RDONLY)) < 0)
+        {
+            continue;
+        }
+        if (file->size > 0 && (data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+        {
+            madvise(data, file->size, MADV_SEQUENTIAL);
+            checksum = crc32c_update(0, data, file->size);
+            munmap(data, file->size);
+        }
+        if (data != MAP_FAILED && checksum == file->checksum)
+        {
+            file->state = USYNC_SAME;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// Function to send one local file of a usync as ufile, or as dufile with only the changes for a big changed .c/.txt file
+void usync_send_file(int sock_fd, const struct usync_job *job, const struct usync_file *file, int delta)
+{
+    char local_path[PATH_MAX], remote_dir[BUFFER_SIZE];
+    const char *name = strrchr(file->path, '/');
+
+    snprintf(local_path, sizeof(local_path), "%s/%s", job->local_dir, file->path);
+    if (name == NULL)
+    {
+        snprintf(remote_dir, sizeof(remote_dir), "%s", job->remote_dir);
+        name = file->path;
+    }
+    else
+    {
+        snprintf(remote_dir, sizeof(remote_dir), "%s/%.*s", job->remote_dir, (int)(name - file->path), file->path);
+        name++;
+    }
+    if (delta)
+    {
+        transmit_command(sock_fd, "dufile", name, remote_dir);
+        delta_upload(sock_fd, local_path);
+    }
+    else
+    {
+        transfer_file(sock_fd, local_path, name, remote_dir);
+    }
+}
+
+// Function to read the reply to one usync upload, returns -1 when the connection is gone
+// A busy server leaves the file as it was so it is sent again after the parallel pass
+int usync_collect_reply(int sock_fd, struct usync_file *file, long *retry_ms)
+{
+    char reply[BUFFER_SIZE];
+
+    if (recv_line(sock_fd, reply, sizeof(reply)) != 0)
+    {
+        return -1;
+    }
+    if (sscanf(reply, "Server busy, retry after %ld ms", retry_ms) == 1)
+    {
+        return 0;
+    }
+    file->state = strncmp(reply, "File ", strlen("File ")) == 0 && strstr(reply, " uploaded") != NULL ? USYNC_UPLOADED : USYNC_FAILED;
+    if (file->state == USYNC_FAILED)
+    {
+        printf("%s: %s", file->path, reply);
+    }
+    return 0;
+}
+
+// Function run by the upload threads of a usync, each on its own connection
+// Every connection keeps one reply in flight: the next file is sent before the reply to the previous one is read.
+// Delta uploads wait for the signatures of the server's copy, so the reply in flight is read before one starts.
+void *usync_upload_thread(void *argument)
+{
+    struct usync_job *job = argument;
+    struct usync_file *pending = NULL;
+    long index, retry_ms;
+    int sock_fd = open_server_connection();
+
+    while (sock_fd >= 0 && (index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->work_count)
+    {
+        struct usync_file *file = &job->files[job->work[index]];
+        const char *extension = strrchr(file->path, '.');
+        int delta = file->state == USYNC_CHANGED && file->size >= DELTA_MIN_BYTES &&
+                    (strcmp(extension, ".c") == 0 || strcmp(extension, ".txt") == 0);
+
+        if (pending != NULL && delta && usync_collect_reply(sock_fd, pending, &retry_ms) != 0)
+        {
+            break;
+        }
+        pending = delta ? NULL : pending;
+        usync_send_file(sock_fd, job, file, delta);
+        if (pending != NULL && usync_collect_reply(sock_fd, pending, &retry_ms) != 0)
+        {
+            break;
+        }
+        pending = file;
+    }
+    if (sock_fd >= 0)
+    {
+        if (pending != NULL)
+        {
+            usync_collect_reply(sock_fd, pending, &retry_ms);
+        }
+        close(sock_fd);
+    }
+    pool_destroy(); // The thread's buffers go away with it
+    return NULL;
+}
+
+// Function to run the threads of a usync job, falling back to the calling thread when none can be started
+void usync_run(struct usync_job *job, void *(*routine)(void *), int thread_count)
+{
+    pthread_t threads[USYNC_MAX_THREADS];
+    int started = 0;
+
+    job->next = 0;
+    while (started < thread_count && started < USYNC_MAX_THREADS && pthread_create(&threads[started], NULL, routine, job) == 0)
+    {
+        started++;
+    }
+    if (started == 0)
+    {
+        routine(job);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Function to upload the job's files over several pipelined connections, then send whatever a busy server or a lost
+// connection left over again on the main connection; returns the number of files uploaded
+long usync_upload(int sock_fd, struct usync_job *job, long *failed, long long *bytes)
+{
+    long uploaded = 0, retry_ms;
+
+    usync_run(job, usync_upload_thread, job->work_count < USYNC_CONNECTIONS ? (int)job->work_count : USYNC_CONNECTIONS);
+    for (long i = 0; i < job->work_count; i++)
+    {
+        struct usync_file *file = &job->files[job->work[i]];
+
+        for (int attempt = 0; attempt < STRIPE_ATTEMPTS && (file->state == USYNC_NEW || file->state == USYNC_CHANGED); attempt++)
+        {
+            retry_ms = 0;
+            usync_send_file(sock_fd, job, file, 0);
+            if (usync_collect_reply(sock_fd, file, &retry_ms) != 0)
+            {
+                break;
+            }
+            usleep(retry_ms * 1000);
+        }
+        *bytes += file->state == USYNC_UPLOADED ? file->size : 0;
+        uploaded += file->state == USYNC_UPLOADED;
+        *failed += file->state != USYNC_UPLOADED;
+    }
+    return uploaded;
+}
+
+// Function to delete the server's files of a list that no local file matched with batched rmfile commands,
+// with -r when they are directories; returns the number of files removed
+long usync_remove_extras(int sock_fd, const struct usync_list *remote, const char *remote_dir, int recursive, long *failed)
+{
+    char batch[BUFFER_SIZE], reply[BUFFER_SIZE];
+    long removed = 0;
+    size_t used = 0;
+    int count = 0, received, deleted, not_deleted;
+
+    for (long i = 0; i <= remote->count; i++)
+    {
+        const struct usync_file *file = i < remote->count ? &remote->files[i] : NULL;
+        int length = file != NULL ? (int)(strlen(remote_dir) + strlen(file->path) + 2) : 0;
+
+        if (file != NULL && (file->state != 0 || strpbrk(file->path, " *?[") != NULL))
+        {
+            *failed += file->state == 0;            // Names rmfile would take apart or read as a glob are left alone
+            continue;
+        }
+        if (count > 0 && (file == NULL || used + length >= sizeof(batch) - 16))
+        {
+            transmit_command(sock_fd, "rmfile", batch, "");
+            received = recv(sock_fd, reply, sizeof(reply) - 1, 0);
+            reply[received > 0 ? received : 0] = '\0';
+            if (sscanf(reply, "Removed %d files, %d failed", &deleted, &not_deleted) == 2)
+            {
+                removed += deleted;
+                *failed += not_deleted;
+            }
+            else
+            {
+                removed += strstr(reply, "deleted successfully") != NULL;
+                *failed += strstr(reply, "deleted successfully") == NULL ? count : 0;
+            }
+            used = 0;
+            count = 0;
+        }
+        if (file != NULL)
+        {
+            used += snprintf(batch + used, sizeof(batch) - used, "%s%s/%s", count > 0 ? " " : recursive ? "-r " : "",
+                             remote_dir, file->path);
+            count++;
+        }
+    }
+    return removed;
+}
+
+// Function to handle "usync <localdir> <smaindir> [-d] [-c]": make the directory on the server match the local one
+// The server's manifest of the whole tree arrives in one stream and is compared with a local walk; a file with the same
+// size that was not modified since the server's copy was written is taken as unchanged, -c hashes every file of the
+// same size instead. Only new and changed files are uploaded, over several pipelined connections; -d also deletes
+// the server's files that are not in the local directory.
+int usync(int sock_fd, char *arguments)
+{
+    struct usync_list local = {NULL, 0, 0}, remote = {NULL, 0, 0};
+    struct usync_job job;
+    struct timespec started;
+    char *local_dir = NULL, *remote_dir = NULL, *save, *token, *manifest_text = NULL;
+    long count[USYNC_FAILED + 1] = {0}, removed = 0, remove_failed = 0;
+    long long bytes = 0;
+    int delete_extras = 0, always_hash = 0, directory_fd, hash_threads;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (token = strtok_r(arguments, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-d") == 0 || strcmp(token, "-c") == 0)
+        {
+            delete_extras |= token[1] == 'd';
+            always_hash |= token[1] == 'c';
+        }
+        else if (local_dir == NULL)
+        {
+            local_dir = token;
+        }
+        else if (remote_dir == NULL)
+        {
+            remote_dir = token;
+        }
+    }
+    if (remote_dir == NULL || strncmp(remote_dir, "~smain", strlen("~smain")) != 0)
+    {
+        printf("Usage: usync localdir ~smain/dir [-d] [-c]\n");
+        return 1;
+    }
+    for (size_t length = strlen(remote_dir); length > strlen("~smain") && remote_dir[length - 1] == '/'; length--)
+    {
+        remote_dir[length - 1] = '\0';
+    }
+    if ((directory_fd = open(local_dir, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        perror(local_dir);
+        return 1;
+    }
+    if (usync_walk(&local, directory_fd, "") != 0)
+    {
+        printf("Out of memory while listing %s\n", local_dir);
+    }
+    else if (usync_fetch_manifest(sock_fd, remote_dir, &remote, &manifest_text) == 0)
+    {
+        // Compare every local file with the server's copy, hashing only where size and time cannot decide
+        memset(&job, 0, sizeof(job));
+        job.files = local.files;
+        job.local_dir = local_dir;
+        job.remote_dir = remote_dir;
+        job.work = malloc((local.count + 1) * sizeof(long));
+        for (long i = 0; job.work != NULL && i < local.count; i++)
+        {
+            struct usync_file *file = &local.files[i];
+            struct usync_file *copy = bsearch(file, remote.files, remote.count, sizeof(remote.files[0]), usync_compare);
+
+            file->state = copy == NULL ? USYNC_NEW : copy->size != file->size || !copy->has_checksum ? USYNC_CHANGED :
+                          !always_hash && file->mtime < copy->mtime ? USYNC_SAME : USYNC_CHECK;
+            if (copy != NULL)
+            {
+                copy->state = 1;
+                file->checksum = copy->checksum;
+            }
+            if (file->state == USYNC_CHECK)
+            {
+                job.work[job.work_count++] = i;
+            }
+        }
+        hash_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? (int)sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        usync_run(&job, usync_hash_thread, job.work_count < hash_threads ? (int)job.work_count : hash_threads);
+
+        // Upload the new and changed files, then send whatever a busy server or a lost connection left over again here
+        job.work_count = 0;
+        for (long i = 0; job.work != NULL && i < local.count; i++)
+        {
+            count[local.files[i].state]++;
+            if (local.files[i].state == USYNC_NEW || local.files[i].state == USYNC_CHANGED)
+            {
+                job.work[job.work_count++] = i;
+            }
+        }
+        count[USYNC_UPLOADED] = usync_upload(sock_fd, &job, &count[USYNC_FAILED], &bytes);
+        free(job.work);
+
+        if (delete_extras)
+        {
+            removed = usync_remove_extras(sock_fd, &remote, remote_dir, 0, &remove_failed);
+        }
+        printf("usync %s -> %s: %ld files, %ld new, %ld changed, %ld unchanged; %ld uploaded (%lld bytes), %ld failed",
+               local_dir, remote_dir, local.count, count[USYNC_NEW], count[USYNC_CHANGED], count[USYNC_SAME],
+               count[USYNC_UPLOADED], bytes, count[USYNC_FAILED]);
+        if (delete_extras)
+        {
+            printf("; %ld removed, %ld not removed", removed, remove_failed);
+        }
+        printf(" in %.2f s\n", seconds_since(&started));
+    }
+
+    for (long i = 0; i < local.count; i++)
+    {
+        free(local.files[i].path);
+    }
+    free(local.files);
+    free(remote.files);
+    free(manifest_text);
+    return 1;
+}
+
+
+// Local tree followed by a watch, and the changes seen since the last batch was sent
+struct watch_state
+{
+    int inotify_fd;
+    const char *local_dir;
+    char **directories;                 // Path of every watched directory relative to local_dir, indexed by watch descriptor
+    int directory_count;                // Entries of directories, the highest watch descriptor plus one
+    struct usync_list changes;          // Changed paths in the order seen; state is USYNC_NEW, WATCH_REMOVE or WATCH_REMOVE_DIR
+    long sequence;                      // Order of the changes, kept in their mtime field so the last change of a path wins
+    int remove;                         // Deletions are sent too (-d)
+};
+
+// Function to remember a changed path until the next batch
+void watch_record(struct watch_state *watch, const char *path, int state)
+{
+    char *copy = strdup(path);
+    struct usync_file *file;
+
+    if (copy == NULL || (file = usync_add(&watch->changes, copy, 0, watch->sequence++)) == NULL)
+    {
+        free(copy);
+        return;
+    }
+    file->state = state;
+}
+
+// Function to watch a local directory and every directory below it, recording the files already there as changed
+// Files can appear in a new directory before its watch exists, as when a tarball is extracted
+void watch_add_tree(struct watch_state *watch, const char *relative, int record_files)
+{
+    char path[PATH_MAX], child[BUFFER_SIZE];
+    struct dirent *entry;
+    DIR *directory;
+    int wd;
+
+    snprintf(path, sizeof(path), "%s%s%s", watch->local_dir, *relative ? "/" : "", relative);
+    if ((wd = inotify_add_watch(watch->inotify_fd, path, WATCH_EVENTS)) < 0)
+    {
+        perror(path);
+        return;
+    }
+    if (wd >= watch->directory_count)
+    {
+        char **grown = realloc(watch->directories, (wd + 64) * sizeof(char *));
+
+        if (grown == NULL)
+        {
+            inotify_rm_watch(watch->inotify_fd, wd);
+            return;
+        }
+        memset(grown + watch->directory_count, 0, (wd + 64 - watch->directory_count) * sizeof(char *));
+        watch->directories = grown;
+        watch->directory_count = wd + 64;
+    }
+    free(watch->directories[wd]);       // A directory moved inside the tree keeps its watch under a new name
+    watch->directories[wd] = strdup(relative);
+
+    if ((directory = opendir(path)) == NULL)
+    {
+        return;
+    }
+    while ((entry = readdir(directory)) != NULL)
+    {
+        const char *extension = strrchr(entry->d_name, '.');
+        struct stat file_info;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strchr(entry->d_name, ' ') != NULL ||
+            fstatat(dirfd(directory), entry->d_name, &file_info, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            continue;
+        }
+        snprintf(child, sizeof(child), "%s%s%s", relative, *relative ? "/" : "", entry->d_name);
+        if (S_ISDIR(file_info.st_mode))
+        {
+            watch_add_tree(watch, child, record_files);
+        }
+        else if (record_files && S_ISREG(file_info.st_mode) && extension != NULL &&
+                 (strcmp(extension, ".c") == 0 || strcmp(extension, ".txt") == 0 || strcmp(extension, ".pdf") == 0))
+        {
+            watch_record(watch, child, USYNC_NEW);
+        }
+    }
+    closedir(directory);
+}
+
+// Function to stop watching a directory that left the tree and everything below it
+void watch_drop_tree(struct watch_state *watch, const char *relative)
+{
+    size_t length = strlen(relative);
+
+    for (int wd = 0; wd < watch->directory_count; wd++)
+    {
+        if (watch->directories[wd] != NULL && strncmp(watch->directories[wd], relative, length) == 0 &&
+            (watch->directories[wd][length] == '\0' || watch->directories[wd][length] == '/'))
+        {
+            inotify_rm_watch(watch->inotify_fd, wd);
+            free(watch->directories[wd]);
+            watch->directories[wd] = NULL;
+        }
+    }
+}
+
+// Function to turn one inotify event into recorded changes, returns -1 when the watched tree itself is gone
+int watch_event(struct watch_state *watch, const struct inotify_event *event)
+{
+    const char *directory = event->wd < watch->directory_count ? watch->directories[event->wd] : NULL;
+    const char *extension = event->len > 0 ? strrchr(event->name, '.') : NULL;
+    char path[BUFFER_SIZE];
+
+    if (event->mask & IN_IGNORED)
+    {
+        int root = directory != NULL && *directory == '\0';
+
+        if (directory != NULL)
+        {
+            free(watch->directories[event->wd]);
+            watch->directories[event->wd] = NULL;
+        }
+        return root ? -1 : 0;
+    }
+    if (directory == NULL || event->len == 0 || strchr(event->name, ' ') != NULL)
+    {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s%s%s", directory, *directory ? "/" : "", event->name);
+    if (event->mask & IN_ISDIR)
+    {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            watch_add_tree(watch, path, 1);
+        }
+        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            watch_drop_tree(watch, path);
+            if (watch->remove)
+            {
+                watch_record(watch, path, WATCH_REMOVE_DIR);
+            }
+        }
+        return 0;
+    }
+    if (extension == NULL || (strcmp(extension, ".c") != 0 && strcmp(extension, ".txt") != 0 && strcmp(extension, ".pdf") != 0))
+    {
+        return 0;                       // Editor swap files, backups and other types are not stored
+    }
+    if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+    {
+        watch_record(watch, path, USYNC_NEW);
+    }
+    else if (event->mask & (IN_DELETE | IN_MOVED_FROM) && watch->remove)
+    {
+        watch_record(watch, path, WATCH_REMOVE);
+    }
+    return 0;
+}
+
+// Function to order recorded changes by path and, for one path, by when they were seen
+int watch_compare(const void *first, const void *second)
+{
+    const struct usync_file *a = first, *b = second;
+    int order = strcmp(a->path, b->path);
+
+    return order != 0 ? order : (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+// Function to send one batch of changes: deletions first as batched rmfile commands, then the uploads over the
+// pipelined usync connections. Only the last change of every path counts, so a save storm becomes one upload.
+void watch_flush(int sock_fd, struct watch_state *watch, const char *remote_dir)
+{
+    struct usync_list uploads = {NULL, 0, 0}, removals = {NULL, 0, 0}, directories = {NULL, 0, 0};
+    struct usync_job job;
+    struct timespec started;
+    long uploaded = 0, removed = 0, failed = 0;
+    long long bytes = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    qsort(watch->changes.files, watch->changes.count, sizeof(watch->changes.files[0]), watch_compare);
+    for (long i = 0; i < watch->changes.count; i++)
+    {
+        struct usync_file *change = &watch->changes.files[i];
+        char path[PATH_MAX];
+        struct stat file_info;
+
+        if (i + 1 < watch->changes.count && strcmp(change->path, watch->changes.files[i + 1].path) == 0)
+        {
+            continue;                   // A later change of the same path replaces this one
+        }
+        snprintf(path, sizeof(path), "%s/%s", watch->local_dir, change->path);
+        if (change->state == WATCH_REMOVE || change->state == WATCH_REMOVE_DIR)
+        {
+            int below_removed = 0;
+
+            // Parents sort before their contents, and rmfile -r on a parent already takes everything below it
+            for (long j = 0; j < directories.count && !below_removed; j++)
+            {
+                size_t length = strlen(directories.files[j].path);
+
+                below_removed = strncmp(change->path, directories.files[j].path, length) == 0 && change->path[length] == '/';
+            }
+            if (!below_removed)
+            {
+                usync_add(change->state == WATCH_REMOVE ? &removals : &directories, change->path, 0, 0);
+            }
+        }
+        else if (stat(path, &file_info) == 0 && S_ISREG(file_info.st_mode))
+        {
+            struct usync_file *file = usync_add(&uploads, change->path, file_info.st_size, file_info.st_mtim.tv_sec);
+
+            if (file != NULL)
+            {
+                file->state = USYNC_NEW;
+            }
+        }
+    }
+
+    removed += usync_remove_extras(sock_fd, &directories, remote_dir, 1, &failed);
+    removed += usync_remove_extras(sock_fd, &removals, remote_dir, 0, &failed);
+    memset(&job, 0, sizeof(job));
+    job.files = uploads.files;
+    job.local_dir = watch->local_dir;
+    job.remote_dir = remote_dir;
+    job.work = malloc((uploads.count + 1) * sizeof(long));
+    for (long i = 0; job.work != NULL && i < uploads.count; i++)
+    {
+        job.work[job.work_count++] = i;
+    }
+    uploaded = usync_upload(sock_fd, &job, &failed, &bytes);
+    printf("watch: %ld uploaded (%lld bytes), %ld removed, %ld failed in %.0f ms\n", uploaded, bytes, removed, failed,
+           seconds_since(&started) * 1000);
+    fflush(stdout);
+
+    free(job.work);
+    free(uploads.files);
+    free(removals.files);
+    free(directories.files);
+    for (long i = 0; i < watch->changes.count; i++)
+    {
+        free(watch->changes.files[i].path);
+    }
+    watch->changes.count = 0;
+}
+
+// Function to handle "watch <localdir> <smaindir> [-d]": sync the tree once with usync, then follow it with inotify
+// and send every change as it happens until a line is entered. Events are collected until the tree has been quiet
+// for WATCH_DEBOUNCE_MS, or for at most WATCH_MAX_DELAY_MS, and sent as one batch; an idle watch sleeps in poll().
+int watch_directory(int sock_fd, char *arguments)
+{
+    struct watch_state watch;
+    struct pollfd events[2];
+    struct timespec first_change;
+    char parsed[BUFFER_SIZE], sync_arguments[BUFFER_SIZE], *save, *token, *remote_dir = NULL, line[BUFFER_SIZE];
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int gone = 0;
+
+    memset(&watch, 0, sizeof(watch));
+    snprintf(parsed, sizeof(parsed), "%s", arguments);
+    for (token = strtok_r(parsed, " ", &save); token != NULL; token = strtok_r(NULL, " ", &save))
+    {
+        if (strcmp(token, "-d") == 0)
+        {
+            watch.remove = 1;
+        }
+        else if (watch.local_dir == NULL)
+        {
+            watch.local_dir = token;
+        }
+        else if (remote_dir == NULL)
+        {
+            remote_dir = token;
+        }
+    }
+    if (remote_dir == NULL || strncmp(remote_dir, "~smain", strlen("~smain")) != 0)
+    {
+        printf("Usage: watch localdir ~smain/dir [-d]\n");
+        return 1;
+    }
+    for (size_t length = strlen(remote_dir); length > strlen("~smain") && remote_dir[length - 1] == '/'; length--)
+    {
+        remote_dir[length - 1] = '\0';
+    }
+
+    // The watches go in before the first sync, so nothing changed during it is missed
+    if ((watch.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+        perror("inotify_init1");
+        return 1;
+    }
+    watch_add_tree(&watch, "", 0);
+    if (watch.directory_count == 0)
+    {
+        close(watch.inotify_fd);
+        return 1;
+    }
+    snprintf(sync_arguments, sizeof(sync_arguments), "%s", arguments);
+    usync(sock_fd, sync_arguments);
+    printf("Watching %s for changes, press Enter to stop\n", watch.local_dir);
+    fflush(stdout);
+
+    events[0].fd = watch.inotify_fd;
+    events[0].events = POLLIN;
+    events[1].fd = STDIN_FILENO;
+    events[1].events = POLLIN;
+    while (!gone)
+    {
+        long waited = watch.changes.count > 0 ? (long)(seconds_since(&first_change) * 1000) : 0;
+        int timeout = watch.changes.count == 0 ? -1 : waited >= WATCH_MAX_DELAY_MS ? 0 :
+                      WATCH_MAX_DELAY_MS - waited < WATCH_DEBOUNCE_MS ? (int)(WATCH_MAX_DELAY_MS - waited) : WATCH_DEBOUNCE_MS;
+        int ready = poll(events, 2, timeout);
+        long pending = watch.changes.count;
+        ssize_t length;
+
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (ready > 0 && events[1].revents)
+        {
+            if (fgets(line, sizeof(line), stdin) == NULL || line[0] == '\n')
+            {
+                break;
+            }
+        }
+        while (ready > 0 && (length = read(watch.inotify_fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char *next = buffer; next < buffer + length; next += sizeof(struct inotify_event) + ((struct inotify_event *)next)->len)
+            {
+                const struct inotify_event *event = (const struct inotify_event *)next;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    printf("Too many changes at once, syncing the whole tree again\n");
+                    watch_flush(sock_fd, &watch, remote_dir);
+                    snprintf(sync_arguments, sizeof(sync_arguments), "%s", arguments);
+                    usync(sock_fd, sync_arguments);
+                }
+                else if (watch_event(&watch, event) != 0)
+                {
+                    printf("%s is gone, watch stopped\n", watch.local_dir);
+                    gone = 1;
+                }
+            }
+        }
+        if (pending == 0 && watch.changes.count > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &first_change);
+        }
+        if (watch.changes.count > 0 && (ready == 0 || seconds_since(&first_change) * 1000 >= WATCH_MAX_DELAY_MS))
+        {
+            watch_flush(sock_fd, &watch, remote_dir);
+        }
+    }
+
+    if (watch.changes.count > 0)
+    {
+        watch_flush(sock_fd, &watch, remote_dir);
+    }
+    for (int wd = 0; wd < watch.directory_count; wd++)
+    {
+        free(watch.directories[wd]);
+    }
+    free(watch.directories);
+    free(watch.changes.files);
+    close(watch.inotify_fd);
+    return 1;
+}
+
+// Function to follow the server's change feed below a path, printing every change as it arrives until a line is entered
+// The line sends "unsubscribe", after which the server ends the stream and sends its status message
+int subscribe_changes(int sock_fd, const char *path)
+{
+    struct pollfd events[2] = {{sock_fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+    size_t capacity = POOL_MIN_CHUNK;
+    char *buffer = pool_acquire(&capacity), line[BUFFER_SIZE];
+    uint32_t checksum = 0, trailer;
+    long length = 1, received = 0;
+    int unsubscribed = 0;
+
+    transmit_command(sock_fd, "subscribe", path, "");
+    printf("Following changes below %s, press Enter to stop\n", path);
+    fflush(stdout);
+    while (buffer != NULL && length > 0)
+    {
+        if (poll(events, unsubscribed ? 1 : 2, -1) < 0)
+        {
+            length = errno == EINTR ? length : -1;
+            continue;
+        }
+        if (!unsubscribed && events[1].revents)
+        {
+            // Any line ends the subscription, and so does the end of the input
+            if (fgets(line, sizeof(line), stdin) == NULL && !feof(stdin))
+            {
+                continue;               // Interrupted read, the line is still to come
+            }
+            transmit_command(sock_fd, "unsubscribe", "", "");
+            unsubscribed = 1;
+        }
+        if (events[0].revents && (length = recv_chunk(sock_fd, &buffer, &capacity)) > 0)
+        {
+            fwrite(buffer, 1, length, stdout);
+            fflush(stdout);
+            checksum = crc32c_update(checksum, buffer, length);
+            received += length;
+        }
+    }
+    pool_release(buffer, capacity);
+    if (buffer == NULL || length < 0 || recv_all(sock_fd, &trailer, sizeof(trailer)) != 0)
+    {
+        printf("The change feed was cut off\n");
+        return 1;
+    }
+    if (ntohl(trailer) != checksum && received > 0)
+    {
+        printf("Checksum mismatch, the changes above may be damaged\n");
+    }
+    return 0;
+}
+
+int execute_command(int sock_fd, const char *cmd, const char *arg1, const char *arg2)
+{
+    // Handle the "ufile" command: upload a file from the client, over several connections when asked to
+    // .c and .txt files the server may already have a copy of only send what changed, as "dufile"
+    if (strcmp(cmd, "ufile") == 0)
+    {
+        struct stat file_info;
+        char destination[BUFFER_SIZE];
+        int connections = 1;
+
+        // "ufile <file> <destination> <connections>" sends the chunks of one big file over several connections at once
+        if (sscanf(arg2, "%1023s %d", destination, &connections) == 2 && connections > 1)
+        {
+            return striped_upload(sock_fd, arg1, destination, connections);
+        }
+        if ((strstr(arg1, ".c") != NULL || strstr(arg1, ".txt") != NULL) && strstr(arg1, ".pdf") == NULL &&
+            stat(arg1, &file_info) == 0 && file_info.st_size >= DELTA_MIN_BYTES)
+        {
+            transmit_command(sock_fd, "dufile", arg1, arg2);
+            delta_upload(sock_fd, arg1);
+        }
+        else
+        {
+            transfer_file(sock_fd, arg1, arg1, arg2);
+        }
+    }
+    // Handle the "dfile" command: download a file to the client, striped over several connections when asked to
+    else if (strcmp(cmd, "dfile") == 0)
+    {
+        if (atoi(arg2) > 1)
+        {
+            return striped_download(sock_fd, arg1, atoi(arg2));
+        }
+        transmit_command(sock_fd, cmd, arg1, arg2);
+        download_file(sock_fd, arg1);
+    }
+    // Handle the "rmfile" command: remove files, globs or with -r directories
+    else if (strcmp(cmd, "rmfile") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+    }
+    // Handle the "mvfile" and "cpfile" commands: move or copy files, globs or with -r directories inside the servers
+    else if (strcmp(cmd, "mvfile") == 0 || strcmp(cmd, "cpfile") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+    }
+    // Handle the "grep" command: search the stored .c and .txt files on the servers
+    else if (strcmp(cmd, "grep") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+        receive_text_stream(sock_fd);
+    }
+    // Handle the "stat" command: size, modification time and checksum of stored files without downloading them
+    // One file is answered with a single line, several with a listing of "<file> <size> <mtime> <crc32c>" lines
+    else if (strcmp(cmd, "stat") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+        if (strchr(arg1, ' ') != NULL)
+        {
+            receive_text_stream(sock_fd);
+        }
+    }
+    // Handle the "usync" command: make a server directory match a local one, sending only new and changed files
+    else if (strcmp(cmd, "usync") == 0)
+    {
+        char arguments[BUFFER_SIZE];
+
+        snprintf(arguments, sizeof(arguments), "%s", arg1);
+        return usync(sock_fd, arguments);
+    }
+    // Handle the "watch" command: keep a server directory in step with a local one until a line is entered
+    else if (strcmp(cmd, "watch") == 0)
+    {
+        char arguments[BUFFER_SIZE];
+
+        snprintf(arguments, sizeof(arguments), "%s", arg1);
+        return watch_directory(sock_fd, arguments);
+    }
+    // Handle the "subscribe" command: print changes below a server path as they happen until Enter is pressed
+    else if (strcmp(cmd, "subscribe") == 0)
+    {
+        return subscribe_changes(sock_fd, arg1);
+    }
+    // Handle the "dtar" command: download a tar archive of one file type or of all stores
+    else if (strcmp(cmd, "dtar") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+        download_archive(sock_fd, arg1);
+    }
+    // Handle the "display" command
+    else if (strcmp(cmd, "display") == 0)
+    {
+        transmit_command(sock_fd, cmd, arg1, arg2);
+    }
+    // Handle unknown commands
+    else
+    {
+        printf("Invalid command received: %s\n", cmd);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Function to stream the benchmark file over a socket pair once, with or without the CRC32C work, and return the time
+double time_loopback_stream(int file_descriptor, int with_checksum)
+{
+    struct timespec start;
+    int pair[2];
+    pid_t receiver;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        perror("socketpair failed");
+        return -1;
+    }
+    lseek(file_descriptor, 0, SEEK_SET);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    fflush(stdout); // Do not let the receiver inherit unprinted output
+    if ((receiver = fork()) == 0)
+    {
+        // Receiver: the normal receive path, or the same chunk loop without checksumming
+        close(pair[0]);
+        if (with_checksum)
+        {
+            recv_file_chunks(pair[1], NULL, NULL);
+        }
+        else
+        {
+            size_t capacity = POOL_MIN_CHUNK;
+            char *buffer = pool_acquire(&capacity);
+            uint32_t trailer;
+            while (recv_chunk(pair[1], &buffer, &capacity) > 0)
+            {
+            }
+            recv_all(pair[1], &trailer, sizeof(trailer));
+        }
+        exit(0);
+    }
+    close(pair[1]);
+    if (with_checksum)
+    {
+        send_file_chunks(pair[0], file_descriptor);
+    }
+    else
+    {
+        struct chunk_sizer sizer;
+        ssize_t bytes_read;
+        chunk_sizer_init(&sizer);
+        while ((bytes_read = read(file_descriptor, sizer.buffer, sizer.size)) > 0)
+        {
+            send_chunk(pair[0], sizer.buffer, bytes_read);
+            chunk_sizer_update(&sizer, bytes_read);
+        }
+        chunk_sizer_done(&sizer);
+        send_end_of_file(pair[0], 0);
+    }
+    close(pair[0]);
+    waitpid(receiver, NULL, 0);
+    return seconds_since(&start);
+}
+
+// Function to fill the benchmark file with megabytes copies of block, returns 0 or -1
+int fill_bench_file(int file_descriptor, const unsigned char *block, size_t block_size, long megabytes)
+{
+    for (long i = 0; i < megabytes; i++)
+    {
+        if (write(file_descriptor, block, block_size) != (ssize_t)block_size)
+        {
+            perror("Failed to write benchmark file");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Function to measure the CRC32C kernels and what checksumming costs a loopback transfer
+// Run as: ./client24s --bench-checksum [megabytes]
+int run_checksum_benchmark(long megabytes)
+{
+    size_t block_size = POOL_MAX_CHUNK;
+    unsigned char *block = malloc(block_size);
+    char temp_path[] = "/tmp/datasync-bench-XXXXXX";
+    struct timespec start;
+    volatile uint32_t sink = 0;
+    double elapsed;
+    int file_descriptor;
+
+    if (block == NULL || (file_descriptor = mkstemp(temp_path)) < 0)
+    {
+        perror("Benchmark setup failed");
+        free(block);
+        return -1;
+    }
+    unlink(temp_path);
+    for (size_t i = 0; i < block_size; i++)
+    {
+        block[i] = (unsigned char)rand();
+    }
+
+    // Raw kernel throughput
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < megabytes; i++)
+    {
+        sink = ~crc32c_portable(sink, block, block_size);
+    }
+    elapsed = seconds_since(&start);
+    printf("CRC32C portable (slicing-by-8): %8.0f MB/s\n", megabytes / elapsed);
+    if (crc32c_hardware)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < megabytes; i++)
+        {
+            sink = ~crc32c_accelerated(sink, block, block_size);
+        }
+        elapsed = seconds_since(&start);
+        printf("CRC32C hardware instruction:    %8.0f MB/s\n", megabytes / elapsed);
+    }
+    else
+    {
+        printf("CRC32C hardware instruction:    not available on this CPU\n");
+    }
+#if defined(__x86_64__)
+    if (crc32c_folding)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < megabytes; i++)
+        {
+            sink = ~crc32c_folded(sink, block, block_size);
+        }
+        elapsed = seconds_since(&start);
+        printf("CRC32C AVX-512 carry-less fold: %8.0f MB/s\n", megabytes / elapsed);
+    }
+#endif
+
+    // On a real link the checksum runs while the socket waits, this is the CPU it takes per endpoint with the kernel
+    // crc32c_update() picks for this CPU
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < megabytes; i++)
+    {
+        sink = crc32c_update(sink, block, block_size);
+    }
+    elapsed = seconds_since(&start);
+    printf("Checksum CPU per endpoint: %.1f%% of transfer time at 1 Gbit/s, %.1f%% at 10 Gbit/s\n",
+           125.0 / (megabytes / elapsed) * 100, 1250.0 / (megabytes / elapsed) * 100);
+
+    // Same transfer path as ufile/dfile over a local socket pair, served from the page cache
+    if (fill_bench_file(file_descriptor, block, block_size, megabytes) != 0)
+    {
+        close(file_descriptor);
+        free(block);
+        return -1;
+    }
+    // Runs with and without checksum are taken in turn so both see the same load on a shared machine
+    double plain = 0, checked = 0;
+    for (int run = 0; run < BENCH_STREAM_RUNS; run++)
+    {
+        double seconds = time_loopback_stream(file_descriptor, 0);
+        plain = run == 0 || seconds < plain ? seconds : plain;
+        seconds = time_loopback_stream(file_descriptor, 1);
+        checked = run == 0 || seconds < checked ? seconds : checked;
+    }
+    printf("Chunk stream without checksum:  %8.0f MB/s\n", megabytes / plain);
+    printf("Chunk stream with CRC32C:       %8.0f MB/s (%+.1f%% time, sender and receiver share %ld CPUs)\n",
+           megabytes / checked, (checked / plain - 1) * 100, sysconf(_SC_NPROCESSORS_ONLN));
+
+    close(file_descriptor);
+    free(block);
+    return 0;
+}
+
+// Function to open the listening socket of the transport benchmark: TCP on a free loopback port, or an abstract
+// Unix socket like the ones Spdf and Stext offer a co-located Smain. The address to connect to is left in address
+int bench_listen(int use_unix, struct sockaddr_storage *address, socklen_t *length)
+{
+    int listener;
+
+    memset(address, 0, sizeof(*address));
+    if (use_unix)
+    {
+        struct sockaddr_un *local = (struct sockaddr_un *)address;
+        local->sun_family = AF_UNIX;
+        snprintf(local->sun_path + 1, sizeof(local->sun_path) - 1, "datasync-bench-%d", getpid());
+        *length = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(local->sun_path + 1);
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    }
+    else
+    {
+        struct sockaddr_in *inet = (struct sockaddr_in *)address;
+        inet->sin_family = AF_INET;
+        inet->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *length = sizeof(*inet);
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+    }
+    if (listener < 0 || bind(listener, (struct sockaddr *)address, *length) != 0 ||
+        listen(listener, SOMAXCONN) != 0 || getsockname(listener, (struct sockaddr *)address, length) != 0)
+    {
+        perror("Benchmark listener failed");
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return -1;
+    }
+    return listener;
+}
+
+// Function to open a benchmark connection, returns the socket or -1
+int bench_connect(const struct sockaddr_storage *address, socklen_t length)
+{
+    int sock = socket(address->ss_family, SOCK_STREAM, 0);
+
+    if (sock >= 0 && connect(sock, (const struct sockaddr *)address, length) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Function run by the benchmark server process: answers every command frame like a backend would,
+// "stream" with the benchmark file as chunks and anything else with a short status line
+void bench_serve(int listener, int file_descriptor)
+{
+    char frame[BUFFER_SIZE];
+    int connection;
+
+    while ((connection = accept(listener, NULL, NULL)) >= 0)
+    {
+        while (recv_all(connection, frame, BUFFER_SIZE) == 0)
+        {
+            if (strcmp(frame, "stream") == 0)
+            {
+                lseek(file_descriptor, 0, SEEK_SET);
+                send_file_chunks(connection, file_descriptor);
+            }
+            else
+            {
+                send(connection, "ok\n", 3, 0);
+            }
+        }
+        close(connection);
+    }
+}
+
+// Function to time one transport: a chunked stream of the benchmark file (best of three), command frames answered
+// on an open connection, and command frames that each open a new connection as Smain does per backend request
+int bench_transport(const char *name, int use_unix, int file_descriptor, long megabytes)
+{
+    struct sockaddr_storage address;
+    struct timespec start;
+    socklen_t length;
+    char frame[BUFFER_SIZE] = "stat", reply[3];
+    double stream = 0, request, connect_request;
+    int listener, sock, failed = 0;
+    pid_t server;
 
-        if (execute_command(sock_fd, cmd, param1, param2) == -1)
+    if ((listener = bench_listen(use_unix, &address, &length)) < 0)
+    {
+        return -1;
+    }
+    fflush(stdout); // Do not let the server inherit unprinted output
+    if ((server = fork()) == 0)
+    {
+        bench_serve(listener, file_descriptor);
+        exit(0);
+    }
+    close(listener);
+    if ((sock = bench_connect(&address, length)) < 0)
+    {
+        perror("Benchmark connection failed");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return -1;
+    }
+
+    for (int run = 0; run < 3; run++)
+    {
+        char stream_frame[BUFFER_SIZE] = "stream";
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (send(sock, stream_frame, BUFFER_SIZE, 0) != BUFFER_SIZE || recv_file_chunks(sock, NULL, NULL) < 0)
+        {
+            failed = 1;
+        }
+        double elapsed = seconds_since(&start);
+        if (run == 0 || elapsed < stream)
+        {
+            stream = elapsed;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_REQUESTS && !failed; i++)
+    {
+        if (send(sock, frame, BUFFER_SIZE, 0) != BUFFER_SIZE || recv_all(sock, reply, sizeof(reply)) != 0)
+        {
+            failed = 1;
+        }
+    }
+    request = seconds_since(&start) / BENCH_REQUESTS;
+    close(sock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_CONNECTS && !failed; i++)
+    {
+        if ((sock = bench_connect(&address, length)) < 0)
+        {
+            failed = 1;
+            break;
+        }
+        if (send(sock, frame, BUFFER_SIZE, 0) != BUFFER_SIZE || recv_all(sock, reply, sizeof(reply)) != 0)
+        {
+            failed = 1;
+        }
+        close(sock);
+    }
+    connect_request = seconds_since(&start) / BENCH_CONNECTS;
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (failed)
+    {
+        fprintf(stderr, "Benchmark over %s failed\n", name);
+        return -1;
+    }
+    printf("%-14s %10.0f MB/s %11.1f us %13.1f us\n", name, megabytes / stream, request * 1e6, connect_request * 1e6);
+    return 0;
+}
+
+// Function to compare the two transports Smain can reach a co-located backend with
+// Run as: ./client24s --bench-transport [megabytes]
+int run_transport_benchmark(long megabytes)
+{
+    size_t block_size = POOL_MAX_CHUNK;
+    unsigned char *block = malloc(block_size);
+    char temp_path[] = "/tmp/datasync-bench-XXXXXX";
+    int file_descriptor, status;
+
+    if (block == NULL || (file_descriptor = mkstemp(temp_path)) < 0)
+    {
+        perror("Benchmark setup failed");
+        free(block);
+        return -1;
+    }
+    unlink(temp_path);
+    for (size_t i = 0; i < block_size; i++)
+    {
+        block[i] = (unsigned char)rand();
+    }
+    if (fill_bench_file(file_descriptor, block, block_size, megabytes) != 0)
+    {
+        close(file_descriptor);
+        free(block);
+        return -1;
+    }
+
+    printf("Transport      chunk stream   request (1 KB)   connect+request\n");
+    status = bench_transport("TCP loopback", 0, file_descriptor, megabytes);
+    if (bench_transport("Unix socket", 1, file_descriptor, megabytes) != 0)
+    {
+        status = -1;
+    }
+    printf("(%ld MB stream, %d requests, %d connections, %ld CPUs)\n", megabytes, BENCH_REQUESTS, BENCH_CONNECTS,
+           sysconf(_SC_NPROCESSORS_ONLN));
+
+    close(file_descriptor);
+    free(block);
+    return status;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int sock_fd;                        // Socket file descriptor for communication with the server
+    char cmd[BUFFER_SIZE], param1[BUFFER_SIZE], param2[BUFFER_SIZE];            // Buffers to store the command and its arguments
+    char *cmd_token;                    // Pointer used for tokenizing user input
+    char user_input[BUFFER_SIZE];       // Buffer to store the raw user input
+
+    crc32c_init();                      // Prepare the checksum tables before any transfer
+    chunk_progress = progress_update;   // Uploads and downloads the user waits for show their progress
+
+    // Benchmark modes: measure checksum overhead or the local transports instead of connecting to Smain
+    if (argc > 1 && strcmp(argv[1], "--bench-checksum") == 0)
+    {
+        return run_checksum_benchmark(argc > 2 ? atol(argv[2]) : 1024) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (argc > 1 && strcmp(argv[1], "--bench-transport") == 0)
+    {
+        return run_transport_benchmark(argc > 2 ? atol(argv[2]) : 256) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    trace_init(TRACE_HOP_CLIENT);
+
+    // Connect to Smain
+    if ((sock_fd = open_server_connection()) < 0)
+    {
+        exit(EXIT_FAILURE);             // Exit the program with a failure status
+    }
+
+    // Display usage instructions for various commands
+    printf("Usage for ufile: ufile filename_in_client filepath_in_smain [connections] (changed .c/.txt files only send the changes) \n");
+    printf("Usage for dfile: dfile filepath_in_smain/filename [connections] \n");
+    printf("Usage for rmfile: rmfile [-r] filepath_in_smain/filename... (globs like ~smain/dir/*.txt, -r for directories) \n");
+    printf("Usage for mvfile: mvfile source_in_smain target_in_smain (files, globs like ~smain/dir/*.pdf or directories) \n");
+    printf("Usage for cpfile: cpfile [-r] source_in_smain target_in_smain (-r copies directories) \n");
+    printf("Usage for stat: stat filepath_in_smain/filename... (size, mtime and checksum without downloading) \n");
+    printf("Usage for grep: grep [-i] [-E] [-m limit] pattern [filepath_in_smain] (searches .c and .txt files) \n");
+    printf("Usage for usync: usync localdir filepath_in_smain [-d] [-c] (uploads new and changed files, -d deletes extras, -c compares checksums) \n");
+    printf("Usage for watch: watch localdir filepath_in_smain [-d] (usync, then sends every change as it happens until Enter) \n");
+    printf("Usage for subscribe: subscribe filepath_in_smain (prints created/modified/deleted files as they happen until Enter) \n");
+    printf("Usage for dtar command: dtar file_extension (Eg: dtar .c/.pdf/.txt/all) \n");
+    printf("Usage for display command: display filepath/pathname (inside smain) \n");
+    while (1)
+    {
+        trace_flush(1);         // The spans of the last command are written out while the user types the next one
+
+        // Prompt the user for input
+        printf("\nEnter command: ");
+        if (fgets(user_input, sizeof(user_input), stdin) == NULL)
+        {
+            perror("Not able to read the input");
+            continue;           // Skipping the rest of the loop and prompt the user again
+        }
+
+        // Remove the newline character from the input
+        user_input[strcspn(user_input, "\n")] = 0;
+
+        // Keep the whole line, rmfile and stat take any number of paths and grep any number of options
+        char input_line[BUFFER_SIZE];
+        strcpy(input_line, user_input);
+
+        // Tokenize the input string to extract the command and arguments
+        cmd_token = strtok(user_input, " ");
+        if (cmd_token == NULL)
+        {
+            printf("No command entered. Please try again.\n");
+            continue;
+        }
+
+        // Copy the command and arguments into respective buffers
+        strncpy(cmd, cmd_token, sizeof(cmd));
+        cmd_token = strtok(NULL, " ");
+        if (cmd_token != NULL)
+        {
+            strncpy(param1, cmd_token, sizeof(param1));
+            cmd_token = strtok(NULL, " ");
+            if (cmd_token != NULL)
+            {
+                // Copy the second argument into the 'param2' buffer
+                strncpy(param2, cmd_token, sizeof(param2));
+                cmd_token = strtok(NULL, " ");
+                if (strcmp(cmd, "ufile") == 0 && cmd_token != NULL)
+                {
+                    // The number of connections of a parallel upload goes along with the destination
+                    snprintf(param2 + strlen(param2), sizeof(param2) - strlen(param2), " %s", cmd_token);
+                }
+            }
+            else
+            {
+                param2[0] = '\0';       // If no second argument, set 'param2' to an empty string
+            }
+        }
+        else
+        {
+            param1[0] = '\0';           // If no first argument, set 'param1' to an empty string
+            param2[0] = '\0';
+        }
+
+        // rmfile, mvfile, cpfile, stat and grep send the whole rest of the line in their one command frame,
+        // usync and watch parse it locally
+        if (strcmp(cmd, "rmfile") == 0 || strcmp(cmd, "mvfile") == 0 || strcmp(cmd, "cpfile") == 0 ||
+            strcmp(cmd, "stat") == 0 || strcmp(cmd, "grep") == 0 || strcmp(cmd, "usync") == 0 || strcmp(cmd, "watch") == 0)
+        {
+            const char *paths = input_line + strspn(input_line, " ");
+            paths += strcspn(paths, " ");
+            snprintf(param1, sizeof(param1), "%s", paths + strspn(paths, " "));
+            for (size_t length = strlen(param1); length > 0 && param1[length - 1] == ' '; length--)
+            {
+                param1[length - 1] = '\0';     // A trailing space must not look like another path
+            }
+            param2[0] = '\0';
+        }
+
+        // Execute the command by calling the appropriate handler, under a new request ID
+
+        trace_begin(trace_new_request());
+        int command_result = execute_command(sock_fd, cmd, param1, param2);
+        if (command_result != 0)
+        {
+            trace_end(cmd, command_result == -1 ? -1 : 0);
+        }
+        if (command_result == -1)
         {
             // Handle the error in command execution
             printf("Error: Command execution failed. Please check the command and try again.\n");
             continue;
         }
+        if (command_result == 1)
+        {
+            continue;           // The command already reported its outcome, the server sends no status message
+        }
 
         // Optional: Receive and display the server's response
         char server_reply[BUFFER_SIZE];
         int bytes_received = recv(sock_fd, server_reply, sizeof(server_reply) - 1, 0);          // Receiving data from the server
+        trace_end(cmd, bytes_received > 0 ? 0 : -1);
         if (bytes_received > 0)
         {
             server_reply[bytes_received] = '\0'; // Null-terminate the received string
@@ -372,6 +2817,8 @@ int main()
 
     // Close the socket and end the connection
     close(sock_fd);
+    trace_flush(1);
+    pool_report("Client"); // Print the buffer pool counters of this session
     return 0;
 }
 
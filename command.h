@@ -0,0 +1,101 @@
+// Command frames shared by Smain, Spdf, Stext and command_fuzz: every command travels in a frame of BUFFER_SIZE bytes
+// whose first three words name the command and its arguments, and the data of an upload follows the frame directly
+// Every program is built from a single source file that includes this header once, after defining BUFFER_SIZE
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <string.h>     // String handling functions
+#include <ctype.h>      // isspace() between the words of a frame
+#include <errno.h>      // System error numbers
+#include <stdint.h>     // Fixed width integer types
+#include <sys/types.h>  // ssize_t
+#include <sys/socket.h> // recv() of the frames
+#include "trace.h"
+
+#define COMMAND_WORD_MAX 512                // Longest command word or argument, a frame with a longer one closes the connection
+#define COMMAND_PARTIAL 2                   // recv_command_frame(): only part of the frame has arrived so far
+
+// Words of a command frame: the command and its first two arguments, copied out of the frame and terminated
+struct command_words
+{
+    char text[BUFFER_SIZE + 3];         // The words one after the other, each with its terminator
+    char *command;
+    char *argument1;
+    char *argument2;
+};
+
+// Function to split the first three words of a command frame like sscanf("%s %s %s") did, without clearing and
+// filling three BUFFER_SIZE buffers per command: only the bytes up to the end of the third word are looked at and
+// missing words are empty. The frame itself is left as it is for the handlers that parse the rest of it
+// Returns -1 when a word is longer than COMMAND_WORD_MAX
+int parse_command(const char *frame, struct command_words *words)
+{
+    char **slots[3] = {&words->command, &words->argument1, &words->argument2};
+    size_t position = 0, used = 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        size_t start;
+
+        while (position < BUFFER_SIZE && frame[position] != '\0' && isspace((unsigned char)frame[position]))
+        {
+            position++;
+        }
+        start = position;
+        while (position < BUFFER_SIZE && frame[position] != '\0' && !isspace((unsigned char)frame[position]))
+        {
+            position++;
+        }
+        if (position - start > COMMAND_WORD_MAX)
+        {
+            return -1;
+        }
+        memcpy(words->text + used, frame + start, position - start);
+        *slots[i] = words->text + used;
+        used += position - start;
+        words->text[used++] = '\0';
+    }
+    return 0;
+}
+
+// Function to receive a command frame of BUFFER_SIZE bytes, of which *used arrived before. Nothing past the frame is
+// read, so the chunks of an upload that follow it in the same segment stay in the socket for the handler. With wait
+// set the call blocks until the frame is complete; without it only what has arrived is taken, and a frame split over
+// several segments is completed by a later call instead of holding a worker. *started_ns gets the time the first
+// bytes of the frame arrived
+// Returns 0 once the frame is complete, COMMAND_PARTIAL while it is not, -1 once the peer has gone, with errno 0
+// when it closed the connection
+int recv_command_frame(int sock, char *frame, size_t *used, int64_t *started_ns, int wait)
+{
+    while (*used < BUFFER_SIZE)
+    {
+        ssize_t count = recv(sock, frame + *used, BUFFER_SIZE - *used, wait ? MSG_WAITALL : MSG_DONTWAIT);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && !wait)
+        {
+            return COMMAND_PARTIAL;
+        }
+        if (count <= 0)
+        {
+            if (count == 0)
+            {
+                errno = 0;
+            }
+            return -1;
+        }
+        if (*used == 0)
+        {
+            *started_ns = trace_now();
+        }
+        *used += count;
+    }
+    *used = 0; // The next command starts a new frame
+    frame[BUFFER_SIZE - 1] = '\0';
+    return 0;
+}
+
+#endif
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define BUFFER_SIZE 1024
+#define FUZZ_FRAMES 4                       // Most command frames sent in one stream
+#define FUZZ_PAYLOAD 3000                   // Most upload bytes following a frame, they must stay in the socket for the handler
+#define FUZZ_PIECES 12                      // Most writes one stream is split into
+
+// parse_command() and recv_command_frame() under test, the ones Smain, Spdf and Stext are built with
+#include "command.h"
+
+// One stream as a client would send it: command frames, each followed by the upload bytes of its command
+struct fuzz_stream
+{
+    char data[FUZZ_FRAMES * (BUFFER_SIZE + FUZZ_PAYLOAD)];
+    size_t length;
+    int frames;
+    size_t frame_at[FUZZ_FRAMES];       // Where each frame starts in data
+    size_t payload[FUZZ_FRAMES];        // Upload bytes after each frame
+    size_t pieces[FUZZ_PIECES];         // Lengths of the writes the stream goes out in
+    int piece_count;
+    int socket;                         // Writing end, for the writer thread in fork mode
+};
+
+unsigned int fuzz_seed;
+
+unsigned int fuzz_random(unsigned int below)
+{
+    fuzz_seed = fuzz_seed * 1103515245u + 12345u;
+    return (fuzz_seed >> 8) % below;
+}
+
+// Function to fill a command frame the way clients and backends do, or do not: words of any length up to past
+// COMMAND_WORD_MAX, any whitespace between them, and either NUL padding or none at all, so the frame ends mid-word
+void fuzz_frame(char *frame)
+{
+    const char spaces[] = " \t\n\v\f\r";
+    size_t position = 0;
+    int nul_free = fuzz_random(4) == 0;
+
+    memset(frame, '\0', BUFFER_SIZE);
+    while (position < BUFFER_SIZE && (nul_free || fuzz_random(5) != 0))
+    {
+        size_t length = fuzz_random(4) == 0 ? fuzz_random(BUFFER_SIZE) : fuzz_random(COMMAND_WORD_MAX / 8) + 1;
+
+        for (size_t gap = fuzz_random(3); gap > 0 && position < BUFFER_SIZE; gap--)
+        {
+            frame[position++] = spaces[fuzz_random(sizeof(spaces) - 1)];
+        }
+        if (fuzz_random(16) == 0)
+        {
+            length = COMMAND_WORD_MAX + fuzz_random(3) - 1;   // Right at the limit
+        }
+        for (; length > 0 && position < BUFFER_SIZE; length--)
+        {
+            frame[position++] = (char)(0x21 + fuzz_random(0x7f - 0x21) + (fuzz_random(8) == 0 ? 0x80 : 0));
+        }
+        if (position < BUFFER_SIZE)
+        {
+            frame[position++] = spaces[fuzz_random(sizeof(spaces) - 1)];
+        }
+    }
+}
+
+// Function to parse a frame another way, with strtok over a terminated copy, as the answer parse_command() must give
+// Returns -1 when one of the first three words is longer than COMMAND_WORD_MAX
+int reference_parse(const char *frame, char words[3][BUFFER_SIZE + 1])
+{
+    char copy[BUFFER_SIZE + 1];
+    char *word = NULL;
+
+    memcpy(copy, frame, BUFFER_SIZE);
+    copy[BUFFER_SIZE] = '\0';
+    for (int i = 0; i < 3; i++)
+    {
+        word = strtok(i == 0 ? copy : NULL, " \t\n\v\f\r");
+        if (word == NULL)
+        {
+            words[i][0] = '\0';
+            continue;
+        }
+        if (strlen(word) > COMMAND_WORD_MAX)
+        {
+            return -1;
+        }
+        strcpy(words[i], word);
+    }
+    return 0;
+}
+
+// Function to check parse_command() on one frame against reference_parse(). The frame is given to it in a buffer of
+// exactly BUFFER_SIZE bytes, so a read past a frame without a NUL shows up under -fsanitize=address
+// Returns 0 when both agree
+int check_parse(const char *frame)
+{
+    char expected[3][BUFFER_SIZE + 1];
+    struct command_words words;
+    char *exact = malloc(BUFFER_SIZE);
+    int result, reference = reference_parse(frame, expected);
+
+    if (exact == NULL)
+    {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(exact, frame, BUFFER_SIZE);
+    result = parse_command(exact, &words);
+    free(exact);
+    if (result != reference)
+    {
+        fprintf(stderr, "parse_command() returned %d, expected %d\n", result, reference);
+        return -1;
+    }
+    if (result == 0 && (strcmp(words.command, expected[0]) != 0 || strcmp(words.argument1, expected[1]) != 0 ||
+                        strcmp(words.argument2, expected[2]) != 0))
+    {
+        fprintf(stderr, "parse_command() split the words as \"%s\" \"%s\" \"%s\", expected \"%s\" \"%s\" \"%s\"\n",
+                words.command, words.argument1, words.argument2, expected[0], expected[1], expected[2]);
+        return -1;
+    }
+    return 0;
+}
+
+// Function to build a stream of frames and upload bytes and pick where its writes split it: inside a frame, between
+// a frame and its upload bytes, or not at all, so a whole stream arrives coalesced in one write
+void fuzz_stream_build(struct fuzz_stream *stream)
+{
+    size_t cut[FUZZ_PIECES];
+    int cuts = 0;
+
+    stream->length = 0;
+    stream->frames = fuzz_random(FUZZ_FRAMES) + 1;
+    for (int i = 0; i < stream->frames; i++)
+    {
+        stream->frame_at[i] = stream->length;
+        fuzz_frame(stream->data + stream->length);
+        stream->length += BUFFER_SIZE;
+        stream->payload[i] = fuzz_random(2) == 0 ? 0 : fuzz_random(FUZZ_PAYLOAD) + 1;
+        for (size_t j = 0; j < stream->payload[i]; j++)
+        {
+            stream->data[stream->length++] = (char)fuzz_random(256);
+        }
+    }
+    for (int i = fuzz_random(FUZZ_PIECES); i > 0; i--)
+    {
+        size_t at = fuzz_random(3) == 0 ? stream->frame_at[fuzz_random(stream->frames)] + fuzz_random(2) * BUFFER_SIZE
+                                        : fuzz_random(stream->length);
+        int j = cuts++;
+
+        // Kept in order by insertion, duplicates and cuts at 0 only make empty pieces that are not written
+        while (j > 0 && cut[j - 1] > at)
+        {
+            cut[j] = cut[j - 1];
+            j--;
+        }
+        cut[j] = at;
+    }
+    stream->piece_count = 0;
+    for (int i = 0; i <= cuts; i++)
+    {
+        size_t end = i < cuts ? cut[i] : stream->length;
+        size_t start = i > 0 ? cut[i - 1] : 0;
+
+        if (end > start)
+        {
+            stream->pieces[stream->piece_count++] = end - start;
+        }
+    }
+}
+
+// Function to write one piece of a stream completely
+void write_piece(int sock, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = write(sock, data, length);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0)
+        {
+            perror("Failed to write the stream");
+            exit(EXIT_FAILURE);
+        }
+        data += count;
+        length -= count;
+    }
+}
+
+// Writer thread of fork mode: the frames are received with MSG_WAITALL, so the pieces have to arrive while it waits
+void *fuzz_writer(void *argument)
+{
+    struct fuzz_stream *stream = argument;
+    size_t sent = 0;
+
+    for (int i = 0; i < stream->piece_count; i++)
+    {
+        write_piece(stream->socket, stream->data + sent, stream->pieces[i]);
+        sent += stream->pieces[i];
+        sched_yield();
+    }
+    return NULL;
+}
+
+// Function to take the upload bytes that follow a frame out of the socket, as a handler would, and compare them
+// with what was sent. In threaded mode only what has arrived so far is taken
+// Returns the bytes taken, or -1 when they differ from the stream
+ssize_t take_payload(int sock, const char *expected, size_t wanted, int flags)
+{
+    char data[FUZZ_PAYLOAD];
+    size_t taken = 0;
+
+    while (taken < wanted)
+    {
+        ssize_t count = recv(sock, data + taken, wanted - taken, flags);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (count <= 0)
+        {
+            fprintf(stderr, "Upload bytes after a frame went missing\n");
+            return -1;
+        }
+        taken += count;
+    }
+    if (memcmp(data, expected, taken) != 0)
+    {
+        fprintf(stderr, "Upload bytes after a frame differ, the frame was read past its end\n");
+        return -1;
+    }
+    return taken;
+}
+
+// Function to compare a received frame with the one sent and check how it parses
+// Returns 0 when it matches
+int check_frame(const char *frame, const char *sent)
+{
+    if (memcmp(frame, sent, BUFFER_SIZE - 1) != 0 || frame[BUFFER_SIZE - 1] != '\0')
+    {
+        fprintf(stderr, "Received frame differs from the one sent\n");
+        return -1;
+    }
+    return check_parse(frame);
+}
+
+// Function to send one stream through a socket pair and receive it with recv_command_frame() as Smain does in the
+// given mode. Threaded mode writes and receives in turn, so each piece is a separate wakeup; fork mode, like Spdf
+// and Stext, waits for whole frames while a thread writes. After every frame the upload bytes behind it are taken
+// and checked
+// Returns 0 when every frame and upload byte came through as sent
+int fuzz_receive(struct fuzz_stream *stream, int threaded, long *partials)
+{
+    char received_frame[BUFFER_SIZE];
+    int64_t started_ns;
+    int pair[2], frame = 0, result = 0, received;
+    size_t sent = 0, payload_left = 0, payload_at = 0, frame_used = 0;
+    pthread_t writer;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        perror("Failed to create a socket pair");
+        exit(EXIT_FAILURE);
+    }
+    stream->socket = pair[1];
+    if (!threaded && pthread_create(&writer, NULL, fuzz_writer, stream) != 0)
+    {
+        perror("Failed to start the writer thread");
+        exit(EXIT_FAILURE);
+    }
+    for (int piece = 0; frame < stream->frames || payload_left > 0; piece++)
+    {
+        if (threaded)
+        {
+            if (piece >= stream->piece_count)
+            {
+                fprintf(stderr, "Stream ended with %d of %d frames received\n", frame, stream->frames);
+                result = -1;
+                break;
+            }
+            write_piece(pair[1], stream->data + sent, stream->pieces[piece]);
+            sent += stream->pieces[piece];
+        }
+        // One wakeup: finish the upload bytes of the last frame, then receive frames while whole ones are there
+        while (result == 0)
+        {
+            if (payload_left > 0)
+            {
+                ssize_t taken = take_payload(pair[0], stream->data + payload_at, payload_left,
+                                             threaded ? MSG_DONTWAIT : MSG_WAITALL);
+
+                if (taken < 0)
+                {
+                    result = -1;
+                    break;
+                }
+                payload_left -= taken;
+                payload_at += taken;
+                if (payload_left > 0)
+                {
+                    break;
+                }
+            }
+            if (frame == stream->frames)
+            {
+                break;
+            }
+            received = recv_command_frame(pair[0], received_frame, &frame_used, &started_ns, !threaded);
+            if (received == COMMAND_PARTIAL)
+            {
+                (*partials)++;
+                break;
+            }
+            if (received != 0 || check_frame(received_frame, stream->data + stream->frame_at[frame]) != 0)
+            {
+                fprintf(stderr, "Frame %d of %d failed\n", frame + 1, stream->frames);
+                result = -1;
+                break;
+            }
+            payload_at = stream->frame_at[frame] + BUFFER_SIZE;
+            payload_left = stream->payload[frame++];
+        }
+        if (result != 0)
+        {
+            break;
+        }
+    }
+    if (result == 0 && recv(pair[0], received_frame, 1, MSG_DONTWAIT) > 0)
+    {
+        fprintf(stderr, "Bytes were left over after the last frame\n");
+        result = -1;
+    }
+    shutdown(pair[0], SHUT_RDWR);
+    if (!threaded)
+    {
+        pthread_join(writer, NULL);
+    }
+    close(pair[0]);
+    close(pair[1]);
+    return result;
+}
+
+// Usage: command_fuzz [iterations] [seed]
+// Feeds the command frame receiver and parser of Smain, Spdf and Stext random streams over a socket pair, in threaded and in fork mode:
+// frames split across writes, coalesced with each other and with the upload bytes that follow them, words past
+// COMMAND_WORD_MAX and frames with no NUL in them. Build with -fsanitize=address,undefined to catch stray reads too
+int main(int argc, char *argv[])
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 20000;
+    long partials = 0, refused = 0;
+    struct fuzz_stream *stream = malloc(sizeof(*stream));
+
+    fuzz_seed = argc > 2 ? (unsigned int)strtoul(argv[2], NULL, 0) : (unsigned int)time(NULL);
+    if (stream == NULL)
+    {
+        perror("Out of memory");
+        return EXIT_FAILURE;
+    }
+    printf("Seed %u\n", fuzz_seed);
+    for (long i = 0; i < iterations; i++)
+    {
+        unsigned int seed = fuzz_seed;
+        struct command_words words;
+
+        fuzz_stream_build(stream);
+        for (int j = 0; j < stream->frames; j++)
+        {
+            refused += parse_command(stream->data + stream->frame_at[j], &words) != 0;
+            if (check_parse(stream->data + stream->frame_at[j]) != 0)
+            {
+                fprintf(stderr, "Iteration %ld failed, rerun it with seed %u\n", i, seed);
+                return EXIT_FAILURE;
+            }
+        }
+        if (fuzz_receive(stream, 1, &partials) != 0 || fuzz_receive(stream, 0, &partials) != 0)
+        {
+            fprintf(stderr, "Iteration %ld failed, rerun it with seed %u\n", i, seed);
+            return EXIT_FAILURE;
+        }
+    }
+    printf("%ld streams passed, %ld partial frames resumed, %ld frames refused for a long word\n",
+           iterations, partials, refused);
+    free(stream);
+    return EXIT_SUCCESS;
+}
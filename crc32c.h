@@ -0,0 +1,368 @@
+// CRC32C (Castagnoli) of file data, shared by Smain, Spdf, Stext and client24s: the hardware instruction over three
+// interleaved streams, folded with the AVX-512 carry-less multiply where the CPU has it, slicing-by-8 tables elsewhere
+// Every program is built from a single source file that includes this header once
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>     // Fixed width integer types
+#include <string.h>     // memcpy() of the shift tables
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // SSE4.2 CRC32C instruction
+#include <immintrin.h>  // AVX-512 carry-less multiply for folding CRC32C
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>   // ARMv8 CRC32C instructions
+#endif
+
+#define CRC32C_LONG 8192                    // Block length of the three-way interleaved hardware CRC32C
+#define CRC32C_SHORT 256                    // Shorter block length used for the tail of a buffer
+#define CRC32C_FOLD_MIN 1024                // Shortest buffer worth folding with the carry-less multiply
+
+uint32_t crc32c_table[8][256];      // Slicing-by-8 tables for the portable CRC32C
+int crc32c_hardware;                // Set when the CPU has a CRC32C instruction
+int crc32c_folding;                 // Set when the CPU also has the AVX-512 carry-less multiply
+
+// Function to run the table-driven CRC32C eight bytes at a time on CPUs without the instruction
+uint32_t crc32c_portable(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+        crc = crc32c_table[7][low & 0xff] ^ crc32c_table[6][(low >> 8) & 0xff] ^
+              crc32c_table[5][(low >> 16) & 0xff] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]] ^
+              crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+// Function to multiply a 32x32 GF(2) matrix by a vector
+uint32_t gf2_matrix_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+
+    while (vector != 0)
+    {
+        if (vector & 1)
+        {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+// Function to square a 32x32 GF(2) matrix
+void gf2_matrix_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2_matrix_times(matrix, matrix[n]);
+    }
+}
+
+#if defined(__x86_64__)
+uint32_t crc32c_long_shift[4][256];    // Operator tables that append CRC32C_LONG zero bytes to a CRC
+uint32_t crc32c_short_shift[4][256];   // Operator tables that append CRC32C_SHORT zero bytes to a CRC
+
+// Function to build the byte-wise tables of the operator that appends `length` zero bytes to a CRC
+// Three blocks are checksummed side by side and stitched together with these tables
+void crc32c_build_shift(uint32_t table[4][256], size_t length)
+{
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+
+    odd[0] = 0x82F63B78; // Operator for one zero bit
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // Two zero bits
+    gf2_matrix_square(odd, even); // Four zero bits
+
+    // Square repeatedly: the first squaring gives one zero byte, then each step doubles it
+    while (1)
+    {
+        gf2_matrix_square(even, odd);
+        length >>= 1;
+        if (length == 0)
+        {
+            memcpy(odd, even, sizeof(odd));
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        length >>= 1;
+        if (length == 0)
+        {
+            break;
+        }
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        table[0][n] = gf2_matrix_times(odd, n);
+        table[1][n] = gf2_matrix_times(odd, n << 8);
+        table[2][n] = gf2_matrix_times(odd, n << 16);
+        table[3][n] = gf2_matrix_times(odd, n << 24);
+    }
+}
+
+// Function to append the zero bytes described by table to a CRC
+uint32_t crc32c_shift(uint32_t table[4][256], uint32_t crc)
+{
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+// Function to run CRC32C with the SSE4.2 crc32 instruction
+// The instruction has a three cycle latency but issues every cycle, so three independent blocks are
+// checksummed at once and combined afterwards, which keeps the CPU's CRC unit busy
+__attribute__((target("sse4.2")))
+uint32_t crc32c_accelerated(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t crc0, crc1, crc2;
+
+    while (length > 0 && ((uintptr_t)data & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+    crc0 = crc;
+
+    // Three long blocks at a time, then three short blocks at a time
+    while (length >= 3 * CRC32C_LONG)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        for (const unsigned char *end = data + CRC32C_LONG; data < end; data += 8)
+        {
+            uint64_t words[3];
+            memcpy(&words[0], data, 8);
+            memcpy(&words[1], data + CRC32C_LONG, 8);
+            memcpy(&words[2], data + 2 * CRC32C_LONG, 8);
+            crc0 = _mm_crc32_u64(crc0, words[0]);
+            crc1 = _mm_crc32_u64(crc1, words[1]);
+            crc2 = _mm_crc32_u64(crc2, words[2]);
+        }
+        crc0 = crc32c_shift(crc32c_long_shift, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long_shift, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_LONG;
+        length -= 3 * CRC32C_LONG;
+    }
+    while (length >= 3 * CRC32C_SHORT)
+    {
+        crc1 = 0;
+        crc2 = 0;
+        for (const unsigned char *end = data + CRC32C_SHORT; data < end; data += 8)
+        {
+            uint64_t words[3];
+            memcpy(&words[0], data, 8);
+            memcpy(&words[1], data + CRC32C_SHORT, 8);
+            memcpy(&words[2], data + 2 * CRC32C_SHORT, 8);
+            crc0 = _mm_crc32_u64(crc0, words[0]);
+            crc1 = _mm_crc32_u64(crc1, words[1]);
+            crc2 = _mm_crc32_u64(crc2, words[2]);
+        }
+        crc0 = crc32c_shift(crc32c_short_shift, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short_shift, (uint32_t)crc0) ^ crc2;
+        data += 2 * CRC32C_SHORT;
+        length -= 3 * CRC32C_SHORT;
+    }
+
+    // Whatever is left, eight bytes and then one byte at a time
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc0 = _mm_crc32_u64(crc0, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)crc0;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+// Function to run CRC32C with the ARMv8 crc32c instructions
+uint32_t crc32c_accelerated(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+#else
+uint32_t crc32c_accelerated(uint32_t crc, const unsigned char *data, size_t length)
+{
+    return crc32c_portable(crc, data, length);
+}
+#endif
+
+#if defined(__x86_64__)
+// Function to fold sixteen 128-bit lanes of CRC32C state forward over the bits given by constants and add the next data
+// Each lane's first and second eight bytes are carry-less multiplied by the first and second constant of the lane
+__attribute__((target("avx512f,vpclmulqdq")))
+__m512i crc32c_fold(__m512i lanes, __m512i constants, __m512i next)
+{
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(lanes, constants, 0x00),
+                                     _mm512_clmulepi64_epi128(lanes, constants, 0x11), next, 0x96);
+}
+
+// Function to run CRC32C with the AVX-512 carry-less multiply, 256 bytes per step: the data is taken as sixteen
+// 128-bit lanes and each lane is folded forward onto the lane 256 bytes later, so nothing waits on a previous step.
+// At the end the lanes are folded into one, whose 16 bytes and the tail go through the crc32 instruction. A lane
+// folded forward by D bits is multiplied by x^(D+63) and x^(D-1) mod P, bit-reflected like the data
+__attribute__((target("avx512f,vpclmulqdq,sse4.2")))
+uint32_t crc32c_folded(uint32_t crc, const unsigned char *data, size_t length)
+{
+    const __m512i stride = _mm512_set_epi64(0x1426a81500000000, 0xe9a5d8be00000000, 0x1426a81500000000,
+                                            0xe9a5d8be00000000, 0x1426a81500000000, 0xe9a5d8be00000000,
+                                            0x1426a81500000000, 0xe9a5d8be00000000); // D = 2048
+    const __m512i register_step = _mm512_set_epi64(0x75bba45b00000000, 0x1c19243b00000000, 0x75bba45b00000000,
+                                                   0x1c19243b00000000, 0x75bba45b00000000, 0x1c19243b00000000,
+                                                   0x75bba45b00000000, 0x1c19243b00000000); // D = 512
+    const __m512i lane_steps = _mm512_set_epi64(0, 0, 0x3171d43000000000, 0x3743f7bd00000000, 0xa2158b3400000000,
+                                                0x33ccbbbc00000000, 0x6051243f00000000,
+                                                0xa46ef4aa00000000); // D = 128, 256 and 384, the last lane stays
+    const unsigned char *end = data + (length & ~(size_t)255);
+    __m512i lanes0, lanes1, lanes2, lanes3;
+    __m128i last;
+
+    if (length < CRC32C_FOLD_MIN)
+    {
+        return crc32c_accelerated(crc, data, length);
+    }
+
+    // The CRC so far is added to the first four bytes, which continues it as the crc32 instruction would
+    lanes0 = _mm512_xor_si512(_mm512_loadu_si512(data), _mm512_set_epi64(0, 0, 0, 0, 0, 0, 0, crc));
+    lanes1 = _mm512_loadu_si512(data + 64);
+    lanes2 = _mm512_loadu_si512(data + 128);
+    lanes3 = _mm512_loadu_si512(data + 192);
+    for (data += 256; data < end; data += 256)
+    {
+        lanes0 = crc32c_fold(lanes0, stride, _mm512_loadu_si512(data));
+        lanes1 = crc32c_fold(lanes1, stride, _mm512_loadu_si512(data + 64));
+        lanes2 = crc32c_fold(lanes2, stride, _mm512_loadu_si512(data + 128));
+        lanes3 = crc32c_fold(lanes3, stride, _mm512_loadu_si512(data + 192));
+    }
+
+    // Four registers into the last one, then its four lanes into the last lane
+    lanes1 = crc32c_fold(lanes0, register_step, lanes1);
+    lanes2 = crc32c_fold(lanes1, register_step, lanes2);
+    lanes3 = crc32c_fold(lanes2, register_step, lanes3);
+    lanes0 = crc32c_fold(lanes3, lane_steps, _mm512_setzero_si512());
+    last = _mm_xor_si128(_mm_xor_si128(_mm512_extracti32x4_epi32(lanes0, 0), _mm512_extracti32x4_epi32(lanes0, 1)),
+                         _mm_xor_si128(_mm512_extracti32x4_epi32(lanes0, 2), _mm512_extracti32x4_epi32(lanes0, 3)));
+    last = _mm_xor_si128(last, _mm512_extracti32x4_epi32(lanes3, 3));
+    crc = (uint32_t)_mm_crc32_u64(_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(last)),
+                                  (uint64_t)_mm_extract_epi64(last, 1));
+    return crc32c_accelerated(crc, data, length & 255);
+}
+#endif
+
+// Function to build the CRC32C (Castagnoli) tables and detect the hardware instruction, called once from main()
+void crc32c_init()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        for (int slice = 1; slice < 8; slice++)
+        {
+            crc32c_table[slice][n] = (crc32c_table[slice - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[slice - 1][n] & 0xff];
+        }
+    }
+#if defined(__x86_64__)
+    crc32c_hardware = __builtin_cpu_supports("sse4.2") != 0;
+    crc32c_folding = crc32c_hardware && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq");
+    crc32c_build_shift(crc32c_long_shift, CRC32C_LONG);
+    crc32c_build_shift(crc32c_short_shift, CRC32C_SHORT);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_hardware = 1;
+#endif
+}
+
+// Function to extend a CRC32C over more data; start with 0 and feed the previous result to continue a stream
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t length)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32c_folding)
+    {
+        return ~crc32c_folded(crc, data, length);
+    }
+#endif
+    crc = crc32c_hardware ? crc32c_accelerated(crc, data, length) : crc32c_portable(crc, data, length);
+    return ~crc;
+}
+
+// Function to combine the CRC32C of two consecutive pieces of data, given the length of the second piece
+// The chunks of a parallel upload and the stripes of a striped download are checksummed separately and stitched
+// together into the whole-file CRC32C
+uint32_t crc32c_combine(uint32_t first, uint32_t second, long long second_length)
+{
+    uint32_t even[32], odd[32];
+    uint32_t row = 1;
+
+    if (second_length <= 0)
+    {
+        return first;
+    }
+    odd[0] = 0x82F63B78; // Operator for one zero bit
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd); // Two zero bits
+    gf2_matrix_square(odd, even); // Four zero bits
+
+    // Append second_length zero bytes to the first CRC, one power-of-two operator per set bit of the length
+    do
+    {
+        gf2_matrix_square(even, odd);
+        if (second_length & 1)
+        {
+            first = gf2_matrix_times(even, first);
+        }
+        second_length >>= 1;
+        if (second_length == 0)
+        {
+            break;
+        }
+        gf2_matrix_square(odd, even);
+        if (second_length & 1)
+        {
+            first = gf2_matrix_times(odd, first);
+        }
+        second_length >>= 1;
+    } while (second_length != 0);
+
+    return first ^ second;
+}
+
+#endif
@@ -0,0 +1,297 @@
+// Request tracing shared by Smain, Spdf, Stext and client24s: spans of every request go to a trace file per program
+// while the trace directory exists, and command frames carry the request ID from the client through every hop
+// Every program is built from a single source file that includes this header once, after defining BUFFER_SIZE;
+// one that runs a command on several threads defines TRACE_SHARED_CONTEXT first
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>      // Standard input/output operations
+#include <stdlib.h>     // getenv() for the trace directory
+#include <string.h>     // String handling functions
+#include <stdint.h>     // Fixed width integer types of the span records
+#include <time.h>       // Clock the spans are recorded with
+#include <fcntl.h>      // Opening the trace file
+#include <unistd.h>     // getpid(), read() and pread()
+#include <sys/uio.h>    // Writing the ring out in one writev()
+#include <sys/syscall.h> // Thread ids of the span records
+
+#define TRACE_ENABLED 1                     // Record request spans while the trace directory exists
+#define TRACE_DIR ".datasync_trace"         // Inside the HOME directory; creating it turns tracing on
+#define TRACE_RING_EVENTS 4096              // Spans a process holds before they are written out
+#define TRACE_FLUSH_EVENTS 64               // Spans waiting that make the next finished request write them out
+#define TRACE_FLUSH_MS 1000                 // ... as does the last write being this long ago
+#define TRACE_MAGIC 0x72747364u             // Starts every span record of a trace file
+#define TRACE_FRAME_OFFSET (BUFFER_SIZE - 16) // Where a command frame carries its request ID, behind the command text
+#define TRACE_FRAME_MAGIC 0x31637274u       // Marks a request ID in a command frame
+#define TRACE_HOP_CLIENT 0                  // Hops recorded in the spans: client24s
+#define TRACE_HOP_SMAIN 1
+#define TRACE_HOP_SPDF 2
+#define TRACE_HOP_STEXT 3
+#define TRACE_ACCEPT 1                      // Span kinds: from accept() until the worker took the connection
+#define TRACE_PARSE 2                       // From the first bytes of a command frame until it was parsed
+#define TRACE_CONNECT 3                     // Connecting to a backend
+#define TRACE_TRANSFER 4                    // From the first to the last byte of file data
+#define TRACE_REQUEST 5                     // The whole command, with its status
+
+// One span as written to a trace file, the same layout in every program of the system
+struct trace_record
+{
+    uint32_t magic;                     // TRACE_MAGIC, marks the start of a record
+    uint16_t hop;                       // TRACE_HOP_CLIENT, TRACE_HOP_SMAIN, TRACE_HOP_SPDF or TRACE_HOP_STEXT
+    uint16_t kind;                      // TRACE_ACCEPT, TRACE_PARSE, TRACE_CONNECT, TRACE_TRANSFER or TRACE_REQUEST
+    uint64_t request;                   // Request ID chosen by the client for one command
+    int64_t start_ns;                   // CLOCK_REALTIME, so the spans of all processes on a host line up
+    int64_t end_ns;
+    int64_t bytes;                      // TRACE_TRANSFER: file data moved between the first and the last byte
+    int64_t io_ns;                      // TRACE_TRANSFER: time of it spent reading or writing local files
+    int32_t status;                     // TRACE_CONNECT and TRACE_REQUEST: 0, or -1 when it failed
+    uint32_t pid;
+    uint32_t thread;
+    char label[12];                     // Command, or file type of a backend connection
+};
+
+// Spans of this process waiting to be written out. Recording takes a slot with a compare-and-swap and never
+// blocks; the thread that finishes a request writes the completed slots in order, one thread at a time
+struct trace_ring
+{
+    uint64_t head;                      // Next slot to fill
+    uint64_t flushed;                   // Slots before this one are written out
+    int flushing;                       // Set while a thread writes the ring out
+    int file;                           // Trace file, -1 while tracing is off
+    uint16_t hop;                       // Hop recorded in every span of this process
+    int64_t last_flush_ns;
+    uint32_t ready[TRACE_RING_EVENTS];  // Set once the record of a slot is complete
+    struct trace_record records[TRACE_RING_EVENTS];
+};
+
+// Request the running thread works for and the data it moved so far
+struct trace_context
+{
+    uint64_t request;                   // 0 while the request is not traced
+    int64_t started_ns;                 // 0 while this process records no spans
+    int64_t first_byte_ns;
+    int64_t last_byte_ns;
+    int64_t bytes;
+    int64_t io_ns;
+};
+
+struct trace_ring trace_ring = {.file = -1};
+#ifdef TRACE_SHARED_CONTEXT
+struct trace_context trace_context;     // A program whose threads all work for the one command it runs
+#else
+__thread struct trace_context trace_context;
+#endif
+
+// Function to read the clock spans are recorded with, in nanoseconds
+int64_t trace_now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to turn tracing on when the trace directory exists in the HOME directory, spans go to <hop>.trace in it
+void trace_init(uint16_t hop)
+{
+    static const char *names[] = {"client", "smain", "spdf", "stext"};
+    char path[BUFFER_SIZE];
+
+    trace_ring.hop = hop;
+    snprintf(path, sizeof(path), "%s/%s/%s.trace", getenv("HOME"), TRACE_DIR, names[hop]);
+    if (TRACE_ENABLED && (trace_ring.file = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) >= 0)
+    {
+        printf("Tracing requests to %s\n", path);
+    }
+}
+
+// Function to record one span of a request, dropped when the request is not traced or the ring is full
+void trace_span(uint16_t kind, uint64_t request, int64_t start_ns, int64_t end_ns, int32_t status, const char *label)
+{
+    struct trace_record *record;
+    uint64_t slot;
+
+    if (trace_ring.file < 0 || request == 0)
+    {
+        return;
+    }
+    do
+    {
+        slot = __atomic_load_n(&trace_ring.head, __ATOMIC_RELAXED);
+        if (slot - __atomic_load_n(&trace_ring.flushed, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS)
+        {
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&trace_ring.head, &slot, slot + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    record = &trace_ring.records[slot % TRACE_RING_EVENTS];
+    memset(record, 0, sizeof(*record));
+    record->magic = TRACE_MAGIC;
+    record->hop = trace_ring.hop;
+    record->kind = kind;
+    record->request = request;
+    record->start_ns = start_ns;
+    record->end_ns = end_ns;
+    record->status = status;
+    record->pid = getpid();
+    record->thread = syscall(SYS_gettid);
+    snprintf(record->label, sizeof(record->label), "%s", label);
+    if (kind == TRACE_TRANSFER)
+    {
+        record->bytes = trace_context.bytes;
+        record->io_ns = trace_context.io_ns;
+    }
+    __atomic_store_n(&trace_ring.ready[slot % TRACE_RING_EVENTS], 1, __ATOMIC_RELEASE);
+}
+
+// Function to write the completed spans to the trace file once enough are waiting or the oldest has waited long
+// enough; `force` writes whatever is complete, for a process about to end
+void trace_flush(int force)
+{
+    struct iovec parts[2];
+    uint64_t from, to;
+    int64_t now;
+
+    if (trace_ring.file < 0 || __atomic_exchange_n(&trace_ring.flushing, 1, __ATOMIC_ACQUIRE) != 0)
+    {
+        return;
+    }
+    from = to = trace_ring.flushed;
+    now = trace_now();
+    if (force || __atomic_load_n(&trace_ring.head, __ATOMIC_RELAXED) - from >= TRACE_FLUSH_EVENTS ||
+        now - trace_ring.last_flush_ns >= TRACE_FLUSH_MS * 1000000LL)
+    {
+        while (__atomic_load_n(&trace_ring.ready[to % TRACE_RING_EVENTS], __ATOMIC_ACQUIRE))
+        {
+            trace_ring.ready[to % TRACE_RING_EVENTS] = 0;
+            to++;
+        }
+    }
+    if (to > from)
+    {
+        // The slots may wrap around the end of the ring, O_APPEND keeps the records of all processes whole
+        size_t first = from % TRACE_RING_EVENTS, count = to - from;
+        size_t head_count = count < TRACE_RING_EVENTS - first ? count : TRACE_RING_EVENTS - first;
+
+        parts[0].iov_base = &trace_ring.records[first];
+        parts[0].iov_len = head_count * sizeof(struct trace_record);
+        parts[1].iov_base = trace_ring.records;
+        parts[1].iov_len = (count - head_count) * sizeof(struct trace_record);
+        if (writev(trace_ring.file, parts, count > head_count ? 2 : 1) < 0)
+        {
+            perror("Failed to write the trace file");
+        }
+        trace_ring.last_flush_ns = now;
+        __atomic_store_n(&trace_ring.flushed, to, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&trace_ring.flushing, 0, __ATOMIC_RELEASE);
+}
+
+// Function to start a request on the running thread, the ID is passed on even while this process records nothing
+void trace_begin(uint64_t request)
+{
+    memset(&trace_context, 0, sizeof(trace_context));
+    trace_context.request = request;
+    trace_context.started_ns = trace_ring.file >= 0 ? trace_now() : 0;
+}
+
+// Function to record the spans of the request the running thread has finished: its transfer from the first to the
+// last byte of file data, if any moved, and the whole request with its status
+void trace_end(const char *label, int32_t status)
+{
+    if (trace_context.started_ns == 0)
+    {
+        trace_context.request = 0;
+        return;
+    }
+    if (trace_context.first_byte_ns != 0)
+    {
+        trace_span(TRACE_TRANSFER, trace_context.request, trace_context.first_byte_ns, trace_context.last_byte_ns, 0, label);
+    }
+    trace_span(TRACE_REQUEST, trace_context.request, trace_context.started_ns, trace_now(), status, label);
+    trace_context.request = 0;
+    trace_flush(0);
+}
+
+// Function to count file data sent or received for the running request
+void trace_bytes(size_t length)
+{
+    int64_t now, expected = 0;
+
+    if (trace_context.started_ns == 0 || length == 0)
+    {
+        return;
+    }
+    now = trace_now();
+    __atomic_compare_exchange_n(&trace_context.first_byte_ns, &expected, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_context.last_byte_ns, now, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&trace_context.bytes, length, __ATOMIC_RELAXED);
+}
+
+// Function to read from a local file like read(), or pread() for an offset of 0 and up, timing it for the request
+ssize_t trace_file_read(int file_descriptor, void *buffer, size_t length, long long offset)
+{
+    int64_t started = trace_context.started_ns != 0 ? trace_now() : 0;
+    ssize_t result = offset < 0 ? read(file_descriptor, buffer, length) : pread(file_descriptor, buffer, length, offset);
+
+    if (started != 0)
+    {
+        __atomic_add_fetch(&trace_context.io_ns, trace_now() - started, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+// Function to write to a local file like fwrite(), timing it for the request
+size_t trace_file_write(const void *data, size_t length, FILE *file)
+{
+    int64_t started = trace_context.started_ns != 0 ? trace_now() : 0;
+    size_t result = fwrite(data, 1, length, file);
+
+    if (started != 0)
+    {
+        __atomic_add_fetch(&trace_context.io_ns, trace_now() - started, __ATOMIC_RELAXED);
+    }
+    return result;
+}
+
+// Function to read the request ID a command frame carries behind its text, 0 when it has none
+uint64_t trace_frame_request(const char *frame)
+{
+    uint32_t magic;
+    uint64_t request;
+
+    if (strnlen(frame, TRACE_FRAME_OFFSET) == TRACE_FRAME_OFFSET)
+    {
+        return 0;
+    }
+    memcpy(&magic, frame + TRACE_FRAME_OFFSET, sizeof(magic));
+    memcpy(&request, frame + TRACE_FRAME_OFFSET + sizeof(magic), sizeof(request));
+    return magic == TRACE_FRAME_MAGIC ? request : 0;
+}
+
+// Function to put a request ID into a command frame behind its text, when the text leaves room for it
+void trace_stamp_frame(char *frame, uint64_t request)
+{
+    uint32_t magic = TRACE_FRAME_MAGIC;
+
+    if (request != 0 && strnlen(frame, TRACE_FRAME_OFFSET) < TRACE_FRAME_OFFSET)
+    {
+        memcpy(frame + TRACE_FRAME_OFFSET, &magic, sizeof(magic));
+        memcpy(frame + TRACE_FRAME_OFFSET + sizeof(magic), &request, sizeof(request));
+    }
+}
+
+// Function to start tracing a command received from Smain: spans for the wait from accept() until the worker was
+// ready, once per connection, and for parsing the frame received at `received_ns`
+void trace_command(const char *frame, const char *command, int64_t *accepted_ns, int64_t ready_ns, int64_t received_ns)
+{
+    trace_begin(trace_frame_request(frame));
+    if (*accepted_ns != 0 && trace_context.request != 0)
+    {
+        trace_span(TRACE_ACCEPT, trace_context.request, *accepted_ns, ready_ns, 0, command);
+        *accepted_ns = 0;
+    }
+    trace_span(TRACE_PARSE, trace_context.request, received_ns, trace_now(), 0, command);
+}
+
+#endif
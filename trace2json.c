@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#define TRACE_MAGIC 0x72747364u             // Starts every span record of a trace file
+#define TRACE_HOPS 4                        // client24s, Smain, Spdf and Stext
+#define TRACE_KINDS 6                       // Span kinds are numbered from 1
+#define TRACE_TRANSFER 4                    // The one kind that carries byte and file time figures
+
+// One span as written to a trace file, the same layout in every program of the system
+struct trace_record
+{
+    uint32_t magic;                     // TRACE_MAGIC, marks the start of a record
+    uint16_t hop;                       // TRACE_HOP_CLIENT, TRACE_HOP_SMAIN, TRACE_HOP_SPDF or TRACE_HOP_STEXT
+    uint16_t kind;                      // TRACE_ACCEPT, TRACE_PARSE, TRACE_CONNECT, TRACE_TRANSFER or TRACE_REQUEST
+    uint64_t request;                   // Request ID chosen by the client for one command
+    int64_t start_ns;                   // CLOCK_REALTIME, so the spans of all processes on a host line up
+    int64_t end_ns;
+    int64_t bytes;                      // TRACE_TRANSFER: file data moved between the first and the last byte
+    int64_t io_ns;                      // TRACE_TRANSFER: time of it spent reading or writing local files
+    int32_t status;                     // TRACE_CONNECT and TRACE_REQUEST: 0, or -1 when it failed
+    uint32_t pid;
+    uint32_t thread;
+    char label[12];                     // Command, or file type of a backend connection
+};
+
+const char *hop_names[TRACE_HOPS] = {"client24s", "Smain", "Spdf", "Stext"};
+const char *kind_names[TRACE_KINDS] = {"?", "accept", "parse", "connect", "transfer", "request"};
+
+// Function to print one span as a Chrome trace "complete" event, times in microseconds as the format wants them
+// Its process was named before, so a comma always separates it from the previous event
+void print_span(const struct trace_record *record)
+{
+    char label[sizeof(record->label) + 1];
+
+    memcpy(label, record->label, sizeof(record->label));
+    label[sizeof(record->label)] = '\0';
+    for (char *c = label; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+        {
+            *c = '_';   // Labels are command words, nothing in them needs a JSON escape
+        }
+    }
+    printf(",\n{\"name\":\"%s %s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,"
+           "\"args\":{\"request\":\"%016" PRIx64 "\",\"status\":%d",
+           kind_names[record->kind], label, hop_names[record->hop],
+           record->start_ns / 1000.0, (record->end_ns - record->start_ns) / 1000.0, record->pid, record->thread,
+           record->request, record->status);
+    if (record->kind == TRACE_TRANSFER)
+    {
+        printf(",\"bytes\":%" PRId64 ",\"io_ms\":%.3f", record->bytes, record->io_ns / 1000000.0);
+    }
+    printf("}}");
+}
+
+// Usage: trace2json file.trace... > trace.json
+// Converts the span files written to ~/.datasync_trace into one Chrome trace / Perfetto JSON timeline;
+// the spans of one command share its request ID across all hops
+int main(int argc, char *argv[])
+{
+    struct trace_record record;
+    uint32_t *named = NULL;             // Processes already given a name in the timeline
+    size_t named_count = 0, named_capacity = 0;
+    long spans = 0, skipped = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s file.trace...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("{\"traceEvents\":[");
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            continue;
+        }
+        while (fread(&record, sizeof(record), 1, file) == 1)
+        {
+            size_t n;
+
+            if (record.magic != TRACE_MAGIC || record.hop >= TRACE_HOPS || record.kind == 0 || record.kind >= TRACE_KINDS ||
+                record.end_ns < record.start_ns)
+            {
+                skipped++;
+                continue;
+            }
+            for (n = 0; n < named_count && named[n] != record.pid; n++)
+            {
+            }
+            if (n == named_count)
+            {
+                // Name every process after its program, so the timeline groups the rows by hop
+                if (named_count == named_capacity)
+                {
+                    named_capacity = named_capacity ? named_capacity * 2 : 64;
+                    if ((named = realloc(named, named_capacity * sizeof(*named))) == NULL)
+                    {
+                        perror("Out of memory");
+                        return EXIT_FAILURE;
+                    }
+                }
+                named[named_count++] = record.pid;
+                printf("%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+                       spans == 0 && named_count == 1 ? "" : ",", record.pid, hop_names[record.hop], record.pid);
+            }
+            print_span(&record);
+            spans++;
+        }
+        fclose(file);
+    }
+    printf("\n]}\n");
+    fprintf(stderr, "%ld spans converted, %ld unreadable records skipped\n", spans, skipped);
+    free(named);
+    return EXIT_SUCCESS;
+}